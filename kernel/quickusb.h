@@ -1,9 +1,11 @@
 #ifndef QUICKUSB_H
 #define QUICKUSB_H
 
-#ifdef __KERNEL__
-
-#include <linux/ioctl.h>
+/****************************************************************************
+ *
+ * Vendor protocol, shared with user-space tools
+ *
+ */
 
 #define QUICKUSB_BREQUEST_SETTING	0xb0
 #define QUICKUSB_BREQUEST_HSPIO_COMMAND	0xb2
@@ -30,8 +32,17 @@
 #define QUICKUSB_HSPPMODE_SLAVE		0x03
 #define QUICKUSB_HSPPMODE_MASK		0x03
 
+#ifdef __KERNEL__
+
+#include <linux/ioctl.h>
+
 #define QUICKUSB_TIMEOUT ( 1 * HZ )
 
+/* The driver may redirect control requests, e.g. to trace them */
+#ifndef quickusb_control_msg
+#define quickusb_control_msg usb_control_msg
+#endif
+
 /**
  * quickusb_read_setting - read device setting
  *
@@ -47,12 +58,12 @@ static inline int quickusb_read_setting ( struct usb_device *usb,
 	uint16_t setting_le;
 	int ret;
 
-	ret = usb_control_msg ( usb, usb_rcvctrlpipe ( usb, 0 ),
-				QUICKUSB_BREQUEST_SETTING,
-				QUICKUSB_BREQUESTTYPE_READ,
-				0, address,
-				&setting_le, sizeof ( setting_le ),
-				QUICKUSB_TIMEOUT );
+	ret = quickusb_control_msg ( usb, usb_rcvctrlpipe ( usb, 0 ),
+				     QUICKUSB_BREQUEST_SETTING,
+				     QUICKUSB_BREQUESTTYPE_READ,
+				     0, address,
+				     &setting_le, sizeof ( setting_le ),
+				     QUICKUSB_TIMEOUT );
 	if ( ret < 0 )
 		return ret;
 
@@ -75,12 +86,12 @@ static inline int quickusb_write_setting ( struct usb_device *usb,
 	uint16_t setting_le = cpu_to_le16 ( setting );
 	int ret;
 
-	ret = usb_control_msg ( usb, usb_sndctrlpipe ( usb, 0 ),
-				QUICKUSB_BREQUEST_SETTING,
-				QUICKUSB_BREQUESTTYPE_WRITE,
-				0, address,
-				&setting_le, sizeof ( setting_le ),
-				QUICKUSB_TIMEOUT );
+	ret = quickusb_control_msg ( usb, usb_sndctrlpipe ( usb, 0 ),
+				     QUICKUSB_BREQUEST_SETTING,
+				     QUICKUSB_BREQUESTTYPE_WRITE,
+				     0, address,
+				     &setting_le, sizeof ( setting_le ),
+				     QUICKUSB_TIMEOUT );
 	if ( ret < 0 )
 		return ret;
 
@@ -136,11 +147,11 @@ static inline int quickusb_read_command ( struct usb_device *usb,
 					  void *data, size_t len ) {
 	int ret;
 	
-	ret = usb_control_msg ( usb, usb_rcvctrlpipe ( usb, 0 ),
-				QUICKUSB_BREQUEST_HSPIO_COMMAND,
-				QUICKUSB_BREQUESTTYPE_READ,
-				len, address,
-				data, len, QUICKUSB_TIMEOUT );
+	ret = quickusb_control_msg ( usb, usb_rcvctrlpipe ( usb, 0 ),
+				     QUICKUSB_BREQUEST_HSPIO_COMMAND,
+				     QUICKUSB_BREQUESTTYPE_READ,
+				     len, address,
+				     data, len, QUICKUSB_TIMEOUT );
 	if ( ret < 0 )
 		return ret;
 
@@ -162,11 +173,36 @@ static inline int quickusb_write_command ( struct usb_device *usb,
 					   void *data, size_t len ) {
 	int ret;
 	
-	ret = usb_control_msg ( usb, usb_sndctrlpipe ( usb, 0 ),
-				QUICKUSB_BREQUEST_HSPIO_COMMAND,
-				QUICKUSB_BREQUESTTYPE_WRITE,
-				len, address,
-				data, len, QUICKUSB_TIMEOUT );
+	ret = quickusb_control_msg ( usb, usb_sndctrlpipe ( usb, 0 ),
+				     QUICKUSB_BREQUEST_HSPIO_COMMAND,
+				     QUICKUSB_BREQUESTTYPE_WRITE,
+				     len, address,
+				     data, len, QUICKUSB_TIMEOUT );
+	if ( ret < 0 )
+		return ret;
+
+	return 0;
+}
+
+/**
+ * quickusb_request_data - announce length of an HSPIO data read
+ *
+ * @usb: USB device
+ * @len: Length of data that will be read from the bulk IN endpoint
+ *
+ * Returns 0 for success, or negative error number
+ */
+static inline int quickusb_request_data ( struct usb_device *usb,
+					  size_t len ) {
+	uint32_t len_le = cpu_to_le32 ( len );
+	int ret;
+
+	ret = quickusb_control_msg ( usb, usb_sndctrlpipe ( usb, 0 ),
+				     QUICKUSB_BREQUEST_HSPIO,
+				     QUICKUSB_BREQUESTTYPE_WRITE,
+				     0, 0,
+				     &len_le, sizeof ( len_le ),
+				     QUICKUSB_TIMEOUT );
 	if ( ret < 0 )
 		return ret;
 
@@ -184,17 +220,10 @@ static inline int quickusb_write_command ( struct usb_device *usb,
  */
 static inline int quickusb_read_data ( struct usb_device *usb,
 				       void *data, size_t len ) {
-	uint32_t len_le = cpu_to_le32 ( len );
 	int actual_length;
 	int ret;
 	
-	ret = usb_control_msg ( usb, usb_sndctrlpipe ( usb, 0 ),
-				QUICKUSB_BREQUEST_HSPIO,
-				QUICKUSB_BREQUESTTYPE_WRITE,
-				0, 0,
-				&len_le, sizeof ( len_le ),
-				QUICKUSB_TIMEOUT );
-	if ( ret < 0 )
+	if ( ( ret = quickusb_request_data ( usb, len ) ) != 0 )
 		return ret;
 
 	ret = usb_bulk_msg ( usb,
@@ -243,12 +272,12 @@ static inline int quickusb_read_port_dir ( struct usb_device *usb,
 					   uint8_t *outputs ) {
 	int ret;
 	
-	ret = usb_control_msg ( usb, usb_rcvctrlpipe ( usb, 0 ),
-				QUICKUSB_BREQUEST_GPPIO,
-				QUICKUSB_BREQUESTTYPE_READ,
-				address, QUICKUSB_WINDEX_GPPIO_DIR,
-				outputs, sizeof ( *outputs ),
-				QUICKUSB_TIMEOUT );
+	ret = quickusb_control_msg ( usb, usb_rcvctrlpipe ( usb, 0 ),
+				     QUICKUSB_BREQUEST_GPPIO,
+				     QUICKUSB_BREQUESTTYPE_READ,
+				     address, QUICKUSB_WINDEX_GPPIO_DIR,
+				     outputs, sizeof ( *outputs ),
+				     QUICKUSB_TIMEOUT );
 	if ( ret < 0 )
 		return ret;
 
@@ -269,12 +298,12 @@ static inline int quickusb_write_port_dir ( struct usb_device *usb,
 					    uint8_t outputs ) {
 	int ret;
 
-	ret = usb_control_msg ( usb, usb_sndctrlpipe ( usb, 0 ),
-				QUICKUSB_BREQUEST_GPPIO,
-				QUICKUSB_BREQUESTTYPE_WRITE,
-				address, QUICKUSB_WINDEX_GPPIO_DIR,
-				&outputs, sizeof ( outputs ),
-				QUICKUSB_TIMEOUT );
+	ret = quickusb_control_msg ( usb, usb_sndctrlpipe ( usb, 0 ),
+				     QUICKUSB_BREQUEST_GPPIO,
+				     QUICKUSB_BREQUESTTYPE_WRITE,
+				     address, QUICKUSB_WINDEX_GPPIO_DIR,
+				     &outputs, sizeof ( outputs ),
+				     QUICKUSB_TIMEOUT );
 	if ( ret < 0 )
 		return ret;
 
@@ -296,11 +325,11 @@ static inline int quickusb_read_port ( struct usb_device *usb,
 				       void *data, size_t len ) {
 	int ret;
 	
-	ret = usb_control_msg ( usb, usb_rcvctrlpipe ( usb, 0 ),
-				QUICKUSB_BREQUEST_GPPIO,
-				QUICKUSB_BREQUESTTYPE_READ,
-				address, QUICKUSB_WINDEX_GPPIO_DATA,
-				data, len, QUICKUSB_TIMEOUT );
+	ret = quickusb_control_msg ( usb, usb_rcvctrlpipe ( usb, 0 ),
+				     QUICKUSB_BREQUEST_GPPIO,
+				     QUICKUSB_BREQUESTTYPE_READ,
+				     address, QUICKUSB_WINDEX_GPPIO_DATA,
+				     data, len, QUICKUSB_TIMEOUT );
 	if ( ret < 0 )
 		return ret;
 
@@ -322,11 +351,11 @@ static inline int quickusb_write_port ( struct usb_device *usb,
 					void *data, size_t len ) {
 	int ret;
 
-	ret = usb_control_msg ( usb, usb_sndctrlpipe ( usb, 0 ),
-				QUICKUSB_BREQUEST_GPPIO,
-				QUICKUSB_BREQUESTTYPE_WRITE,
-				address, QUICKUSB_WINDEX_GPPIO_DATA,
-				data, len, QUICKUSB_TIMEOUT );
+	ret = quickusb_control_msg ( usb, usb_sndctrlpipe ( usb, 0 ),
+				     QUICKUSB_BREQUEST_GPPIO,
+				     QUICKUSB_BREQUESTTYPE_WRITE,
+				     address, QUICKUSB_WINDEX_GPPIO_DATA,
+				     data, len, QUICKUSB_TIMEOUT );
 	if ( ret < 0 )
 		return ret;
 
@@ -366,4 +395,212 @@ typedef struct quickusb_setting_ioctl_data {
 #define QUICKUSB_IOC_SET_SETTING \
 	_IOW ( 'Q', 0x07, struct quickusb_setting_ioctl_data )
 
+#define QUICKUSB_TRIGGER_OFF		0	/* Plain streaming read() */
+#define QUICKUSB_TRIGGER_GPPIO		1	/* GPPIO port level edge */
+#define QUICKUSB_TRIGGER_PATTERN	2	/* 16-bit HSPIO data word */
+
+#define QUICKUSB_MAX_TRIGGER_WINDOW	( 64 * 1024 * 1024 )
+
+typedef struct quickusb_trigger_ioctl_data {
+	uint32_t mode;		/* QUICKUSB_TRIGGER_xxx */
+	uint32_t port;		/* GPPIO port to sample (GPPIO mode) */
+	uint32_t mask;		/* Bits of the port/word to compare */
+	uint32_t value;		/* Level/word that fires the trigger */
+	uint32_t pre_trigger;	/* Bytes delivered before the trigger */
+	uint32_t post_trigger;	/* Bytes delivered from the trigger on */
+} quickusb_trigger_ioctl_data_t;
+
+typedef struct quickusb_trigger_event_ioctl_data {
+	uint64_t trigger_offset;/* Stream offset of the trigger */
+	uint32_t window_offset;	/* Start of window within mmap()ed ring */
+	uint32_t window_len;	/* Length of window (may wrap the ring) */
+	uint32_t ring_size;	/* Size of mmap()able ring */
+	uint32_t reserved;
+} quickusb_trigger_event_ioctl_data_t;
+
+#define QUICKUSB_IOC_HSPIO_GET_TRIGGER \
+	_IOR ( 'Q', 0x08, struct quickusb_trigger_ioctl_data )
+#define QUICKUSB_IOC_HSPIO_SET_TRIGGER \
+	_IOW ( 'Q', 0x09, struct quickusb_trigger_ioctl_data )
+#define QUICKUSB_IOC_HSPIO_WAIT_TRIGGER \
+	_IOR ( 'Q', 0x0a, struct quickusb_trigger_event_ioctl_data )
+
+#define QUICKUSB_FRAME_MAGIC		0x42465551	/* "QUFB" */
+
+#define QUICKUSB_FRAME_RESTART	0x0001	/* Stream (re)started: the device
+					 * FIFO may have overrun before
+					 * this block */
+#define QUICKUSB_FRAME_SHORT	0x0002	/* Fewer bytes than requested */
+#define QUICKUSB_FRAME_ERROR	0x0004	/* Transfer failed part-way */
+#define QUICKUSB_FRAME_RECOVERED 0x0008	/* Data lost to error recovery */
+
+/* Header preceding each block of data in framed read mode */
+struct quickusb_frame_header {
+	uint32_t magic;		/* QUICKUSB_FRAME_MAGIC */
+	uint32_t flags;		/* QUICKUSB_FRAME_xxx */
+	uint64_t sequence;	/* Block number, counting from open() */
+	uint64_t timestamp_ns;	/* CLOCK_MONOTONIC at URB completion */
+	uint32_t length;	/* Bytes of data following this header */
+	uint32_t reserved;
+};
+
+typedef uint32_t quickusb_framing_ioctl_data_t;
+
+#define QUICKUSB_IOC_HSPIO_GET_FRAMING \
+	_IOR ( 'Q', 0x0b, quickusb_framing_ioctl_data_t )
+#define QUICKUSB_IOC_HSPIO_SET_FRAMING \
+	_IOW ( 'Q', 0x0c, quickusb_framing_ioctl_data_t )
+
+typedef struct quickusb_pacing_ioctl_data {
+	uint64_t rate;		/* Bytes per second (0 => not paced) */
+	uint32_t chunk;		/* Bytes released per timer tick
+				 * (0 => chunk_size) */
+	uint32_t reserved;
+} quickusb_pacing_ioctl_data_t;
+
+/* Statistics of paced writes since pacing was last configured */
+typedef struct quickusb_pacing_stats_ioctl_data {
+	uint64_t rate;		/* Configured rate, bytes per second */
+	uint64_t achieved_rate;	/* Measured from first to last release */
+	uint64_t bytes;		/* Bytes released */
+	uint64_t chunks;	/* Chunks released */
+	uint64_t late;		/* Chunks released a whole tick late */
+	uint64_t underruns;	/* Ticks with no data queued */
+	uint64_t lateness_max_ns; /* Worst release time after schedule */
+	uint64_t lateness_mean_ns;
+} quickusb_pacing_stats_ioctl_data_t;
+
+#define QUICKUSB_IOC_HSPIO_GET_PACING \
+	_IOR ( 'Q', 0x0d, struct quickusb_pacing_ioctl_data )
+#define QUICKUSB_IOC_HSPIO_SET_PACING \
+	_IOW ( 'Q', 0x0e, struct quickusb_pacing_ioctl_data )
+#define QUICKUSB_IOC_HSPIO_GET_PACING_STATS \
+	_IOR ( 'Q', 0x0f, struct quickusb_pacing_stats_ioctl_data )
+
+/*
+ * Monitor tap (/dev/quNhm): a decimated copy of the blocks (URBs) read
+ * from /dev/quNhd by its primary reader.  A block is tapped once at
+ * least "every" blocks and interval_ns have passed since the last one
+ * tapped; each read() returns one, after a struct quickusb_frame_header
+ * whose sequence numbers the blocks streamed since the tap was opened.
+ */
+typedef struct quickusb_tap_ioctl_data {
+	uint32_t every;		/* Tap at most every Nth block (>= 1) */
+	uint32_t reserved;
+	uint64_t interval_ns;	/* and at most one per interval (0 => any) */
+} quickusb_tap_ioctl_data_t;
+
+typedef struct quickusb_tap_stats_ioctl_data {
+	uint64_t blocks;	/* Streamed since the tap was opened */
+	uint64_t tapped;	/* Copied to the tap */
+	uint64_t dropped;	/* Tapped, but lost before being read */
+} quickusb_tap_stats_ioctl_data_t;
+
+#define QUICKUSB_IOC_TAP_GET \
+	_IOR ( 'Q', 0x10, struct quickusb_tap_ioctl_data )
+#define QUICKUSB_IOC_TAP_SET \
+	_IOW ( 'Q', 0x11, struct quickusb_tap_ioctl_data )
+#define QUICKUSB_IOC_TAP_GET_STATS \
+	_IOR ( 'Q', 0x12, struct quickusb_tap_stats_ioctl_data )
+
+/*
+ * Timeout and completion policy of unframed, unpaced read() and
+ * write() on /dev/quNhd, per open file.  The timeout is the longest
+ * wait for any one block (URB) to complete.  Data that had arrived in
+ * a block when it timed out is delivered, not lost.  A read() that
+ * ends early leaves the rest of its length owed by the board; the
+ * next read() collects that first, and asks only for the shortfall.
+ */
+#define QUICKUSB_COMPLETE_ALL		0 /* Recover from timeouts, and
+					   * complete or fail (default) */
+#define QUICKUSB_COMPLETE_PARTIAL	1 /* Return what was transferred
+					   * before a timeout */
+#define QUICKUSB_COMPLETE_FIRST		2 /* Also return as soon as a block
+					   * has completed and the next has
+					   * not */
+
+typedef struct quickusb_timeout_ioctl_data {
+	uint32_t timeout_ms;	/* Per block (0 => driver default, 1s) */
+	uint32_t policy;	/* QUICKUSB_COMPLETE_xxx */
+} quickusb_timeout_ioctl_data_t;
+
+/* Outcome of the last read() or write() subject to the policy */
+typedef struct quickusb_result_ioctl_data {
+	uint64_t requested;	/* Bytes asked for */
+	uint64_t transferred;	/* Bytes transferred, even on failure */
+	int32_t status;		/* 0, or negative errno that ended it */
+	uint32_t recoveries;	/* Errors recovered from on the way */
+} quickusb_result_ioctl_data_t;
+
+#define QUICKUSB_IOC_HSPIO_GET_TIMEOUT \
+	_IOR ( 'Q', 0x13, struct quickusb_timeout_ioctl_data )
+#define QUICKUSB_IOC_HSPIO_SET_TIMEOUT \
+	_IOW ( 'Q', 0x14, struct quickusb_timeout_ioctl_data )
+#define QUICKUSB_IOC_HSPIO_GET_RESULT \
+	_IOR ( 'Q', 0x15, struct quickusb_result_ioctl_data )
+
+/*
+ * Write-combining shadow of a range of the command address space
+ * (/dev/quNhc).  write()s that fall wholly inside the range are held
+ * in the shadow, and sent later as contiguous runs of dirty bytes, in
+ * address order, of up to QUICKUSB_MAX_DATA_LEN bytes each.  They are
+ * flushed after flush_ms, on fsync(), on QUICKUSB_IOC_HSPIO_BARRIER,
+ * on close, and before any other command read or write.  Reads of a
+ * write-only range are answered from the shadow (as 0 where nothing
+ * has been written).  A length of 0 disables the shadow.
+ */
+#define QUICKUSB_SHADOW_WRITE_ONLY	0x0001 /* Registers read back
+						* nothing useful */
+
+#define QUICKUSB_MAX_SHADOW_LEN		0x10000
+
+typedef struct quickusb_shadow_ioctl_data {
+	uint32_t address;	/* First address shadowed */
+	uint32_t length;	/* Bytes shadowed (0 => disabled) */
+	uint32_t flags;		/* QUICKUSB_SHADOW_xxx */
+	uint32_t flush_ms;	/* Longest hold (0 => driver default, 10ms) */
+} quickusb_shadow_ioctl_data_t;
+
+typedef struct quickusb_shadow_stats_ioctl_data {
+	uint64_t writes;	/* write()s held in the shadow */
+	uint64_t bytes;		/* Bytes written to the shadow */
+	uint64_t transfers;	/* Control transfers that flushed them */
+	uint64_t flushes;	/* Flushes that found dirty bytes */
+	uint64_t read_hits;	/* read()s answered from the shadow */
+} quickusb_shadow_stats_ioctl_data_t;
+
+#define QUICKUSB_IOC_HSPIO_GET_SHADOW \
+	_IOR ( 'Q', 0x16, struct quickusb_shadow_ioctl_data )
+#define QUICKUSB_IOC_HSPIO_SET_SHADOW \
+	_IOW ( 'Q', 0x17, struct quickusb_shadow_ioctl_data )
+#define QUICKUSB_IOC_HSPIO_BARRIER \
+	_IO ( 'Q', 0x18 )
+#define QUICKUSB_IOC_HSPIO_GET_SHADOW_STATS \
+	_IOR ( 'Q', 0x19, struct quickusb_shadow_stats_ioctl_data )
+
+/****************************************************************************
+ *
+ * Transaction trace records, read from debugfs quickusb/trace
+ *
+ */
+
+#define QUICKUSB_TRACE_CONTROL		1
+#define QUICKUSB_TRACE_BULK		2
+
+struct quickusb_trace_record {
+	uint64_t timestamp_ns;	/* CLOCK_MONOTONIC at start */
+	uint32_t duration_us;
+	int32_t status;		/* Bytes transferred, or negative errno */
+	uint32_t length;	/* Bytes requested */
+	uint16_t device;	/* USB device number */
+	uint8_t type;		/* QUICKUSB_TRACE_xxx */
+	uint8_t endpoint;	/* Bulk endpoint address */
+	uint8_t request_type;	/* Control bRequestType */
+	uint8_t request;	/* Control bRequest */
+	uint16_t value;		/* Control wValue */
+	uint16_t index;		/* Control wIndex */
+	uint16_t reserved;
+	uint8_t data[8];	/* Start of control data stage */
+};
+
 #endif /* QUICKUSB_H */
@@ -0,0 +1,3556 @@
+/*
+ * QuickUSB driver
+ *
+ * Copyright 2006 Michael Brown <mbrown@fensystems.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/usb.h>
+#include <linux/tty.h>
+#include <linux/kernel.h>
+#include <linux/scatterlist.h>
+#include <linux/usb/serial.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/debugfs.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+#include <linux/bitmap.h>
+#include <asm/uaccess.h>
+
+static int quickusb_trace_control_msg ( struct usb_device *usb,
+					unsigned int pipe, __u8 request,
+					__u8 requesttype, __u16 value,
+					__u16 index, void *data, __u16 size,
+					int timeout );
+#define quickusb_control_msg quickusb_trace_control_msg
+
+#include "quickusb.h"
+#include "quickusb_sg.h"
+
+#define QUICKUSB_VENDOR_ID 0x0fbb
+#define QUICKUSB_DEVICE_ID 0x0001
+
+#define QUICKUSB_MAX_SUBDEVS 16
+#define QUICKUSB_SUBDEV_MASK ( QUICKUSB_MAX_SUBDEVS - 1 )
+#define QUICKUSB_MINOR_BOARD( dev_minor ) \
+	( (dev_minor) / QUICKUSB_MAX_SUBDEVS )
+#define QUICKUSB_MINOR_SUBDEV( dev_minor ) \
+	( (dev_minor) & QUICKUSB_SUBDEV_MASK )
+#define QUICKUSB_MINOR( board, subdev ) \
+	( (board) * QUICKUSB_MAX_SUBDEVS + (subdev) )
+
+#define QUICKUSB_MAX_GPPIO 5
+
+#define INTERRUPT_RATE 1 /* msec/transfer */
+
+#define QUICKUSB_DEFAULT_CHUNK_SIZE ( 128 * 1024 )
+#define QUICKUSB_DEFAULT_URBS 8
+#define QUICKUSB_DEFAULT_POOL_SIZE ( 2 * 1024 * 1024 )
+#define QUICKUSB_MAX_CHUNK_SIZE ( 4 * 1024 * 1024 )
+#define QUICKUSB_MAX_URBS 64
+#define QUICKUSB_MAX_POOL_SIZE ( 64 * 1024 * 1024 )
+#define QUICKUSB_AUTOTUNE_LEN ( 4 * 1024 * 1024 )
+#define QUICKUSB_MAX_FRAME_BLOCK ( 64 * 1024 * 1024 )
+#define QUICKUSB_MAX_RECOVERIES 3
+#define QUICKUSB_RECOVERY_BUCKETS 16
+#define QUICKUSB_DEFAULT_TRACE_SIZE 4096
+#define QUICKUSB_MIN_PACE_PERIOD_NS ( 20 * NSEC_PER_USEC )
+#define QUICKUSB_TAP_SLOTS 4
+#define QUICKUSB_DEFAULT_TAP_INTERVAL_NS ( 100 * NSEC_PER_MSEC )
+#define QUICKUSB_DEFAULT_SHADOW_FLUSH_MS 10
+
+#define ERROR(fmt, args...) printk(KERN_ERR fmt , ## args)
+#define INFO(fmt, args...) printk(KERN_INFO fmt , ## args)
+#define DBG(fmt, args...) printk(KERN_DEBUG fmt , ## args)
+
+struct quickusb_gppio {
+	struct quickusb_device *quickusb;
+	unsigned int port;
+};
+
+struct quickusb_hspio_urb {
+	struct quickusb_hspio *hspio;
+	struct urb *urb;
+	struct scatterlist *sg;
+	int done;
+	ktime_t completed;
+};
+
+struct quickusb_pacer {
+	struct hrtimer timer;
+	spinlock_t lock;
+	struct quickusb_hspio *hspio;
+	u64 rate;
+	/* Schedule: next release is due at start + due_ns */
+	ktime_t start;
+	u64 due_ns;
+	u64 due_rem;
+	/* Pool buffers filled by write(), released in order by the timer */
+	unsigned int next;
+	unsigned int queued;
+	int running;
+	int error;
+	/* Statistics */
+	struct quickusb_pacing_stats_ioctl_data stats;
+	u64 lateness_total_ns;
+	ktime_t first;
+	ktime_t last;
+	size_t last_len;
+};
+
+struct quickusb_tap_slot {
+	void *data;
+	struct quickusb_frame_header header;
+};
+
+struct quickusb_tap {
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	struct mutex read_lock;
+	struct quickusb_tap_ioctl_data config;
+	struct quickusb_tap_stats_ioctl_data stats;
+	/* Ring of tapped blocks, allocated while the tap is open */
+	struct quickusb_tap_slot slots[QUICKUSB_TAP_SLOTS];
+	size_t slot_size;
+	unsigned int head;
+	unsigned int tail;
+	int open;
+	int filling;		/* Head slot being copied into */
+	int reading;		/* Tail slot being copied out of */
+	int gone;		/* Board disconnected */
+	/* Decimation */
+	unsigned int count;	/* Blocks since the last tapped */
+	ktime_t last;		/* Completion of the last tapped */
+};
+
+struct quickusb_shadow {
+	struct mutex lock;
+	struct quickusb_hspio *hspio;
+	struct quickusb_shadow_ioctl_data config;
+	struct quickusb_shadow_stats_ioctl_data stats;
+	/* Contents of the range, and which bytes are yet to be sent */
+	unsigned char *data;
+	unsigned long *dirty;
+	int pending;
+	/* Timed flush, and the error it met (for fsync() to report) */
+	struct delayed_work flush_work;
+	int error;
+	/* Open files on the command device */
+	unsigned int users;
+};
+
+struct quickusb_hspio {
+	struct quickusb_device *quickusb;
+	struct mutex lock;
+	wait_queue_head_t wait;
+	/* Transfer tuning */
+	unsigned int chunk_size;
+	unsigned int urbs;
+	unsigned int pool_size;
+	/* NUMA node of the pool (by default, the host controller's) */
+	int numa_node;
+	/* Buffer pool, allocated on first use */
+	struct scatterlist *pool;
+	unsigned int pool_nents;
+	struct quickusb_hspio_urb *pool_urbs;
+	/* Result of the last auto-tune run, in bytes per second */
+	u64 tuned_rate;
+	/* Result of the last quickusb_hspio_stream() */
+	size_t stream_len;
+	ktime_t stream_completed;
+	unsigned int stream_recoveries;
+	/* Bytes announced by quickusb_hspio_request() and not yet read */
+	size_t announced;
+	/* Error recovery statistics */
+	unsigned int recoveries;
+	unsigned int recovery_histogram[QUICKUSB_RECOVERY_BUCKETS];
+	/* Paced write mode */
+	struct quickusb_pacer pacer;
+	/* Monitor tap */
+	struct quickusb_tap tap;
+	/* Write-combining shadow of the command address space */
+	struct quickusb_shadow shadow;
+};
+
+struct quickusb_trigger {
+	struct quickusb_trigger_ioctl_data config;
+	size_t block;
+	void *ring;
+	size_t ring_size;
+	struct quickusb_trigger_event_ioctl_data event;
+	size_t pos;
+	int pending;
+};
+
+struct quickusb_hspio_file {
+	struct quickusb_hspio *hspio;
+	struct quickusb_trigger trigger;
+	/* Framed read mode */
+	size_t frame_block;
+	uint64_t frame_seq;
+	/* Paced write mode */
+	struct quickusb_pacing_ioctl_data pacing;
+	/* Timeout and completion policy, and the last outcome */
+	struct quickusb_timeout_ioctl_data timeout;
+	struct quickusb_result_ioctl_data result;
+};
+
+struct quickusb_subdev {
+	struct file_operations *f_op;
+	void *private_data;
+	dev_t dev;
+	unsigned char name[32];
+	struct device *devp;
+};
+
+struct quickusb_device {
+	struct usb_device *usb;
+	struct usb_interface *interface;
+	struct kref kref;
+	struct list_head list;
+	unsigned int board;
+	struct quickusb_gppio gppio[QUICKUSB_MAX_GPPIO];
+	struct quickusb_hspio hspio;
+	struct quickusb_subdev subdev[QUICKUSB_MAX_SUBDEVS];
+};
+
+static void quickusb_hspio_free_pool ( struct quickusb_hspio *hspio );
+static void quickusb_pacer_stop ( struct quickusb_pacer *pacer );
+static void quickusb_shadow_free ( struct quickusb_shadow *shadow );
+static ssize_t quickusb_hspio_stream ( struct quickusb_hspio *hspio, int pipe,
+				       char __user *user_data,
+				       void *kernel_data, size_t len,
+				       const struct quickusb_timeout_ioctl_data
+				       *timeout );
+static void quickusb_tap_feed ( struct quickusb_tap *tap, const void *data,
+				size_t len, ktime_t completed,
+				uint32_t flags );
+
+static void quickusb_delete ( struct kref *kref ) {
+	struct quickusb_device *quickusb;
+
+	quickusb = container_of ( kref, struct quickusb_device, kref );
+	quickusb_hspio_free_pool ( &quickusb->hspio );
+	quickusb_shadow_free ( &quickusb->hspio.shadow );
+	usb_put_dev ( quickusb->usb );
+	kfree ( quickusb );
+}
+
+static LIST_HEAD ( quickusb_list );
+
+static DEFINE_SEMAPHORE ( quickusb_lock );
+
+static struct class *quickusb_class;
+
+static bool debug = 0;
+static int dev_major = 0;
+static unsigned int chunk_size = QUICKUSB_DEFAULT_CHUNK_SIZE;
+static unsigned int urbs = QUICKUSB_DEFAULT_URBS;
+static unsigned int pool_size = QUICKUSB_DEFAULT_POOL_SIZE;
+static unsigned int trace_size = QUICKUSB_DEFAULT_TRACE_SIZE;
+
+static struct usb_device_id quickusb_ids[];
+
+/****************************************************************************
+ *
+ * Transaction tracing
+ *
+ * Every control request and every bulk stream is logged as a struct
+ * quickusb_trace_record into a ring of trace_size records, which is
+ * drained by reading debugfs quickusb/trace (up to end of file when the
+ * ring is empty), or followed by reading quickusb/trace_pipe (which
+ * waits for more).  When the ring is full, the oldest records are
+ * overwritten and counted in trace_lost.
+ *
+ */
+
+struct quickusb_trace {
+	spinlock_t lock;
+	struct mutex read_lock;
+	wait_queue_head_t wait;
+	struct quickusb_trace_record *records;
+	unsigned int size;
+	unsigned int head;
+	unsigned int tail;
+	u32 lost;
+};
+
+static struct quickusb_trace quickusb_trace;
+
+static struct dentry *quickusb_debugfs;
+
+static void quickusb_trace_add ( struct quickusb_trace_record *record ) {
+	struct quickusb_trace *trace = &quickusb_trace;
+	unsigned long flags;
+
+	spin_lock_irqsave ( &trace->lock, flags );
+	if ( ( trace->head - trace->tail ) == trace->size ) {
+		trace->tail++;
+		trace->lost++;
+	}
+	trace->records[ trace->head & ( trace->size - 1 ) ] = *record;
+	trace->head++;
+	spin_unlock_irqrestore ( &trace->lock, flags );
+
+	wake_up_interruptible ( &trace->wait );
+}
+
+static int quickusb_trace_control_msg ( struct usb_device *usb,
+					unsigned int pipe, __u8 request,
+					__u8 requesttype, __u16 value,
+					__u16 index, void *data, __u16 size,
+					int timeout ) {
+	struct quickusb_trace_record record;
+	ktime_t start = ktime_get();
+	int rc;
+
+	rc = usb_control_msg ( usb, pipe, request, requesttype, value, index,
+			       data, size, timeout );
+
+	if ( ! quickusb_trace.records )
+		return rc;
+	memset ( &record, 0, sizeof ( record ) );
+	record.timestamp_ns = ktime_to_ns ( start );
+	record.duration_us = ktime_to_us ( ktime_sub ( ktime_get(), start ) );
+	record.status = rc;
+	record.length = size;
+	record.device = usb->devnum;
+	record.type = QUICKUSB_TRACE_CONTROL;
+	record.request_type = requesttype;
+	record.request = request;
+	record.value = value;
+	record.index = index;
+	memcpy ( record.data, data, min_t ( size_t, size,
+					    sizeof ( record.data ) ) );
+	quickusb_trace_add ( &record );
+
+	return rc;
+}
+
+static void quickusb_trace_bulk ( struct usb_device *usb, int pipe,
+				  ktime_t start, size_t len, ssize_t rc ) {
+	struct quickusb_trace_record record;
+
+	if ( ! quickusb_trace.records )
+		return;
+	memset ( &record, 0, sizeof ( record ) );
+	record.timestamp_ns = ktime_to_ns ( start );
+	record.duration_us = ktime_to_us ( ktime_sub ( ktime_get(), start ) );
+	record.status = rc;
+	record.length = len;
+	record.device = usb->devnum;
+	record.type = QUICKUSB_TRACE_BULK;
+	record.endpoint = ( usb_pipeendpoint ( pipe ) |
+			    ( usb_pipein ( pipe ) ? USB_DIR_IN : 0 ) );
+	quickusb_trace_add ( &record );
+}
+
+/* Copy out as many whole records as fit, or return 0 if there are none */
+static ssize_t quickusb_trace_copy ( char __user *user_data, size_t len ) {
+	struct quickusb_trace *trace = &quickusb_trace;
+	struct quickusb_trace_record record;
+	unsigned long flags;
+	unsigned int tail;
+	size_t done = 0;
+
+	while ( ( done + sizeof ( record ) ) <= len ) {
+		spin_lock_irqsave ( &trace->lock, flags );
+		if ( trace->head == trace->tail ) {
+			spin_unlock_irqrestore ( &trace->lock, flags );
+			break;
+		}
+		tail = trace->tail;
+		record = trace->records[ tail & ( trace->size - 1 ) ];
+		spin_unlock_irqrestore ( &trace->lock, flags );
+
+		/* Leave the record on the ring until the reader has it */
+		if ( copy_to_user ( ( user_data + done ), &record,
+				    sizeof ( record ) ) )
+			return ( done ? ( ssize_t ) done : -EFAULT );
+
+		spin_lock_irqsave ( &trace->lock, flags );
+		if ( trace->tail == tail ) {
+			trace->tail++;
+		} else {
+			/* Overwritten meanwhile, but delivered after all */
+			trace->lost--;
+		}
+		spin_unlock_irqrestore ( &trace->lock, flags );
+		done += sizeof ( record );
+	}
+
+	return done;
+}
+
+static ssize_t quickusb_trace_read_records ( struct file *file,
+					     char __user *user_data,
+					     size_t len, loff_t *ppos,
+					     int follow ) {
+	struct quickusb_trace *trace = &quickusb_trace;
+	ssize_t done;
+	int rc;
+
+	if ( len < sizeof ( struct quickusb_trace_record ) )
+		return -EINVAL;
+
+	while ( 1 ) {
+		if ( follow && ! ( file->f_flags & O_NONBLOCK ) ) {
+			if ( ( rc = wait_event_interruptible ( trace->wait,
+					( trace->head != trace->tail ) ) ) != 0 )
+				return rc;
+		}
+
+		rc = mutex_lock_interruptible ( &trace->read_lock );
+		if ( rc != 0 )
+			return rc;
+		done = quickusb_trace_copy ( user_data, len );
+		mutex_unlock ( &trace->read_lock );
+
+		if ( done > 0 ) {
+			*ppos += done;
+			return done;
+		}
+		if ( done < 0 )
+			return done;
+		/* Drained: end of file, unless following */
+		if ( ! follow )
+			return 0;
+		if ( file->f_flags & O_NONBLOCK )
+			return -EAGAIN;
+		/* Another reader took the records: wait again */
+	}
+}
+
+static ssize_t quickusb_trace_read ( struct file *file, char __user *user_data,
+				     size_t len, loff_t *ppos ) {
+	return quickusb_trace_read_records ( file, user_data, len, ppos, 0 );
+}
+
+static ssize_t quickusb_trace_pipe_read ( struct file *file,
+					  char __user *user_data,
+					  size_t len, loff_t *ppos ) {
+	return quickusb_trace_read_records ( file, user_data, len, ppos, 1 );
+}
+
+static struct file_operations quickusb_trace_fops = {
+	.owner		= THIS_MODULE,
+	.read		= quickusb_trace_read,
+};
+
+static struct file_operations quickusb_trace_pipe_fops = {
+	.owner		= THIS_MODULE,
+	.read		= quickusb_trace_pipe_read,
+};
+
+static int quickusb_trace_init ( void ) {
+	struct quickusb_trace *trace = &quickusb_trace;
+
+	spin_lock_init ( &trace->lock );
+	mutex_init ( &trace->read_lock );
+	init_waitqueue_head ( &trace->wait );
+
+	quickusb_debugfs = debugfs_create_dir ( "quickusb", NULL );
+	if ( IS_ERR_OR_NULL ( quickusb_debugfs ) ) {
+		/* Tracing is optional */
+		quickusb_debugfs = NULL;
+		return 0;
+	}
+	quickusb_sg_debugfs_init ( quickusb_debugfs );
+	if ( ! trace_size )
+		return 0;
+
+	trace->size = roundup_pow_of_two ( trace_size );
+	trace->records = vzalloc ( trace->size * sizeof ( trace->records[0] ) );
+	if ( ! trace->records ) {
+		printk ( KERN_WARNING "quickusb could not allocate %d trace "
+			 "records\n", trace->size );
+		return 0;
+	}
+	debugfs_create_file ( "trace", S_IRUSR, quickusb_debugfs, NULL,
+			      &quickusb_trace_fops );
+	debugfs_create_file ( "trace_pipe", S_IRUSR, quickusb_debugfs, NULL,
+			      &quickusb_trace_pipe_fops );
+	debugfs_create_u32 ( "trace_lost", S_IRUGO, quickusb_debugfs,
+			     &trace->lost );
+
+	return 0;
+}
+
+static void quickusb_trace_exit ( void ) {
+	debugfs_remove_recursive ( quickusb_debugfs );
+	vfree ( quickusb_trace.records );
+	quickusb_trace.records = NULL;
+}
+
+/****************************************************************************
+ *
+ * HSPIO bulk streaming engine
+ *
+ * Bulk data is moved through a per-board pool of chunk_size buffers,
+ * each with its own URB.  Up to "urbs" of them are kept in flight,
+ * and each one is copied to/from user space as soon as it completes,
+ * so an arbitrarily long read() or write() needs only pool_size bytes
+ * of kernel memory.
+ *
+ */
+
+static void quickusb_hspio_free_pool ( struct quickusb_hspio *hspio ) {
+	unsigned int i;
+
+	/* The pacer may still be armed between paced write()s */
+	quickusb_pacer_stop ( &hspio->pacer );
+	if ( hspio->pool_urbs ) {
+		for ( i = 0 ; i < hspio->pool_nents ; i++ )
+			usb_free_urb ( hspio->pool_urbs[i].urb );
+		kfree ( hspio->pool_urbs );
+	}
+	free_sglist ( hspio->pool, hspio->pool_nents );
+	hspio->pool = NULL;
+	hspio->pool_urbs = NULL;
+	hspio->pool_nents = 0;
+}
+
+static int quickusb_hspio_alloc_pool ( struct quickusb_hspio *hspio ) {
+	struct quickusb_hspio_urb *xfer;
+	unsigned int nents;
+	unsigned int i;
+
+	if ( hspio->pool )
+		return 0;
+
+	hspio->pool = alloc_sglist ( hspio->pool_size, hspio->chunk_size,
+				     &nents, hspio->numa_node, NULL );
+	if ( ! hspio->pool )
+		return -ENOMEM;
+	hspio->pool_nents = nents;
+
+	hspio->pool_urbs = kcalloc_node ( nents, sizeof ( hspio->pool_urbs[0] ),
+					  GFP_KERNEL, hspio->numa_node );
+	if ( ! hspio->pool_urbs )
+		goto err;
+	for ( i = 0 ; i < nents ; i++ ) {
+		xfer = &hspio->pool_urbs[i];
+		xfer->hspio = hspio;
+		xfer->sg = &hspio->pool[i];
+		xfer->urb = usb_alloc_urb ( 0, GFP_KERNEL );
+		if ( ! xfer->urb )
+			goto err;
+	}
+
+	return 0;
+
+ err:
+	quickusb_hspio_free_pool ( hspio );
+	return -ENOMEM;
+}
+
+static void quickusb_hspio_complete ( struct urb *urb ) {
+	struct quickusb_hspio_urb *xfer = urb->context;
+
+	xfer->completed = ktime_get();
+	xfer->done = 1;
+	wake_up ( &xfer->hspio->wait );
+}
+
+static int quickusb_hspio_submit ( struct quickusb_hspio_urb *xfer,
+				   int pipe, size_t len ) {
+	struct usb_device *usb = xfer->hspio->quickusb->usb;
+
+	usb_fill_bulk_urb ( xfer->urb, usb, pipe, sg_virt ( xfer->sg ), len,
+			    quickusb_hspio_complete, xfer );
+	xfer->done = 0;
+	return usb_submit_urb ( xfer->urb, GFP_KERNEL );
+}
+
+static void quickusb_hspio_kill ( struct quickusb_hspio *hspio ) {
+	unsigned int i;
+
+	for ( i = 0 ; i < hspio->pool_nents ; i++ )
+		usb_kill_urb ( hspio->pool_urbs[i].urb );
+}
+
+/**
+ * quickusb_hspio_request - announce length of an HSPIO data read
+ *
+ * @hspio: HSPIO port (locked)
+ * @len: Length of data that will be read
+ *
+ * The length is remembered, so that it can be re-announced for the
+ * remaining data if the stream has to be recovered after an error.
+ * A new announcement replaces the old one, so anything the device
+ * still owes for that (see quickusb_hspio_read()) is read and
+ * discarded first.
+ *
+ * Returns 0 for success, or negative error number
+ */
+static int quickusb_hspio_request ( struct quickusb_hspio *hspio,
+				    size_t len ) {
+	struct usb_device *usb = hspio->quickusb->usb;
+	int rc;
+
+	if ( hspio->announced ) {
+		quickusb_hspio_stream ( hspio, usb_rcvbulkpipe (
+					usb, QUICKUSB_BULK_IN_EP ),
+					NULL, NULL, hspio->announced, NULL );
+	}
+	hspio->announced = 0;
+	if ( ( rc = quickusb_request_data ( usb, len ) ) != 0 )
+		return rc;
+	hspio->announced = len;
+
+	return 0;
+}
+
+/**
+ * quickusb_hspio_deliver - deliver the data moved by one URB
+ *
+ * @hspio: HSPIO port (locked)
+ * @xfer: Completed (or killed) transfer
+ * @in: Transfer is from the device
+ * @user_data: User buffer, or NULL
+ * @kernel_data: Kernel buffer, used if @user_data is NULL
+ *
+ * Copies incoming data to offset stream_len, and advances stream_len
+ * past it.
+ *
+ * Returns 0 for success, or negative error number
+ */
+static int quickusb_hspio_deliver ( struct quickusb_hspio *hspio,
+				    struct quickusb_hspio_urb *xfer, int in,
+				    char __user *user_data,
+				    void *kernel_data ) {
+	size_t completed = hspio->stream_len;
+	size_t chunk = xfer->urb->actual_length;
+
+	if ( in && user_data &&
+	     copy_to_user ( ( user_data + completed ),
+			    sg_virt ( xfer->sg ), chunk ) )
+		return -EFAULT;
+	if ( in && ( ! user_data ) && kernel_data ) {
+		memcpy ( ( kernel_data + completed ),
+			 sg_virt ( xfer->sg ), chunk );
+	}
+	if ( in ) {
+		quickusb_tap_feed ( &hspio->tap, sg_virt ( xfer->sg ),
+				    chunk, xfer->completed,
+				    ( completed ? 0 : QUICKUSB_FRAME_RESTART ) );
+		hspio->announced -= min ( hspio->announced, chunk );
+	}
+	hspio->stream_len = ( completed + chunk );
+	hspio->stream_completed = xfer->completed;
+
+	return 0;
+}
+
+/**
+ * quickusb_hspio_pump - move data until done or a transfer fails
+ *
+ * @hspio: HSPIO port (locked)
+ * @pipe: Bulk pipe
+ * @user_data: User buffer, or NULL
+ * @kernel_data: Kernel buffer, used if @user_data is NULL
+ * @len: Length of data
+ * @timeout: Timeout and completion policy, or NULL for the default
+ *
+ * Starts at offset stream_len, and advances it as URBs complete.  When
+ * a transfer fails or times out, the URBs still in flight are killed
+ * and whatever they had already moved is delivered, in order, so that
+ * stream_len counts every byte that reached its destination.
+ *
+ * Returns 0 for success, or negative error number
+ */
+static int quickusb_hspio_pump ( struct quickusb_hspio *hspio, int pipe,
+				 char __user *user_data, void *kernel_data,
+				 size_t len,
+				 const struct quickusb_timeout_ioctl_data
+				 *timeout ) {
+	struct quickusb_hspio_urb *xfer;
+	unsigned int head = 0;
+	unsigned int tail = 0;
+	unsigned int in_flight = 0;
+	unsigned int max_in_flight;
+	unsigned long wait = QUICKUSB_TIMEOUT;
+	size_t submitted = hspio->stream_len;
+	size_t chunk;
+	long remaining;
+	int first = 0;
+	int in = usb_pipein ( pipe );
+	int rc;
+
+	max_in_flight = min ( hspio->urbs, hspio->pool_nents );
+	if ( timeout && timeout->timeout_ms )
+		wait = msecs_to_jiffies ( timeout->timeout_ms );
+	if ( timeout && ( timeout->policy == QUICKUSB_COMPLETE_FIRST ) )
+		first = 1;
+
+	while ( hspio->stream_len < len ) {
+
+		/* Keep the pipeline full */
+		while ( ( in_flight < max_in_flight ) && ( submitted < len ) ) {
+			xfer = &hspio->pool_urbs[tail];
+			chunk = min_t ( size_t, xfer->sg->length,
+					( len - submitted ) );
+			if ( ( ! in ) && user_data &&
+			     copy_from_user ( sg_virt ( xfer->sg ),
+					      ( user_data + submitted ),
+					      chunk ) ) {
+				rc = -EFAULT;
+				goto stop;
+			}
+			if ( ( ! in ) && ( ! user_data ) && kernel_data ) {
+				memcpy ( sg_virt ( xfer->sg ),
+					 ( kernel_data + submitted ), chunk );
+			}
+			if ( ( rc = quickusb_hspio_submit ( xfer, pipe,
+							    chunk ) ) != 0 )
+				goto stop;
+			submitted += chunk;
+			in_flight++;
+			tail = ( ( tail + 1 ) % hspio->pool_nents );
+		}
+
+		/* Wait for the oldest transfer, which completes first */
+		xfer = &hspio->pool_urbs[head];
+		remaining = wait_event_interruptible_timeout ( hspio->wait,
+							       xfer->done,
+							       wait );
+		if ( remaining < 0 ) {
+			rc = remaining;
+			goto stop;
+		}
+		if ( ! remaining ) {
+			rc = -ETIMEDOUT;
+			goto stop;
+		}
+		in_flight--;
+		head = ( ( head + 1 ) % hspio->pool_nents );
+		if ( ( rc = xfer->urb->status ) != 0 )
+			goto stop;
+
+		if ( ( rc = quickusb_hspio_deliver ( hspio, xfer, in, user_data,
+						     kernel_data ) ) != 0 )
+			goto stop;
+		if ( xfer->urb->actual_length <
+		     xfer->urb->transfer_buffer_length ) {
+			rc = -EREMOTEIO;
+			goto stop;
+		}
+
+		/* Return on a block, unless the next is already in */
+		if ( first && ( hspio->stream_len < len ) &&
+		     ! ( in_flight && hspio->pool_urbs[head].done ) ) {
+			rc = 0;
+			goto stop;
+		}
+	}
+
+	return 0;
+
+ stop:
+	quickusb_hspio_kill ( hspio );
+	while ( in_flight-- ) {
+		xfer = &hspio->pool_urbs[head];
+		head = ( ( head + 1 ) % hspio->pool_nents );
+		if ( ( ! xfer->urb->actual_length ) ||
+		     ( quickusb_hspio_deliver ( hspio, xfer, in, user_data,
+						kernel_data ) != 0 ) ||
+		     ( xfer->urb->actual_length <
+		       xfer->urb->transfer_buffer_length ) )
+			break;
+	}
+	return rc;
+}
+
+/**
+ * quickusb_hspio_recover - recover the bulk endpoints after an error
+ *
+ * @hspio: HSPIO port (locked)
+ *
+ * Clears any halt on the bulk endpoints, and re-announces the data
+ * still owed by the device, if any.  Data that was in flight when a
+ * stall or protocol error occurred is lost (data that had arrived
+ * before a timeout has already been delivered).  The time since data
+ * last flowed is recorded in the recovery histogram.
+ *
+ * Returns 0 for success, or negative error number
+ */
+static int quickusb_hspio_recover ( struct quickusb_hspio *hspio ) {
+	struct usb_device *usb = hspio->quickusb->usb;
+	s64 downtime_ms;
+	unsigned int bucket;
+	int rc;
+
+	quickusb_hspio_kill ( hspio );
+	if ( ( rc = usb_clear_halt ( usb, usb_rcvbulkpipe (
+				usb, QUICKUSB_BULK_IN_EP ) ) ) != 0 )
+		return rc;
+	if ( ( rc = usb_clear_halt ( usb, usb_sndbulkpipe (
+				usb, QUICKUSB_BULK_OUT_EP ) ) ) != 0 )
+		return rc;
+	if ( hspio->announced ) {
+		if ( ( rc = quickusb_request_data ( usb,
+						    hspio->announced ) ) != 0 )
+			return rc;
+	}
+
+	/* Bucket 0 is < 1ms, bucket n is [ 2^(n-1), 2^n ) ms */
+	downtime_ms = div_s64 ( ktime_to_ns ( ktime_sub ( ktime_get(),
+				hspio->stream_completed ) ), NSEC_PER_MSEC );
+	bucket = ( ( downtime_ms > 0 ) ? fls64 ( downtime_ms ) : 0 );
+	if ( bucket >= QUICKUSB_RECOVERY_BUCKETS )
+		bucket = ( QUICKUSB_RECOVERY_BUCKETS - 1 );
+	hspio->recovery_histogram[bucket]++;
+	hspio->recoveries++;
+	hspio->stream_recoveries++;
+
+	return 0;
+}
+
+static int quickusb_hspio_recoverable ( int rc ) {
+	switch ( rc ) {
+	case -ETIMEDOUT:	/* No completion within the timeout */
+	case -EPIPE:		/* Endpoint stalled */
+	case -EPROTO:		/* Bitstuff error or host controller timeout */
+	case -EILSEQ:		/* CRC mismatch */
+	case -EOVERFLOW:	/* Babble */
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * quickusb_hspio_stream - stream bulk data through the buffer pool
+ *
+ * @hspio: HSPIO port (locked)
+ * @pipe: Bulk pipe
+ * @user_data: User buffer, or NULL
+ * @kernel_data: Kernel buffer, used if @user_data is NULL
+ * @len: Length of data
+ * @timeout: Timeout and completion policy, or NULL for the default
+ *
+ * Incoming data is discarded if both buffers are NULL.  The number of
+ * bytes transferred and the completion time of the last URB are left
+ * in stream_len and stream_completed, even on failure.  Timeouts and
+ * stalls are recovered from without failing the transfer, up to
+ * QUICKUSB_MAX_RECOVERIES times, except that a timeout ends the
+ * transfer under a policy other than QUICKUSB_COMPLETE_ALL.  Under
+ * QUICKUSB_COMPLETE_FIRST, the transfer may also end early, without
+ * error.  Incoming data lost to a stall or protocol error is not
+ * papered over: the endpoints are recovered, but the transfer ends
+ * short at the loss (or fails, if nothing had arrived before it).
+ *
+ * Returns number of bytes transferred, or negative error number
+ */
+static ssize_t quickusb_hspio_stream ( struct quickusb_hspio *hspio, int pipe,
+				       char __user *user_data,
+				       void *kernel_data, size_t len,
+				       const struct quickusb_timeout_ioctl_data
+				       *timeout ) {
+	struct usb_device *usb = hspio->quickusb->usb;
+	ktime_t start = ktime_get();
+	unsigned int attempts = 0;
+	int complete_all = ( ( ! timeout ) ||
+			     ( timeout->policy == QUICKUSB_COMPLETE_ALL ) );
+	int in = usb_pipein ( pipe );
+	int lost;
+	int rc;
+
+	hspio->stream_len = 0;
+	hspio->stream_completed = ktime_get();
+	hspio->stream_recoveries = 0;
+	/* Nothing announced is owed while writing */
+	if ( ! in )
+		hspio->announced = 0;
+	if ( ( rc = quickusb_hspio_alloc_pool ( hspio ) ) != 0 ) {
+		hspio->announced = 0;
+		return rc;
+	}
+
+	while ( ( rc = quickusb_hspio_pump ( hspio, pipe, user_data,
+					     kernel_data, len,
+					     timeout ) ) != 0 ) {
+		if ( ( ! quickusb_hspio_recoverable ( rc ) ) ||
+		     ( ( rc == -ETIMEDOUT ) && ( ! complete_all ) ) ||
+		     ( attempts++ >= QUICKUSB_MAX_RECOVERIES ) )
+			goto err;
+		INFO ( "quickusb%d HSPIO transfer error %d after %zd of %zd "
+		       "bytes, recovering\n", hspio->quickusb->board, rc,
+		       hspio->stream_len, len );
+		/* Resuming a read past lost data would leave a gap */
+		lost = ( in && ( rc != -ETIMEDOUT ) );
+		if ( lost )
+			hspio->announced = 0;
+		if ( quickusb_hspio_recover ( hspio ) != 0 )
+			goto err;
+		if ( lost ) {
+			if ( ! hspio->stream_len )
+				goto err;
+			break;
+		}
+	}
+
+	quickusb_trace_bulk ( usb, pipe, start, len, hspio->stream_len );
+	return hspio->stream_len;
+
+ err:
+	/* A read ended early at the reader's request leaves the rest owed;
+	 * what the device owes after a failure is unknown */
+	if ( ( rc != -ERESTARTSYS ) &&
+	     ( ( rc != -ETIMEDOUT ) || complete_all ) ) {
+		hspio->announced = 0;
+		ERROR ( "quickusb%d HSPIO transfer failed after %zd of %zd "
+			"bytes, rc %d\n", hspio->quickusb->board,
+			hspio->stream_len, len, rc );
+	}
+	quickusb_trace_bulk ( usb, pipe, start, len, rc );
+	return rc;
+}
+
+/**
+ * quickusb_hspio_read - read bulk data, collecting what is owed first
+ *
+ * @hspio: HSPIO port (locked)
+ * @user_data: User buffer
+ * @len: Length of data
+ * @timeout: Timeout and completion policy
+ *
+ * A read that ended early under QUICKUSB_COMPLETE_PARTIAL or
+ * QUICKUSB_COMPLETE_FIRST, or at a signal, leaves the rest of its
+ * announced length owed by the device.  That is read first, and only
+ * the shortfall is then announced; under QUICKUSB_COMPLETE_FIRST, the
+ * read returns once what was owed has arrived.  stream_len and
+ * stream_recoveries cover both parts.
+ *
+ * Returns number of bytes transferred, or negative error number
+ */
+static ssize_t quickusb_hspio_read ( struct quickusb_hspio *hspio,
+				     char __user *user_data, size_t len,
+				     const struct quickusb_timeout_ioctl_data
+				     *timeout ) {
+	struct usb_device *usb = hspio->quickusb->usb;
+	int pipe = usb_rcvbulkpipe ( usb, QUICKUSB_BULK_IN_EP );
+	size_t owed = min ( hspio->announced, len );
+	unsigned int recoveries = 0;
+	ssize_t rc;
+
+	if ( owed ) {
+		rc = quickusb_hspio_stream ( hspio, pipe, user_data, NULL,
+					     owed, timeout );
+		if ( ( rc < 0 ) || ( ( size_t ) rc < owed ) || ( owed == len ) ||
+		     ( timeout->policy == QUICKUSB_COMPLETE_FIRST ) )
+			return rc;
+		recoveries = hspio->stream_recoveries;
+	}
+
+	if ( ( rc = quickusb_hspio_request ( hspio, ( len - owed ) ) ) != 0 )
+		return ( owed ? ( ssize_t ) owed : rc );
+	rc = quickusb_hspio_stream ( hspio, pipe, ( user_data + owed ), NULL,
+				     ( len - owed ), timeout );
+	hspio->stream_len += owed;
+	hspio->stream_recoveries += recoveries;
+	if ( rc >= 0 )
+		rc += owed;
+	return rc;
+}
+
+/**
+ * quickusb_hspio_set_tuning - change HSPIO transfer tuning
+ *
+ * @hspio: HSPIO port
+ * @new_chunk_size: Size of each pool buffer (and of each URB)
+ * @new_urbs: Maximum number of URBs in flight
+ * @new_pool_size: Total size of the buffer pool
+ *
+ * Returns 0 for success, or negative error number
+ */
+static int quickusb_hspio_set_tuning ( struct quickusb_hspio *hspio,
+				       unsigned int new_chunk_size,
+				       unsigned int new_urbs,
+				       unsigned int new_pool_size ) {
+	int rc;
+
+	if ( ( new_chunk_size < PAGE_SIZE ) ||
+	     ( new_chunk_size > QUICKUSB_MAX_CHUNK_SIZE ) ||
+	     ( ! is_power_of_2 ( new_chunk_size ) ) )
+		return -EINVAL;
+	if ( ( new_urbs < 1 ) || ( new_urbs > QUICKUSB_MAX_URBS ) )
+		return -EINVAL;
+	if ( ( new_pool_size < new_chunk_size ) ||
+	     ( new_pool_size > QUICKUSB_MAX_POOL_SIZE ) )
+		return -EINVAL;
+
+	if ( ( rc = mutex_lock_interruptible ( &hspio->lock ) ) != 0 )
+		return rc;
+	quickusb_hspio_free_pool ( hspio );
+	hspio->chunk_size = new_chunk_size;
+	hspio->urbs = new_urbs;
+	hspio->pool_size = new_pool_size;
+	mutex_unlock ( &hspio->lock );
+
+	return 0;
+}
+
+/**
+ * quickusb_hspio_controller_node - find the host controller's NUMA node
+ *
+ * @hspio: HSPIO port
+ *
+ * Returns node number, or NUMA_NO_NODE
+ */
+static int quickusb_hspio_controller_node ( struct quickusb_hspio *hspio ) {
+	return dev_to_node ( hspio->quickusb->usb->bus->controller );
+}
+
+/**
+ * quickusb_hspio_set_node - change the NUMA node of HSPIO buffers
+ *
+ * @hspio: HSPIO port
+ * @node: Node number, or NUMA_NO_NODE for the host controller's
+ *
+ * The pool is reallocated on the new node when next used.
+ *
+ * Returns 0 for success, or negative error number
+ */
+static int quickusb_hspio_set_node ( struct quickusb_hspio *hspio,
+				     int node ) {
+	int rc;
+
+	if ( node == NUMA_NO_NODE )
+		node = quickusb_hspio_controller_node ( hspio );
+	else if ( ( node < 0 ) || ( node >= MAX_NUMNODES ) ||
+		  ( ! node_online ( node ) ) )
+		return -EINVAL;
+
+	if ( ( rc = mutex_lock_interruptible ( &hspio->lock ) ) != 0 )
+		return rc;
+	if ( node != hspio->numa_node ) {
+		quickusb_hspio_free_pool ( hspio );
+		hspio->numa_node = node;
+	}
+	mutex_unlock ( &hspio->lock );
+
+	return 0;
+}
+
+/****************************************************************************
+ *
+ * HSPIO paced output
+ *
+ * In paced write mode, write() fills pool buffers ahead of time and an
+ * hrtimer releases (submits) them in order, one chunk per tick, at
+ * start + (bytes released so far) / rate.  The schedule is absolute,
+ * so timer latency does not accumulate.  A tick that finds nothing
+ * queued is an underrun: the timer stops, and the schedule restarts
+ * with the next chunk queued.  The schedule carries over from one
+ * write() to the next, provided the next one arrives in time.
+ *
+ */
+
+static enum hrtimer_restart quickusb_pacer_tick ( struct hrtimer *timer ) {
+	struct quickusb_pacer *pacer =
+		container_of ( timer, struct quickusb_pacer, timer );
+	struct quickusb_hspio *hspio = pacer->hspio;
+	struct quickusb_hspio_urb *xfer;
+	unsigned long flags;
+	ktime_t now;
+	u64 lateness;
+	u64 period;
+	size_t len;
+	int rc;
+
+	spin_lock_irqsave ( &pacer->lock, flags );
+	if ( ! pacer->queued ) {
+		pacer->stats.underruns++;
+		pacer->running = 0;
+		spin_unlock_irqrestore ( &pacer->lock, flags );
+		return HRTIMER_NORESTART;
+	}
+
+	xfer = &hspio->pool_urbs[pacer->next];
+	len = xfer->urb->transfer_buffer_length;
+	if ( ( rc = usb_submit_urb ( xfer->urb, GFP_ATOMIC ) ) != 0 ) {
+		pacer->error = rc;
+		pacer->running = 0;
+		spin_unlock_irqrestore ( &pacer->lock, flags );
+		wake_up ( &hspio->wait );
+		return HRTIMER_NORESTART;
+	}
+	pacer->next = ( ( pacer->next + 1 ) % hspio->pool_nents );
+	pacer->queued--;
+
+	/* Record the lateness of this release against the schedule */
+	now = ktime_get();
+	lateness = max_t ( s64, ktime_to_ns ( ktime_sub ( now,
+				hrtimer_get_expires ( timer ) ) ), 0 );
+	period = div64_u64 ( ( ( u64 ) len * NSEC_PER_SEC ), pacer->rate );
+	if ( lateness >= period )
+		pacer->stats.late++;
+	if ( lateness > pacer->stats.lateness_max_ns )
+		pacer->stats.lateness_max_ns = lateness;
+	pacer->lateness_total_ns += lateness;
+	if ( ! pacer->stats.chunks )
+		pacer->first = now;
+	pacer->last = now;
+	pacer->last_len = len;
+	pacer->stats.chunks++;
+	pacer->stats.bytes += len;
+
+	/* The next release is due once this one has been paid for */
+	pacer->due_ns += div64_u64_rem ( ( ( u64 ) len * NSEC_PER_SEC +
+					   pacer->due_rem ), pacer->rate,
+					 &pacer->due_rem );
+	hrtimer_set_expires ( timer, ktime_add_ns ( pacer->start,
+						    pacer->due_ns ) );
+	spin_unlock_irqrestore ( &pacer->lock, flags );
+
+	return HRTIMER_RESTART;
+}
+
+static void quickusb_pacer_init ( struct quickusb_pacer *pacer,
+				  struct quickusb_hspio *hspio ) {
+	hrtimer_init ( &pacer->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS );
+	pacer->timer.function = quickusb_pacer_tick;
+	spin_lock_init ( &pacer->lock );
+	pacer->hspio = hspio;
+}
+
+/**
+ * quickusb_pacer_queue - queue a filled pool buffer for release
+ *
+ * @pacer: Pacer
+ *
+ * The buffer after the last one queued must already hold its URB.
+ * Starts a new schedule if the timer is not running.
+ */
+static void quickusb_pacer_queue ( struct quickusb_pacer *pacer ) {
+	unsigned long flags;
+
+	spin_lock_irqsave ( &pacer->lock, flags );
+	pacer->queued++;
+	if ( ! pacer->running ) {
+		pacer->start = ktime_get();
+		pacer->due_ns = 0;
+		pacer->due_rem = 0;
+		pacer->running = 1;
+		hrtimer_start ( &pacer->timer, pacer->start,
+				HRTIMER_MODE_ABS );
+	}
+	spin_unlock_irqrestore ( &pacer->lock, flags );
+}
+
+/**
+ * quickusb_pacer_stop - stop the pacer, dropping anything queued
+ *
+ * @pacer: Pacer
+ *
+ * URBs already released are left for the caller to kill.
+ */
+static void quickusb_pacer_stop ( struct quickusb_pacer *pacer ) {
+	unsigned long flags;
+
+	hrtimer_cancel ( &pacer->timer );
+	spin_lock_irqsave ( &pacer->lock, flags );
+	pacer->running = 0;
+	pacer->queued = 0;
+	pacer->next = 0;
+	pacer->error = 0;
+	spin_unlock_irqrestore ( &pacer->lock, flags );
+}
+
+/**
+ * quickusb_pacer_reset - stop the pacer and start new statistics
+ *
+ * @pacer: Pacer
+ * @rate: New rate, in bytes per second
+ */
+static void quickusb_pacer_reset ( struct quickusb_pacer *pacer,
+				   u64 rate ) {
+	unsigned long flags;
+
+	quickusb_pacer_stop ( pacer );
+	spin_lock_irqsave ( &pacer->lock, flags );
+	memset ( &pacer->stats, 0, sizeof ( pacer->stats ) );
+	pacer->stats.rate = rate;
+	pacer->rate = rate;
+	pacer->lateness_total_ns = 0;
+	pacer->last_len = 0;
+	spin_unlock_irqrestore ( &pacer->lock, flags );
+}
+
+static void quickusb_pacer_stats ( struct quickusb_pacer *pacer,
+				   struct quickusb_pacing_stats_ioctl_data
+				   *stats ) {
+	unsigned long flags;
+	s64 elapsed_us;
+
+	spin_lock_irqsave ( &pacer->lock, flags );
+	*stats = pacer->stats;
+	if ( stats->chunks ) {
+		stats->lateness_mean_ns = div64_u64 ( pacer->lateness_total_ns,
+						      stats->chunks );
+	}
+	/* The last chunk released has not been paid for yet */
+	elapsed_us = ktime_to_us ( ktime_sub ( pacer->last, pacer->first ) );
+	if ( elapsed_us > 0 ) {
+		stats->achieved_rate =
+			div64_u64 ( ( ( stats->bytes - pacer->last_len ) *
+				      USEC_PER_SEC ), elapsed_us );
+	}
+	spin_unlock_irqrestore ( &pacer->lock, flags );
+}
+
+/**
+ * quickusb_pacing_check - validate a paced write configuration
+ *
+ * @hspio: HSPIO port
+ * @pacing: Pacing configuration
+ *
+ * Returns 0 for success, or negative error number
+ */
+static int quickusb_pacing_check ( struct quickusb_hspio *hspio,
+				   struct quickusb_pacing_ioctl_data *pacing ) {
+	unsigned int chunk;
+
+	if ( ! pacing->rate ) {
+		pacing->chunk = 0;
+		return 0;
+	}
+	/* Every chunk but the last must end on a packet boundary */
+	if ( ( pacing->chunk % QUICKUSB_MAX_BULK_DATA_LEN ) ||
+	     ( pacing->chunk > QUICKUSB_MAX_CHUNK_SIZE ) )
+		return -EINVAL;
+	chunk = ( pacing->chunk ? pacing->chunk : hspio->chunk_size );
+	if ( div64_u64 ( ( ( u64 ) chunk * NSEC_PER_SEC ), pacing->rate ) <
+	     QUICKUSB_MIN_PACE_PERIOD_NS )
+		return -EINVAL;
+
+	return 0;
+}
+
+/**
+ * quickusb_hspio_paced_write - write bulk data on the pacer's schedule
+ *
+ * @hspio: HSPIO port (locked)
+ * @pipe: Bulk OUT pipe
+ * @user_data: User buffer
+ * @len: Length of data
+ * @pacing: Pacing configuration
+ *
+ * Keeps up to "urbs" pool buffers filled ahead of the pacer, each of
+ * one chunk (limited to chunk_size), and returns once the last has
+ * been sent.  Errors are not recovered from, since the schedule
+ * could not be kept anyway.  A signal after data has been sent ends
+ * the write short.
+ *
+ * Returns number of bytes transferred, or negative error number
+ */
+static ssize_t quickusb_hspio_paced_write ( struct quickusb_hspio *hspio,
+					    int pipe,
+					    const char __user *user_data,
+					    size_t len,
+					    struct quickusb_pacing_ioctl_data
+					    *pacing ) {
+	struct quickusb_pacer *pacer = &hspio->pacer;
+	struct usb_device *usb = hspio->quickusb->usb;
+	struct quickusb_hspio_urb *xfer;
+	ktime_t start = ktime_get();
+	unsigned long flags;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int outstanding = 0;
+	unsigned int max_outstanding;
+	size_t pace_chunk;
+	size_t filled = 0;
+	size_t completed = 0;
+	size_t chunk;
+	u64 period_ns;
+	long remaining;
+	int rc;
+
+	hspio->stream_len = 0;
+	hspio->stream_completed = start;
+	hspio->stream_recoveries = 0;
+	hspio->announced = 0;
+	if ( ( rc = quickusb_hspio_alloc_pool ( hspio ) ) != 0 )
+		return rc;
+	max_outstanding = min ( hspio->urbs, hspio->pool_nents );
+	pace_chunk = ( pacing->chunk ? pacing->chunk : hspio->chunk_size );
+	period_ns = div64_u64 ( ( ( u64 ) pace_chunk * NSEC_PER_SEC ),
+				pacing->rate );
+
+	/* Another file may have left the pacer at a different rate */
+	if ( pacer->rate != pacing->rate )
+		quickusb_pacer_reset ( pacer, pacing->rate );
+
+	/* Nothing is queued between write()s, but the timer may be armed */
+	spin_lock_irqsave ( &pacer->lock, flags );
+	head = tail = pacer->next;
+	spin_unlock_irqrestore ( &pacer->lock, flags );
+
+	while ( completed < len ) {
+
+		/* Fill free buffers ahead of the schedule */
+		while ( ( outstanding < max_outstanding ) && ( filled < len ) ) {
+			xfer = &hspio->pool_urbs[tail];
+			chunk = min_t ( size_t, xfer->sg->length, pace_chunk );
+			chunk = min_t ( size_t, chunk, ( len - filled ) );
+			if ( copy_from_user ( sg_virt ( xfer->sg ),
+					      ( user_data + filled ), chunk ) ) {
+				rc = -EFAULT;
+				goto err;
+			}
+			usb_fill_bulk_urb ( xfer->urb, usb, pipe,
+					    sg_virt ( xfer->sg ), chunk,
+					    quickusb_hspio_complete, xfer );
+			xfer->done = 0;
+			quickusb_pacer_queue ( pacer );
+			filled += chunk;
+			outstanding++;
+			tail = ( ( tail + 1 ) % hspio->pool_nents );
+		}
+
+		/* Wait for the oldest buffer to be released and sent */
+		xfer = &hspio->pool_urbs[head];
+		remaining = wait_event_interruptible_timeout ( hspio->wait,
+				( xfer->done || pacer->error ),
+				( QUICKUSB_TIMEOUT +
+				  nsecs_to_jiffies ( period_ns *
+						     outstanding ) ) );
+		if ( remaining < 0 ) {
+			rc = remaining;
+			goto err;
+		}
+		if ( ! remaining ) {
+			rc = -ETIMEDOUT;
+			goto err;
+		}
+		if ( ( rc = pacer->error ) != 0 )
+			goto err;
+		outstanding--;
+		head = ( ( head + 1 ) % hspio->pool_nents );
+		if ( ( rc = xfer->urb->status ) != 0 )
+			goto err;
+
+		chunk = xfer->urb->actual_length;
+		completed += chunk;
+		hspio->stream_len = completed;
+		hspio->stream_completed = xfer->completed;
+		if ( chunk < xfer->urb->transfer_buffer_length ) {
+			rc = -EREMOTEIO;
+			goto err;
+		}
+	}
+
+	quickusb_trace_bulk ( usb, pipe, start, len, completed );
+	return completed;
+
+ err:
+	quickusb_pacer_stop ( pacer );
+	quickusb_hspio_kill ( hspio );
+	quickusb_trace_bulk ( usb, pipe, start, len, rc );
+	/* As for an unpaced write, a signal must not have the write()
+	 * restarted from the start, sending what was sent again */
+	if ( rc == -ERESTARTSYS )
+		return ( completed ? ( ssize_t ) completed : rc );
+	ERROR ( "quickusb%d paced HSPIO write failed after %zd of %zd bytes, "
+		"rc %d\n", hspio->quickusb->board, completed, len, rc );
+	return rc;
+}
+
+/****************************************************************************
+ *
+ * Common operations
+ *
+ */
+
+static int quickusb_set_hsppmode ( struct quickusb_device *quickusb,
+				   unsigned int hsppmode ) {
+	uint16_t fifoconfig;
+	int rc;
+
+	if ( ( rc = quickusb_read_setting ( quickusb->usb,
+					    QUICKUSB_SETTING_FIFOCONFIG,
+					    &fifoconfig ) ) != 0 )
+		return rc;
+	fifoconfig &= ~QUICKUSB_HSPPMODE_MASK;
+	fifoconfig |= ( hsppmode & QUICKUSB_HSPPMODE_MASK );
+	if ( ( rc = quickusb_write_setting ( quickusb->usb,
+					     QUICKUSB_SETTING_FIFOCONFIG,
+					     fifoconfig ) ) != 0 )
+		return rc;
+
+	return 0;
+}
+
+/****************************************************************************
+ *
+ * GPPIO char device operations
+ *
+ */
+
+static ssize_t quickusb_gppio_read ( struct file *file, char __user *user_data,
+				     size_t len, loff_t *ppos ) {
+	struct quickusb_gppio *gppio = file->private_data;
+	unsigned char data[QUICKUSB_MAX_DATA_LEN];
+	int rc;
+
+	if ( len > sizeof ( data ) )
+		len = sizeof ( data );
+
+	if ( ( rc = quickusb_read_port ( gppio->quickusb->usb, gppio->port,
+					 data, len ) ) != 0 )
+		return rc;
+
+	if ( ( rc = copy_to_user ( user_data, data, len ) ) != 0 )
+		return rc;
+
+	*ppos += len;
+	return len;
+}
+
+static ssize_t quickusb_gppio_write ( struct file *file,
+				      const char __user *user_data,
+				      size_t len, loff_t *ppos ) {
+	struct quickusb_gppio *gppio = file->private_data;
+	unsigned char data[QUICKUSB_MAX_DATA_LEN];
+	int rc;
+
+	if ( len > sizeof ( data ) )
+		len = sizeof ( data );
+
+	if ( ( rc = copy_from_user ( data, user_data, len ) ) != 0 )
+		return rc;
+
+	if ( ( rc = quickusb_write_port ( gppio->quickusb->usb, gppio->port,
+					  data, len ) ) != 0 )
+		return rc;
+
+	*ppos += len;
+	return len;
+}
+
+static long quickusb_gppio_ioctl ( struct file *file,
+				   unsigned int cmd, unsigned long arg ) {
+	struct quickusb_gppio *gppio = file->private_data;
+	struct quickusb_device *quickusb = gppio->quickusb;
+	void __user *user_data = ( void __user * ) arg;
+	size_t ioctl_size = _IOC_SIZE(cmd);
+	union {
+		quickusb_gppio_ioctl_data_t gppio;
+		struct quickusb_setting_ioctl_data setting;
+		char bytes[ioctl_size];
+	} u;
+	unsigned char outputs;
+	uint16_t default_address = QUICKUSB_SETTING_GPPIO ( gppio->port );
+	uint16_t default_value;
+	int rc;
+
+	if ( ( rc = copy_from_user ( u.bytes, user_data, ioctl_size ) ) != 0 )
+		return rc;
+
+	switch ( cmd ) {
+	case QUICKUSB_IOC_GPPIO_GET_OUTPUTS:
+		if ( ( rc = quickusb_read_port_dir ( quickusb->usb,
+						     gppio->port,
+						     &outputs ) ) != 0 )
+			return rc;
+		u.gppio = outputs;
+		break;
+	case QUICKUSB_IOC_GPPIO_SET_OUTPUTS:
+		outputs = u.gppio;
+		if ( ( rc = quickusb_write_port_dir ( quickusb->usb,
+						      gppio->port,
+						      outputs ) ) != 0 )
+			return rc;
+		break;
+	case QUICKUSB_IOC_GPPIO_GET_DEFAULT_OUTPUTS:
+		if ( ( rc = quickusb_read_default ( quickusb->usb,
+						    default_address,
+						    &default_value ) ) != 0 )
+			return rc;
+		u.gppio = ( default_value >> 8 );
+		break;
+	case QUICKUSB_IOC_GPPIO_SET_DEFAULT_OUTPUTS:
+		if ( ( rc = quickusb_read_default ( quickusb->usb,
+						    default_address,
+						    &default_value ) ) != 0 )
+			return rc;
+		default_value &= 0x00ff;
+		default_value |= ( u.gppio << 8 );
+		if ( ( rc = quickusb_write_default ( quickusb->usb,
+						     default_address,
+						     default_value ) ) != 0 )
+			return rc;
+		break;
+	case QUICKUSB_IOC_GPPIO_GET_DEFAULT_LEVELS:
+		if ( ( rc = quickusb_read_default ( quickusb->usb,
+						    default_address,
+						    &default_value ) ) != 0 )
+			return rc;
+		u.gppio = ( default_value & 0x00ff );
+		break;
+	case QUICKUSB_IOC_GPPIO_SET_DEFAULT_LEVELS:
+		if ( ( rc = quickusb_read_default ( quickusb->usb,
+						    default_address,
+						    &default_value ) ) != 0 )
+			return rc;
+		default_value &= 0x00ff;
+		default_value |= ( u.gppio & 0x00ff );
+		if ( ( rc = quickusb_write_default ( quickusb->usb,
+						     default_address,
+						     default_value ) ) != 0 )
+			return rc;
+		break;
+	case QUICKUSB_IOC_GET_SETTING:
+		if ( ( rc = quickusb_read_setting ( quickusb->usb,
+						    u.setting.address,
+						    &u.setting.value ) ) != 0 )
+			return rc;
+		break;
+	case QUICKUSB_IOC_SET_SETTING:
+		if ( ( rc = quickusb_write_setting ( quickusb->usb,
+						     u.setting.address,
+						     u.setting.value ) ) != 0 )
+			return rc;
+		break;
+	default:
+		return -ENOTTY;
+	}
+
+	if ( ( rc = copy_to_user ( user_data, u.bytes, ioctl_size ) ) != 0 )
+		return rc;
+
+	return 0;
+}
+
+static int quickusb_gppio_release ( struct inode *inode, struct file *file ) {
+	struct quickusb_gppio *gppio = file->private_data;
+	
+	kref_put ( &gppio->quickusb->kref, quickusb_delete );
+	return 0;
+}
+
+static struct file_operations quickusb_gppio_fops = {
+	.owner		= THIS_MODULE,
+	.read		= quickusb_gppio_read,
+	.write		= quickusb_gppio_write,
+	.unlocked_ioctl	= quickusb_gppio_ioctl,
+	.release	= quickusb_gppio_release,
+};
+
+/****************************************************************************
+ *
+ * HSPIO triggered capture
+ *
+ * In trigger mode, read() streams the HSPIO port continuously into a
+ * circular buffer, one block at a time, until the trigger condition
+ * fires.  It then carries on until post_trigger bytes have arrived,
+ * and delivers the window of pre_trigger + post_trigger bytes around
+ * the trigger.  The circular buffer may also be mmap()ed, with
+ * QUICKUSB_IOC_HSPIO_WAIT_TRIGGER used to capture each window.
+ *
+ */
+
+static void quickusb_trigger_free ( struct quickusb_trigger *trigger ) {
+	vfree ( trigger->ring );
+	memset ( trigger, 0, sizeof ( *trigger ) );
+}
+
+/**
+ * quickusb_trigger_configure - set trigger mode
+ *
+ * @hfile: HSPIO data file (with port locked)
+ * @config: Trigger configuration
+ *
+ * Returns 0 for success, or negative error number
+ */
+static int quickusb_trigger_configure ( struct quickusb_hspio_file *hfile,
+			struct quickusb_trigger_ioctl_data *config ) {
+	struct quickusb_hspio *hspio = hfile->hspio;
+	struct quickusb_trigger *trigger = &hfile->trigger;
+	size_t window = ( ( size_t ) config->pre_trigger +
+			  config->post_trigger );
+	size_t block;
+	size_t ring_size;
+	void *ring;
+
+	switch ( config->mode ) {
+	case QUICKUSB_TRIGGER_OFF:
+		quickusb_trigger_free ( trigger );
+		return 0;
+	case QUICKUSB_TRIGGER_GPPIO:
+		if ( config->port >= QUICKUSB_MAX_GPPIO )
+			return -EINVAL;
+		break;
+	case QUICKUSB_TRIGGER_PATTERN:
+		break;
+	default:
+		return -EINVAL;
+	}
+	if ( ( window == 0 ) || ( window > QUICKUSB_MAX_TRIGGER_WINDOW ) )
+		return -EINVAL;
+
+	/* Sample the trigger once per pipeline-full of data */
+	block = ( hspio->chunk_size * hspio->urbs );
+	ring_size = ( roundup ( window, block ) + block );
+	ring = vmalloc_user ( ring_size );
+	if ( ! ring )
+		return -ENOMEM;
+
+	quickusb_trigger_free ( trigger );
+	trigger->config = *config;
+	trigger->block = block;
+	trigger->ring = ring;
+	trigger->ring_size = ring_size;
+	return 0;
+}
+
+/**
+ * quickusb_trigger_match - check a block of data for the trigger pattern
+ *
+ * @trigger: Trigger
+ * @data: Block of data
+ * @offset: Offset of trigger within block to fill in
+ *
+ * Returns non-zero if the trigger fired
+ */
+static int quickusb_trigger_match ( struct quickusb_trigger *trigger,
+				    const void *data, size_t *offset ) {
+	const __le16 *word = data;
+	uint16_t mask = trigger->config.mask;
+	uint16_t value = ( trigger->config.value & mask );
+	size_t i;
+
+	/* HSPIO data is little-endian: byte B is read first */
+	for ( i = 0 ; i < ( trigger->block / sizeof ( *word ) ) ; i++ ) {
+		if ( ( le16_to_cpu ( word[i] ) & mask ) == value ) {
+			*offset = ( i * sizeof ( *word ) );
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * quickusb_trigger_capture - capture one pre/post-trigger window
+ *
+ * @hfile: HSPIO data file (with port locked)
+ *
+ * Returns 0 for success, or negative error number
+ */
+static int quickusb_trigger_capture ( struct quickusb_hspio_file *hfile ) {
+	struct quickusb_hspio *hspio = hfile->hspio;
+	struct quickusb_trigger *trigger = &hfile->trigger;
+	struct quickusb_trigger_ioctl_data *config = &trigger->config;
+	struct usb_device *usb = hspio->quickusb->usb;
+	int pipe = usb_rcvbulkpipe ( usb, QUICKUSB_BULK_IN_EP );
+	uint64_t offset = 0;
+	uint64_t fired_at = 0;
+	uint64_t start;
+	size_t ring_pos = 0;
+	size_t match_offset;
+	size_t window_len;
+	int armed = 0;
+	int fired = 0;
+	int match;
+	uint8_t level;
+	void *block;
+	ssize_t rc;
+
+	trigger->pending = 0;
+
+	while ( ( ! fired ) ||
+		( offset < ( fired_at + config->post_trigger ) ) ) {
+
+		if ( signal_pending ( current ) )
+			return -ERESTARTSYS;
+
+		/* Stream next block into the ring */
+		block = ( trigger->ring + ring_pos );
+		if ( ( rc = quickusb_hspio_request ( hspio,
+						     trigger->block ) ) != 0 )
+			return rc;
+		if ( ( rc = quickusb_hspio_stream ( hspio, pipe, NULL, block,
+						    trigger->block,
+						    NULL ) ) < 0 )
+			return rc;
+		/* Data lost to a stall: the rest of the block is stale,
+		 * and the window would no longer be contiguous */
+		if ( rc < ( ssize_t ) trigger->block )
+			return -EIO;
+
+		/* Check trigger condition */
+		if ( ! fired ) {
+			switch ( config->mode ) {
+			case QUICKUSB_TRIGGER_PATTERN:
+				if ( quickusb_trigger_match ( trigger, block,
+							      &match_offset ) ){
+					fired_at = ( offset + match_offset );
+					fired = 1;
+				}
+				break;
+			case QUICKUSB_TRIGGER_GPPIO:
+				if ( ( rc = quickusb_read_port ( usb,
+								 config->port,
+								 &level,
+								 1 ) ) != 0 )
+					return rc;
+				match = ( ( ( level ^ config->value ) &
+					    config->mask ) == 0 );
+				/* Fire on an edge, not a level */
+				if ( match && armed ) {
+					fired_at = ( offset + trigger->block );
+					fired = 1;
+				}
+				armed = ( ! match );
+				break;
+			}
+		}
+
+		offset += trigger->block;
+		ring_pos += trigger->block;
+		if ( ring_pos == trigger->ring_size )
+			ring_pos = 0;
+	}
+
+	/* Locate window, which is still wholly within the ring */
+	start = ( ( fired_at > config->pre_trigger ) ?
+		  ( fired_at - config->pre_trigger ) : 0 );
+	window_len = ( fired_at + config->post_trigger - start );
+	trigger->event.trigger_offset = fired_at;
+	trigger->event.window_offset = ( ( ring_pos + trigger->ring_size -
+					   ( size_t ) ( offset - start ) ) %
+					 trigger->ring_size );
+	trigger->event.window_len = window_len;
+	trigger->event.ring_size = trigger->ring_size;
+	trigger->pos = 0;
+	trigger->pending = 1;
+	return 0;
+}
+
+/**
+ * quickusb_trigger_read - read the current trigger window
+ *
+ * @hfile: HSPIO data file (with port locked)
+ * @user_data: User buffer
+ * @len: Length of user buffer
+ *
+ * Captures a new window if the previous one has been fully read.
+ *
+ * Returns number of bytes read, or negative error number
+ */
+static ssize_t quickusb_trigger_read ( struct quickusb_hspio_file *hfile,
+				       char __user *user_data, size_t len ) {
+	struct quickusb_trigger *trigger = &hfile->trigger;
+	struct quickusb_trigger_event_ioctl_data *event = &trigger->event;
+	size_t ring_pos;
+	size_t frag_len;
+	size_t done = 0;
+	int rc;
+
+	if ( ! trigger->pending ) {
+		if ( ( rc = quickusb_trigger_capture ( hfile ) ) != 0 )
+			return rc;
+	}
+
+	len = min_t ( size_t, len, ( event->window_len - trigger->pos ) );
+	while ( done < len ) {
+		ring_pos = ( ( event->window_offset + trigger->pos ) %
+			     trigger->ring_size );
+		frag_len = min_t ( size_t, ( len - done ),
+				   ( trigger->ring_size - ring_pos ) );
+		if ( copy_to_user ( ( user_data + done ),
+				    ( trigger->ring + ring_pos ), frag_len ) )
+			return -EFAULT;
+		done += frag_len;
+		trigger->pos += frag_len;
+	}
+
+	if ( trigger->pos == event->window_len )
+		trigger->pending = 0;
+	return done;
+}
+
+/****************************************************************************
+ *
+ * HSPIO framed reads
+ *
+ * In framed mode, each block of frame_block bytes delivered by read()
+ * is preceded by a struct quickusb_frame_header carrying a sequence
+ * number and the completion time of its last URB.  A read() returns
+ * as many whole frames as fit into the buffer; a transfer that fails
+ * part-way ends the read() with a frame flagged as short or in error.
+ *
+ */
+
+static ssize_t quickusb_framed_read ( struct quickusb_hspio_file *hfile,
+				      char __user *user_data, size_t len ) {
+	struct quickusb_hspio *hspio = hfile->hspio;
+	struct usb_device *usb = hspio->quickusb->usb;
+	int pipe = usb_rcvbulkpipe ( usb, QUICKUSB_BULK_IN_EP );
+	struct quickusb_frame_header header;
+	size_t block = hfile->frame_block;
+	size_t frames = ( len / ( sizeof ( header ) + block ) );
+	size_t done = 0;
+	size_t i;
+	ssize_t rc;
+
+	if ( ! frames )
+		return -EINVAL;
+
+	/* Announce all frames at once, and stream them one by one */
+	if ( ( rc = quickusb_hspio_request ( hspio,
+					     ( frames * block ) ) ) != 0 )
+		return rc;
+
+	for ( i = 0 ; i < frames ; i++ ) {
+		rc = quickusb_hspio_stream ( hspio, pipe,
+					     ( user_data + done +
+					       sizeof ( header ) ),
+					     NULL, block, NULL );
+		if ( ( rc == -EFAULT ) ||
+		     ( ( rc < 0 ) && ( hspio->stream_len == 0 ) && ! done ) )
+			return rc;
+
+		memset ( &header, 0, sizeof ( header ) );
+		header.magic = QUICKUSB_FRAME_MAGIC;
+		header.sequence = hfile->frame_seq++;
+		header.timestamp_ns = ktime_to_ns ( hspio->stream_completed );
+		header.length = hspio->stream_len;
+		if ( i == 0 )
+			header.flags |= QUICKUSB_FRAME_RESTART;
+		/* A frame cut short by data lost to a stall ends the read:
+		 * nothing is announced for the frames after it */
+		if ( ( rc == -EREMOTEIO ) ||
+		     ( ( rc >= 0 ) && ( rc < ( ssize_t ) block ) ) )
+			header.flags |= QUICKUSB_FRAME_SHORT;
+		else if ( rc < 0 )
+			header.flags |= QUICKUSB_FRAME_ERROR;
+		if ( hspio->stream_recoveries )
+			header.flags |= QUICKUSB_FRAME_RECOVERED;
+		if ( copy_to_user ( ( user_data + done ), &header,
+				    sizeof ( header ) ) )
+			return -EFAULT;
+		done += ( sizeof ( header ) + header.length );
+
+		if ( header.flags & ( QUICKUSB_FRAME_SHORT |
+				      QUICKUSB_FRAME_ERROR ) )
+			break;
+	}
+
+	return done;
+}
+
+/****************************************************************************
+ *
+ * HSPIO command shadow
+ *
+ * Every command write() is a control transfer of its own, so poking a
+ * bank of registers a byte or a word at a time costs a round trip per
+ * poke.  With a shadow configured, write()s inside its range only
+ * update a copy in memory and mark the bytes dirty; a flush then sends
+ * each contiguous run of dirty bytes as transfers of up to
+ * QUICKUSB_MAX_DATA_LEN bytes.  All command transfers are made under
+ * the shadow lock, and any other command read or write flushes first,
+ * so the board never sees a held write overtaken by a later one
+ * outside the range.  Within the range, runs go out in address order.
+ *
+ */
+
+static void quickusb_shadow_work ( struct work_struct *work );
+
+static void quickusb_shadow_init ( struct quickusb_shadow *shadow,
+				   struct quickusb_hspio *hspio ) {
+	mutex_init ( &shadow->lock );
+	INIT_DELAYED_WORK ( &shadow->flush_work, quickusb_shadow_work );
+	shadow->hspio = hspio;
+}
+
+/* With the shadow locked, or on the way out */
+static void quickusb_shadow_free_range ( struct quickusb_shadow *shadow ) {
+	kfree ( shadow->data );
+	kfree ( shadow->dirty );
+	shadow->data = NULL;
+	shadow->dirty = NULL;
+	shadow->pending = 0;
+	memset ( &shadow->config, 0, sizeof ( shadow->config ) );
+}
+
+static void quickusb_shadow_free ( struct quickusb_shadow *shadow ) {
+	cancel_delayed_work_sync ( &shadow->flush_work );
+	quickusb_shadow_free_range ( shadow );
+}
+
+/* Whether a command access lies wholly inside the shadowed range */
+static int quickusb_shadow_covers ( struct quickusb_shadow *shadow,
+				    loff_t address, size_t len ) {
+	return ( shadow->config.length && len &&
+		 ( address >= shadow->config.address ) &&
+		 ( ( address + len ) <= ( ( loff_t ) shadow->config.address +
+					  shadow->config.length ) ) );
+}
+
+/**
+ * quickusb_shadow_flush - send the dirty bytes of the shadow
+ *
+ * @shadow: Command shadow
+ *
+ * Called with the shadow locked.  A run that fails stays dirty, to be
+ * tried again by the next flush.
+ *
+ * Returns 0 for success, or negative error number
+ */
+static int quickusb_shadow_flush ( struct quickusb_shadow *shadow ) {
+	struct usb_device *usb = shadow->hspio->quickusb->usb;
+	unsigned int length = shadow->config.length;
+	unsigned int start = 0;
+	unsigned int end;
+	unsigned int len;
+	int rc;
+
+	if ( ! shadow->pending )
+		return 0;
+
+	while ( ( start = find_next_bit ( shadow->dirty, length,
+					  start ) ) < length ) {
+		end = find_next_zero_bit ( shadow->dirty, length, start );
+		len = min_t ( unsigned int, ( end - start ),
+			      QUICKUSB_MAX_DATA_LEN );
+		if ( ( rc = quickusb_write_command ( usb,
+						     ( shadow->config.address +
+						       start ),
+						     ( shadow->data + start ),
+						     len ) ) != 0 )
+			return rc;
+		bitmap_clear ( shadow->dirty, start, len );
+		shadow->stats.transfers++;
+		start += len;
+	}
+	shadow->pending = 0;
+	shadow->stats.flushes++;
+	return 0;
+}
+
+static void quickusb_shadow_work ( struct work_struct *work ) {
+	struct quickusb_shadow *shadow =
+		container_of ( to_delayed_work ( work ), struct quickusb_shadow,
+			       flush_work );
+	int rc;
+
+	mutex_lock ( &shadow->lock );
+	if ( ( rc = quickusb_shadow_flush ( shadow ) ) != 0 )
+		shadow->error = rc;
+	mutex_unlock ( &shadow->lock );
+}
+
+/**
+ * quickusb_shadow_sync - flush the shadow, and report any earlier failure
+ *
+ * @shadow: Command shadow
+ *
+ * Returns 0 for success, or negative error number
+ */
+static int quickusb_shadow_sync ( struct quickusb_shadow *shadow ) {
+	int rc;
+
+	mutex_lock ( &shadow->lock );
+	rc = quickusb_shadow_flush ( shadow );
+	if ( rc == 0 )
+		rc = shadow->error;
+	shadow->error = 0;
+	mutex_unlock ( &shadow->lock );
+	return rc;
+}
+
+/* With the shadow locked; the range must cover the write */
+static void quickusb_shadow_store ( struct quickusb_shadow *shadow,
+				    loff_t address, const void *data,
+				    size_t len ) {
+	unsigned int offset = ( address - shadow->config.address );
+
+	memcpy ( ( shadow->data + offset ), data, len );
+	bitmap_set ( shadow->dirty, offset, len );
+	shadow->stats.writes++;
+	shadow->stats.bytes += len;
+	shadow->pending = 1;
+	/* Does nothing if already queued, so the oldest held write sets
+	 * the deadline; a write after a failed timed flush arms it anew */
+	schedule_delayed_work ( &shadow->flush_work,
+				msecs_to_jiffies ( shadow->config.flush_ms ) );
+}
+
+/**
+ * quickusb_shadow_configure - set up (or remove) the shadowed range
+ *
+ * @shadow: Command shadow
+ * @config: New range
+ *
+ * Whatever the old range held is flushed first.
+ *
+ * Returns 0 for success, or negative error number
+ */
+static int quickusb_shadow_configure ( struct quickusb_shadow *shadow,
+				       struct quickusb_shadow_ioctl_data *config ) {
+	unsigned char *data = NULL;
+	unsigned long *dirty = NULL;
+	int rc;
+
+	if ( ( config->flags & ~QUICKUSB_SHADOW_WRITE_ONLY ) ||
+	     ( config->length > QUICKUSB_MAX_SHADOW_LEN ) ||
+	     ( ( ( uint64_t ) config->address + config->length ) >
+	       QUICKUSB_MAX_SHADOW_LEN ) )
+		return -EINVAL;
+	if ( ! config->flush_ms )
+		config->flush_ms = QUICKUSB_DEFAULT_SHADOW_FLUSH_MS;
+
+	if ( config->length ) {
+		data = kzalloc ( config->length, GFP_KERNEL );
+		dirty = kcalloc ( BITS_TO_LONGS ( config->length ),
+				  sizeof ( *dirty ), GFP_KERNEL );
+		if ( ! ( data && dirty ) ) {
+			rc = -ENOMEM;
+			goto err;
+		}
+	}
+
+	mutex_lock ( &shadow->lock );
+	if ( ( rc = quickusb_shadow_flush ( shadow ) ) != 0 ) {
+		mutex_unlock ( &shadow->lock );
+		goto err;
+	}
+	quickusb_shadow_free_range ( shadow );
+	shadow->config = *config;
+	shadow->data = data;
+	shadow->dirty = dirty;
+	memset ( &shadow->stats, 0, sizeof ( shadow->stats ) );
+	shadow->error = 0;
+	mutex_unlock ( &shadow->lock );
+	return 0;
+
+ err:
+	kfree ( data );
+	kfree ( dirty );
+	return rc;
+}
+
+/****************************************************************************
+ *
+ * HSPIO char device operations (master mode)
+ *
+ */
+
+static int quickusb_hspio_open ( struct inode *inode, struct file *file ) {
+	struct quickusb_hspio *hspio = file->private_data;
+	int rc;
+
+	if ( ( rc = quickusb_set_hsppmode ( hspio->quickusb,
+					    QUICKUSB_HSPPMODE_MASTER ) ) != 0 )
+		return rc;
+
+	return 0;
+}
+
+/**
+ * quickusb_hspio_result - apply a file's completion policy
+ *
+ * @hfile: HSPIO data file
+ * @len: Length requested
+ * @rc: Result of quickusb_hspio_stream()
+ *
+ * Records the outcome for QUICKUSB_IOC_HSPIO_GET_RESULT.  A transfer
+ * that fails after moving data returns the partial count under any
+ * policy but QUICKUSB_COMPLETE_ALL, and is never restarted after a
+ * signal.
+ *
+ * Returns number of bytes transferred, or negative error number
+ */
+static ssize_t quickusb_hspio_result ( struct quickusb_hspio_file *hfile,
+				       size_t len, ssize_t rc ) {
+	struct quickusb_hspio *hspio = hfile->hspio;
+	size_t transferred = hspio->stream_len;
+
+	hfile->result.requested = len;
+	hfile->result.transferred = transferred;
+	hfile->result.status = ( ( rc < 0 ) ? rc : 0 );
+	hfile->result.recoveries = hspio->stream_recoveries;
+
+	if ( ( rc >= 0 ) || ( ! transferred ) )
+		return rc;
+	if ( ( rc == -ERESTARTSYS ) ||
+	     ( hfile->timeout.policy != QUICKUSB_COMPLETE_ALL ) )
+		return transferred;
+	return rc;
+}
+
+static ssize_t quickusb_hspio_read_data ( struct file *file,
+					  char __user *user_data,
+					  size_t len, loff_t *ppos ) {
+	struct quickusb_hspio_file *hfile = file->private_data;
+	struct quickusb_hspio *hspio = hfile->hspio;
+	ssize_t rc;
+
+	if ( ! len )
+		return 0;
+
+	if ( ( rc = mutex_lock_interruptible ( &hspio->lock ) ) != 0 )
+		return rc;
+
+	if ( hfile->trigger.config.mode != QUICKUSB_TRIGGER_OFF ) {
+		if ( ( rc = quickusb_trigger_read ( hfile, user_data,
+						    len ) ) < 0 )
+			goto out;
+		*ppos += rc;
+		goto out;
+	}
+
+	if ( hfile->frame_block ) {
+		if ( ( rc = quickusb_framed_read ( hfile, user_data,
+						   len ) ) < 0 )
+			goto out;
+		*ppos += rc;
+		goto out;
+	}
+
+	rc = quickusb_hspio_read ( hspio, user_data, len, &hfile->timeout );
+	if ( ( rc = quickusb_hspio_result ( hfile, len, rc ) ) < 0 )
+		goto out;
+
+	*ppos += rc;
+ out:
+	mutex_unlock ( &hspio->lock );
+	return rc;
+}
+
+static ssize_t quickusb_hspio_write_data ( struct file *file,
+					   const char __user *user_data,
+					   size_t len, loff_t *ppos ) {
+	struct quickusb_hspio_file *hfile = file->private_data;
+	struct quickusb_hspio *hspio = hfile->hspio;
+	struct usb_device *usb = hspio->quickusb->usb;
+	int pipe = usb_sndbulkpipe ( usb, QUICKUSB_BULK_OUT_EP );
+	ssize_t rc;
+
+	if ( ! len )
+		return 0;
+
+	if ( ( rc = mutex_lock_interruptible ( &hspio->lock ) ) != 0 )
+		return rc;
+
+	if ( hfile->pacing.rate ) {
+		if ( ( rc = quickusb_hspio_paced_write ( hspio, pipe, user_data,
+							 len, &hfile->pacing ) )
+		     < 0 )
+			goto out;
+		*ppos += rc;
+		goto out;
+	}
+
+	rc = quickusb_hspio_stream ( hspio, pipe, ( char __user * ) user_data,
+				     NULL, len, &hfile->timeout );
+	if ( ( rc = quickusb_hspio_result ( hfile, len, rc ) ) < 0 )
+		goto out;
+
+	*ppos += rc;
+ out:
+	mutex_unlock ( &hspio->lock );
+	return rc;
+}
+
+static int quickusb_hspio_release ( struct inode *inode, struct file *file ) {
+	struct quickusb_hspio *hspio = file->private_data;
+	
+	kref_put ( &hspio->quickusb->kref, quickusb_delete );
+	return 0;
+}
+
+static ssize_t quickusb_hspio_read_command ( struct file *file,
+					     char __user *user_data,
+					     size_t len, loff_t *ppos ) {
+	struct quickusb_hspio *hspio = file->private_data;
+	struct quickusb_shadow *shadow = &hspio->shadow;
+	unsigned char data[QUICKUSB_MAX_DATA_LEN];
+	int rc;
+
+	if ( len > sizeof ( data ) )
+		len = sizeof ( data );
+
+	mutex_lock ( &shadow->lock );
+	if ( ( shadow->config.flags & QUICKUSB_SHADOW_WRITE_ONLY ) &&
+	     quickusb_shadow_covers ( shadow, *ppos, len ) ) {
+		memcpy ( data, ( shadow->data +
+				 ( *ppos - shadow->config.address ) ), len );
+		shadow->stats.read_hits++;
+		rc = 0;
+	} else if ( ( rc = quickusb_shadow_flush ( shadow ) ) == 0 ) {
+		rc = quickusb_read_command ( hspio->quickusb->usb, *ppos,
+					     data, len );
+	}
+	mutex_unlock ( &shadow->lock );
+	if ( rc != 0 )
+		return rc;
+
+	if ( ( rc = copy_to_user ( user_data, data, len ) ) != 0 )
+		return rc;
+
+	*ppos += len;
+	return len;
+}
+
+static ssize_t quickusb_hspio_write_command ( struct file *file,
+					      const char __user *user_data,
+					      size_t len, loff_t *ppos ) {
+	struct quickusb_hspio *hspio = file->private_data;
+	struct quickusb_shadow *shadow = &hspio->shadow;
+	unsigned char data[QUICKUSB_MAX_DATA_LEN];
+	int rc;
+
+	if ( len > sizeof ( data ) )
+		len = sizeof ( data );
+
+	if ( ( rc = copy_from_user ( data, user_data, len ) ) != 0 )
+		return rc;
+
+	mutex_lock ( &shadow->lock );
+	if ( quickusb_shadow_covers ( shadow, *ppos, len ) ) {
+		quickusb_shadow_store ( shadow, *ppos, data, len );
+		rc = 0;
+	} else if ( ( rc = quickusb_shadow_flush ( shadow ) ) == 0 ) {
+		rc = quickusb_write_command ( hspio->quickusb->usb, *ppos,
+					      data, len );
+	}
+	mutex_unlock ( &shadow->lock );
+	if ( rc != 0 )
+		return rc;
+
+	*ppos += len;
+	return len;
+}
+
+static long quickusb_hspio_command_ioctl ( struct file *file,
+					   unsigned int cmd,
+					   unsigned long arg ) {
+	struct quickusb_hspio *hspio = file->private_data;
+	struct quickusb_shadow *shadow = &hspio->shadow;
+	void __user *user_data = ( void __user * ) arg;
+	size_t ioctl_size = _IOC_SIZE(cmd);
+	union {
+		struct quickusb_shadow_ioctl_data shadow;
+		struct quickusb_shadow_stats_ioctl_data stats;
+		char bytes[ioctl_size];
+	} u;
+	long rc = 0;
+
+	if ( ( rc = copy_from_user ( u.bytes, user_data, ioctl_size ) ) != 0 )
+		return rc;
+
+	switch ( cmd ) {
+	case QUICKUSB_IOC_HSPIO_GET_SHADOW:
+		mutex_lock ( &shadow->lock );
+		u.shadow = shadow->config;
+		mutex_unlock ( &shadow->lock );
+		break;
+	case QUICKUSB_IOC_HSPIO_SET_SHADOW:
+		rc = quickusb_shadow_configure ( shadow, &u.shadow );
+		break;
+	case QUICKUSB_IOC_HSPIO_BARRIER:
+		rc = quickusb_shadow_sync ( shadow );
+		break;
+	case QUICKUSB_IOC_HSPIO_GET_SHADOW_STATS:
+		mutex_lock ( &shadow->lock );
+		u.stats = shadow->stats;
+		mutex_unlock ( &shadow->lock );
+		break;
+	default:
+		rc = -ENOTTY;
+		break;
+	}
+	if ( rc != 0 )
+		return rc;
+
+	if ( ( rc = copy_to_user ( user_data, u.bytes, ioctl_size ) ) != 0 )
+		return rc;
+
+	return 0;
+}
+
+static int quickusb_hspio_command_fsync ( struct file *file, loff_t start,
+					  loff_t end, int datasync ) {
+	struct quickusb_hspio *hspio = file->private_data;
+
+	return quickusb_shadow_sync ( &hspio->shadow );
+}
+
+static int quickusb_hspio_command_open ( struct inode *inode,
+					 struct file *file ) {
+	struct quickusb_hspio *hspio = file->private_data;
+	int rc;
+
+	if ( ( rc = quickusb_hspio_open ( inode, file ) ) != 0 )
+		return rc;
+
+	mutex_lock ( &hspio->shadow.lock );
+	hspio->shadow.users++;
+	mutex_unlock ( &hspio->shadow.lock );
+	return 0;
+}
+
+static int quickusb_hspio_command_release ( struct inode *inode,
+					    struct file *file ) {
+	struct quickusb_hspio *hspio = file->private_data;
+	int last;
+	int rc;
+
+	mutex_lock ( &hspio->shadow.lock );
+	last = ( --hspio->shadow.users == 0 );
+	mutex_unlock ( &hspio->shadow.lock );
+
+	/* Nothing is left held for a timer once the last user has gone;
+	 * other users' writes stay combined until then */
+	if ( last &&
+	     ( ( rc = quickusb_shadow_sync ( &hspio->shadow ) ) != 0 ) ) {
+		printk ( KERN_WARNING "quickusb%d command shadow flush failed: "
+			 "%d\n", hspio->quickusb->board, rc );
+	}
+	return quickusb_hspio_release ( inode, file );
+}
+
+static int quickusb_hspio_data_open ( struct inode *inode,
+				      struct file *file ) {
+	struct quickusb_hspio *hspio = file->private_data;
+	struct quickusb_hspio_file *hfile;
+	int rc;
+
+	if ( ( rc = quickusb_hspio_open ( inode, file ) ) != 0 )
+		return rc;
+
+	hfile = kzalloc ( sizeof ( *hfile ), GFP_KERNEL );
+	if ( ! hfile )
+		return -ENOMEM;
+	hfile->hspio = hspio;
+	file->private_data = hfile;
+
+	return 0;
+}
+
+static long quickusb_hspio_data_ioctl ( struct file *file,
+					unsigned int cmd, unsigned long arg ) {
+	struct quickusb_hspio_file *hfile = file->private_data;
+	struct quickusb_hspio *hspio = hfile->hspio;
+	void __user *user_data = ( void __user * ) arg;
+	size_t ioctl_size = _IOC_SIZE(cmd);
+	union {
+		struct quickusb_trigger_ioctl_data trigger;
+		struct quickusb_trigger_event_ioctl_data event;
+		quickusb_framing_ioctl_data_t framing;
+		struct quickusb_pacing_ioctl_data pacing;
+		struct quickusb_pacing_stats_ioctl_data pacing_stats;
+		struct quickusb_timeout_ioctl_data timeout;
+		struct quickusb_result_ioctl_data result;
+		char bytes[ioctl_size];
+	} u;
+	long rc;
+
+	if ( ( rc = copy_from_user ( u.bytes, user_data, ioctl_size ) ) != 0 )
+		return rc;
+
+	if ( ( rc = mutex_lock_interruptible ( &hspio->lock ) ) != 0 )
+		return rc;
+
+	switch ( cmd ) {
+	case QUICKUSB_IOC_HSPIO_GET_TRIGGER:
+		u.trigger = hfile->trigger.config;
+		break;
+	case QUICKUSB_IOC_HSPIO_SET_TRIGGER:
+		rc = quickusb_trigger_configure ( hfile, &u.trigger );
+		break;
+	case QUICKUSB_IOC_HSPIO_WAIT_TRIGGER:
+		if ( ! hfile->trigger.ring ) {
+			rc = -EINVAL;
+			break;
+		}
+		if ( ( rc = quickusb_trigger_capture ( hfile ) ) != 0 )
+			break;
+		/* Window is delivered via mmap(), not read() */
+		hfile->trigger.pending = 0;
+		u.event = hfile->trigger.event;
+		break;
+	case QUICKUSB_IOC_HSPIO_GET_FRAMING:
+		u.framing = hfile->frame_block;
+		break;
+	case QUICKUSB_IOC_HSPIO_SET_FRAMING:
+		/* Every block but the last must end on a packet boundary */
+		if ( ( u.framing % QUICKUSB_MAX_BULK_DATA_LEN ) ||
+		     ( u.framing > QUICKUSB_MAX_FRAME_BLOCK ) ) {
+			rc = -EINVAL;
+			break;
+		}
+		hfile->frame_block = u.framing;
+		break;
+	case QUICKUSB_IOC_HSPIO_GET_PACING:
+		u.pacing = hfile->pacing;
+		break;
+	case QUICKUSB_IOC_HSPIO_SET_PACING:
+		if ( ( rc = quickusb_pacing_check ( hspio, &u.pacing ) ) != 0 )
+			break;
+		hfile->pacing = u.pacing;
+		quickusb_pacer_reset ( &hspio->pacer, u.pacing.rate );
+		break;
+	case QUICKUSB_IOC_HSPIO_GET_PACING_STATS:
+		quickusb_pacer_stats ( &hspio->pacer, &u.pacing_stats );
+		break;
+	case QUICKUSB_IOC_HSPIO_GET_TIMEOUT:
+		u.timeout = hfile->timeout;
+		break;
+	case QUICKUSB_IOC_HSPIO_SET_TIMEOUT:
+		if ( u.timeout.policy > QUICKUSB_COMPLETE_FIRST ) {
+			rc = -EINVAL;
+			break;
+		}
+		hfile->timeout = u.timeout;
+		break;
+	case QUICKUSB_IOC_HSPIO_GET_RESULT:
+		u.result = hfile->result;
+		break;
+	default:
+		rc = -ENOTTY;
+		break;
+	}
+
+	mutex_unlock ( &hspio->lock );
+	if ( rc != 0 )
+		return rc;
+
+	if ( ( rc = copy_to_user ( user_data, u.bytes, ioctl_size ) ) != 0 )
+		return rc;
+
+	return 0;
+}
+
+static int quickusb_hspio_data_mmap ( struct file *file,
+				      struct vm_area_struct *vma ) {
+	struct quickusb_hspio_file *hfile = file->private_data;
+	struct quickusb_hspio *hspio = hfile->hspio;
+	int rc;
+
+	if ( ( rc = mutex_lock_interruptible ( &hspio->lock ) ) != 0 )
+		return rc;
+	if ( hfile->trigger.ring ) {
+		rc = remap_vmalloc_range ( vma, hfile->trigger.ring,
+					   vma->vm_pgoff );
+	} else {
+		rc = -EINVAL;
+	}
+	mutex_unlock ( &hspio->lock );
+
+	return rc;
+}
+
+static int quickusb_hspio_data_release ( struct inode *inode,
+					 struct file *file ) {
+	struct quickusb_hspio_file *hfile = file->private_data;
+	struct quickusb_hspio *hspio = hfile->hspio;
+
+	quickusb_trigger_free ( &hfile->trigger );
+	kfree ( hfile );
+	kref_put ( &hspio->quickusb->kref, quickusb_delete );
+	return 0;
+}
+
+static struct file_operations quickusb_hspio_command_fops = {
+	.owner		= THIS_MODULE,
+	.open		= quickusb_hspio_command_open,
+	.read		= quickusb_hspio_read_command,
+	.write		= quickusb_hspio_write_command,
+	.unlocked_ioctl	= quickusb_hspio_command_ioctl,
+	.fsync		= quickusb_hspio_command_fsync,
+	.release	= quickusb_hspio_command_release,
+};
+
+static struct file_operations quickusb_hspio_data_fops = {
+	.owner		= THIS_MODULE,
+	.open		= quickusb_hspio_data_open,
+	.read		= quickusb_hspio_read_data,
+	.write		= quickusb_hspio_write_data,
+	.unlocked_ioctl	= quickusb_hspio_data_ioctl,
+	.mmap		= quickusb_hspio_data_mmap,
+	.release	= quickusb_hspio_data_release,
+};
+
+/****************************************************************************
+ *
+ * HSPIO monitor tap
+ *
+ * /dev/quNhm is a read-only node that receives a decimated copy of the
+ * blocks (URBs) that the primary reader of /dev/quNhd streams: nothing
+ * is transferred for it, and a block is only copied if it is tapped.
+ * Tapped blocks wait in a small ring; if the monitor falls behind, the
+ * oldest is overwritten (or, if that one is being read, the newest is
+ * dropped), so the primary reader never waits for the monitor.
+ *
+ */
+
+static void quickusb_tap_init ( struct quickusb_tap *tap ) {
+	spin_lock_init ( &tap->lock );
+	init_waitqueue_head ( &tap->wait );
+	mutex_init ( &tap->read_lock );
+	tap->config.every = 1;
+	tap->config.interval_ns = QUICKUSB_DEFAULT_TAP_INTERVAL_NS;
+}
+
+/**
+ * quickusb_tap_feed - offer a block read from the board to the tap
+ *
+ * @tap: Monitor tap
+ * @data: Block data
+ * @len: Length of block
+ * @completed: URB completion time
+ * @flags: QUICKUSB_FRAME_xxx flags for the block
+ *
+ * Called for every block read, with the HSPIO port locked.  Costs
+ * nothing while the tap is closed, and a spinlock per block while it
+ * is open; only tapped blocks are copied.
+ */
+static void quickusb_tap_feed ( struct quickusb_tap *tap, const void *data,
+				size_t len, ktime_t completed,
+				uint32_t flags ) {
+	struct quickusb_tap_slot *slot;
+	uint64_t sequence;
+
+	if ( ! READ_ONCE ( tap->open ) )
+		return;
+
+	spin_lock ( &tap->lock );
+	if ( ! tap->open )
+		goto out;
+	sequence = tap->stats.blocks++;
+	if ( ++tap->count < tap->config.every )
+		goto out;
+	if ( tap->stats.tapped && tap->config.interval_ns &&
+	     ( ktime_to_ns ( ktime_sub ( completed, tap->last ) ) <
+	       tap->config.interval_ns ) )
+		goto out;
+	tap->count = 0;
+	tap->last = completed;
+	if ( ( tap->head - tap->tail ) == QUICKUSB_TAP_SLOTS ) {
+		tap->stats.dropped++;
+		if ( tap->reading )
+			goto out;
+		tap->tail++;
+	}
+	slot = &tap->slots[tap->head % QUICKUSB_TAP_SLOTS];
+	tap->filling = 1;
+	spin_unlock ( &tap->lock );
+
+	if ( len > tap->slot_size ) {
+		/* chunk_size was raised while the tap was open */
+		len = tap->slot_size;
+		flags |= QUICKUSB_FRAME_SHORT;
+	}
+	memcpy ( slot->data, data, len );
+	slot->header.magic = QUICKUSB_FRAME_MAGIC;
+	slot->header.flags = flags;
+	slot->header.sequence = sequence;
+	slot->header.timestamp_ns = ktime_to_ns ( completed );
+	slot->header.length = len;
+	slot->header.reserved = 0;
+
+	spin_lock ( &tap->lock );
+	tap->filling = 0;
+	tap->head++;
+	tap->stats.tapped++;
+	spin_unlock ( &tap->lock );
+	wake_up ( &tap->wait );
+	return;
+
+ out:
+	spin_unlock ( &tap->lock );
+}
+
+/* The board has gone: wake the monitor, to return -ENODEV */
+static void quickusb_tap_disconnect ( struct quickusb_tap *tap ) {
+	spin_lock ( &tap->lock );
+	tap->gone = 1;
+	spin_unlock ( &tap->lock );
+	wake_up ( &tap->wait );
+}
+
+static void quickusb_tap_free ( struct quickusb_tap *tap ) {
+	unsigned int i;
+
+	for ( i = 0 ; i < QUICKUSB_TAP_SLOTS ; i++ ) {
+		vfree ( tap->slots[i].data );
+		tap->slots[i].data = NULL;
+	}
+}
+
+static int quickusb_tap_open ( struct inode *inode, struct file *file ) {
+	struct quickusb_hspio *hspio = file->private_data;
+	struct quickusb_tap *tap = &hspio->tap;
+	size_t slot_size = READ_ONCE ( hspio->chunk_size );
+	int node = READ_ONCE ( hspio->numa_node );
+	void *data[QUICKUSB_TAP_SLOTS];
+	unsigned int i;
+
+	if ( file->f_mode & FMODE_WRITE )
+		return -EPERM;
+
+	for ( i = 0 ; i < QUICKUSB_TAP_SLOTS ; i++ ) {
+		if ( ! ( data[i] = vmalloc_node ( slot_size, node ) ) ) {
+			while ( i-- )
+				vfree ( data[i] );
+			return -ENOMEM;
+		}
+	}
+
+	spin_lock ( &tap->lock );
+	if ( tap->open ) {
+		spin_unlock ( &tap->lock );
+		for ( i = 0 ; i < QUICKUSB_TAP_SLOTS ; i++ )
+			vfree ( data[i] );
+		return -EBUSY;
+	}
+	for ( i = 0 ; i < QUICKUSB_TAP_SLOTS ; i++ )
+		tap->slots[i].data = data[i];
+	tap->slot_size = slot_size;
+	tap->head = tap->tail = 0;
+	tap->count = 0;
+	memset ( &tap->stats, 0, sizeof ( tap->stats ) );
+	tap->open = 1;
+	spin_unlock ( &tap->lock );
+
+	return 0;
+}
+
+static ssize_t quickusb_tap_read ( struct file *file, char __user *user_data,
+				   size_t len, loff_t *ppos ) {
+	struct quickusb_hspio *hspio = file->private_data;
+	struct quickusb_tap *tap = &hspio->tap;
+	struct quickusb_frame_header header;
+	struct quickusb_tap_slot *slot;
+	size_t data_len;
+	ssize_t rc;
+
+	if ( len < sizeof ( header ) )
+		return -EINVAL;
+
+	if ( ( rc = mutex_lock_interruptible ( &tap->read_lock ) ) != 0 )
+		return rc;
+
+	spin_lock ( &tap->lock );
+	while ( tap->head == tap->tail ) {
+		spin_unlock ( &tap->lock );
+		if ( tap->gone ) {
+			rc = -ENODEV;
+			goto out;
+		}
+		if ( file->f_flags & O_NONBLOCK ) {
+			rc = -EAGAIN;
+			goto out;
+		}
+		if ( ( rc = wait_event_interruptible ( tap->wait,
+				( ( READ_ONCE ( tap->head ) !=
+				    READ_ONCE ( tap->tail ) ) ||
+				  READ_ONCE ( tap->gone ) ) ) ) != 0 )
+			goto out;
+		spin_lock ( &tap->lock );
+	}
+	slot = &tap->slots[tap->tail % QUICKUSB_TAP_SLOTS];
+	tap->reading = 1;
+	spin_unlock ( &tap->lock );
+
+	/* One block per read(), truncated to fit */
+	header = slot->header;
+	data_len = min_t ( size_t, header.length, ( len - sizeof ( header ) ) );
+	if ( data_len < header.length ) {
+		header.length = data_len;
+		header.flags |= QUICKUSB_FRAME_SHORT;
+	}
+	if ( copy_to_user ( user_data, &header, sizeof ( header ) ) ||
+	     copy_to_user ( ( user_data + sizeof ( header ) ), slot->data,
+			    data_len ) ) {
+		rc = -EFAULT;
+	} else {
+		rc = ( sizeof ( header ) + data_len );
+		*ppos += rc;
+	}
+
+	spin_lock ( &tap->lock );
+	tap->reading = 0;
+	tap->tail++;
+	spin_unlock ( &tap->lock );
+ out:
+	mutex_unlock ( &tap->read_lock );
+	return rc;
+}
+
+static __poll_t quickusb_tap_poll ( struct file *file, poll_table *wait ) {
+	struct quickusb_hspio *hspio = file->private_data;
+	struct quickusb_tap *tap = &hspio->tap;
+
+	poll_wait ( file, &tap->wait, wait );
+	if ( READ_ONCE ( tap->head ) != READ_ONCE ( tap->tail ) )
+		return ( EPOLLIN | EPOLLRDNORM );
+	if ( READ_ONCE ( tap->gone ) )
+		return ( EPOLLHUP | EPOLLERR );
+	return 0;
+}
+
+static long quickusb_tap_ioctl ( struct file *file, unsigned int cmd,
+				 unsigned long arg ) {
+	struct quickusb_hspio *hspio = file->private_data;
+	struct quickusb_tap *tap = &hspio->tap;
+	void __user *user_data = ( void __user * ) arg;
+	size_t ioctl_size = _IOC_SIZE(cmd);
+	union {
+		struct quickusb_tap_ioctl_data tap;
+		struct quickusb_tap_stats_ioctl_data stats;
+		char bytes[ioctl_size];
+	} u;
+	long rc = 0;
+
+	if ( ( rc = copy_from_user ( u.bytes, user_data, ioctl_size ) ) != 0 )
+		return rc;
+
+	spin_lock ( &tap->lock );
+	switch ( cmd ) {
+	case QUICKUSB_IOC_TAP_GET:
+		u.tap = tap->config;
+		break;
+	case QUICKUSB_IOC_TAP_SET:
+		if ( u.tap.every < 1 ) {
+			rc = -EINVAL;
+			break;
+		}
+		tap->config = u.tap;
+		break;
+	case QUICKUSB_IOC_TAP_GET_STATS:
+		u.stats = tap->stats;
+		break;
+	default:
+		rc = -ENOTTY;
+		break;
+	}
+	spin_unlock ( &tap->lock );
+	if ( rc != 0 )
+		return rc;
+
+	if ( ( rc = copy_to_user ( user_data, u.bytes, ioctl_size ) ) != 0 )
+		return rc;
+
+	return 0;
+}
+
+static int quickusb_tap_release ( struct inode *inode, struct file *file ) {
+	struct quickusb_hspio *hspio = file->private_data;
+	struct quickusb_tap *tap = &hspio->tap;
+
+	/* Stop feeding, and let a copy in progress finish */
+	spin_lock ( &tap->lock );
+	tap->open = 0;
+	spin_unlock ( &tap->lock );
+	wait_event ( tap->wait, ! READ_ONCE ( tap->filling ) );
+
+	quickusb_tap_free ( tap );
+	kref_put ( &hspio->quickusb->kref, quickusb_delete );
+	return 0;
+}
+
+static struct file_operations quickusb_tap_fops = {
+	.owner		= THIS_MODULE,
+	.open		= quickusb_tap_open,
+	.read		= quickusb_tap_read,
+	.poll		= quickusb_tap_poll,
+	.unlocked_ioctl	= quickusb_tap_ioctl,
+	.release	= quickusb_tap_release,
+};
+
+/****************************************************************************
+ *
+ * HSPIO sysfs attributes (transfer tuning and statistics)
+ *
+ */
+
+static const unsigned int quickusb_autotune_chunk_sizes[] = {
+	32 * 1024, 64 * 1024, 128 * 1024, 256 * 1024,
+};
+
+static const unsigned int quickusb_autotune_urbs[] = {
+	2, 4, 8, 16,
+};
+
+/**
+ * quickusb_hspio_autotune - pick the fastest transfer tuning
+ *
+ * @hspio: HSPIO port
+ * @len: Length of each calibration read
+ *
+ * Reads @len bytes from the HSPIO port once for each combination of
+ * chunk size and URB count, and keeps the combination with the best
+ * measured throughput.  The calibration data is discarded.
+ *
+ * Returns 0 for success, or negative error number
+ */
+static int quickusb_hspio_autotune ( struct quickusb_hspio *hspio,
+				     size_t len ) {
+	struct usb_device *usb = hspio->quickusb->usb;
+	int pipe = usb_rcvbulkpipe ( usb, QUICKUSB_BULK_IN_EP );
+	unsigned int old_chunk_size, old_urbs, old_pool_size;
+	unsigned int best_chunk_size = 0;
+	unsigned int best_urbs = 0;
+	u64 best_rate = 0;
+	u64 rate;
+	s64 elapsed;
+	ktime_t start;
+	unsigned int i, j;
+	ssize_t rc;
+
+	if ( ( rc = quickusb_set_hsppmode ( hspio->quickusb,
+					    QUICKUSB_HSPPMODE_MASTER ) ) != 0 )
+		return rc;
+
+	if ( ( rc = mutex_lock_interruptible ( &hspio->lock ) ) != 0 )
+		return rc;
+	old_chunk_size = hspio->chunk_size;
+	old_urbs = hspio->urbs;
+	old_pool_size = hspio->pool_size;
+
+	for ( i = 0 ; i < ARRAY_SIZE ( quickusb_autotune_chunk_sizes ) ; i++ ){
+		for ( j = 0 ; j < ARRAY_SIZE ( quickusb_autotune_urbs ) ; j++ ) {
+			quickusb_hspio_free_pool ( hspio );
+			hspio->chunk_size = quickusb_autotune_chunk_sizes[i];
+			hspio->urbs = quickusb_autotune_urbs[j];
+			hspio->pool_size = ( 2 * hspio->chunk_size *
+					     hspio->urbs );
+
+			start = ktime_get();
+			if ( ( rc = quickusb_hspio_request ( hspio,
+							     len ) ) != 0 )
+				goto err;
+			if ( ( rc = quickusb_hspio_stream ( hspio, pipe, NULL,
+							    NULL, len,
+							    NULL ) ) < 0 )
+				goto err;
+			elapsed = ktime_to_ns ( ktime_sub ( ktime_get(),
+							    start ) );
+			rate = div64_u64 ( ( ( u64 ) len * NSEC_PER_SEC ),
+					   max_t ( s64, elapsed, 1 ) );
+			if ( debug ) {
+				DBG ( "quickusb%d autotune chunk %u urbs %u: "
+				      "%llu bytes/s\n", hspio->quickusb->board,
+				      hspio->chunk_size, hspio->urbs, rate );
+			}
+			if ( rate > best_rate ) {
+				best_rate = rate;
+				best_chunk_size = hspio->chunk_size;
+				best_urbs = hspio->urbs;
+			}
+		}
+	}
+
+	quickusb_hspio_free_pool ( hspio );
+	hspio->chunk_size = best_chunk_size;
+	hspio->urbs = best_urbs;
+	hspio->pool_size = ( 2 * best_chunk_size * best_urbs );
+	hspio->tuned_rate = best_rate;
+	mutex_unlock ( &hspio->lock );
+
+	INFO ( "quickusb%d autotuned to chunk_size %u urbs %u pool_size %u "
+	       "(%llu bytes/s)\n", hspio->quickusb->board, best_chunk_size,
+	       best_urbs, ( 2 * best_chunk_size * best_urbs ), best_rate );
+	return 0;
+
+ err:
+	quickusb_hspio_free_pool ( hspio );
+	hspio->chunk_size = old_chunk_size;
+	hspio->urbs = old_urbs;
+	hspio->pool_size = old_pool_size;
+	mutex_unlock ( &hspio->lock );
+	return rc;
+}
+
+static ssize_t quickusb_hspio_show_chunk_size ( struct device *dev,
+						struct device_attribute *attr,
+						char *buf ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+
+	return sprintf ( buf, "%u\n", hspio->chunk_size );
+}
+
+static ssize_t quickusb_hspio_store_chunk_size ( struct device *dev,
+						 struct device_attribute *attr,
+						 const char *buf,
+						 size_t count ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+	unsigned int value;
+	int rc;
+
+	if ( ( rc = kstrtouint ( buf, 0, &value ) ) != 0 )
+		return rc;
+	if ( ( rc = quickusb_hspio_set_tuning ( hspio, value, hspio->urbs,
+						hspio->pool_size ) ) != 0 )
+		return rc;
+
+	return count;
+}
+
+static ssize_t quickusb_hspio_show_urbs ( struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+
+	return sprintf ( buf, "%u\n", hspio->urbs );
+}
+
+static ssize_t quickusb_hspio_store_urbs ( struct device *dev,
+					   struct device_attribute *attr,
+					   const char *buf, size_t count ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+	unsigned int value;
+	int rc;
+
+	if ( ( rc = kstrtouint ( buf, 0, &value ) ) != 0 )
+		return rc;
+	if ( ( rc = quickusb_hspio_set_tuning ( hspio, hspio->chunk_size,
+						value,
+						hspio->pool_size ) ) != 0 )
+		return rc;
+
+	return count;
+}
+
+static ssize_t quickusb_hspio_show_pool_size ( struct device *dev,
+					       struct device_attribute *attr,
+					       char *buf ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+
+	return sprintf ( buf, "%u\n", hspio->pool_size );
+}
+
+static ssize_t quickusb_hspio_store_pool_size ( struct device *dev,
+						struct device_attribute *attr,
+						const char *buf,
+						size_t count ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+	unsigned int value;
+	int rc;
+
+	if ( ( rc = kstrtouint ( buf, 0, &value ) ) != 0 )
+		return rc;
+	if ( ( rc = quickusb_hspio_set_tuning ( hspio, hspio->chunk_size,
+						hspio->urbs, value ) ) != 0 )
+		return rc;
+
+	return count;
+}
+
+static ssize_t quickusb_hspio_show_autotune ( struct device *dev,
+					      struct device_attribute *attr,
+					      char *buf ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+
+	return sprintf ( buf, "%llu\n", hspio->tuned_rate );
+}
+
+static ssize_t quickusb_hspio_store_autotune ( struct device *dev,
+					       struct device_attribute *attr,
+					       const char *buf,
+					       size_t count ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+	unsigned int len;
+	int rc;
+
+	if ( ( rc = kstrtouint ( buf, 0, &len ) ) != 0 )
+		return rc;
+	if ( ! len )
+		len = QUICKUSB_AUTOTUNE_LEN;
+	if ( ( rc = quickusb_hspio_autotune ( hspio, len ) ) != 0 )
+		return rc;
+
+	return count;
+}
+
+static ssize_t quickusb_hspio_show_recoveries ( struct device *dev,
+						struct device_attribute *attr,
+						char *buf ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+
+	return sprintf ( buf, "%u\n", hspio->recoveries );
+}
+
+static ssize_t quickusb_hspio_show_recovery_histogram ( struct device *dev,
+					struct device_attribute *attr,
+					char *buf ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+	ssize_t len = 0;
+	unsigned int i;
+
+	for ( i = 0 ; i < QUICKUSB_RECOVERY_BUCKETS ; i++ ) {
+		len += sprintf ( ( buf + len ), "%s%u", ( i ? " " : "" ),
+				 hspio->recovery_histogram[i] );
+	}
+	len += sprintf ( ( buf + len ), "\n" );
+	return len;
+}
+
+static ssize_t quickusb_hspio_show_pacing_stats ( struct device *dev,
+					struct device_attribute *attr,
+					char *buf ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+	struct quickusb_pacing_stats_ioctl_data stats;
+
+	quickusb_pacer_stats ( &hspio->pacer, &stats );
+	return sprintf ( buf, "%llu %llu %llu %llu %llu %llu %llu %llu\n",
+			 stats.rate, stats.achieved_rate, stats.bytes,
+			 stats.chunks, stats.late, stats.underruns,
+			 stats.lateness_max_ns, stats.lateness_mean_ns );
+}
+
+static ssize_t quickusb_hspio_show_tap ( struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+	struct quickusb_tap_ioctl_data config;
+
+	spin_lock ( &hspio->tap.lock );
+	config = hspio->tap.config;
+	spin_unlock ( &hspio->tap.lock );
+	return sprintf ( buf, "%u %llu\n", config.every, config.interval_ns );
+}
+
+static ssize_t quickusb_hspio_store_tap ( struct device *dev,
+					  struct device_attribute *attr,
+					  const char *buf, size_t count ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+	struct quickusb_tap_ioctl_data config;
+
+	memset ( &config, 0, sizeof ( config ) );
+	if ( ( sscanf ( buf, "%u %llu", &config.every,
+			&config.interval_ns ) < 1 ) || ( config.every < 1 ) )
+		return -EINVAL;
+	spin_lock ( &hspio->tap.lock );
+	hspio->tap.config = config;
+	spin_unlock ( &hspio->tap.lock );
+
+	return count;
+}
+
+static ssize_t quickusb_hspio_show_tap_stats ( struct device *dev,
+					       struct device_attribute *attr,
+					       char *buf ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+	struct quickusb_tap_stats_ioctl_data stats;
+
+	spin_lock ( &hspio->tap.lock );
+	stats = hspio->tap.stats;
+	spin_unlock ( &hspio->tap.lock );
+	return sprintf ( buf, "%llu %llu %llu\n", stats.blocks, stats.tapped,
+			 stats.dropped );
+}
+
+static ssize_t quickusb_hspio_show_numa_node ( struct device *dev,
+					       struct device_attribute *attr,
+					       char *buf ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+
+	return sprintf ( buf, "%d\n", READ_ONCE ( hspio->numa_node ) );
+}
+
+static ssize_t quickusb_hspio_store_numa_node ( struct device *dev,
+						struct device_attribute *attr,
+						const char *buf,
+						size_t count ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+	int value;
+	int rc;
+
+	if ( ( rc = kstrtoint ( buf, 0, &value ) ) != 0 )
+		return rc;
+	if ( ( rc = quickusb_hspio_set_node ( hspio, value ) ) != 0 )
+		return rc;
+
+	return count;
+}
+
+static ssize_t quickusb_hspio_show_local_cpus ( struct device *dev,
+						struct device_attribute *attr,
+						char *buf ) {
+	struct quickusb_hspio *hspio = dev_get_drvdata ( dev );
+	int node = READ_ONCE ( hspio->numa_node );
+	const struct cpumask *mask;
+
+	mask = ( ( node == NUMA_NO_NODE ) ?
+		 cpu_online_mask : cpumask_of_node ( node ) );
+	return sprintf ( buf, "%*pbl\n", cpumask_pr_args ( mask ) );
+}
+
+static DEVICE_ATTR ( chunk_size, S_IRUGO | S_IWUSR,
+		     quickusb_hspio_show_chunk_size,
+		     quickusb_hspio_store_chunk_size );
+static DEVICE_ATTR ( urbs, S_IRUGO | S_IWUSR,
+		     quickusb_hspio_show_urbs,
+		     quickusb_hspio_store_urbs );
+static DEVICE_ATTR ( pool_size, S_IRUGO | S_IWUSR,
+		     quickusb_hspio_show_pool_size,
+		     quickusb_hspio_store_pool_size );
+static DEVICE_ATTR ( autotune, S_IRUGO | S_IWUSR,
+		     quickusb_hspio_show_autotune,
+		     quickusb_hspio_store_autotune );
+static DEVICE_ATTR ( numa_node, S_IRUGO | S_IWUSR,
+		     quickusb_hspio_show_numa_node,
+		     quickusb_hspio_store_numa_node );
+static DEVICE_ATTR ( local_cpus, S_IRUGO,
+		     quickusb_hspio_show_local_cpus, NULL );
+
+static DEVICE_ATTR ( recoveries, S_IRUGO,
+		     quickusb_hspio_show_recoveries, NULL );
+static DEVICE_ATTR ( recovery_histogram, S_IRUGO,
+		     quickusb_hspio_show_recovery_histogram, NULL );
+static DEVICE_ATTR ( pacing_stats, S_IRUGO,
+		     quickusb_hspio_show_pacing_stats, NULL );
+static DEVICE_ATTR ( tap, S_IRUGO | S_IWUSR,
+		     quickusb_hspio_show_tap,
+		     quickusb_hspio_store_tap );
+static DEVICE_ATTR ( tap_stats, S_IRUGO,
+		     quickusb_hspio_show_tap_stats, NULL );
+
+static struct attribute *quickusb_hspio_attrs[] = {
+	&dev_attr_chunk_size.attr,
+	&dev_attr_urbs.attr,
+	&dev_attr_pool_size.attr,
+	&dev_attr_autotune.attr,
+	&dev_attr_numa_node.attr,
+	&dev_attr_local_cpus.attr,
+	&dev_attr_recoveries.attr,
+	&dev_attr_recovery_histogram.attr,
+	&dev_attr_pacing_stats.attr,
+	&dev_attr_tap.attr,
+	&dev_attr_tap_stats.attr,
+	NULL,
+};
+
+static struct attribute_group quickusb_hspio_attr_group = {
+	.attrs = quickusb_hspio_attrs,
+};
+
+static const struct attribute_group *quickusb_hspio_attr_groups[] = {
+	&quickusb_hspio_attr_group,
+	NULL,
+};
+
+/****************************************************************************
+ *
+ * HSPIO ttyUSB device operations (slave mode)
+ *
+ */
+
+static int quickusb_ttyusb_open ( struct tty_struct *tty,
+                                  struct usb_serial_port *port ) {
+	struct quickusb_device *quickusb
+		= usb_get_intfdata ( port->serial->interface );
+	int rc;
+
+	if ( ( rc = quickusb_set_hsppmode ( quickusb,
+					    QUICKUSB_HSPPMODE_SLAVE ) ) != 0 )
+		return rc;
+
+	if ( ( rc = usb_serial_generic_open ( tty, port ) ) != 0 )
+		return rc;
+
+	return 0;
+}
+
+/****************************************************************************
+ *
+ * Char device (subdev) operations
+ *
+ */
+
+static int quickusb_open ( struct inode *inode, struct file *file ) {
+	unsigned int board = QUICKUSB_MINOR_BOARD ( iminor ( inode ) );
+	unsigned int subdev = QUICKUSB_MINOR_SUBDEV ( iminor ( inode ) );
+	struct quickusb_device *quickusb;
+	int found = 0;
+	int rc = 0;
+
+	/* Locate board and increase refcount */
+	down ( &quickusb_lock );
+	list_for_each_entry ( quickusb, &quickusb_list, list ) {
+		if ( quickusb->board == board ) {
+			kref_get ( &quickusb->kref );
+			found = 1;
+			break;
+		}
+	}
+	up ( &quickusb_lock );
+	if ( ! found ) {
+		quickusb = NULL;
+		rc = -ENODEV;
+		goto out;
+	}
+
+	/* Set up per-subdevice file operations and private data */
+	file->f_op = quickusb->subdev[subdev].f_op;
+	file->private_data = quickusb->subdev[subdev].private_data;
+	if ( ! file->f_op ) {
+		rc = -ENODEV;
+		goto out;
+	}
+	
+	/* Perform any subdev-specific open operation */
+	if ( file->f_op->open )
+		rc = file->f_op->open ( inode, file );
+
+ out:
+	if ( ( rc != 0 ) && quickusb )
+		kref_put ( &quickusb->kref, quickusb_delete );
+	return rc;
+}
+
+static struct file_operations quickusb_fops = {
+	.owner		= THIS_MODULE,
+	.open		= quickusb_open,
+};
+
+/****************************************************************************
+ *
+ * Char device (subdev) registration/deregistration
+ *
+ */
+
+static int quickusb_register_subdev ( struct quickusb_device *quickusb,
+				      unsigned int subdev_idx,
+				      struct file_operations *f_op,
+				      void *private_data,
+				      const struct attribute_group **groups,
+				      const char *subdev_fmt, ... ) {
+	struct quickusb_subdev *subdev = &quickusb->subdev[subdev_idx];
+	unsigned int dev_minor;
+	va_list ap;
+	int rc;
+
+	/* Construct device number */
+	dev_minor = QUICKUSB_MINOR ( quickusb->board, subdev_idx );
+	subdev->dev = MKDEV ( dev_major, dev_minor );
+
+	/* Fill subdev structure */
+	subdev->f_op = f_op;
+	subdev->private_data = private_data;
+
+	/* Construct device name */
+	va_start ( ap, subdev_fmt );
+	vsnprintf ( subdev->name, sizeof ( subdev->name ), subdev_fmt, ap );
+	va_end ( ap );
+
+        /* Create a device, with its attributes in place before the
+         * uevent announces it */
+        subdev->devp = device_create_with_groups( quickusb_class, NULL,
+                                                  subdev->dev, private_data,
+                                                  groups, "%s",
+                                                  subdev->name );
+        if ( IS_ERR ( subdev->devp ) ) {
+                rc = PTR_ERR ( subdev->devp );
+                goto err_class;
+        }
+
+	return 0;
+
+ err_class:
+	memset ( subdev, 0, sizeof ( *subdev ) );
+	return rc;
+}
+				      
+static void quickusb_deregister_subdev ( struct quickusb_device *quickusb,
+					 unsigned int subdev_idx ) {
+	struct quickusb_subdev *subdev = &quickusb->subdev[subdev_idx];
+
+	if ( ! subdev->f_op )
+		return;
+
+	/* Remove device */
+        device_destroy ( quickusb_class, subdev->dev );
+
+	/* Clear subdev structure */
+	memset ( subdev, 0, sizeof ( *subdev ) );
+}
+
+/****************************************************************************
+ *
+ * Device creation / destruction
+ *
+ */
+
+static int quickusb_register_devices ( struct quickusb_device *quickusb ) {
+	unsigned int subdev_idx = 0;
+	struct quickusb_gppio *gppio;
+	unsigned char gppio_char;
+	int i;
+	int rc;
+
+	/* Register GPPIO ports as subdevs */
+	for ( i = 0 ; i < QUICKUSB_MAX_GPPIO ; i++ ) {
+		gppio = &quickusb->gppio[i];
+		gppio_char = ( 'a' + gppio->port );
+		if ( ( rc = quickusb_register_subdev ( quickusb, subdev_idx++,
+						       &quickusb_gppio_fops,
+						       gppio, NULL,
+						       "qu%dg%c",
+						       quickusb->board,
+						       gppio_char ) ) != 0 )
+			return rc;
+	}
+
+	/* Register HSPIO port in all its variants */
+	if ( ( rc = quickusb_register_subdev ( quickusb, subdev_idx++,
+					       &quickusb_hspio_command_fops,
+					       &quickusb->hspio, NULL,
+					       "qu%dhc",
+					       quickusb->board ) ) != 0 )
+		return rc;
+	if ( ( rc = quickusb_register_subdev ( quickusb, subdev_idx++,
+					       &quickusb_hspio_data_fops,
+					       &quickusb->hspio,
+					       quickusb_hspio_attr_groups,
+					       "qu%dhd",
+					       quickusb->board ) ) != 0 )
+		return rc;
+	if ( ( rc = quickusb_register_subdev ( quickusb, subdev_idx++,
+					       &quickusb_tap_fops,
+					       &quickusb->hspio, NULL,
+					       "qu%dhm",
+					       quickusb->board ) ) != 0 )
+		return rc;
+
+	return 0;
+}
+
+static void quickusb_deregister_devices ( struct quickusb_device *quickusb ) {
+	int i;
+
+	/* Deregister all subdevs */
+	for ( i = 0 ; i < QUICKUSB_MAX_SUBDEVS ; i++ ) {
+		quickusb_deregister_subdev ( quickusb, i );
+	}
+}
+
+/****************************************************************************
+ *
+ * USB hotplug add/remove
+ *
+ */
+
+static int quickusb_probe ( struct usb_serial *serial,
+			    const struct usb_device_id *id ) {
+	struct usb_interface *interface = serial->interface;
+	struct quickusb_device *quickusb = NULL;
+	struct quickusb_device *pre_existing_quickusb;
+	unsigned int board = 0;
+	int i;
+	int rc = 0;
+
+	down ( &quickusb_lock );
+
+	/* Create new quickusb device structure */
+	quickusb = kmalloc ( sizeof ( *quickusb ), GFP_KERNEL );
+	if ( ! quickusb ) {
+		rc = -ENOMEM;
+		goto err;
+	}
+	memset ( quickusb, 0, sizeof ( *quickusb ) );
+	kref_init ( &quickusb->kref );
+	INIT_LIST_HEAD ( &quickusb_list );
+	quickusb->usb = usb_get_dev ( interface_to_usbdev ( interface ) );
+	quickusb->interface = interface;
+	for ( i = 0 ; i < QUICKUSB_MAX_GPPIO ; i++ ) {
+		quickusb->gppio[i].quickusb = quickusb;
+		quickusb->gppio[i].port = i;
+	}
+	quickusb->hspio.quickusb = quickusb;
+	quickusb->hspio.numa_node =
+		quickusb_hspio_controller_node ( &quickusb->hspio );
+	mutex_init ( &quickusb->hspio.lock );
+	init_waitqueue_head ( &quickusb->hspio.wait );
+	quickusb_pacer_init ( &quickusb->hspio.pacer, &quickusb->hspio );
+	quickusb_tap_init ( &quickusb->hspio.tap );
+	quickusb_shadow_init ( &quickusb->hspio.shadow, &quickusb->hspio );
+	if ( quickusb_hspio_set_tuning ( &quickusb->hspio, chunk_size, urbs,
+					 pool_size ) != 0 ) {
+		printk ( KERN_WARNING "quickusb invalid chunk_size/urbs/"
+			 "pool_size, using defaults\n" );
+		quickusb_hspio_set_tuning ( &quickusb->hspio,
+					    QUICKUSB_DEFAULT_CHUNK_SIZE,
+					    QUICKUSB_DEFAULT_URBS,
+					    QUICKUSB_DEFAULT_POOL_SIZE );
+	}
+
+	/* Obtain a free board board and link into list */
+	list_for_each_entry ( pre_existing_quickusb, &quickusb_list, list ) {
+		if ( pre_existing_quickusb->board != board )
+			break;
+		board++;
+	}
+	quickusb->board = board;
+	list_add_tail ( &quickusb->list, &pre_existing_quickusb->list );
+
+	/* Record driver private data */
+	usb_set_serial_data ( serial, quickusb );
+
+	/* Register devices */
+	if ( ( rc = quickusb_register_devices ( quickusb ) ) != 0 ) {
+		printk ( KERN_ERR "quickusb unable to register devices\n" );
+		goto err;
+	}
+
+	printk ( KERN_INFO "quickusb%d connected\n", quickusb->board ); 
+	goto out;
+
+ err:
+	usb_set_serial_data ( serial, NULL );
+	if ( quickusb ) {
+		quickusb_deregister_devices ( quickusb );
+		list_del ( &quickusb->list );
+		kref_put ( &quickusb->kref, quickusb_delete );
+	}
+ out:
+	up ( &quickusb_lock );
+	return rc;
+}
+
+static void quickusb_disconnect ( struct usb_serial *serial ) {
+	struct quickusb_device *quickusb = usb_get_serial_data ( serial );
+
+	printk ( KERN_INFO "quickusb%d disconnected\n", quickusb->board );
+
+	down ( &quickusb_lock );
+	usb_set_serial_data ( serial, NULL );
+	quickusb_deregister_devices ( quickusb );
+	list_del ( &quickusb->list );
+	up ( &quickusb_lock );
+	quickusb_tap_disconnect ( &quickusb->hspio.tap );
+
+	kref_put ( &quickusb->kref, quickusb_delete );
+}
+
+static struct usb_device_id quickusb_ids[] = {
+	{ USB_DEVICE ( QUICKUSB_VENDOR_ID, QUICKUSB_DEVICE_ID ) },
+	{ },
+};
+
+static struct usb_serial_driver quickusb_serial = {
+	.driver = {
+		.owner	= THIS_MODULE,
+		.name	= "quickusb",
+	},
+	.probe		= quickusb_probe,
+	.disconnect	= quickusb_disconnect,
+	.open		= quickusb_ttyusb_open,
+	.id_table	= quickusb_ids,
+	.num_ports	= 1,
+};
+
+static struct usb_serial_driver * const quickusb_serial_drivers[] = {
+	&quickusb_serial, NULL
+};
+
+/****************************************************************************
+ *
+ * Kernel module interface
+ *
+ */
+
+static int quickusb_init ( void ) {
+	int rc;
+
+	/* Set up transaction tracing */
+	if ( ( rc = quickusb_trace_init() ) != 0 )
+		goto err_trace;
+
+	/* Register major char device */
+	if ( ( rc = register_chrdev ( dev_major, "quickusb",
+				      &quickusb_fops ) ) < 0 ) {
+		printk ( KERN_ERR "quickusb could not register char device: "
+			 "error %d\n", rc );
+		goto err_chrdev;
+	}
+	if ( ! dev_major ) {
+		dev_major = rc;
+		printk ( KERN_INFO "quickusb using major device %d\n",
+			 dev_major );
+	}
+
+	/* Create device class */
+	quickusb_class = class_create ( THIS_MODULE, "quickusb" );
+	if ( IS_ERR ( quickusb_class ) ) {
+		rc = PTR_ERR ( quickusb_class );
+		printk ( KERN_ERR "quickusb could not create device class: "
+			 "error %d\n", rc );
+		goto err_class;
+	}
+
+	/* Register driver */
+	if ( ( rc = usb_serial_register_drivers ( quickusb_serial_drivers,
+						  "quickusb",
+						  quickusb_ids ) ) != 0 )
+		goto err_usbserial;
+
+	return 0;
+
+	usb_serial_deregister_drivers ( quickusb_serial_drivers );
+ err_usbserial:
+	class_destroy ( quickusb_class );
+ err_class:
+	unregister_chrdev ( dev_major, "quickusb" );
+ err_chrdev:
+	quickusb_trace_exit();
+ err_trace:
+	return rc;
+}
+
+static void quickusb_exit ( void ) {
+	usb_serial_deregister_drivers ( quickusb_serial_drivers );
+	class_destroy ( quickusb_class );
+	unregister_chrdev ( dev_major, "quickusb" );
+	quickusb_trace_exit();
+}
+
+module_init ( quickusb_init );
+module_exit ( quickusb_exit );
+
+MODULE_AUTHOR ( "Michael Brown <mbrown@fensystems.co.uk>" );
+MODULE_DESCRIPTION ( "QuickUSB serial driver" );
+MODULE_LICENSE ( "GPL" );
+MODULE_DEVICE_TABLE ( usb, quickusb_ids );
+
+module_param ( debug, bool, S_IRUGO | S_IWUSR );
+MODULE_PARM_DESC ( debug, "Enable debugging" );
+
+module_param ( dev_major, uint, S_IRUGO | S_IWUSR );
+MODULE_PARM_DESC ( dev_major, "Major device number" );
+
+module_param ( chunk_size, uint, S_IRUGO | S_IWUSR );
+MODULE_PARM_DESC ( chunk_size, "Default HSPIO bulk chunk (URB) size" );
+
+module_param ( urbs, uint, S_IRUGO | S_IWUSR );
+MODULE_PARM_DESC ( urbs, "Default number of HSPIO URBs in flight" );
+
+module_param ( pool_size, uint, S_IRUGO | S_IWUSR );
+MODULE_PARM_DESC ( pool_size, "Default HSPIO buffer pool size" );
+
+module_param ( trace_size, uint, S_IRUGO );
+MODULE_PARM_DESC ( trace_size, "Transaction trace records (0 to disable)" );
@@ -0,0 +1,309 @@
+/*
+ * QuickUSB driver - scatter-gather buffer lists
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/numa.h>
+#include <linux/scatterlist.h>
+#include <asm/uaccess.h>
+#if IS_ENABLED(CONFIG_KUNIT)
+#include <kunit/static_stub.h>
+#endif
+
+#include "quickusb_sg.h"
+
+/****************************************************************************
+ *
+ * Auxiliary scatter-gather functions
+ *
+ * A list of @bytes is built from buffers of @chunk_size, as contiguous
+ * memory allows: when an allocation fails, it is retried at half the
+ * size (but never less than a page), and later buffers stay at the
+ * smaller size.  Every buffer but the last is therefore at least a
+ * page, so the list has at most DIV_ROUND_UP ( bytes, PAGE_SIZE )
+ * entries; the last holds whatever remains, which may be any length.
+ *
+ ****************************************************************************/
+
+struct buffer_size_pair {
+	char *buffer;
+	size_t size;
+};
+
+/* Every buffer comes from, and goes back to, these two, which the KUnit
+ * tests replace to inject failures and count what is left allocated */
+void * quickusb_sg_alloc_chunk ( size_t size, gfp_t gfp, int node ) {
+#if IS_ENABLED(CONFIG_KUNIT)
+	KUNIT_STATIC_STUB_REDIRECT ( quickusb_sg_alloc_chunk, size, gfp, node );
+#endif
+	return kzalloc_node ( size, gfp, node );
+}
+
+void quickusb_sg_free_chunk ( void *buffer ) {
+#if IS_ENABLED(CONFIG_KUNIT)
+	KUNIT_STATIC_STUB_REDIRECT ( quickusb_sg_free_chunk, buffer );
+#endif
+	kfree ( buffer );
+}
+
+static void free_ba ( struct buffer_size_pair *ba, unsigned int n ) {
+	unsigned int i;
+
+	if ( ! ba )
+		return;
+	for ( i = 0 ; i < n ; i++ )
+		quickusb_sg_free_chunk ( ba[i].buffer );
+	kfree ( ba );
+}
+
+void free_sglist ( struct scatterlist *sg, unsigned int nents ) {
+	unsigned int i;
+
+	if ( ! sg )
+		return;
+	for ( i = 0 ; i < nents ; i++ ) {
+		if ( ! sg_page ( &sg[i] ) )
+			continue;
+		quickusb_sg_free_chunk ( sg_virt ( &sg[i] ) );
+	}
+	kfree ( sg );
+}
+
+/**
+ * alloc_sglist - allocate a list of zeroed buffers
+ *
+ * @bytes: Total size
+ * @chunk_size: Size of each buffer (the last may be shorter)
+ * @nents: Number of entries, filled in
+ * @node: NUMA node to allocate on, or NUMA_NO_NODE
+ * @stats: What it cost, added to, or NULL
+ *
+ * Returns the list, or NULL if out of memory (or @bytes is 0).  Large
+ * buffers are asked for without retrying or warning: a smaller one
+ * will do, and is cheaper than compacting memory for the large one.
+ */
+struct scatterlist * alloc_sglist ( size_t bytes, unsigned int chunk_size,
+				    unsigned int *nents, int node,
+				    struct quickusb_sg_stats *stats ) {
+	struct scatterlist *sg;
+	struct buffer_size_pair *ba;
+	unsigned int ba_size = DIV_ROUND_UP ( bytes, PAGE_SIZE );
+	unsigned int entries = 0;
+	unsigned int i;
+	size_t size = max_t ( size_t, chunk_size, PAGE_SIZE );
+	char *buffer;
+	gfp_t gfp;
+	ktime_t start;
+
+	*nents = 0;
+	if ( ! bytes )
+		return NULL;
+	ba = kcalloc_node ( ba_size, sizeof ( *ba ), GFP_KERNEL, node );
+	if ( ! ba )
+		return NULL;
+
+	start = ktime_get();
+	while ( bytes ) {
+		if ( WARN_ON ( entries == ba_size ) )
+			goto err;
+		size = min ( size, bytes );
+		gfp = GFP_KERNEL;
+		if ( size > PAGE_SIZE )
+			gfp |= ( __GFP_NORETRY | __GFP_NOWARN );
+		buffer = quickusb_sg_alloc_chunk ( size, gfp, node );
+		if ( ! buffer ) {
+			if ( size <= PAGE_SIZE )
+				goto err;
+			size = max_t ( size_t, ( ( size / 2 ) & PAGE_MASK ),
+				       PAGE_SIZE );
+			if ( stats )
+				stats->fallbacks++;
+			continue;
+		}
+		ba[entries].buffer = buffer;
+		ba[entries].size = size;
+		entries++;
+		bytes -= size;
+	}
+	if ( stats ) {
+		stats->chunks += entries;
+		stats->alloc_ns += ktime_to_ns ( ktime_sub ( ktime_get(),
+							     start ) );
+	}
+
+	/* Now we know the number of entries */
+	start = ktime_get();
+	sg = kmalloc_array_node ( entries, sizeof ( *sg ), GFP_KERNEL, node );
+	if ( ! sg )
+		goto err;
+	sg_init_table ( sg, entries );
+	for ( i = 0 ; i < entries ; i++ )
+		sg_set_buf ( &sg[i], ba[i].buffer, ba[i].size );
+	if ( stats ) {
+		stats->setup_ns += ktime_to_ns ( ktime_sub ( ktime_get(),
+							     start ) );
+	}
+
+	/* Remove the temporary array */
+	kfree ( ba );
+	*nents = entries;
+	return sg;
+
+ err:
+	free_ba ( ba, entries );
+	return NULL;
+}
+
+/****************************************************************************
+ *
+ * Benchmark
+ *
+ * Writing "BYTES [CHUNK_SIZE [ITERATIONS]]" to debugfs quickusb/sg_bench
+ * allocates and frees that list ITERATIONS times (default 2 MiB, 128
+ * KiB, 100), checking the shape of each; reading it gives the results
+ * of the last run, with the time taken per MB, so that a change to the
+ * allocator can be judged by numbers.  Fragmentation shows up as
+ * fallbacks, and as more chunks than BYTES / CHUNK_SIZE.  (The fallback
+ * and failure paths themselves are covered by quickusb_sg_test.c.)
+ *
+ ****************************************************************************/
+
+#define QUICKUSB_SG_BENCH_MAX_BYTES ( 256 * 1024 * 1024 )
+#define QUICKUSB_SG_BENCH_MAX_ITERATIONS 100000
+
+static DEFINE_MUTEX ( quickusb_sg_bench_lock );
+static char quickusb_sg_bench_result[512];
+
+/* Count what is wrong with a list: 0 if every byte is there once, in
+ * buffers no larger than @chunk_size, and all but the last a page or
+ * more */
+static unsigned int quickusb_sg_check ( struct scatterlist *sg,
+					unsigned int nents, size_t bytes,
+					unsigned int chunk_size ) {
+	unsigned int errors = 0;
+	size_t total = 0;
+	unsigned int i;
+
+	for ( i = 0 ; i < nents ; i++ ) {
+		if ( ( sg[i].length > max_t ( size_t, chunk_size, PAGE_SIZE ) ) ||
+		     ( ( sg[i].length < PAGE_SIZE ) && ( i != ( nents - 1 ) ) ) ||
+		     ( ! sg[i].length ) )
+			errors++;
+		total += sg[i].length;
+	}
+	if ( ( total != bytes ) || ( ! sg_is_last ( &sg[nents - 1] ) ) )
+		errors++;
+	return errors;
+}
+
+static int quickusb_sg_bench ( size_t bytes, unsigned int chunk_size,
+			       unsigned int iterations ) {
+	struct quickusb_sg_stats stats;
+	struct scatterlist *sg;
+	unsigned int nents = 0;
+	unsigned int errors = 0;
+	unsigned int i;
+	u64 free_ns = 0;
+	u64 mb;
+	ktime_t start;
+
+	memset ( &stats, 0, sizeof ( stats ) );
+	for ( i = 0 ; i < iterations ; i++ ) {
+		sg = alloc_sglist ( bytes, chunk_size, &nents, NUMA_NO_NODE,
+				    &stats );
+		if ( ! sg )
+			return -ENOMEM;
+		errors += quickusb_sg_check ( sg, nents, bytes, chunk_size );
+		start = ktime_get();
+		free_sglist ( sg, nents );
+		free_ns += ktime_to_ns ( ktime_sub ( ktime_get(), start ) );
+		cond_resched();
+	}
+
+	/* In MB of 10^6 bytes, rounded up */
+	mb = DIV_ROUND_UP_ULL ( ( ( u64 ) bytes * iterations ), 1000000 );
+	snprintf ( quickusb_sg_bench_result,
+		   sizeof ( quickusb_sg_bench_result ),
+		   "bytes %zu\nchunk_size %u\niterations %u\n"
+		   "chunks %u\nfallbacks %u\nerrors %u\n"
+		   "alloc_ns_per_mb %llu\nsetup_ns_per_mb %llu\n"
+		   "free_ns_per_mb %llu\n",
+		   bytes, chunk_size, iterations,
+		   ( stats.chunks / iterations ), stats.fallbacks, errors,
+		   div64_u64 ( stats.alloc_ns, mb ),
+		   div64_u64 ( stats.setup_ns, mb ),
+		   div64_u64 ( free_ns, mb ) );
+	return 0;
+}
+
+static ssize_t quickusb_sg_bench_write ( struct file *file,
+					 const char __user *user_data,
+					 size_t len, loff_t *ppos ) {
+	char buf[64];
+	unsigned long long bytes = ( 2 * 1024 * 1024 );
+	unsigned int chunk_size = ( 128 * 1024 );
+	unsigned int iterations = 100;
+	int rc;
+
+	if ( len >= sizeof ( buf ) )
+		return -EINVAL;
+	if ( copy_from_user ( buf, user_data, len ) )
+		return -EFAULT;
+	buf[len] = '\0';
+	if ( sscanf ( buf, "%llu %u %u", &bytes, &chunk_size,
+		      &iterations ) < 1 )
+		return -EINVAL;
+	if ( ( bytes < 1 ) || ( bytes > QUICKUSB_SG_BENCH_MAX_BYTES ) ||
+	     ( chunk_size < PAGE_SIZE ) ||
+	     ( iterations < 1 ) ||
+	     ( iterations > QUICKUSB_SG_BENCH_MAX_ITERATIONS ) )
+		return -EINVAL;
+
+	if ( ( rc = mutex_lock_interruptible ( &quickusb_sg_bench_lock ) ) != 0 )
+		return rc;
+	rc = quickusb_sg_bench ( bytes, chunk_size, iterations );
+	mutex_unlock ( &quickusb_sg_bench_lock );
+	if ( rc != 0 )
+		return rc;
+
+	*ppos += len;
+	return len;
+}
+
+static ssize_t quickusb_sg_bench_read ( struct file *file,
+					char __user *user_data,
+					size_t len, loff_t *ppos ) {
+	ssize_t rc;
+
+	mutex_lock ( &quickusb_sg_bench_lock );
+	rc = simple_read_from_buffer ( user_data, len, ppos,
+				       quickusb_sg_bench_result,
+				       strlen ( quickusb_sg_bench_result ) );
+	mutex_unlock ( &quickusb_sg_bench_lock );
+	return rc;
+}
+
+static struct file_operations quickusb_sg_bench_fops = {
+	.owner		= THIS_MODULE,
+	.read		= quickusb_sg_bench_read,
+	.write		= quickusb_sg_bench_write,
+};
+
+/* Removed with @dir */
+void quickusb_sg_debugfs_init ( struct dentry *dir ) {
+	debugfs_create_file ( "sg_bench", ( S_IRUSR | S_IWUSR ), dir, NULL,
+			      &quickusb_sg_bench_fops );
+}
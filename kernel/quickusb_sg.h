@@ -0,0 +1,42 @@
+#ifndef QUICKUSB_SG_H
+#define QUICKUSB_SG_H
+
+/*
+ * QuickUSB driver - scatter-gather buffer lists
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+#include <linux/types.h>
+#include <linux/scatterlist.h>
+
+struct dentry;
+
+/* What building a list cost, for the benchmark */
+struct quickusb_sg_stats {
+	/* Buffers allocated */
+	unsigned int chunks;
+	/* Allocations that failed, and were retried at half the size */
+	unsigned int fallbacks;
+	/* Time allocating the buffers, and building the scatterlist */
+	u64 alloc_ns;
+	u64 setup_ns;
+};
+
+extern struct scatterlist * alloc_sglist ( size_t bytes,
+					   unsigned int chunk_size,
+					   unsigned int *nents, int node,
+					   struct quickusb_sg_stats *stats );
+extern void free_sglist ( struct scatterlist *sg, unsigned int nents );
+
+/* Buffer allocator, replaced by the KUnit tests */
+extern void * quickusb_sg_alloc_chunk ( size_t size, gfp_t gfp, int node );
+extern void quickusb_sg_free_chunk ( void *buffer );
+
+extern void quickusb_sg_debugfs_init ( struct dentry *dir );
+
+#endif /* QUICKUSB_SG_H */
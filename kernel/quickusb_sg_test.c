@@ -0,0 +1,217 @@
+/*
+ * QuickUSB driver - KUnit tests of the scatter-gather buffer lists
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+#include <kunit/test.h>
+#include <kunit/static_stub.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/numa.h>
+#include <linux/scatterlist.h>
+
+#include "quickusb_sg.h"
+
+/****************************************************************************
+ *
+ * Fault injection
+ *
+ * The buffer allocator is replaced for each test: it can refuse every
+ * buffer larger than max_size (as fragmented memory would), or just
+ * the fail_at'th request, and it counts the buffers still live so
+ * that a test can see the failure path give them all back.
+ *
+ */
+
+struct quickusb_sg_test_ctx {
+	unsigned int allocs;
+	unsigned int fail_at;
+	size_t max_size;
+	int live;
+};
+
+static void * quickusb_sg_test_alloc ( size_t size, gfp_t gfp, int node ) {
+	struct kunit *test = kunit_get_current_test();
+	struct quickusb_sg_test_ctx *ctx = test->priv;
+
+	ctx->allocs++;
+	if ( ( ctx->fail_at && ( ctx->allocs == ctx->fail_at ) ) ||
+	     ( ctx->max_size && ( size > ctx->max_size ) ) )
+		return NULL;
+	ctx->live++;
+	return kzalloc_node ( size, gfp, node );
+}
+
+static void quickusb_sg_test_free ( void *buffer ) {
+	struct kunit *test = kunit_get_current_test();
+	struct quickusb_sg_test_ctx *ctx = test->priv;
+
+	if ( buffer )
+		ctx->live--;
+	kfree ( buffer );
+}
+
+static int quickusb_sg_test_init ( struct kunit *test ) {
+	struct quickusb_sg_test_ctx *ctx;
+
+	ctx = kunit_kzalloc ( test, sizeof ( *ctx ), GFP_KERNEL );
+	if ( ! ctx )
+		return -ENOMEM;
+	test->priv = ctx;
+	kunit_activate_static_stub ( test, quickusb_sg_alloc_chunk,
+				     quickusb_sg_test_alloc );
+	kunit_activate_static_stub ( test, quickusb_sg_free_chunk,
+				     quickusb_sg_test_free );
+	return 0;
+}
+
+/* Every byte there once, no buffer over @max, all but the last a page
+ * or more, and the list properly ended */
+static void quickusb_sg_test_shape ( struct kunit *test,
+				     struct scatterlist *sg,
+				     unsigned int nents, size_t bytes,
+				     size_t max ) {
+	size_t total = 0;
+	unsigned int i;
+
+	KUNIT_ASSERT_GT ( test, nents, 0U );
+	for ( i = 0 ; i < nents ; i++ ) {
+		KUNIT_EXPECT_GT ( test, sg[i].length, 0U );
+		KUNIT_EXPECT_LE ( test, ( size_t ) sg[i].length, max );
+		if ( i != ( nents - 1 ) ) {
+			KUNIT_EXPECT_GE ( test, ( size_t ) sg[i].length,
+					  PAGE_SIZE );
+		}
+		total += sg[i].length;
+	}
+	KUNIT_EXPECT_EQ ( test, total, bytes );
+	KUNIT_EXPECT_TRUE ( test, sg_is_last ( &sg[nents - 1] ) );
+}
+
+/****************************************************************************
+ *
+ * Tests
+ *
+ */
+
+static void quickusb_sg_test_empty ( struct kunit *test ) {
+	struct quickusb_sg_test_ctx *ctx = test->priv;
+	unsigned int nents = 1;
+
+	KUNIT_EXPECT_NULL ( test, alloc_sglist ( 0, PAGE_SIZE, &nents,
+						 NUMA_NO_NODE, NULL ) );
+	KUNIT_EXPECT_EQ ( test, nents, 0U );
+	KUNIT_EXPECT_EQ ( test, ctx->allocs, 0U );
+}
+
+/* Lengths that are not a multiple of a page, or of the chunk size */
+static void quickusb_sg_test_odd_lengths ( struct kunit *test ) {
+	struct quickusb_sg_test_ctx *ctx = test->priv;
+	const size_t chunk = ( 4 * PAGE_SIZE );
+	const size_t lengths[] = {
+		1, ( PAGE_SIZE - 1 ), ( PAGE_SIZE + 1 ),
+		( ( 3 * PAGE_SIZE ) + 17 ), ( chunk - 1 ), ( chunk + 1 ),
+		( ( 5 * chunk ) - 3 ),
+	};
+	struct scatterlist *sg;
+	unsigned int nents;
+	unsigned int i;
+
+	for ( i = 0 ; i < ARRAY_SIZE ( lengths ) ; i++ ) {
+		sg = alloc_sglist ( lengths[i], chunk, &nents, NUMA_NO_NODE,
+				    NULL );
+		KUNIT_ASSERT_NOT_NULL ( test, sg );
+		quickusb_sg_test_shape ( test, sg, nents, lengths[i], chunk );
+		KUNIT_EXPECT_EQ ( test, nents,
+				  ( unsigned int ) DIV_ROUND_UP ( lengths[i],
+								  chunk ) );
+		free_sglist ( sg, nents );
+		KUNIT_EXPECT_EQ ( test, ctx->live, 0 );
+	}
+}
+
+/* Large buffers refused: halve, never below a page, and stay smaller */
+static void quickusb_sg_test_fallback ( struct kunit *test ) {
+	struct quickusb_sg_test_ctx *ctx = test->priv;
+	struct quickusb_sg_stats stats = { 0 };
+	struct scatterlist *sg;
+	unsigned int nents;
+	unsigned int i;
+
+	/* 10 pages in chunks of 16: 10 and 5 pages fail, 2 succeed */
+	ctx->max_size = ( 2 * PAGE_SIZE );
+	sg = alloc_sglist ( ( 10 * PAGE_SIZE ), ( 16 * PAGE_SIZE ), &nents,
+			    NUMA_NO_NODE, &stats );
+	KUNIT_ASSERT_NOT_NULL ( test, sg );
+	quickusb_sg_test_shape ( test, sg, nents, ( 10 * PAGE_SIZE ),
+				 ( 2 * PAGE_SIZE ) );
+	KUNIT_EXPECT_EQ ( test, nents, 5U );
+	for ( i = 0 ; i < nents ; i++ ) {
+		KUNIT_EXPECT_EQ ( test, ( size_t ) sg[i].length,
+				  ( 2 * PAGE_SIZE ) );
+	}
+	KUNIT_EXPECT_EQ ( test, stats.fallbacks, 2U );
+	KUNIT_EXPECT_EQ ( test, stats.chunks, 5U );
+	free_sglist ( sg, nents );
+	KUNIT_EXPECT_EQ ( test, ctx->live, 0 );
+
+	/* Nothing larger than a page: an odd tail still fits */
+	ctx->max_size = PAGE_SIZE;
+	sg = alloc_sglist ( ( ( 3 * PAGE_SIZE ) + 5 ), ( 8 * PAGE_SIZE ),
+			    &nents, NUMA_NO_NODE, NULL );
+	KUNIT_ASSERT_NOT_NULL ( test, sg );
+	quickusb_sg_test_shape ( test, sg, nents, ( ( 3 * PAGE_SIZE ) + 5 ),
+				 PAGE_SIZE );
+	KUNIT_EXPECT_EQ ( test, nents, 4U );
+	free_sglist ( sg, nents );
+	KUNIT_EXPECT_EQ ( test, ctx->live, 0 );
+}
+
+/* A page that cannot be had fails the list, and frees what was built */
+static void quickusb_sg_test_failure ( struct kunit *test ) {
+	struct quickusb_sg_test_ctx *ctx = test->priv;
+	unsigned int nents = 1;
+	unsigned int fail_at;
+
+	for ( fail_at = 1 ; fail_at <= 5 ; fail_at++ ) {
+		ctx->allocs = 0;
+		ctx->fail_at = fail_at;
+		KUNIT_EXPECT_NULL ( test, alloc_sglist ( ( 5 * PAGE_SIZE ),
+							 PAGE_SIZE, &nents,
+							 NUMA_NO_NODE,
+							 NULL ) );
+		KUNIT_EXPECT_EQ ( test, nents, 0U );
+		KUNIT_EXPECT_EQ ( test, ctx->allocs, fail_at );
+		KUNIT_EXPECT_EQ ( test, ctx->live, 0 );
+	}
+
+	/* Every size refused, down to a page */
+	ctx->fail_at = 0;
+	ctx->max_size = 1;
+	KUNIT_EXPECT_NULL ( test, alloc_sglist ( ( 4 * PAGE_SIZE ),
+						 ( 4 * PAGE_SIZE ), &nents,
+						 NUMA_NO_NODE, NULL ) );
+	KUNIT_EXPECT_EQ ( test, ctx->live, 0 );
+}
+
+static struct kunit_case quickusb_sg_test_cases[] = {
+	KUNIT_CASE ( quickusb_sg_test_empty ),
+	KUNIT_CASE ( quickusb_sg_test_odd_lengths ),
+	KUNIT_CASE ( quickusb_sg_test_fallback ),
+	KUNIT_CASE ( quickusb_sg_test_failure ),
+	{ }
+};
+
+static struct kunit_suite quickusb_sg_test_suite = {
+	.name		= "quickusb_sg",
+	.init		= quickusb_sg_test_init,
+	.test_cases	= quickusb_sg_test_cases,
+};
+
+kunit_test_suite ( quickusb_sg_test_suite );
@@ -0,0 +1,1594 @@
+/*
+ * libquickusb - user-space access to QuickUSB boards
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+
+#include "libquickusb_internal.h"
+
+#define QUSB_CLASS_DIR		"/sys/class/quickusb"
+
+/****************************************************************************
+ *
+ * Back-end selection
+ *
+ */
+
+static const struct qusb_backend * qusb_backend ( enum qusb_backend_type type ) {
+	const char *env;
+
+	if ( type == QUSB_BACKEND_DEFAULT ) {
+		env = getenv ( "QUSB_BACKEND" );
+		type = ( ( env && ( strcmp ( env, "libusb" ) == 0 ) ) ?
+			 QUSB_BACKEND_LIBUSB : QUSB_BACKEND_KERNEL );
+	}
+
+	switch ( type ) {
+	case QUSB_BACKEND_KERNEL:
+		return &qusb_kernel_backend;
+#ifdef QUSB_LIBUSB
+	case QUSB_BACKEND_LIBUSB:
+		return &qusb_usb_backend;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+/****************************************************************************
+ *
+ * Devices
+ *
+ */
+
+/**
+ * qusb_enumerate_backend - list attached boards
+ *
+ * @type: Back-end
+ * @info: Array to fill, in order of board number
+ * @max: Size of array
+ *
+ * Returns the number of boards found (which may exceed @max)
+ */
+int qusb_enumerate_backend ( enum qusb_backend_type type,
+			     struct qusb_info *info, unsigned int max ) {
+	const struct qusb_backend *backend = qusb_backend ( type );
+
+	if ( ! backend )
+		return -ENOTSUP;
+	return backend->enumerate ( info, max );
+}
+
+int qusb_enumerate ( struct qusb_info *info, unsigned int max ) {
+	return qusb_enumerate_backend ( QUSB_BACKEND_DEFAULT, info, max );
+}
+
+/**
+ * qusb_open_backend - open a board
+ *
+ * @type: Back-end
+ * @board: Board number
+ * @dev: Device handle to fill in
+ *
+ * As for opening the kernel driver's data node, the HSPIO port is
+ * switched to master mode.
+ */
+int qusb_open_backend ( enum qusb_backend_type type, unsigned int board,
+			struct qusb_device **dev ) {
+	const struct qusb_backend *backend = qusb_backend ( type );
+	unsigned int i;
+	int rc;
+
+	if ( ! backend )
+		return -ENOTSUP;
+
+	if ( ! ( *dev = calloc ( 1, sizeof ( **dev ) ) ) )
+		return -ENOMEM;
+
+	( *dev )->backend = backend;
+	( *dev )->board = board;
+	( *dev )->data_fd = -1;
+	( *dev )->command_fd = -1;
+	for ( i = 0 ; i < QUSB_MAX_GPPIO ; i++ )
+		( *dev )->gppio_fd[i] = -1;
+
+	if ( ( rc = backend->open ( *dev ) ) != 0 ) {
+		free ( *dev );
+		*dev = NULL;
+		return rc;
+	}
+
+	return 0;
+}
+
+int qusb_open ( unsigned int board, struct qusb_device **dev ) {
+	return qusb_open_backend ( QUSB_BACKEND_DEFAULT, board, dev );
+}
+
+/**
+ * qusb_close - close a board
+ *
+ * @dev: Device handle
+ *
+ * Any streams on the board must already have been destroyed.
+ */
+void qusb_close ( struct qusb_device *dev ) {
+	if ( ! dev )
+		return;
+
+	dev->backend->close ( dev );
+	free ( dev );
+}
+
+unsigned int qusb_board ( struct qusb_device *dev ) {
+	return dev->board;
+}
+
+const char * qusb_backend_name ( struct qusb_device *dev ) {
+	return dev->backend->name;
+}
+
+/****************************************************************************
+ *
+ * Settings, GPPIO and HSPIO commands
+ *
+ */
+
+int qusb_get_setting ( struct qusb_device *dev, unsigned int address,
+		       uint16_t *value ) {
+	return dev->backend->get_setting ( dev, address, value );
+}
+
+int qusb_set_setting ( struct qusb_device *dev, unsigned int address,
+		       uint16_t value ) {
+	return dev->backend->set_setting ( dev, address, value );
+}
+
+static int qusb_gppio_get ( struct qusb_device *dev, unsigned int port,
+			    unsigned long request, uint8_t *value ) {
+	quickusb_gppio_ioctl_data_t data;
+	int rc;
+
+	if ( port >= QUSB_MAX_GPPIO )
+		return -EINVAL;
+	if ( ( rc = dev->backend->gppio_ioctl ( dev, port, request,
+						&data ) ) != 0 )
+		return rc;
+	*value = data;
+	return 0;
+}
+
+static int qusb_gppio_set ( struct qusb_device *dev, unsigned int port,
+			    unsigned long request, uint8_t value ) {
+	quickusb_gppio_ioctl_data_t data = value;
+
+	if ( port >= QUSB_MAX_GPPIO )
+		return -EINVAL;
+	return dev->backend->gppio_ioctl ( dev, port, request, &data );
+}
+
+int qusb_gppio_get_outputs ( struct qusb_device *dev, unsigned int port,
+			     uint8_t *outputs ) {
+	return qusb_gppio_get ( dev, port, QUICKUSB_IOC_GPPIO_GET_OUTPUTS,
+				outputs );
+}
+
+int qusb_gppio_set_outputs ( struct qusb_device *dev, unsigned int port,
+			     uint8_t outputs ) {
+	return qusb_gppio_set ( dev, port, QUICKUSB_IOC_GPPIO_SET_OUTPUTS,
+				outputs );
+}
+
+int qusb_gppio_get_default_outputs ( struct qusb_device *dev,
+				     unsigned int port, uint8_t *outputs ) {
+	return qusb_gppio_get ( dev, port,
+				QUICKUSB_IOC_GPPIO_GET_DEFAULT_OUTPUTS,
+				outputs );
+}
+
+int qusb_gppio_set_default_outputs ( struct qusb_device *dev,
+				     unsigned int port, uint8_t outputs ) {
+	return qusb_gppio_set ( dev, port,
+				QUICKUSB_IOC_GPPIO_SET_DEFAULT_OUTPUTS,
+				outputs );
+}
+
+int qusb_gppio_get_default_levels ( struct qusb_device *dev,
+				    unsigned int port, uint8_t *levels ) {
+	return qusb_gppio_get ( dev, port,
+				QUICKUSB_IOC_GPPIO_GET_DEFAULT_LEVELS,
+				levels );
+}
+
+int qusb_gppio_set_default_levels ( struct qusb_device *dev,
+				    unsigned int port, uint8_t levels ) {
+	return qusb_gppio_set ( dev, port,
+				QUICKUSB_IOC_GPPIO_SET_DEFAULT_LEVELS,
+				levels );
+}
+
+int qusb_gppio_read ( struct qusb_device *dev, unsigned int port,
+		      uint8_t *value ) {
+	if ( port >= QUSB_MAX_GPPIO )
+		return -EINVAL;
+	return dev->backend->gppio_read ( dev, port, value );
+}
+
+int qusb_gppio_write ( struct qusb_device *dev, unsigned int port,
+		       uint8_t value ) {
+	if ( port >= QUSB_MAX_GPPIO )
+		return -EINVAL;
+	return dev->backend->gppio_write ( dev, port, value );
+}
+
+/**
+ * qusb_command_read - read from the HSPIO command address space
+ *
+ * @dev: Device handle
+ * @address: Starting address
+ * @data: Buffer
+ * @len: Length (split into QUICKUSB_MAX_DATA_LEN cycles as needed)
+ */
+int qusb_command_read ( struct qusb_device *dev, unsigned int address,
+			void *data, size_t len ) {
+	return dev->backend->command_read ( dev, address, data, len );
+}
+
+int qusb_command_write ( struct qusb_device *dev, unsigned int address,
+			 const void *data, size_t len ) {
+	return dev->backend->command_write ( dev, address, data, len );
+}
+
+/*
+ * Write-combining shadow: writes inside the range are held by the
+ * driver and sent in runs of up to QUICKUSB_MAX_DATA_LEN bytes.
+ * qusb_command_barrier() sends them now, and reports any failure of
+ * an earlier timed flush.
+ */
+static int qusb_command_ioctl ( struct qusb_device *dev,
+				unsigned long request, void *data ) {
+	if ( ! dev->backend->command_ioctl )
+		return -ENOTSUP;
+	return dev->backend->command_ioctl ( dev, request, data );
+}
+
+int qusb_get_shadow ( struct qusb_device *dev,
+		      struct quickusb_shadow_ioctl_data *shadow ) {
+	return qusb_command_ioctl ( dev, QUICKUSB_IOC_HSPIO_GET_SHADOW,
+				    shadow );
+}
+
+int qusb_set_shadow ( struct qusb_device *dev,
+		      const struct quickusb_shadow_ioctl_data *shadow ) {
+	return qusb_command_ioctl ( dev, QUICKUSB_IOC_HSPIO_SET_SHADOW,
+				    ( void * ) shadow );
+}
+
+int qusb_command_barrier ( struct qusb_device *dev ) {
+	return qusb_command_ioctl ( dev, QUICKUSB_IOC_HSPIO_BARRIER, NULL );
+}
+
+int qusb_shadow_stats ( struct qusb_device *dev,
+			struct quickusb_shadow_stats_ioctl_data *stats ) {
+	return qusb_command_ioctl ( dev, QUICKUSB_IOC_HSPIO_GET_SHADOW_STATS,
+				    stats );
+}
+
+/****************************************************************************
+ *
+ * HSPIO data (synchronous)
+ *
+ */
+
+ssize_t qusb_read ( struct qusb_device *dev, void *data, size_t len ) {
+	return dev->backend->read ( dev, data, len );
+}
+
+ssize_t qusb_write ( struct qusb_device *dev, const void *data, size_t len ) {
+	return dev->backend->write ( dev, data, len );
+}
+
+int qusb_get_trigger ( struct qusb_device *dev,
+		       struct quickusb_trigger_ioctl_data *trigger ) {
+	return dev->backend->data_ioctl ( dev, QUICKUSB_IOC_HSPIO_GET_TRIGGER,
+					  trigger );
+}
+
+int qusb_set_trigger ( struct qusb_device *dev,
+		       const struct quickusb_trigger_ioctl_data *trigger ) {
+	return dev->backend->data_ioctl ( dev, QUICKUSB_IOC_HSPIO_SET_TRIGGER,
+					  ( void * ) trigger );
+}
+
+int qusb_wait_trigger ( struct qusb_device *dev,
+			struct quickusb_trigger_event_ioctl_data *event ) {
+	return dev->backend->data_ioctl ( dev, QUICKUSB_IOC_HSPIO_WAIT_TRIGGER,
+					  event );
+}
+
+int qusb_get_framing ( struct qusb_device *dev, uint32_t *block ) {
+	quickusb_framing_ioctl_data_t data;
+	int rc;
+
+	if ( ( rc = dev->backend->data_ioctl ( dev,
+					       QUICKUSB_IOC_HSPIO_GET_FRAMING,
+					       &data ) ) != 0 )
+		return rc;
+	*block = data;
+	return 0;
+}
+
+int qusb_set_framing ( struct qusb_device *dev, uint32_t block ) {
+	quickusb_framing_ioctl_data_t data = block;
+
+	return dev->backend->data_ioctl ( dev, QUICKUSB_IOC_HSPIO_SET_FRAMING,
+					  &data );
+}
+
+int qusb_get_pacing ( struct qusb_device *dev,
+		      struct quickusb_pacing_ioctl_data *pacing ) {
+	return dev->backend->data_ioctl ( dev, QUICKUSB_IOC_HSPIO_GET_PACING,
+					  pacing );
+}
+
+int qusb_set_pacing ( struct qusb_device *dev,
+		      const struct quickusb_pacing_ioctl_data *pacing ) {
+	return dev->backend->data_ioctl ( dev, QUICKUSB_IOC_HSPIO_SET_PACING,
+					  ( void * ) pacing );
+}
+
+int qusb_pacing_stats ( struct qusb_device *dev,
+			struct quickusb_pacing_stats_ioctl_data *stats ) {
+	return dev->backend->data_ioctl ( dev,
+					  QUICKUSB_IOC_HSPIO_GET_PACING_STATS,
+					  stats );
+}
+
+int qusb_get_timeout ( struct qusb_device *dev,
+		       struct quickusb_timeout_ioctl_data *timeout ) {
+	return dev->backend->data_ioctl ( dev, QUICKUSB_IOC_HSPIO_GET_TIMEOUT,
+					  timeout );
+}
+
+int qusb_set_timeout ( struct qusb_device *dev,
+		       const struct quickusb_timeout_ioctl_data *timeout ) {
+	return dev->backend->data_ioctl ( dev, QUICKUSB_IOC_HSPIO_SET_TIMEOUT,
+					  ( void * ) timeout );
+}
+
+int qusb_last_result ( struct qusb_device *dev,
+		       struct quickusb_result_ioctl_data *result ) {
+	return dev->backend->data_ioctl ( dev, QUICKUSB_IOC_HSPIO_GET_RESULT,
+					  result );
+}
+
+/****************************************************************************
+ *
+ * HSPIO monitor tap
+ *
+ * /dev/quNhm is opened on its own, not through a qusb_device: the board
+ * is being read by another process, which the tap must not disturb.
+ *
+ */
+
+/* Open board N's tap: returns a file descriptor, or a negative errno */
+int qusb_tap_open ( unsigned int board ) {
+	char path[32];
+	int fd;
+
+	snprintf ( path, sizeof ( path ), "/dev/qu%uhm", board );
+	if ( ( fd = open ( path, ( O_RDONLY | O_CLOEXEC ) ) ) < 0 )
+		return -errno;
+	return fd;
+}
+
+/**
+ * qusb_tap_read - read the next tapped block
+ *
+ * @fd: Tap, from qusb_tap_open()
+ * @header: Block header to fill in
+ * @data: Buffer for the block's data
+ * @len: Size of buffer (chunk_size, to be sure of whole blocks)
+ *
+ * Waits for a block, unless the tap was made non-blocking.  Returns the
+ * length of the block's data, or a negative errno
+ */
+ssize_t qusb_tap_read ( int fd, struct quickusb_frame_header *header,
+			void *data, size_t len ) {
+	struct iovec iov[2];
+	ssize_t rc;
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof ( *header );
+	iov[1].iov_base = data;
+	iov[1].iov_len = len;
+	if ( ( rc = readv ( fd, iov, 2 ) ) < 0 )
+		return -errno;
+	if ( ( size_t ) rc < sizeof ( *header ) )
+		return -EIO;
+	return header->length;
+}
+
+static int qusb_tap_ioctl ( int fd, unsigned long request, void *data ) {
+	if ( ioctl ( fd, request, data ) < 0 )
+		return -errno;
+	return 0;
+}
+
+int qusb_get_tap ( int fd, struct quickusb_tap_ioctl_data *tap ) {
+	return qusb_tap_ioctl ( fd, QUICKUSB_IOC_TAP_GET, tap );
+}
+
+int qusb_set_tap ( int fd, const struct quickusb_tap_ioctl_data *tap ) {
+	return qusb_tap_ioctl ( fd, QUICKUSB_IOC_TAP_SET, ( void * ) tap );
+}
+
+int qusb_tap_stats ( int fd, struct quickusb_tap_stats_ioctl_data *stats ) {
+	return qusb_tap_ioctl ( fd, QUICKUSB_IOC_TAP_GET_STATS, stats );
+}
+
+/****************************************************************************
+ *
+ * NUMA placement
+ *
+ * On a multi-socket host, a board's data should stay on the node of
+ * its host controller.  The driver places its own buffers there (or
+ * on the node set in its numa_node attribute); here, stream pools
+ * follow, and loops may be bound to the CPUs of that node.
+ *
+ */
+
+/* Read a sysfs attribute, without its trailing newline */
+int qusb_sysfs_read ( const char *path, char *buf, size_t len ) {
+	ssize_t rc;
+	int fd;
+
+	if ( ( fd = open ( path, ( O_RDONLY | O_CLOEXEC ) ) ) < 0 )
+		return -errno;
+	rc = read ( fd, buf, ( len - 1 ) );
+	if ( rc < 0 )
+		rc = -errno;
+	close ( fd );
+	if ( rc < 0 )
+		return rc;
+	while ( rc && ( buf[rc - 1] == '\n' ) )
+		rc--;
+	buf[rc] = '\0';
+	return 0;
+}
+
+/* Board's NUMA node: returns node number, or a negative errno */
+int qusb_numa_node ( struct qusb_device *dev ) {
+	if ( ! dev->backend->numa_node )
+		return -ENOTSUP;
+	return dev->backend->numa_node ( dev );
+}
+
+/* Prefer a node for pages not yet touched; placement is best-effort */
+static void qusb_numa_prefer ( void *addr, size_t len, int node ) {
+	unsigned long mask[16];
+	const unsigned int bits = ( 8 * sizeof ( mask ) );
+
+	if ( ( node < 0 ) || ( ( unsigned int ) node >= bits ) )
+		return;
+	memset ( mask, 0, sizeof ( mask ) );
+	mask[ node / ( 8 * sizeof ( mask[0] ) ) ] |=
+		( 1UL << ( node % ( 8 * sizeof ( mask[0] ) ) ) );
+	syscall ( __NR_mbind, addr, len, MPOL_PREFERRED, mask,
+		  ( bits + 1 ), 0 );
+}
+
+/* Parse a CPU list ("0-3,8"), as found in sysfs */
+static int qusb_parse_cpulist ( const char *list, cpu_set_t *cpus ) {
+	unsigned long first;
+	unsigned long last;
+	char *end;
+
+	CPU_ZERO ( cpus );
+	while ( *list ) {
+		first = last = strtoul ( list, &end, 10 );
+		if ( end == list )
+			return -EINVAL;
+		if ( *end == '-' ) {
+			list = ( end + 1 );
+			last = strtoul ( list, &end, 10 );
+			if ( ( end == list ) || ( last < first ) )
+				return -EINVAL;
+		}
+		if ( last >= CPU_SETSIZE )
+			return -EINVAL;
+		for ( ; first <= last ; first++ )
+			CPU_SET ( first, cpus );
+		if ( *end == ',' )
+			end++;
+		else if ( *end )
+			return -EINVAL;
+		list = end;
+	}
+	return ( CPU_COUNT ( cpus ) ? 0 : -EINVAL );
+}
+
+/**
+ * qusb_loop_bind - bind a loop's completion processing to CPUs
+ *
+ * @loop: Loop
+ * @cpus: CPU list, e.g. "0-3,8"
+ *
+ * Binds the calling thread, which should be the one that runs the loop,
+ * and the loop's io_uring workers, which carry out transfers on the
+ * kernel driver.  Kernels without worker affinity bind the thread only.
+ *
+ * Returns 0, or a negative errno
+ */
+int qusb_loop_bind ( struct qusb_loop *loop, const char *cpus ) {
+	cpu_set_t set;
+	int rc;
+
+	if ( ( rc = qusb_parse_cpulist ( cpus, &set ) ) != 0 )
+		return rc;
+	if ( sched_setaffinity ( 0, sizeof ( set ), &set ) != 0 )
+		return -errno;
+	if ( ( loop->ring.fd >= 0 ) &&
+	     ( syscall ( __NR_io_uring_register, loop->ring.fd,
+			 IORING_REGISTER_IOWQ_AFF, &set,
+			 sizeof ( set ) ) < 0 ) && ( errno != EINVAL ) )
+		return -errno;
+	return 0;
+}
+
+/* Bind a loop's completion processing to the CPUs local to a board */
+int qusb_loop_bind_local ( struct qusb_loop *loop, struct qusb_device *dev ) {
+	char cpus[QUSB_SYSFS_MAX];
+	int rc;
+
+	if ( ! dev->backend->local_cpus )
+		return -ENOTSUP;
+	if ( ( rc = dev->backend->local_cpus ( dev, cpus,
+					       sizeof ( cpus ) ) ) != 0 )
+		return rc;
+	return qusb_loop_bind ( loop, cpus );
+}
+
+/****************************************************************************
+ *
+ * io_uring
+ *
+ * A minimal ring, driven through the raw system calls so that liburing
+ * is not needed.
+ *
+ */
+
+static int qusb_uring_setup ( struct qusb_uring *ring, unsigned int entries ) {
+	struct io_uring_params params;
+	int rc;
+
+	memset ( ring, 0, sizeof ( *ring ) );
+	memset ( &params, 0, sizeof ( params ) );
+	if ( ( ring->fd = syscall ( __NR_io_uring_setup, entries,
+				    &params ) ) < 0 )
+		return -errno;
+	ring->features = params.features;
+
+	ring->sq_ring_size = ( params.sq_off.array +
+			       ( params.sq_entries * sizeof ( unsigned int ) ) );
+	ring->cq_ring_size = ( params.cq_off.cqes +
+			       ( params.cq_entries *
+				 sizeof ( struct io_uring_cqe ) ) );
+	if ( params.features & IORING_FEAT_SINGLE_MMAP ) {
+		if ( ring->cq_ring_size > ring->sq_ring_size )
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sq_ring = mmap ( NULL, ring->sq_ring_size,
+			       ( PROT_READ | PROT_WRITE ),
+			       ( MAP_SHARED | MAP_POPULATE ), ring->fd,
+			       IORING_OFF_SQ_RING );
+	if ( ring->sq_ring == MAP_FAILED ) {
+		rc = -errno;
+		goto err_sq_ring;
+	}
+	if ( params.features & IORING_FEAT_SINGLE_MMAP ) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap ( NULL, ring->cq_ring_size,
+				       ( PROT_READ | PROT_WRITE ),
+				       ( MAP_SHARED | MAP_POPULATE ),
+				       ring->fd, IORING_OFF_CQ_RING );
+		if ( ring->cq_ring == MAP_FAILED ) {
+			rc = -errno;
+			goto err_cq_ring;
+		}
+	}
+	ring->sqes_size = ( params.sq_entries * sizeof ( struct io_uring_sqe ) );
+	ring->sqes = mmap ( NULL, ring->sqes_size, ( PROT_READ | PROT_WRITE ),
+			    ( MAP_SHARED | MAP_POPULATE ), ring->fd,
+			    IORING_OFF_SQES );
+	if ( ring->sqes == MAP_FAILED ) {
+		rc = -errno;
+		goto err_sqes;
+	}
+
+	ring->sq_head = ( ring->sq_ring + params.sq_off.head );
+	ring->sq_tail = ( ring->sq_ring + params.sq_off.tail );
+	ring->sq_mask = *( unsigned int * ) ( ring->sq_ring +
+					      params.sq_off.ring_mask );
+	ring->sq_entries = params.sq_entries;
+	ring->sq_array = ( ring->sq_ring + params.sq_off.array );
+	ring->cq_head = ( ring->cq_ring + params.cq_off.head );
+	ring->cq_tail = ( ring->cq_ring + params.cq_off.tail );
+	ring->cq_mask = *( unsigned int * ) ( ring->cq_ring +
+					      params.cq_off.ring_mask );
+	ring->cqes = ( ring->cq_ring + params.cq_off.cqes );
+
+	return 0;
+
+ err_sqes:
+	if ( ring->cq_ring != ring->sq_ring )
+		munmap ( ring->cq_ring, ring->cq_ring_size );
+ err_cq_ring:
+	munmap ( ring->sq_ring, ring->sq_ring_size );
+ err_sq_ring:
+	close ( ring->fd );
+	ring->fd = -1;
+	return rc;
+}
+
+static void qusb_uring_free ( struct qusb_uring *ring ) {
+	if ( ring->fd < 0 )
+		return;
+
+	munmap ( ring->sqes, ring->sqes_size );
+	if ( ring->cq_ring != ring->sq_ring )
+		munmap ( ring->cq_ring, ring->cq_ring_size );
+	munmap ( ring->sq_ring, ring->sq_ring_size );
+	close ( ring->fd );
+}
+
+/* Number of SQEs that can still be prepared */
+static unsigned int qusb_uring_space ( struct qusb_uring *ring ) {
+	unsigned int head;
+	unsigned int tail;
+
+	if ( ring->fd < 0 )
+		return 0;
+
+	head = __atomic_load_n ( ring->sq_head, __ATOMIC_ACQUIRE );
+	tail = ( *ring->sq_tail + ring->sq_pending );
+	return ( ring->sq_entries - ( tail - head ) );
+}
+
+/* Prepare the next SQE; the caller has checked qusb_uring_space() */
+static struct io_uring_sqe * qusb_uring_sqe ( struct qusb_uring *ring ) {
+	unsigned int index = ( ( *ring->sq_tail + ring->sq_pending++ ) &
+			       ring->sq_mask );
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	ring->sq_array[index] = index;
+	memset ( sqe, 0, sizeof ( *sqe ) );
+	return sqe;
+}
+
+/* Publish prepared SQEs and submit them, optionally waiting for one CQE */
+static int qusb_uring_enter ( struct qusb_uring *ring, int timeout_ms ) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int to_submit = ring->sq_pending;
+	unsigned int flags = 0;
+	unsigned int wait = 0;
+	void *argp = NULL;
+	size_t argsz = 0;
+	int rc;
+
+	__atomic_store_n ( ring->sq_tail, ( *ring->sq_tail + to_submit ),
+			   __ATOMIC_RELEASE );
+	ring->sq_pending = 0;
+
+	if ( timeout_ms != 0 ) {
+		flags |= IORING_ENTER_GETEVENTS;
+		wait = 1;
+		if ( ( timeout_ms > 0 ) &&
+		     ( ring->features & IORING_FEAT_EXT_ARG ) ) {
+			ts.tv_sec = ( timeout_ms / 1000 );
+			ts.tv_nsec = ( ( timeout_ms % 1000 ) * 1000000LL );
+			memset ( &arg, 0, sizeof ( arg ) );
+			arg.ts = ( uintptr_t ) &ts;
+			argp = &arg;
+			argsz = sizeof ( arg );
+			flags |= IORING_ENTER_EXT_ARG;
+		}
+	}
+
+	rc = syscall ( __NR_io_uring_enter, ring->fd, to_submit, wait, flags,
+		       argp, argsz );
+	if ( rc < 0 ) {
+		if ( ( errno == ETIME ) || ( errno == EINTR ) )
+			return 0;
+		return -errno;
+	}
+	return 0;
+}
+
+/****************************************************************************
+ *
+ * File writer
+ *
+ */
+
+int qusb_writer_create ( unsigned int depth, struct qusb_writer **writer ) {
+	int rc;
+
+	if ( ! depth )
+		return -EINVAL;
+	if ( ! ( *writer = calloc ( 1, sizeof ( **writer ) ) ) )
+		return -ENOMEM;
+	if ( ( rc = qusb_uring_setup ( &(*writer)->ring, depth ) ) != 0 ) {
+		free ( *writer );
+		*writer = NULL;
+		return rc;
+	}
+	return 0;
+}
+
+void qusb_writer_destroy ( struct qusb_writer *writer ) {
+	if ( ! writer )
+		return;
+	qusb_uring_free ( &writer->ring );
+	free ( writer );
+}
+
+int qusb_writer_write ( struct qusb_writer *writer, int fd, const void *data,
+			size_t len, uint64_t offset, uint64_t user_data ) {
+	struct io_uring_sqe *sqe;
+
+	if ( ! qusb_uring_space ( &writer->ring ) )
+		return -EBUSY;
+	sqe = qusb_uring_sqe ( &writer->ring );
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = ( uintptr_t ) data;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+	return 0;
+}
+
+int qusb_writer_submit ( struct qusb_writer *writer, int timeout_ms ) {
+	return qusb_uring_enter ( &writer->ring, timeout_ms );
+}
+
+int qusb_writer_reap ( struct qusb_writer *writer,
+		       struct qusb_write_done *done ) {
+	struct qusb_uring *ring = &writer->ring;
+	unsigned int head = *ring->cq_head;
+	struct io_uring_cqe *cqe;
+
+	if ( head == __atomic_load_n ( ring->cq_tail, __ATOMIC_ACQUIRE ) )
+		return 0;
+	cqe = &ring->cqes[head & ring->cq_mask];
+	done->user_data = cqe->user_data;
+	done->res = cqe->res;
+	__atomic_store_n ( ring->cq_head, ( head + 1 ), __ATOMIC_RELEASE );
+	return 1;
+}
+
+/****************************************************************************
+ *
+ * HSPIO data (asynchronous streaming)
+ *
+ * Transfers on a board must stay in order, but the driver serialises
+ * them on a lock, and io_uring hands blocking reads and writes of a
+ * character device to worker threads that may reach that lock in any
+ * order.  (Likewise, the vendor protocol announces the length of a
+ * read before it starts.)  So each stream's queued requests are
+ * submitted as a chain, run back to back, and the next chain is
+ * submitted once the previous one has completed.  Within each request,
+ * the driver keeps its own pool of URBs in flight.
+ *
+ */
+
+/**
+ * qusb_loop_create - create an event loop
+ *
+ * @entries: Submission queue size; at least the sum of the depths of
+ *	the streams to be served
+ * @loop: Loop to fill in
+ *
+ * If io_uring is unavailable, the loop can still serve libusb streams.
+ */
+int qusb_loop_create ( unsigned int entries, struct qusb_loop **loop ) {
+	if ( ! ( *loop = calloc ( 1, sizeof ( **loop ) ) ) )
+		return -ENOMEM;
+
+	( *loop )->ring_error = qusb_uring_setup ( &( *loop )->ring, entries );
+	return 0;
+}
+
+/**
+ * qusb_loop_destroy - destroy an event loop
+ *
+ * @loop: Loop, whose streams must already have been destroyed
+ */
+void qusb_loop_destroy ( struct qusb_loop *loop ) {
+	if ( ! loop )
+		return;
+
+	qusb_uring_free ( &loop->ring );
+	free ( loop );
+}
+
+/* File descriptor that polls readable when io_uring completions wait */
+int qusb_loop_fd ( struct qusb_loop *loop ) {
+	return ( ( loop->ring.fd >= 0 ) ? loop->ring.fd : loop->ring_error );
+}
+
+/* Number of streams running or with requests still in flight */
+int qusb_loop_active ( struct qusb_loop *loop ) {
+	struct qusb_stream *stream;
+	int active = 0;
+
+	for ( stream = loop->streams ; stream ; stream = stream->next )
+		active += ( stream->running || stream->inflight );
+	return active;
+}
+
+static void qusb_stream_free_block ( struct qusb_stream *stream,
+				     struct qusb_block *block ) {
+	stream->free[stream->nfree++] = block->index;
+}
+
+/* Add a block to the tail (or, to retry it, the head) of the queue */
+static void qusb_stream_enqueue ( struct qusb_stream *stream,
+				  struct qusb_block *block, int head ) {
+	unsigned int n = stream->config.blocks;
+
+	if ( head ) {
+		stream->queue_head = ( ( stream->queue_head + n - 1 ) % n );
+		stream->queue[stream->queue_head] = block->index;
+	} else {
+		stream->queue[ ( stream->queue_head + stream->queue_len ) %
+			       n ] = block->index;
+	}
+	stream->queue_len++;
+}
+
+/**
+ * qusb_stream_chain - take the blocks for the next chain
+ *
+ * @stream: Stream, running and idle
+ * @max: Maximum number of requests the back-end can take
+ *
+ * Free blocks (IN) or queued blocks (OUT) are placed in stream->chain,
+ * in order, and counted as in flight.  Returns the number of blocks.
+ */
+unsigned int qusb_stream_chain ( struct qusb_stream *stream,
+				 unsigned int max ) {
+	struct qusb_block *block;
+	unsigned int count;
+	unsigned int i;
+
+	if ( stream->config.direction == QUSB_IN ) {
+		count = stream->nfree;
+		if ( ! count )
+			stream->stats.starved++;
+	} else {
+		count = stream->queue_len;
+	}
+	if ( count > stream->config.depth )
+		count = stream->config.depth;
+	if ( count > max )
+		count = max;
+
+	for ( i = 0 ; i < count ; i++ ) {
+		if ( stream->config.direction == QUSB_IN ) {
+			block = &stream->blocks[stream->free[--stream->nfree]];
+			block->len = stream->config.block_size;
+		} else {
+			block = &stream->blocks[stream->queue[stream->queue_head]];
+			stream->queue_head = ( ( stream->queue_head + 1 ) %
+					       stream->config.blocks );
+			stream->queue_len--;
+		}
+		stream->cancelled[block->index] = 0;
+		stream->chain[i] = block->index;
+	}
+	stream->chain_len = count;
+	stream->inflight = count;
+	return count;
+}
+
+/* The chain has completed: requeue (in order) writes it never reached */
+static void qusb_stream_chain_done ( struct qusb_stream *stream ) {
+	struct qusb_block *block;
+	unsigned int i;
+
+	for ( i = stream->chain_len ; i-- ; ) {
+		if ( ! stream->cancelled[stream->chain[i]] )
+			continue;
+		block = &stream->blocks[stream->chain[i]];
+		if ( stream->config.direction == QUSB_IN ) {
+			qusb_stream_free_block ( stream, block );
+		} else {
+			qusb_stream_enqueue ( stream, block, 1 );
+		}
+	}
+	stream->chain_len = 0;
+}
+
+/**
+ * qusb_stream_complete - complete a request
+ *
+ * @stream: Stream
+ * @block: Block
+ * @res: Bytes transferred, negative errno, or -ECANCELED if the request
+ *	was never attempted (an earlier request in the chain failed)
+ */
+void qusb_stream_complete ( struct qusb_stream *stream,
+			    struct qusb_block *block, ssize_t res ) {
+	int rc = QUSB_CONTINUE;
+
+	stream->inflight--;
+
+	if ( res == -ECANCELED ) {
+		stream->cancelled[block->index] = 1;
+		goto out;
+	}
+
+	block->status = res;
+	block->sequence = stream->sequence++;
+	stream->stats.blocks++;
+	if ( res < 0 ) {
+		stream->stats.errors++;
+		if ( ( res == -ENODEV ) || ( res == -ESHUTDOWN ) )
+			stream->running = 0;
+	} else {
+		stream->stats.bytes += res;
+		if ( stream->config.direction == QUSB_IN )
+			block->len = res;
+	}
+
+	stream->loop->completions++;
+	if ( stream->config.complete )
+		rc = stream->config.complete ( block, stream->config.priv );
+	if ( ( rc == QUSB_STOP ) || ( rc < 0 ) )
+		stream->running = 0;
+	if ( rc != QUSB_HOLD )
+		qusb_stream_free_block ( stream, block );
+
+ out:
+	if ( ! stream->inflight )
+		qusb_stream_chain_done ( stream );
+}
+
+/**
+ * qusb_loop_run - submit queued requests and process completions
+ *
+ * @loop: Loop
+ * @timeout_ms: Time to wait for a completion: 0 to poll, -1 forever
+ *
+ * Completion callbacks are called from here.  Returns the number of
+ * completions processed, or a negative errno.  (A loop serving streams
+ * of both back-ends waits on libusb in slices of at most 1ms.)
+ */
+int qusb_loop_run ( struct qusb_loop *loop, int timeout_ms ) {
+	struct qusb_uring *ring = &loop->ring;
+	const struct qusb_backend *events = NULL;
+	struct qusb_stream *stream;
+	struct io_uring_cqe *cqe;
+	struct qusb_block *block;
+	unsigned int head;
+	unsigned int tail;
+	int uring_active = 0;
+	int uring_wait;
+	int rc;
+
+	loop->completions = 0;
+	for ( stream = loop->streams ; stream ; stream = stream->next ) {
+		if ( stream->running && ! stream->inflight )
+			stream->dev->backend->stream_fill ( stream );
+		if ( ! ( stream->running || stream->inflight ) )
+			continue;
+		if ( stream->dev->backend->events ) {
+			events = stream->dev->backend;
+		} else {
+			uring_active = 1;
+		}
+	}
+
+	if ( ring->fd >= 0 ) {
+		/* Sleep here only if nothing else could wake us */
+		uring_wait = ( ( uring_active && ! events ) ? timeout_ms : 0 );
+		head = *ring->cq_head;
+		if ( head != __atomic_load_n ( ring->cq_tail, __ATOMIC_ACQUIRE ) )
+			uring_wait = 0;
+		if ( ring->sq_pending || uring_wait ) {
+			if ( ( rc = qusb_uring_enter ( ring, uring_wait ) ) != 0 )
+				return rc;
+		}
+
+		tail = __atomic_load_n ( ring->cq_tail, __ATOMIC_ACQUIRE );
+		for ( ; head != tail ; head++ ) {
+			cqe = &ring->cqes[head & ring->cq_mask];
+			block = ( struct qusb_block * ) ( uintptr_t )
+				cqe->user_data;
+			if ( block )
+				qusb_stream_complete ( block->stream, block,
+						       cqe->res );
+			__atomic_store_n ( ring->cq_head, ( head + 1 ),
+					   __ATOMIC_RELEASE );
+		}
+	}
+
+	if ( events ) {
+		if ( uring_active && ( ( timeout_ms < 0 ) || ( timeout_ms > 1 ) ) )
+			timeout_ms = 1;
+		if ( loop->completions )
+			timeout_ms = 0;
+		if ( ( rc = events->events ( timeout_ms ) ) != 0 )
+			return rc;
+	}
+
+	return loop->completions;
+}
+
+/**
+ * qusb_stream_create - create a stream on a board
+ *
+ * @loop: Loop to serve the stream
+ * @dev: Board
+ * @config: Direction, block pool geometry and callback
+ * @stream: Stream to fill in
+ */
+int qusb_stream_create ( struct qusb_loop *loop, struct qusb_device *dev,
+			 const struct qusb_stream_config *config,
+			 struct qusb_stream **stream ) {
+	struct qusb_stream *s;
+	struct qusb_block *block;
+	long page_size = sysconf ( _SC_PAGESIZE );
+	unsigned int i;
+	int rc;
+
+	if ( ( ! config->block_size ) || ( ! config->blocks ) ||
+	     ( ! config->depth ) || ( config->depth > config->blocks ) )
+		return -EINVAL;
+
+	if ( ! ( s = calloc ( 1, sizeof ( *s ) ) ) )
+		return -ENOMEM;
+	s->loop = loop;
+	s->dev = dev;
+	s->config = *config;
+	s->fd = -1;
+
+	/* Page-aligned, so blocks may also be used with O_DIRECT */
+	s->pool_size = ( ( ( config->block_size + page_size - 1 ) /
+			   page_size ) * page_size );
+	if ( ( rc = -posix_memalign ( &s->pool, page_size,
+				      ( s->pool_size * config->blocks ) ) ) != 0 )
+		goto err_pool;
+	qusb_numa_prefer ( s->pool, ( s->pool_size * config->blocks ),
+			   qusb_numa_node ( dev ) );
+	s->blocks = calloc ( config->blocks, sizeof ( s->blocks[0] ) );
+	s->free = calloc ( config->blocks, sizeof ( s->free[0] ) );
+	s->queue = calloc ( config->blocks, sizeof ( s->queue[0] ) );
+	s->chain = calloc ( config->blocks, sizeof ( s->chain[0] ) );
+	s->cancelled = calloc ( config->blocks, sizeof ( s->cancelled[0] ) );
+	if ( ! ( s->blocks && s->free && s->queue && s->chain &&
+		 s->cancelled ) ) {
+		rc = -ENOMEM;
+		goto err_alloc;
+	}
+
+	for ( i = 0 ; i < config->blocks ; i++ ) {
+		block = &s->blocks[i];
+		block->data = ( s->pool + ( i * s->pool_size ) );
+		block->stream = s;
+		block->index = i;
+		s->free[i] = ( config->blocks - 1 - i );
+	}
+	s->nfree = config->blocks;
+
+	if ( ( rc = dev->backend->stream_open ( s ) ) != 0 )
+		goto err_open;
+
+	s->next = loop->streams;
+	loop->streams = s;
+	*stream = s;
+	return 0;
+
+ err_open:
+ err_alloc:
+	free ( s->cancelled );
+	free ( s->chain );
+	free ( s->queue );
+	free ( s->free );
+	free ( s->blocks );
+	free ( s->pool );
+ err_pool:
+	free ( s );
+	return rc;
+}
+
+/**
+ * qusb_stream_destroy - destroy a stream
+ *
+ * @stream: Stream
+ *
+ * Stops the stream and runs its loop until its requests have drained.
+ */
+void qusb_stream_destroy ( struct qusb_stream *stream ) {
+	struct qusb_stream **prev;
+
+	if ( ! stream )
+		return;
+
+	qusb_stream_stop ( stream );
+	while ( stream->inflight ) {
+		if ( qusb_loop_run ( stream->loop, 100 ) < 0 )
+			break;
+	}
+
+	for ( prev = &stream->loop->streams ; *prev ; prev = &( *prev )->next ) {
+		if ( *prev == stream ) {
+			*prev = stream->next;
+			break;
+		}
+	}
+	stream->dev->backend->stream_close ( stream );
+	free ( stream->cancelled );
+	free ( stream->chain );
+	free ( stream->queue );
+	free ( stream->free );
+	free ( stream->blocks );
+	free ( stream->pool );
+	free ( stream );
+}
+
+int qusb_stream_start ( struct qusb_stream *stream ) {
+	stream->running = 1;
+	return 0;
+}
+
+/**
+ * qusb_stream_stop - stop queuing requests
+ *
+ * @stream: Stream
+ *
+ * Requests in flight are cancelled where possible; their completions
+ * (and callbacks) are still delivered by qusb_loop_run().
+ */
+void qusb_stream_stop ( struct qusb_stream *stream ) {
+	stream->running = 0;
+	if ( stream->inflight )
+		stream->dev->backend->stream_cancel ( stream );
+}
+
+int qusb_stream_running ( struct qusb_stream *stream ) {
+	return stream->running;
+}
+
+/**
+ * qusb_stream_get_block - take a free block, to fill for an OUT stream
+ *
+ * @stream: Stream
+ *
+ * Returns NULL if all blocks are in use.
+ */
+struct qusb_block * qusb_stream_get_block ( struct qusb_stream *stream ) {
+	struct qusb_block *block;
+
+	if ( ! stream->nfree )
+		return NULL;
+	block = &stream->blocks[stream->free[--stream->nfree]];
+	block->len = stream->config.block_size;
+	return block;
+}
+
+/**
+ * qusb_stream_submit - queue a filled block on an OUT stream
+ *
+ * @block: Block from qusb_stream_get_block(), with len set
+ *
+ * Blocks are written in the order submitted.
+ */
+int qusb_stream_submit ( struct qusb_block *block ) {
+	struct qusb_stream *stream = block->stream;
+
+	if ( stream->config.direction != QUSB_OUT )
+		return -EINVAL;
+	if ( ( ! block->len ) || ( block->len > stream->config.block_size ) )
+		return -EINVAL;
+
+	qusb_stream_enqueue ( stream, block, 0 );
+	return 0;
+}
+
+/* Return a block held by a callback (or taken and not submitted) */
+void qusb_block_release ( struct qusb_block *block ) {
+	qusb_stream_free_block ( block->stream, block );
+}
+
+void qusb_stream_stats ( struct qusb_stream *stream,
+			 struct qusb_stream_stats *stats ) {
+	*stats = stream->stats;
+}
+
+/****************************************************************************
+ *
+ * Kernel driver back-end
+ *
+ */
+
+static int qusb_compare_info ( const void *a, const void *b ) {
+	const struct qusb_info *info_a = a;
+	const struct qusb_info *info_b = b;
+
+	return ( ( int ) info_a->board - ( int ) info_b->board );
+}
+
+static int qusb_kernel_enumerate ( struct qusb_info *info, unsigned int max ) {
+	struct dirent *dirent;
+	unsigned int board;
+	unsigned int count = 0;
+	char suffix[3];
+	DIR *dir;
+
+	if ( ! ( dir = opendir ( QUSB_CLASS_DIR ) ) )
+		return ( ( errno == ENOENT ) ? 0 : -errno );
+
+	while ( ( dirent = readdir ( dir ) ) ) {
+		if ( sscanf ( dirent->d_name, "qu%u%2s", &board, suffix ) != 2 )
+			continue;
+		if ( strcmp ( suffix, "hd" ) != 0 )
+			continue;
+		if ( count < max ) {
+			info[count].board = board;
+			snprintf ( info[count].data_path,
+				   sizeof ( info[count].data_path ),
+				   "/dev/qu%uhd", board );
+			snprintf ( info[count].command_path,
+				   sizeof ( info[count].command_path ),
+				   "/dev/qu%uhc", board );
+		}
+		count++;
+	}
+	closedir ( dir );
+
+	qsort ( info, ( ( count < max ) ? count : max ), sizeof ( *info ),
+		qusb_compare_info );
+	return count;
+}
+
+/*
+ * Only the HSPIO data node is opened here; the command and GPPIO nodes
+ * are opened on first use.
+ */
+static int qusb_kernel_open ( struct qusb_device *dev ) {
+	char path[32];
+
+	snprintf ( path, sizeof ( path ), "/dev/qu%uhd", dev->board );
+	if ( ( dev->data_fd = open ( path, O_RDWR | O_CLOEXEC ) ) < 0 )
+		return -errno;
+	return 0;
+}
+
+static void qusb_kernel_close ( struct qusb_device *dev ) {
+	unsigned int i;
+
+	for ( i = 0 ; i < QUSB_MAX_GPPIO ; i++ ) {
+		if ( dev->gppio_fd[i] >= 0 )
+			close ( dev->gppio_fd[i] );
+	}
+	if ( dev->command_fd >= 0 )
+		close ( dev->command_fd );
+	close ( dev->data_fd );
+}
+
+static int qusb_kernel_gppio_fd ( struct qusb_device *dev,
+				  unsigned int port ) {
+	char path[32];
+
+	if ( dev->gppio_fd[port] < 0 ) {
+		snprintf ( path, sizeof ( path ), "/dev/qu%ug%c",
+			   dev->board, ( 'a' + port ) );
+		if ( ( dev->gppio_fd[port] = open ( path,
+						    O_RDWR | O_CLOEXEC ) ) < 0 )
+			return -errno;
+	}
+	return dev->gppio_fd[port];
+}
+
+static int qusb_kernel_command_fd ( struct qusb_device *dev ) {
+	char path[32];
+
+	if ( dev->command_fd < 0 ) {
+		snprintf ( path, sizeof ( path ), "/dev/qu%uhc", dev->board );
+		if ( ( dev->command_fd = open ( path,
+						O_RDWR | O_CLOEXEC ) ) < 0 )
+			return -errno;
+	}
+	return dev->command_fd;
+}
+
+static int qusb_kernel_ioctl ( int fd, unsigned long request, void *data ) {
+	if ( fd < 0 )
+		return fd;
+	if ( ioctl ( fd, request, data ) < 0 )
+		return -errno;
+	return 0;
+}
+
+static int qusb_kernel_get_setting ( struct qusb_device *dev,
+				     unsigned int address, uint16_t *value ) {
+	struct quickusb_setting_ioctl_data setting;
+	int rc;
+
+	setting.address = address;
+	if ( ( rc = qusb_kernel_ioctl ( qusb_kernel_gppio_fd ( dev, 0 ),
+					QUICKUSB_IOC_GET_SETTING,
+					&setting ) ) != 0 )
+		return rc;
+	*value = setting.value;
+	return 0;
+}
+
+static int qusb_kernel_set_setting ( struct qusb_device *dev,
+				     unsigned int address, uint16_t value ) {
+	struct quickusb_setting_ioctl_data setting;
+
+	setting.address = address;
+	setting.value = value;
+	return qusb_kernel_ioctl ( qusb_kernel_gppio_fd ( dev, 0 ),
+				   QUICKUSB_IOC_SET_SETTING, &setting );
+}
+
+static int qusb_kernel_gppio_ioctl ( struct qusb_device *dev,
+				     unsigned int port, unsigned long request,
+				     quickusb_gppio_ioctl_data_t *data ) {
+	return qusb_kernel_ioctl ( qusb_kernel_gppio_fd ( dev, port ),
+				   request, data );
+}
+
+static int qusb_kernel_gppio_read ( struct qusb_device *dev, unsigned int port,
+				    uint8_t *value ) {
+	int fd;
+
+	if ( ( fd = qusb_kernel_gppio_fd ( dev, port ) ) < 0 )
+		return fd;
+	if ( read ( fd, value, sizeof ( *value ) ) < 0 )
+		return -errno;
+	return 0;
+}
+
+static int qusb_kernel_gppio_write ( struct qusb_device *dev,
+				     unsigned int port, uint8_t value ) {
+	int fd;
+
+	if ( ( fd = qusb_kernel_gppio_fd ( dev, port ) ) < 0 )
+		return fd;
+	if ( write ( fd, &value, sizeof ( value ) ) < 0 )
+		return -errno;
+	return 0;
+}
+
+static int qusb_kernel_command_read ( struct qusb_device *dev,
+				      unsigned int address, void *data,
+				      size_t len ) {
+	ssize_t frag_len;
+	int fd;
+
+	if ( ( fd = qusb_kernel_command_fd ( dev ) ) < 0 )
+		return fd;
+
+	while ( len ) {
+		if ( ( frag_len = pread ( fd, data, len, address ) ) <= 0 )
+			return ( frag_len ? -errno : -EIO );
+		data += frag_len;
+		address += frag_len;
+		len -= frag_len;
+	}
+	return 0;
+}
+
+static int qusb_kernel_command_write ( struct qusb_device *dev,
+				       unsigned int address, const void *data,
+				       size_t len ) {
+	ssize_t frag_len;
+	int fd;
+
+	if ( ( fd = qusb_kernel_command_fd ( dev ) ) < 0 )
+		return fd;
+
+	while ( len ) {
+		if ( ( frag_len = pwrite ( fd, data, len, address ) ) <= 0 )
+			return ( frag_len ? -errno : -EIO );
+		data += frag_len;
+		address += frag_len;
+		len -= frag_len;
+	}
+	return 0;
+}
+
+static ssize_t qusb_kernel_read ( struct qusb_device *dev, void *data,
+				  size_t len ) {
+	ssize_t rc;
+
+	if ( ( rc = read ( dev->data_fd, data, len ) ) < 0 )
+		return -errno;
+	return rc;
+}
+
+static ssize_t qusb_kernel_write ( struct qusb_device *dev, const void *data,
+				   size_t len ) {
+	ssize_t rc;
+
+	if ( ( rc = write ( dev->data_fd, data, len ) ) < 0 )
+		return -errno;
+	return rc;
+}
+
+static int qusb_kernel_data_ioctl ( struct qusb_device *dev,
+				    unsigned long request, void *data ) {
+	return qusb_kernel_ioctl ( dev->data_fd, request, data );
+}
+
+static int qusb_kernel_command_ioctl ( struct qusb_device *dev,
+				       unsigned long request, void *data ) {
+	return qusb_kernel_ioctl ( qusb_kernel_command_fd ( dev ), request,
+				   data );
+}
+
+static int qusb_kernel_numa_node ( struct qusb_device *dev ) {
+	char path[64];
+	char value[16];
+	int node;
+	int rc;
+
+	snprintf ( path, sizeof ( path ), QUSB_CLASS_DIR "/qu%uhd/numa_node",
+		   dev->board );
+	if ( ( rc = qusb_sysfs_read ( path, value, sizeof ( value ) ) ) != 0 )
+		return rc;
+	node = atoi ( value );
+	return ( ( node >= 0 ) ? node : -ENOENT );
+}
+
+static int qusb_kernel_local_cpus ( struct qusb_device *dev, char *cpus,
+				    size_t len ) {
+	char path[64];
+
+	snprintf ( path, sizeof ( path ), QUSB_CLASS_DIR "/qu%uhd/local_cpus",
+		   dev->board );
+	return qusb_sysfs_read ( path, cpus, len );
+}
+
+/*
+ * Each stream has its own open file on the data node, so per-file state
+ * (such as framed reads) may be set on it independently.
+ */
+static int qusb_kernel_stream_open ( struct qusb_stream *stream ) {
+	char path[32];
+
+	if ( stream->loop->ring.fd < 0 )
+		return stream->loop->ring_error;
+
+	snprintf ( path, sizeof ( path ), "/dev/qu%uhd", stream->dev->board );
+	if ( ( stream->fd = open ( path, O_RDWR | O_CLOEXEC ) ) < 0 )
+		return -errno;
+	return 0;
+}
+
+static void qusb_kernel_stream_close ( struct qusb_stream *stream ) {
+	close ( stream->fd );
+}
+
+/* Submit the next chain as linked io_uring reads or writes */
+static void qusb_kernel_stream_fill ( struct qusb_stream *stream ) {
+	struct qusb_uring *ring = &stream->loop->ring;
+	struct io_uring_sqe *sqe;
+	struct qusb_block *block;
+	unsigned int count;
+	unsigned int i;
+
+	count = qusb_stream_chain ( stream, qusb_uring_space ( ring ) );
+	for ( i = 0 ; i < count ; i++ ) {
+		block = &stream->blocks[stream->chain[i]];
+		sqe = qusb_uring_sqe ( ring );
+		sqe->opcode = ( ( stream->config.direction == QUSB_IN ) ?
+				IORING_OP_READ : IORING_OP_WRITE );
+		sqe->fd = stream->fd;
+		sqe->off = -1ULL;
+		sqe->addr = ( uintptr_t ) block->data;
+		sqe->len = block->len;
+		sqe->user_data = ( uintptr_t ) block;
+		if ( i < ( count - 1 ) )
+			sqe->flags = IOSQE_IO_LINK;
+	}
+}
+
+static void qusb_kernel_stream_cancel ( struct qusb_stream *stream ) {
+	struct qusb_uring *ring = &stream->loop->ring;
+	struct io_uring_sqe *sqe;
+
+	if ( ! qusb_uring_space ( ring ) )
+		return;
+
+	sqe = qusb_uring_sqe ( ring );
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = stream->fd;
+	sqe->cancel_flags = ( IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL );
+}
+
+const struct qusb_backend qusb_kernel_backend = {
+	.name		= "kernel",
+	.enumerate	= qusb_kernel_enumerate,
+	.open		= qusb_kernel_open,
+	.close		= qusb_kernel_close,
+	.get_setting	= qusb_kernel_get_setting,
+	.set_setting	= qusb_kernel_set_setting,
+	.gppio_ioctl	= qusb_kernel_gppio_ioctl,
+	.gppio_read	= qusb_kernel_gppio_read,
+	.gppio_write	= qusb_kernel_gppio_write,
+	.command_read	= qusb_kernel_command_read,
+	.command_write	= qusb_kernel_command_write,
+	.command_ioctl	= qusb_kernel_command_ioctl,
+	.read		= qusb_kernel_read,
+	.write		= qusb_kernel_write,
+	.data_ioctl	= qusb_kernel_data_ioctl,
+	.stream_open	= qusb_kernel_stream_open,
+	.stream_close	= qusb_kernel_stream_close,
+	.stream_fill	= qusb_kernel_stream_fill,
+	.stream_cancel	= qusb_kernel_stream_cancel,
+	.numa_node	= qusb_kernel_numa_node,
+	.local_cpus	= qusb_kernel_local_cpus,
+};
+
+/****************************************************************************
+ *
+ * Utilities shared by the tools
+ *
+ */
+
+double qusb_now_us ( void ) {
+	struct timespec ts;
+
+	clock_gettime ( CLOCK_MONOTONIC, &ts );
+	return ( ( ts.tv_sec * 1e6 ) + ( ts.tv_nsec / 1e3 ) );
+}
+
+unsigned long long qusb_parse_size ( const char *arg ) {
+	char *end;
+	unsigned long long size = strtoull ( arg, &end, 0 );
+
+	switch ( *end ) {
+	case 'k': case 'K':
+		return ( size << 10 );
+	case 'm': case 'M':
+		return ( size << 20 );
+	case 'g': case 'G':
+		return ( size << 30 );
+	default:
+		return size;
+	}
+}
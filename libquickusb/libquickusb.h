@@ -0,0 +1,830 @@
+#ifndef LIBQUICKUSB_H
+#define LIBQUICKUSB_H
+
+/*
+ * libquickusb - user-space access to QuickUSB boards
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/ioctl.h>
+
+#include "../kernel/quickusb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * All functions returning int return 0 (or a count) for success, or a
+ * negative errno.
+ */
+
+#define QUSB_MAX_BOARDS		16
+#define QUSB_MAX_GPPIO		5
+
+/****************************************************************************
+ *
+ * Devices
+ *
+ */
+
+struct qusb_device;
+
+struct qusb_info {
+	unsigned int board;	/* N in /dev/quN*, or Nth board on the bus */
+	char data_path[32];	/* /dev/quNhd, or usb:BUS:ADDRESS */
+	char command_path[32];	/* /dev/quNhc, or usb:BUS:ADDRESS */
+};
+
+/*
+ * Boards are reached through the kernel driver, or (where the module
+ * cannot be loaded) by speaking the vendor protocol directly through
+ * libusb.  Both back-ends offer the same API.  The default is taken
+ * from the environment variable QUSB_BACKEND ("kernel" or "libusb"),
+ * else the kernel driver.
+ */
+enum qusb_backend_type {
+	QUSB_BACKEND_DEFAULT = 0,
+	QUSB_BACKEND_KERNEL,
+	QUSB_BACKEND_LIBUSB,
+};
+
+extern int qusb_enumerate ( struct qusb_info *info, unsigned int max );
+extern int qusb_enumerate_backend ( enum qusb_backend_type type,
+				    struct qusb_info *info, unsigned int max );
+extern int qusb_open ( unsigned int board, struct qusb_device **dev );
+extern int qusb_open_backend ( enum qusb_backend_type type, unsigned int board,
+			       struct qusb_device **dev );
+extern void qusb_close ( struct qusb_device *dev );
+extern unsigned int qusb_board ( struct qusb_device *dev );
+extern const char * qusb_backend_name ( struct qusb_device *dev );
+
+/****************************************************************************
+ *
+ * Settings, GPPIO and HSPIO commands
+ *
+ */
+
+extern int qusb_get_setting ( struct qusb_device *dev, unsigned int address,
+			      uint16_t *value );
+extern int qusb_set_setting ( struct qusb_device *dev, unsigned int address,
+			      uint16_t value );
+
+extern int qusb_gppio_get_outputs ( struct qusb_device *dev,
+				    unsigned int port, uint8_t *outputs );
+extern int qusb_gppio_set_outputs ( struct qusb_device *dev,
+				    unsigned int port, uint8_t outputs );
+extern int qusb_gppio_get_default_outputs ( struct qusb_device *dev,
+					    unsigned int port,
+					    uint8_t *outputs );
+extern int qusb_gppio_set_default_outputs ( struct qusb_device *dev,
+					    unsigned int port,
+					    uint8_t outputs );
+extern int qusb_gppio_get_default_levels ( struct qusb_device *dev,
+					   unsigned int port,
+					   uint8_t *levels );
+extern int qusb_gppio_set_default_levels ( struct qusb_device *dev,
+					   unsigned int port,
+					   uint8_t levels );
+extern int qusb_gppio_read ( struct qusb_device *dev, unsigned int port,
+			     uint8_t *value );
+extern int qusb_gppio_write ( struct qusb_device *dev, unsigned int port,
+			      uint8_t value );
+
+extern int qusb_command_read ( struct qusb_device *dev, unsigned int address,
+			       void *data, size_t len );
+extern int qusb_command_write ( struct qusb_device *dev, unsigned int address,
+				const void *data, size_t len );
+
+/* Write-combining shadow of a range of the command address space */
+extern int qusb_get_shadow ( struct qusb_device *dev,
+			     struct quickusb_shadow_ioctl_data *shadow );
+extern int qusb_set_shadow ( struct qusb_device *dev,
+			     const struct quickusb_shadow_ioctl_data *shadow );
+extern int qusb_command_barrier ( struct qusb_device *dev );
+extern int qusb_shadow_stats ( struct qusb_device *dev,
+			       struct quickusb_shadow_stats_ioctl_data *stats );
+
+/****************************************************************************
+ *
+ * HSPIO data (synchronous)
+ *
+ */
+
+extern ssize_t qusb_read ( struct qusb_device *dev, void *data, size_t len );
+extern ssize_t qusb_write ( struct qusb_device *dev, const void *data,
+			    size_t len );
+
+extern int qusb_get_trigger ( struct qusb_device *dev,
+			      struct quickusb_trigger_ioctl_data *trigger );
+extern int qusb_set_trigger ( struct qusb_device *dev,
+			      const struct quickusb_trigger_ioctl_data *trigger );
+extern int qusb_wait_trigger ( struct qusb_device *dev,
+			       struct quickusb_trigger_event_ioctl_data *event );
+extern int qusb_get_framing ( struct qusb_device *dev, uint32_t *block );
+extern int qusb_set_framing ( struct qusb_device *dev, uint32_t block );
+extern int qusb_get_pacing ( struct qusb_device *dev,
+			     struct quickusb_pacing_ioctl_data *pacing );
+extern int qusb_set_pacing ( struct qusb_device *dev,
+			     const struct quickusb_pacing_ioctl_data *pacing );
+extern int qusb_pacing_stats ( struct qusb_device *dev,
+			       struct quickusb_pacing_stats_ioctl_data *stats );
+extern int qusb_get_timeout ( struct qusb_device *dev,
+			      struct quickusb_timeout_ioctl_data *timeout );
+extern int qusb_set_timeout ( struct qusb_device *dev,
+			      const struct quickusb_timeout_ioctl_data
+			      *timeout );
+extern int qusb_last_result ( struct qusb_device *dev,
+			      struct quickusb_result_ioctl_data *result );
+
+/* Monitor tap (/dev/quNhm): a decimated copy of what another process reads */
+extern int qusb_tap_open ( unsigned int board );
+extern ssize_t qusb_tap_read ( int fd, struct quickusb_frame_header *header,
+			       void *data, size_t len );
+extern int qusb_get_tap ( int fd, struct quickusb_tap_ioctl_data *tap );
+extern int qusb_set_tap ( int fd, const struct quickusb_tap_ioctl_data *tap );
+extern int qusb_tap_stats ( int fd,
+			    struct quickusb_tap_stats_ioctl_data *stats );
+
+/****************************************************************************
+ *
+ * HSPIO data (asynchronous streaming)
+ *
+ * A loop is one io_uring, serving any number of streams (typically one
+ * per board) from a single thread.  Each stream owns a pool of blocks,
+ * allocated when it is created; nothing is allocated per block.
+ *
+ * An IN stream keeps its free blocks queued as reads, and calls the
+ * completion callback with each filled block, in order.  An OUT stream
+ * is fed by the caller: qusb_stream_get_block(), fill it, set len and
+ * qusb_stream_submit(); the callback reports each completed write.
+ *
+ * A block is returned to the pool when the callback returns
+ * QUSB_CONTINUE.  Returning QUSB_HOLD keeps it, until the caller
+ * hands it back with qusb_block_release().  Returning QUSB_STOP (or a
+ * negative errno) stops the stream.
+ */
+
+struct qusb_loop;
+struct qusb_stream;
+
+enum qusb_direction {
+	QUSB_IN = 0,		/* Board to host (read) */
+	QUSB_OUT,		/* Host to board (write) */
+};
+
+#define QUSB_CONTINUE	0
+#define QUSB_HOLD	1
+#define QUSB_STOP	2
+
+struct qusb_block {
+	void *data;
+	size_t len;		/* Bytes valid (IN), or to be written (OUT) */
+	ssize_t status;		/* Bytes transferred, or negative errno */
+	uint64_t sequence;	/* Completion number within the stream */
+	struct qusb_stream *stream;
+	/* Library private */
+	unsigned int index;
+};
+
+typedef int ( * qusb_complete_t ) ( struct qusb_block *block, void *priv );
+
+struct qusb_stream_config {
+	enum qusb_direction direction;
+	size_t block_size;	/* Bytes per read/write request */
+	unsigned int blocks;	/* Blocks in the pool */
+	unsigned int depth;	/* Maximum requests queued at once */
+	qusb_complete_t complete;
+	void *priv;
+};
+
+struct qusb_stream_stats {
+	uint64_t blocks;	/* Completed requests */
+	uint64_t bytes;		/* Bytes transferred */
+	uint64_t errors;	/* Requests that failed */
+	uint64_t starved;	/* Times no free block could be queued */
+};
+
+extern int qusb_loop_create ( unsigned int entries, struct qusb_loop **loop );
+extern void qusb_loop_destroy ( struct qusb_loop *loop );
+extern int qusb_loop_fd ( struct qusb_loop *loop );
+extern int qusb_loop_run ( struct qusb_loop *loop, int timeout_ms );
+extern int qusb_loop_active ( struct qusb_loop *loop );
+
+extern int qusb_stream_create ( struct qusb_loop *loop, struct qusb_device *dev,
+				const struct qusb_stream_config *config,
+				struct qusb_stream **stream );
+extern void qusb_stream_destroy ( struct qusb_stream *stream );
+extern int qusb_stream_start ( struct qusb_stream *stream );
+extern void qusb_stream_stop ( struct qusb_stream *stream );
+extern int qusb_stream_running ( struct qusb_stream *stream );
+extern struct qusb_block * qusb_stream_get_block ( struct qusb_stream *stream );
+extern int qusb_stream_submit ( struct qusb_block *block );
+extern void qusb_block_release ( struct qusb_block *block );
+extern void qusb_stream_stats ( struct qusb_stream *stream,
+				struct qusb_stream_stats *stats );
+
+/*
+ * NUMA placement: a stream's pool is placed on its board's node (that
+ * of the host controller, unless changed in the driver's numa_node
+ * attribute).  Completions are processed by the thread running the
+ * loop, and (for the kernel driver) by io_uring's workers; both may
+ * be bound to a CPU list such as "0-3,8", or to the board's CPUs.
+ */
+extern int qusb_numa_node ( struct qusb_device *dev );
+extern int qusb_loop_bind ( struct qusb_loop *loop, const char *cpus );
+extern int qusb_loop_bind_local ( struct qusb_loop *loop,
+				  struct qusb_device *dev );
+
+/****************************************************************************
+ *
+ * File writer
+ *
+ * An io_uring of its own, for a thread that writes blocks to a file
+ * (typically opened with O_DIRECT) several at a time, as a capture's
+ * writer does.  qusb_writer_write() queues a write, up to depth of
+ * them outstanding; qusb_writer_submit() submits what is queued, and
+ * waits up to timeout_ms (0: not at all, -1: indefinitely) for a
+ * completion; qusb_writer_reap() takes one completion, returning 1,
+ * or 0 if there is none.
+ */
+
+struct qusb_writer;
+
+struct qusb_write_done {
+	uint64_t user_data;	/* As passed to qusb_writer_write() */
+	int32_t res;		/* Bytes written, or negative errno */
+};
+
+extern int qusb_writer_create ( unsigned int depth,
+				struct qusb_writer **writer );
+extern void qusb_writer_destroy ( struct qusb_writer *writer );
+extern int qusb_writer_write ( struct qusb_writer *writer, int fd,
+			       const void *data, size_t len, uint64_t offset,
+			       uint64_t user_data );
+extern int qusb_writer_submit ( struct qusb_writer *writer, int timeout_ms );
+extern int qusb_writer_reap ( struct qusb_writer *writer,
+			      struct qusb_write_done *done );
+
+/****************************************************************************
+ *
+ * Utilities shared by the tools
+ *
+ */
+
+/* CLOCK_MONOTONIC, in microseconds */
+extern double qusb_now_us ( void );
+/* A size such as "4096", "0x1000", "64k", "16M" or "2G" */
+extern unsigned long long qusb_parse_size ( const char *arg );
+
+/****************************************************************************
+ *
+ * Sample compression
+ *
+ * Delta, zigzag and bit-packing of 16-bit little-endian samples (see
+ * libquickusb_pack.c).  Calls are independent, and may run in parallel.
+ */
+
+extern size_t qusb_pack16_bound ( size_t len );
+extern ssize_t qusb_pack16 ( const void *in, size_t len, void *out,
+			     size_t max );
+extern ssize_t qusb_unpack16 ( const void *in, size_t packed, void *out,
+			       size_t len );
+
+/****************************************************************************
+ *
+ * Sample conversion
+ *
+ * Vectorised conversions of 16-bit little-endian samples (see
+ * libquickusb_convert.c), with the SIMD instructions chosen at run
+ * time; QUSB_CONVERT=scalar (etc.) in the environment overrides them.
+ */
+
+extern int qusb_convert_select ( const char *isa );
+extern const char * qusb_convert_isa ( void );
+extern void qusb_swap16 ( const void *in, void *out, size_t samples );
+extern void qusb_split8 ( const void *in, uint8_t *b, uint8_t *d,
+			  size_t samples );
+extern int qusb_sext16 ( const void *in, int16_t *out, size_t samples,
+			 unsigned int bits );
+extern int qusb_float16 ( const void *in, float *out, size_t samples,
+			  unsigned int bits, float scale );
+
+#define QUSB_STATS_MAX_CHANNELS		8
+
+/* Per channel */
+struct qusb_stats16 {
+	uint64_t count;			/* Samples */
+	int32_t min;
+	int32_t max;
+	int64_t sum;
+	uint64_t sumsq;			/* Sum of squares */
+};
+
+extern int qusb_stats16 ( const void *in, size_t samples,
+			  unsigned int channels, int is_signed,
+			  struct qusb_stats16 *stats );
+
+/****************************************************************************
+ *
+ * Capture files
+ *
+ * A capture file (as written by qusb-capture) is a header block, then
+ * blocks of HSPIO data, then an index.  Every block begins with a
+ * struct qusb_file_block giving its position in the data stream and
+ * the time it was read, followed by the data; the remainder (after the
+ * first stored bytes) is padding.  Blocks are block_size bytes, at
+ * ( header_size + ( N * block_size ) ), unless the file is packed
+ * (QUSB_FILE_PACKED), when each block's data is compressed with
+ * qusb_pack16() and the block is only as large as it needs to be.
+ * Sizes and offsets are multiples of QUSB_FILE_ALIGN, for O_DIRECT.
+ * Fields are little-endian.
+ *
+ * The index is written when the file is closed: one entry per block,
+ * so that a reader can binary-search it without touching the data.  A
+ * file without an index (the capture was interrupted) can still be
+ * searched, via the block headers (a packed one after a scan of them).
+ */
+
+#define QUSB_FILE_MAGIC			0x46435551	/* "QUCF" */
+#define QUSB_FILE_VERSION		1
+#define QUSB_FILE_ALIGN			4096
+#define QUSB_FILE_HEADER_SIZE		QUSB_FILE_ALIGN
+
+#define QUSB_FILE_SETTINGS	0x0001	/* Board settings were recorded */
+#define QUSB_FILE_PACKED	0x0002	/* Blocks are compressed */
+
+struct qusb_file_header {
+	uint32_t magic;			/* QUSB_FILE_MAGIC */
+	uint16_t version;		/* QUSB_FILE_VERSION */
+	uint16_t flags;			/* QUSB_FILE_xxx */
+	uint32_t header_size;		/* Offset of the first block */
+	uint32_t block_size;		/* Including the block header (or the
+					 * largest, if packed) */
+	uint32_t board;
+	uint16_t fifoconfig;		/* QUICKUSB_SETTING_FIFOCONFIG */
+	uint8_t gppio_outputs[QUSB_MAX_GPPIO];
+	uint8_t gppio_levels[QUSB_MAX_GPPIO];
+	uint64_t start_ns;		/* CLOCK_REALTIME at capture start */
+	uint64_t index_offset;		/* 0 if there is no index */
+	uint64_t index_count;		/* Blocks indexed */
+};
+
+#define QUSB_FILE_BLOCK_MAGIC		0x42435551	/* "QUCB" */
+#define QUSB_FILE_BLOCK_HEADER_SIZE	64
+
+#define QUSB_FILE_BLOCK_GAP	0x0001	/* Data was lost before this block */
+#define QUSB_FILE_BLOCK_PACKED	0x0002	/* Data is qusb_pack16()ed */
+
+struct qusb_file_block {
+	uint32_t magic;			/* QUSB_FILE_BLOCK_MAGIC */
+	uint32_t flags;			/* QUSB_FILE_BLOCK_xxx */
+	uint64_t sequence;		/* Block number within the stream */
+	uint64_t offset;		/* Stream byte offset of the data */
+	uint64_t timestamp_ns;		/* CLOCK_REALTIME when read */
+	uint32_t length;		/* Bytes of data */
+	uint32_t stored;		/* Bytes stored (length, unless packed) */
+	uint32_t board;			/* In a striped capture */
+	uint32_t reserved[5];
+};
+
+struct qusb_file_index_entry {
+	uint64_t offset;
+	uint64_t timestamp_ns;
+	uint64_t position;		/* File offset of the block */
+};
+
+struct qusb_file;
+
+extern int qusb_file_header_init ( struct qusb_device *dev,
+				   struct qusb_file_header *header,
+				   uint32_t block_size );
+
+extern int qusb_file_open ( const char *path, struct qusb_file **file );
+extern void qusb_file_close ( struct qusb_file *file );
+extern const struct qusb_file_header *
+qusb_file_header ( struct qusb_file *file );
+extern uint64_t qusb_file_blocks ( struct qusb_file *file );
+extern int qusb_file_indexed ( struct qusb_file *file );
+extern const struct qusb_file_block *
+qusb_file_block ( struct qusb_file *file, uint64_t block );
+extern const void * qusb_file_data ( const struct qusb_file_block *block );
+extern ssize_t qusb_file_unpack ( const struct qusb_file_block *block,
+				  void *data );
+extern int64_t qusb_file_seek_time ( struct qusb_file *file,
+				     uint64_t timestamp_ns );
+extern int64_t qusb_file_seek_offset ( struct qusb_file *file,
+				       uint64_t offset );
+
+/****************************************************************************
+ *
+ * Striped captures
+ *
+ * qusb-stripe captures several boards at once, striping their blocks
+ * across several disks (targets): each target holds one stripe file,
+ * a capture file header (QUSB_FILE_STRIPED, board the target number)
+ * followed by whole blocks, of any of the boards, in the order that
+ * target was given them.  The manifest records where each block went:
+ * a struct qusb_stripe_manifest, then one struct qusb_stripe_entry per
+ * block, appended as each write completes, so an interrupted capture
+ * still has a manifest of every block on disk.
+ *
+ * qusb_stripe_open() gathers one board's blocks from the stripe files,
+ * in order, as a struct qusb_file: the qusb_file_xxx() functions then
+ * read it as if it were a capture file of that board alone.
+ */
+
+#define QUSB_FILE_STRIPED	0x0004	/* A stripe file, of several boards */
+
+#define QUSB_STRIPE_MAGIC		0x4d435551	/* "QUCM" */
+#define QUSB_STRIPE_VERSION		1
+#define QUSB_STRIPE_MAX_BOARDS		16
+#define QUSB_STRIPE_MAX_TARGETS		16
+#define QUSB_STRIPE_PATH_MAX		256
+
+struct qusb_stripe_manifest {
+	uint32_t magic;			/* QUSB_STRIPE_MAGIC */
+	uint16_t version;		/* QUSB_STRIPE_VERSION */
+	uint16_t flags;
+	uint32_t header_size;		/* Offset of the first entry */
+	uint32_t block_size;		/* Of every block, in every file */
+	uint32_t boards;
+	uint32_t targets;
+	uint64_t start_ns;		/* CLOCK_REALTIME at capture start */
+	/* Each board's settings, as the capture started */
+	struct qusb_file_header board[QUSB_STRIPE_MAX_BOARDS];
+	/* Stripe file names (absolute), NUL-terminated */
+	char target[QUSB_STRIPE_MAX_TARGETS][QUSB_STRIPE_PATH_MAX];
+};
+
+struct qusb_stripe_entry {
+	uint32_t board;			/* Index in board[] */
+	uint32_t target;		/* Index in target[] */
+	uint64_t sequence;		/* Block number within the board's stream */
+	uint64_t offset;		/* Stream byte offset of the data */
+	uint64_t timestamp_ns;
+	uint64_t position;		/* File offset of the block */
+};
+
+extern int qusb_stripe_open ( const char *manifest, unsigned int board,
+			      struct qusb_file **file );
+
+/****************************************************************************
+ *
+ * Capture ring
+ *
+ * A reader thread, qusb_ring_reader(), reads a board (or a file) into
+ * a ring of nblocks fixed-size blocks, each a struct qusb_file_block
+ * (if header_size is QUSB_FILE_BLOCK_HEADER_SIZE) followed by the data,
+ * publishing head after each one; the consumer frees blocks in order
+ * with qusb_ring_release().  A board has a FIFO to overflow, so when
+ * the ring is full its reader keeps reading, discards the data (into
+ * scratch) and counts it as dropped, flagging the next block kept as
+ * QUSB_FILE_BLOCK_GAP; a file has not, so its reader waits instead.
+ * The caller fills in the configuration and zeroes the rest, starts
+ * the thread, and to stop it calls qusb_ring_stop() and then signals
+ * the thread (with a handler, but no SA_RESTART) to interrupt a read.
+ */
+
+struct qusb_ring {
+	/* Configuration */
+	struct qusb_device *dev;	/* Or NULL to read input_fd */
+	int input_fd;
+	unsigned char *blocks;		/* nblocks of block_size bytes */
+	unsigned char *scratch;		/* One block, discarded */
+	size_t *lengths;		/* Per block: data bytes, or NULL */
+	uint64_t *offsets;		/* Per block: stream offset, or NULL */
+	unsigned int nblocks;
+	size_t block_size;
+	size_t header_size;		/* Before the data: 0, or
+					 * QUSB_FILE_BLOCK_HEADER_SIZE */
+	uint32_t board;			/* In the block headers */
+	int pad;			/* Zero the rest of a short block */
+	uint64_t limit_bytes;		/* Stop after this many, or 0 */
+	/* Reader */
+	uint64_t head;			/* Blocks kept */
+	uint64_t sequence;		/* Blocks read, including dropped */
+	uint64_t bytes_read;
+	uint64_t bytes_dropped;
+	unsigned int fill_max;		/* Most blocks in the ring */
+	int gap;			/* Dropped since the last block kept */
+	int done;			/* The reader has finished */
+	int error;			/* Negative errno, if it failed */
+	uint32_t waiting;		/* For room in the ring */
+	/* Consumer */
+	uint64_t tail;			/* Blocks released */
+	uint32_t space_futex;		/* Bumped as blocks are released */
+	int stop;
+};
+
+extern unsigned char * qusb_ring_block ( struct qusb_ring *ring,
+					 uint64_t block );
+extern void * qusb_ring_reader ( void *ring );
+extern void qusb_ring_release ( struct qusb_ring *ring, uint64_t tail );
+extern void qusb_ring_stop ( struct qusb_ring *ring );
+
+/****************************************************************************
+ *
+ * Live capture statistics
+ *
+ * qusb-capture -S NAME publishes statistics of the data it captures in
+ * the POSIX shared memory object /NAME (/dev/shm/NAME), rewritten at a
+ * fixed rate: per channel, the minimum, maximum, mean, variance and a
+ * histogram (of the top 8 bits) over the last interval, and a rolling
+ * decimated preview, each point the minimum and maximum of
+ * preview_samples samples from stream offset .offset.
+ *
+ * The object is a seqlock: sequence is odd while it is being rewritten.
+ * Readers copy it, and retry if sequence was odd or changed meanwhile.
+ * Values are raw 16-bit sample codes (signed if QUSB_STATS_SIGNED).
+ */
+
+#define QUSB_STATS_MAGIC		0x53435551	/* "QUCS" */
+#define QUSB_STATS_VERSION		1
+#define QUSB_STATS_BINS			256
+#define QUSB_STATS_PREVIEW		1024
+
+#define QUSB_STATS_SIGNED	0x0001	/* Samples are two's complement */
+
+struct qusb_stats_channel {
+	int32_t min;
+	int32_t max;
+	double mean;
+	double variance;
+	uint32_t histogram[QUSB_STATS_BINS];	/* By ( code ^ 0x8000 ) >> 8 if
+						 * signed, else code >> 8 */
+};
+
+struct qusb_stats_point {
+	uint64_t offset;
+	int32_t min[QUSB_STATS_MAX_CHANNELS];
+	int32_t max[QUSB_STATS_MAX_CHANNELS];
+};
+
+struct qusb_stats_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sequence;		/* Odd while being rewritten */
+	uint32_t flags;
+	uint32_t channels;
+	uint32_t preview_samples;	/* Per point, per channel */
+	uint64_t updated_ns;		/* CLOCK_REALTIME */
+	uint64_t interval_ns;		/* Covered by channel[] */
+	uint64_t samples;		/* Per channel, in the interval */
+	uint64_t blocks;		/* Analysed, in all */
+	uint64_t blocks_skipped;	/* Not analysed, falling behind */
+	uint64_t bytes_read;		/* By the capture, in all */
+	uint64_t bytes_dropped;
+	uint64_t preview_count;		/* Points, in all: the newest is at
+					 * ( ( preview_count - 1 ) %
+					 *   QUSB_STATS_PREVIEW ) */
+	struct qusb_stats_channel channel[QUSB_STATS_MAX_CHANNELS];
+	struct qusb_stats_point preview[QUSB_STATS_PREVIEW];
+};
+
+/****************************************************************************
+ *
+ * Stream verification
+ *
+ * Checks a stream of 16-bit little-endian words against a test pattern
+ * (see libquickusb_verify.c), reporting each gap, duplicate and damaged
+ * word with its stream offset.  Counts are of words, except that with
+ * QUSB_PATTERN_CRC gaps and duplicates are counted in frames.
+ */
+
+/* Galois LFSR: next = ( word >> 1 ) ^ ( ( word & 1 ) ? QUSB_LFSR_TAPS : 0 ) */
+#define QUSB_LFSR_TAPS		0xb400	/* x^16 + x^14 + x^13 + x^11 + 1 */
+
+enum qusb_verify_pattern {
+	QUSB_PATTERN_COUNTER,	/* Each word one more than the last */
+	QUSB_PATTERN_LFSR,	/* Each word the next LFSR state */
+	QUSB_PATTERN_CRC,	/* Frames: counter, data, CRC-16/CCITT */
+};
+
+/* Event types */
+#define QUSB_VERIFY_GAP		0	/* count words (frames) missing */
+#define QUSB_VERIFY_DUPLICATE	1	/* count words (frames) repeated */
+#define QUSB_VERIFY_FLIP	2	/* One word, one bit wrong */
+#define QUSB_VERIFY_CORRUPT	3	/* One word, count bits wrong */
+#define QUSB_VERIFY_CRC		4	/* One frame: expected, actual CRC */
+#define QUSB_VERIFY_SYNC	5	/* count words without a frame */
+
+struct qusb_verify_event {
+	unsigned int type;
+	uint64_t offset;		/* Of the word (frame) */
+	uint64_t count;
+	uint16_t expected;
+	uint16_t actual;
+};
+
+struct qusb_verify_stats {
+	uint64_t words;			/* Checked */
+	uint64_t gaps;
+	uint64_t lost;			/* Words (frames) in gaps */
+	uint64_t duplicates;
+	uint64_t repeated;		/* Words (frames) in duplicates */
+	uint64_t flips;
+	uint64_t corrupt;
+	uint64_t frames;		/* Good */
+	uint64_t crc_errors;
+	uint64_t resyncs;
+	uint64_t skipped;		/* Bytes, by qusb_verify_skip() */
+};
+
+struct qusb_verify;
+
+extern int qusb_verify_parse ( const char *spec,
+			       enum qusb_verify_pattern *pattern,
+			       unsigned int *frame_words );
+extern int qusb_verify_create ( enum qusb_verify_pattern pattern,
+				unsigned int frame_words,
+				void ( * report ) ( void *priv,
+						    const struct qusb_verify_event
+						    *event ),
+				void *priv, struct qusb_verify **verify );
+extern void qusb_verify_destroy ( struct qusb_verify *verify );
+extern void qusb_verify_data ( struct qusb_verify *verify, const void *data,
+			       size_t len );
+extern void qusb_verify_skip ( struct qusb_verify *verify, uint64_t len );
+extern void qusb_verify_finish ( struct qusb_verify *verify );
+extern const struct qusb_verify_stats *
+qusb_verify_stats ( struct qusb_verify *verify );
+extern const char * qusb_verify_event_name ( unsigned int type );
+
+/****************************************************************************
+ *
+ * Daemon clients
+ *
+ * qusbd holds every board open, and serves clients over a Unix
+ * (SOCK_SEQPACKET) socket, QUSBD_SOCKET unless $QUSBD_SOCKET is set.
+ * A client submits batches of setting and GPPIO operations, which the
+ * daemon runs back to back with those of other clients, answering
+ * repeated configuration reads from one transfer (see qusbd).  A client may also
+ * attach to a board's HSPIO data, in either direction, through a ring
+ * of blocks in shared memory (see libquickusb_client.c).
+ */
+
+#define QUSBD_SOCKET		"/run/qusbd.sock"
+#define QUSBD_MAGIC		0x44535551	/* "QUSD" */
+#define QUSBD_VERSION		1
+#define QUSBD_MAX_OPS		256
+
+/* Messages (each answered by a message of the same type) */
+#define QUSBD_MSG_BATCH		1	/* Followed by count qusbd_ops */
+#define QUSBD_MSG_STREAM	2	/* Answered with the ring's fds */
+#define QUSBD_MSG_CLOSE		3	/* Detach from a stream */
+
+struct qusbd_msg {
+	uint32_t magic;		/* QUSBD_MAGIC */
+	uint16_t version;	/* QUSBD_VERSION */
+	uint16_t type;		/* QUSBD_MSG_xxx */
+	uint32_t board;
+	int32_t status;		/* Answer: 0 or negative errno */
+	uint32_t count;		/* Batch: operations following */
+	uint32_t direction;	/* Stream: enum qusb_direction */
+	uint32_t block_size;	/* Stream: bytes per block */
+	uint32_t blocks;	/* Stream: blocks in the ring */
+};
+
+/* Operations in a batch */
+#define QUSBD_GET_SETTING		1
+#define QUSBD_SET_SETTING		2
+#define QUSBD_GET_OUTPUTS		3
+#define QUSBD_SET_OUTPUTS		4
+#define QUSBD_GET_DEFAULT_OUTPUTS	5
+#define QUSBD_SET_DEFAULT_OUTPUTS	6
+#define QUSBD_GET_DEFAULT_LEVELS	7
+#define QUSBD_SET_DEFAULT_LEVELS	8
+#define QUSBD_GPPIO_READ		9
+#define QUSBD_GPPIO_WRITE		10
+
+struct qusbd_op {
+	uint16_t type;		/* QUSBD_xxx */
+	uint16_t address;	/* Setting address, or GPPIO port */
+	uint16_t value;		/* To set, or answered by a get */
+	uint16_t reserved;
+	int32_t status;		/* Answer: 0 or negative errno */
+};
+
+/*
+ * A stream ring is a memfd shared with the daemon: this header, then
+ * the length of each slot, then (from data_offset) the slots of
+ * block_size bytes.  The producer (the daemon for QUSB_IN, else the
+ * client) fills slot ( head % blocks ) and advances head; the consumer
+ * empties slot ( tail % blocks ) and advances tail.  Each side then
+ * signals the other's eventfd.  The daemon never waits for an IN
+ * client: a block that finds the ring full is dropped, and counted.
+ */
+
+#define QUSBD_RING_MAGIC	0x52535551	/* "QUSR" */
+
+struct qusbd_ring {
+	uint32_t magic;		/* QUSBD_RING_MAGIC */
+	uint32_t direction;	/* enum qusb_direction */
+	uint32_t block_size;
+	uint32_t blocks;
+	uint64_t data_offset;
+	int32_t status;		/* Set by the daemon: negative errno once
+				 * the stream has failed or shut down */
+	uint32_t reserved;
+	uint64_t dropped;	/* QUSB_IN blocks lost to a full ring */
+	uint64_t head __attribute__ (( aligned ( 64 ) ));
+	uint64_t tail __attribute__ (( aligned ( 64 ) ));
+	uint32_t len[] __attribute__ (( aligned ( 64 ) ));
+};
+
+struct qusbd_client;
+struct qusbd_stream;
+
+extern int qusbd_connect ( const char *path, struct qusbd_client **client );
+extern void qusbd_disconnect ( struct qusbd_client *client );
+extern int qusbd_batch ( struct qusbd_client *client, unsigned int board,
+			 struct qusbd_op *ops, unsigned int count );
+extern int qusbd_stream_open ( struct qusbd_client *client,
+			       unsigned int board,
+			       enum qusb_direction direction,
+			       size_t block_size, unsigned int blocks,
+			       struct qusbd_stream **stream );
+extern void qusbd_stream_close ( struct qusbd_stream *stream );
+extern int qusbd_stream_fd ( struct qusbd_stream *stream );
+extern int qusbd_stream_acquire ( struct qusbd_stream *stream, void **data,
+				  size_t *len, int timeout_ms );
+extern void qusbd_stream_release ( struct qusbd_stream *stream, size_t len );
+extern uint64_t qusbd_stream_dropped ( struct qusbd_stream *stream );
+
+/****************************************************************************
+ *
+ * Shared-memory fan-out
+ *
+ * One producer (e.g. qusb-fanout, reading a board) publishes blocks
+ * into a ring in the POSIX shared memory object /NAME; any number of
+ * consumer processes attach by name, each with its own cursor, and
+ * read the blocks in place, without locks (see libquickusb_fanout.c).
+ * A QUSB_FANOUT_BLOCK consumer holds the producer back when it falls a
+ * whole ring behind; a QUSB_FANOUT_DROP consumer is lapped, and skips
+ * ahead, counting the blocks it missed.
+ */
+
+#define QUSB_FANOUT_MAX_CONSUMERS	64
+
+enum qusb_fanout_policy {
+	QUSB_FANOUT_DROP,	/* Skip what the producer overwrites */
+	QUSB_FANOUT_BLOCK,	/* Make the producer wait */
+};
+
+struct qusb_fanout_consumer {
+	uint32_t pid;
+	uint32_t policy;		/* enum qusb_fanout_policy */
+	uint64_t lag;			/* Blocks published, not yet read */
+	uint64_t consumed;		/* Blocks read */
+	uint64_t dropped;		/* Blocks missed */
+};
+
+struct qusb_fanout_stats {
+	uint32_t block_size;
+	uint32_t blocks;		/* In the ring */
+	uint32_t producer_pid;
+	int32_t status;			/* Negative errno once stopped */
+	uint64_t published;		/* Blocks, in all */
+	uint64_t stalls;		/* Waits for a BLOCK consumer */
+	unsigned int consumers;
+	struct qusb_fanout_consumer consumer[QUSB_FANOUT_MAX_CONSUMERS];
+};
+
+struct qusb_fanout;
+struct qusb_fanout_reader;
+
+extern int qusb_fanout_create ( const char *name, size_t block_size,
+				unsigned int blocks,
+				struct qusb_fanout **fanout );
+extern void qusb_fanout_destroy ( struct qusb_fanout *fanout );
+extern int qusb_fanout_get_block ( struct qusb_fanout *fanout, void **data );
+extern void qusb_fanout_publish ( struct qusb_fanout *fanout, size_t len );
+extern int qusb_fanout_wait ( struct qusb_fanout *fanout, int timeout_ms );
+
+extern int qusb_fanout_attach ( const char *name,
+				enum qusb_fanout_policy policy,
+				struct qusb_fanout_reader **reader );
+extern void qusb_fanout_detach ( struct qusb_fanout_reader *reader );
+extern int qusb_fanout_acquire ( struct qusb_fanout_reader *reader,
+				 const void **data, size_t *len,
+				 int timeout_ms );
+extern int qusb_fanout_release ( struct qusb_fanout_reader *reader );
+extern void qusb_fanout_reader_stats ( struct qusb_fanout_reader *reader,
+				       struct qusb_fanout_consumer *consumer );
+extern int qusb_fanout_stats ( const char *name,
+			       struct qusb_fanout_stats *stats );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBQUICKUSB_H */
@@ -0,0 +1,389 @@
+/*
+ * libquickusb - qusbd clients
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "libquickusb_internal.h"
+
+struct qusbd_client {
+	int fd;
+};
+
+struct qusbd_stream {
+	struct qusbd_client *client;
+	unsigned int board;
+	struct qusbd_ring *ring;
+	size_t map_size;
+	/* Signalled by the daemon, and by us for it */
+	int wait_fd;
+	int notify_fd;
+	unsigned int producer;
+	/* Slot acquired and not yet released */
+	int held;
+};
+
+/****************************************************************************
+ *
+ * Connection
+ *
+ */
+
+int qusbd_connect ( const char *path, struct qusbd_client **client ) {
+	struct sockaddr_un addr;
+	struct qusbd_client *c;
+	int rc;
+
+	if ( ! path )
+		path = getenv ( "QUSBD_SOCKET" );
+	if ( ! path )
+		path = QUSBD_SOCKET;
+	if ( strlen ( path ) >= sizeof ( addr.sun_path ) )
+		return -ENAMETOOLONG;
+
+	if ( ! ( c = calloc ( 1, sizeof ( *c ) ) ) )
+		return -ENOMEM;
+	if ( ( c->fd = socket ( AF_UNIX, ( SOCK_SEQPACKET | SOCK_CLOEXEC ),
+				0 ) ) < 0 ) {
+		rc = -errno;
+		goto err_socket;
+	}
+	memset ( &addr, 0, sizeof ( addr ) );
+	addr.sun_family = AF_UNIX;
+	strcpy ( addr.sun_path, path );
+	if ( connect ( c->fd, ( struct sockaddr * ) &addr,
+		       sizeof ( addr ) ) < 0 ) {
+		rc = -errno;
+		goto err_connect;
+	}
+
+	*client = c;
+	return 0;
+
+ err_connect:
+	close ( c->fd );
+ err_socket:
+	free ( c );
+	return rc;
+}
+
+void qusbd_disconnect ( struct qusbd_client *client ) {
+	close ( client->fd );
+	free ( client );
+}
+
+/**
+ * qusbd_call - send a request and receive its answer
+ *
+ * @client: Client
+ * @msg: Request, overwritten by the answer
+ * @ops: Operations following the message, overwritten by the answer
+ * @fds: File descriptors passed with the answer, or NULL
+ * @nfds: Number of file descriptors expected
+ *
+ * Returns the answer's status, or a negative errno
+ */
+static int qusbd_call ( struct qusbd_client *client, struct qusbd_msg *msg,
+			struct qusbd_op *ops, int *fds, unsigned int nfds ) {
+	union {
+		struct cmsghdr cmsg;
+		char buf[CMSG_SPACE ( 4 * sizeof ( int ) )];
+	} control;
+	struct iovec iov[2];
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	size_t ops_len = ( msg->count * sizeof ( ops[0] ) );
+	uint16_t type = msg->type;
+	ssize_t len;
+
+	msg->magic = QUSBD_MAGIC;
+	msg->version = QUSBD_VERSION;
+	msg->status = 0;
+	iov[0].iov_base = msg;
+	iov[0].iov_len = sizeof ( *msg );
+	iov[1].iov_base = ops;
+	iov[1].iov_len = ops_len;
+	memset ( &mh, 0, sizeof ( mh ) );
+	mh.msg_iov = iov;
+	mh.msg_iovlen = ( ops_len ? 2 : 1 );
+	if ( sendmsg ( client->fd, &mh, MSG_NOSIGNAL ) < 0 )
+		return -errno;
+
+	memset ( &mh, 0, sizeof ( mh ) );
+	mh.msg_iov = iov;
+	mh.msg_iovlen = ( ops_len ? 2 : 1 );
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof ( control.buf );
+	do {
+		len = recvmsg ( client->fd, &mh, MSG_CMSG_CLOEXEC );
+	} while ( ( len < 0 ) && ( errno == EINTR ) );
+	if ( len < 0 )
+		return -errno;
+	if ( len == 0 )
+		return -ECONNRESET;
+	if ( ( len < ( ssize_t ) sizeof ( *msg ) ) ||
+	     ( msg->magic != QUSBD_MAGIC ) || ( msg->type != type ) ||
+	     ( ( msg->status == 0 ) &&
+	       ( len != ( ssize_t ) ( sizeof ( *msg ) + ops_len ) ) ) )
+		return -EPROTO;
+
+	for ( cmsg = CMSG_FIRSTHDR ( &mh ) ; cmsg ;
+	      cmsg = CMSG_NXTHDR ( &mh, cmsg ) ) {
+		if ( ( cmsg->cmsg_level != SOL_SOCKET ) ||
+		     ( cmsg->cmsg_type != SCM_RIGHTS ) )
+			continue;
+		if ( fds && ( msg->status == 0 ) &&
+		     ( cmsg->cmsg_len == CMSG_LEN ( nfds * sizeof ( int ) ) ) ) {
+			memcpy ( fds, CMSG_DATA ( cmsg ),
+				 ( nfds * sizeof ( int ) ) );
+			fds = NULL;
+		} else {
+			/* Unexpected: don't leak them */
+			int *extra = ( int * ) CMSG_DATA ( cmsg );
+			size_t n = ( ( cmsg->cmsg_len - CMSG_LEN ( 0 ) ) /
+				     sizeof ( int ) );
+
+			while ( n-- )
+				close ( extra[n] );
+		}
+	}
+	if ( fds && ( msg->status == 0 ) )
+		return -EPROTO;
+
+	return msg->status;
+}
+
+/****************************************************************************
+ *
+ * Batches
+ *
+ */
+
+/**
+ * qusbd_batch - run setting and GPPIO operations on a board
+ *
+ * @client: Client
+ * @board: Board number
+ * @ops: Operations, answered in place
+ * @count: Number of operations (at most QUSBD_MAX_OPS)
+ *
+ * The operations run in order, each with its own status.  The first
+ * to fail stops the batch: those after it are not run, and are
+ * answered with -ECANCELED.  Returns 0 if the batch was run,
+ * or a negative errno (e.g. -ENODEV for a board the daemon lacks).
+ */
+int qusbd_batch ( struct qusbd_client *client, unsigned int board,
+		  struct qusbd_op *ops, unsigned int count ) {
+	struct qusbd_msg msg;
+
+	if ( count > QUSBD_MAX_OPS )
+		return -E2BIG;
+
+	memset ( &msg, 0, sizeof ( msg ) );
+	msg.type = QUSBD_MSG_BATCH;
+	msg.board = board;
+	msg.count = count;
+	return qusbd_call ( client, &msg, ops, NULL, 0 );
+}
+
+/****************************************************************************
+ *
+ * Streams
+ *
+ */
+
+/**
+ * qusbd_stream_open - attach to a board's HSPIO data
+ *
+ * @client: Client
+ * @board: Board number
+ * @direction: QUSB_IN to read from the board, QUSB_OUT to write to it
+ * @block_size: Bytes per block (a multiple of 512)
+ * @blocks: Blocks in the ring
+ * @stream: Stream to fill in
+ *
+ * An IN stream starts at once.  Only one client may hold each
+ * direction of a board at a time (-EBUSY).
+ */
+int qusbd_stream_open ( struct qusbd_client *client, unsigned int board,
+			enum qusb_direction direction, size_t block_size,
+			unsigned int blocks, struct qusbd_stream **stream ) {
+	struct qusbd_stream *s;
+	struct qusbd_msg msg;
+	int fds[3];
+	int rc;
+
+	if ( block_size > UINT32_MAX )
+		return -EINVAL;
+
+	memset ( &msg, 0, sizeof ( msg ) );
+	msg.type = QUSBD_MSG_STREAM;
+	msg.board = board;
+	msg.direction = direction;
+	msg.block_size = block_size;
+	msg.blocks = blocks;
+	if ( ( rc = qusbd_call ( client, &msg, NULL, fds, 3 ) ) != 0 )
+		return rc;
+
+	if ( ! ( s = calloc ( 1, sizeof ( *s ) ) ) ) {
+		rc = -ENOMEM;
+		goto err_alloc;
+	}
+	s->map_size = ( msg.block_size * ( size_t ) msg.blocks );
+	s->ring = mmap ( NULL, sizeof ( *s->ring ), PROT_READ, MAP_SHARED,
+			 fds[0], 0 );
+	if ( s->ring == MAP_FAILED ) {
+		rc = -errno;
+		goto err_map;
+	}
+	s->map_size += s->ring->data_offset;
+	munmap ( s->ring, sizeof ( *s->ring ) );
+	s->ring = mmap ( NULL, s->map_size, ( PROT_READ | PROT_WRITE ),
+			 MAP_SHARED, fds[0], 0 );
+	if ( s->ring == MAP_FAILED ) {
+		rc = -errno;
+		goto err_map;
+	}
+	if ( s->ring->magic != QUSBD_RING_MAGIC ) {
+		rc = -EPROTO;
+		goto err_magic;
+	}
+	close ( fds[0] );
+	s->wait_fd = fds[1];
+	s->notify_fd = fds[2];
+	s->producer = ( direction == QUSB_OUT );
+	s->client = client;
+	s->board = board;
+
+	*stream = s;
+	return 0;
+
+ err_magic:
+	munmap ( s->ring, s->map_size );
+ err_map:
+	free ( s );
+ err_alloc:
+	close ( fds[0] );
+	close ( fds[1] );
+	close ( fds[2] );
+	return rc;
+}
+
+/* Streams are also closed when their client disconnects */
+void qusbd_stream_close ( struct qusbd_stream *stream ) {
+	struct qusbd_msg msg;
+
+	memset ( &msg, 0, sizeof ( msg ) );
+	msg.type = QUSBD_MSG_CLOSE;
+	msg.board = stream->board;
+	msg.direction = ( stream->producer ? QUSB_OUT : QUSB_IN );
+	qusbd_call ( stream->client, &msg, NULL, NULL, 0 );
+	close ( stream->wait_fd );
+	close ( stream->notify_fd );
+	munmap ( stream->ring, stream->map_size );
+	free ( stream );
+}
+
+/* Readable when qusbd_stream_acquire() might succeed */
+int qusbd_stream_fd ( struct qusbd_stream *stream ) {
+	return stream->wait_fd;
+}
+
+/**
+ * qusbd_stream_acquire - take the next block
+ *
+ * @stream: Stream
+ * @data: Block data
+ * @len: Bytes of data (IN), or space for data (OUT)
+ * @timeout_ms: Time to wait: 0 to poll, -1 forever
+ *
+ * For an IN stream, the next filled block; for an OUT stream, the next
+ * free one.  Hand it back with qusbd_stream_release().  Returns 1 for
+ * a block, 0 on timeout, or the daemon's negative errno once the
+ * stream has ended (-ESHUTDOWN if the daemon is stopping).
+ */
+int qusbd_stream_acquire ( struct qusbd_stream *stream, void **data,
+			   size_t *len, int timeout_ms ) {
+	struct qusbd_ring *ring = stream->ring;
+	struct pollfd pfd = { .fd = stream->wait_fd, .events = POLLIN };
+	uint64_t head;
+	uint64_t tail;
+	uint64_t count;
+	unsigned int slot;
+	int status;
+	int rc;
+
+	while ( 1 ) {
+		head = __atomic_load_n ( &ring->head, __ATOMIC_ACQUIRE );
+		tail = __atomic_load_n ( &ring->tail, __ATOMIC_ACQUIRE );
+		if ( stream->producer ? ( ( head - tail ) < ring->blocks ) :
+		     ( head != tail ) )
+			break;
+		if ( ( status = __atomic_load_n ( &ring->status,
+						  __ATOMIC_ACQUIRE ) ) != 0 )
+			return status;
+		do {
+			rc = poll ( &pfd, 1, timeout_ms );
+		} while ( ( rc < 0 ) && ( errno == EINTR ) );
+		if ( rc < 0 )
+			return -errno;
+		if ( rc == 0 )
+			return 0;
+		if ( read ( stream->wait_fd, &count, sizeof ( count ) ) < 0 &&
+		     ( errno != EAGAIN ) )
+			return -errno;
+	}
+
+	slot = ( ( stream->producer ? head : tail ) % ring->blocks );
+	*data = ( ( ( uint8_t * ) ring ) + ring->data_offset +
+		  ( slot * ( size_t ) ring->block_size ) );
+	*len = ( stream->producer ? ring->block_size : ring->len[slot] );
+	stream->held = 1;
+	return 1;
+}
+
+/**
+ * qusbd_stream_release - hand back the block taken
+ *
+ * @stream: Stream
+ * @len: OUT: bytes to write (at most block_size); ignored for IN
+ */
+void qusbd_stream_release ( struct qusbd_stream *stream, size_t len ) {
+	struct qusbd_ring *ring = stream->ring;
+	uint64_t one = 1;
+
+	if ( ! stream->held )
+		return;
+	stream->held = 0;
+	if ( stream->producer ) {
+		ring->len[ ring->head % ring->blocks ] =
+			( ( len < ring->block_size ) ? len : ring->block_size );
+		__atomic_store_n ( &ring->head, ( ring->head + 1 ),
+				   __ATOMIC_RELEASE );
+	} else {
+		__atomic_store_n ( &ring->tail, ( ring->tail + 1 ),
+				   __ATOMIC_RELEASE );
+	}
+	if ( write ( stream->notify_fd, &one, sizeof ( one ) ) < 0 ) {
+		/* The daemon also checks the ring whenever it runs */
+	}
+}
+
+uint64_t qusbd_stream_dropped ( struct qusbd_stream *stream ) {
+	return __atomic_load_n ( &stream->ring->dropped, __ATOMIC_RELAXED );
+}
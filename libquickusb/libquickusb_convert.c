@@ -0,0 +1,1002 @@
+/*
+ * libquickusb - conversion of 16-bit sample streams
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+/*
+ * HSPIO data is a stream of 16-bit little-endian words.  These convert
+ * it to what programs usually want: byte-swapped words, the two byte
+ * lanes split apart (when the port carries two 8-bit ports, B in the
+ * low byte and D in the high), N-bit two's complement samples sign
+ * extended, or scaled floats; or summarises it, as the minimum,
+ * maximum, sum and sum of squares of each of its interleaved channels.
+ *
+ * Each conversion has a scalar version, which works on any host and
+ * any alignment, and SSE2, AVX2 and NEON versions which do the bulk of
+ * the work and leave the last few samples to the scalar one.  The best
+ * set the CPU supports is chosen on first use, unless QUSB_CONVERT in
+ * the environment (or qusb_convert_select) names one.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined ( __x86_64__ ) || defined ( __i386__ )
+#define QUSB_CONVERT_X86
+#include <immintrin.h>
+#endif
+
+#if defined ( __aarch64__ ) && ( __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ )
+#define QUSB_CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+#include "libquickusb_internal.h"
+
+/* Per-lane results of a SIMD pass of qusb_stats16(): lane i has every
+ * ( lanes )'th sample from the i'th, biased to be signed */
+struct qusb_stats_lanes {
+	unsigned int lanes;
+	size_t done;			/* Samples, a multiple of lanes */
+	int16_t min[16];
+	int16_t max[16];
+	int64_t sum[16];
+	uint64_t sumsq[16];
+};
+
+/* Vector iterations between flushes of 32-bit sums: < 2^31 / 2^15 */
+#define QUSB_STATS_FLUSH	32768
+
+struct qusb_convert_ops {
+	const char *name;
+	int ( * supported ) ( void );
+	void ( * swap16 ) ( const uint8_t *in, uint8_t *out, size_t samples );
+	void ( * split8 ) ( const uint8_t *in, uint8_t *b, uint8_t *d,
+			    size_t samples );
+	void ( * sext16 ) ( const uint8_t *in, int16_t *out, size_t samples,
+			    unsigned int bits );
+	void ( * float16 ) ( const uint8_t *in, float *out, size_t samples,
+			     unsigned int bits, float scale );
+	void ( * stats16 ) ( const uint8_t *in, size_t samples, uint16_t bias,
+			     struct qusb_stats_lanes *lanes );
+	size_t ( * match16 ) ( const uint8_t *in, size_t samples,
+			       unsigned int pattern );
+};
+
+/****************************************************************************
+ *
+ * Scalar
+ *
+ */
+
+static int scalar_supported ( void ) {
+	return 1;
+}
+
+static void scalar_swap16 ( const uint8_t *in, uint8_t *out,
+			    size_t samples ) {
+	uint8_t lo;
+	size_t i;
+
+	for ( i = 0 ; i < samples ; i++ ) {
+		lo = in[0];
+		out[0] = in[1];
+		out[1] = lo;
+		in += 2;
+		out += 2;
+	}
+}
+
+static void scalar_split8 ( const uint8_t *in, uint8_t *b, uint8_t *d,
+			    size_t samples ) {
+	size_t i;
+
+	for ( i = 0 ; i < samples ; i++ ) {
+		b[i] = in[0];
+		d[i] = in[1];
+		in += 2;
+	}
+}
+
+static void scalar_sext16 ( const uint8_t *in, int16_t *out, size_t samples,
+			    unsigned int bits ) {
+	unsigned int shift = ( 16 - bits );
+	uint16_t word;
+	size_t i;
+
+	for ( i = 0 ; i < samples ; i++ ) {
+		word = ( in[0] | ( in[1] << 8 ) );
+		out[i] = ( ( int16_t ) ( uint16_t ) ( word << shift ) >> shift );
+		in += 2;
+	}
+}
+
+static void scalar_float16 ( const uint8_t *in, float *out, size_t samples,
+			     unsigned int bits, float scale ) {
+	unsigned int shift = ( 16 - bits );
+	uint16_t word;
+	size_t i;
+
+	for ( i = 0 ; i < samples ; i++ ) {
+		word = ( in[0] | ( in[1] << 8 ) );
+		if ( bits ) {
+			out[i] = ( ( ( int16_t ) ( uint16_t ) ( word << shift ) >>
+				     shift ) * scale );
+		} else {
+			out[i] = ( word * scale );
+		}
+		in += 2;
+	}
+}
+
+/* Leaves all the samples to qusb_stats16() */
+static void scalar_stats16 ( const uint8_t *in, size_t samples, uint16_t bias,
+			     struct qusb_stats_lanes *lanes ) {
+	lanes->lanes = 1;
+	lanes->done = 0;
+}
+
+static inline uint16_t qusb_match_next ( uint16_t word,
+					 unsigned int pattern ) {
+	if ( pattern == QUSB_MATCH_LFSR )
+		return ( ( word >> 1 ) ^ ( ( word & 1 ) ? QUSB_LFSR_TAPS : 0 ) );
+	return ( word + 1 );
+}
+
+static size_t scalar_match16 ( const uint8_t *in, size_t samples,
+			       unsigned int pattern ) {
+	uint16_t prev;
+	uint16_t word;
+	size_t i;
+
+	if ( ! samples )
+		return 0;
+	prev = ( in[0] | ( in[1] << 8 ) );
+	for ( i = 1 ; i < samples ; i++ ) {
+		word = ( in[2 * i] | ( in[( 2 * i ) + 1] << 8 ) );
+		if ( word != qusb_match_next ( prev, pattern ) )
+			break;
+		prev = word;
+	}
+	return i;
+}
+
+static const struct qusb_convert_ops qusb_convert_scalar = {
+	.name = "scalar",
+	.supported = scalar_supported,
+	.swap16 = scalar_swap16,
+	.split8 = scalar_split8,
+	.sext16 = scalar_sext16,
+	.float16 = scalar_float16,
+	.stats16 = scalar_stats16,
+	.match16 = scalar_match16,
+};
+
+/****************************************************************************
+ *
+ * SSE2 and AVX2
+ *
+ * Built with target attributes, so the library itself needs no -m
+ * flags and runs on any x86; they are only called if the CPU has them.
+ */
+
+#ifdef QUSB_CONVERT_X86
+
+#define SSE2 __attribute__ (( target ( "sse2" ) ))
+#define AVX2 __attribute__ (( target ( "avx2" ) ))
+
+static int sse2_supported ( void ) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports ( "sse2" );
+}
+
+static SSE2 void sse2_swap16 ( const uint8_t *in, uint8_t *out,
+			       size_t samples ) {
+	__m128i v;
+	size_t i;
+
+	for ( i = 0 ; ( i + 8 ) <= samples ; i += 8 ) {
+		v = _mm_loadu_si128 ( ( const __m128i * ) ( in + ( 2 * i ) ) );
+		v = _mm_or_si128 ( _mm_slli_epi16 ( v, 8 ),
+				   _mm_srli_epi16 ( v, 8 ) );
+		_mm_storeu_si128 ( ( __m128i * ) ( out + ( 2 * i ) ), v );
+	}
+	scalar_swap16 ( ( in + ( 2 * i ) ), ( out + ( 2 * i ) ),
+			( samples - i ) );
+}
+
+static SSE2 void sse2_split8 ( const uint8_t *in, uint8_t *b, uint8_t *d,
+			       size_t samples ) {
+	__m128i mask = _mm_set1_epi16 ( 0x00ff );
+	__m128i v0, v1;
+	size_t i;
+
+	for ( i = 0 ; ( i + 16 ) <= samples ; i += 16 ) {
+		v0 = _mm_loadu_si128 ( ( const __m128i * ) ( in + ( 2 * i ) ) );
+		v1 = _mm_loadu_si128 ( ( const __m128i * )
+				       ( in + ( 2 * i ) + 16 ) );
+		_mm_storeu_si128 ( ( __m128i * ) ( b + i ),
+				   _mm_packus_epi16 ( _mm_and_si128 ( v0, mask ),
+						      _mm_and_si128 ( v1, mask ) ) );
+		_mm_storeu_si128 ( ( __m128i * ) ( d + i ),
+				   _mm_packus_epi16 ( _mm_srli_epi16 ( v0, 8 ),
+						      _mm_srli_epi16 ( v1, 8 ) ) );
+	}
+	scalar_split8 ( ( in + ( 2 * i ) ), ( b + i ), ( d + i ),
+			( samples - i ) );
+}
+
+static SSE2 void sse2_sext16 ( const uint8_t *in, int16_t *out,
+			       size_t samples, unsigned int bits ) {
+	__m128i shift = _mm_cvtsi32_si128 ( 16 - bits );
+	__m128i v;
+	size_t i;
+
+	for ( i = 0 ; ( i + 8 ) <= samples ; i += 8 ) {
+		v = _mm_loadu_si128 ( ( const __m128i * ) ( in + ( 2 * i ) ) );
+		v = _mm_sra_epi16 ( _mm_sll_epi16 ( v, shift ), shift );
+		_mm_storeu_si128 ( ( __m128i * ) ( out + i ), v );
+	}
+	scalar_sext16 ( ( in + ( 2 * i ) ), ( out + i ), ( samples - i ),
+			bits );
+}
+
+static SSE2 void sse2_float16 ( const uint8_t *in, float *out, size_t samples,
+				unsigned int bits, float scale ) {
+	__m128i shift = _mm_cvtsi32_si128 ( 16 - bits );
+	__m128i zero = _mm_setzero_si128();
+	__m128 mul = _mm_set1_ps ( scale );
+	__m128i v, lo, hi;
+	size_t i;
+
+	for ( i = 0 ; ( i + 8 ) <= samples ; i += 8 ) {
+		v = _mm_loadu_si128 ( ( const __m128i * ) ( in + ( 2 * i ) ) );
+		if ( bits ) {
+			v = _mm_sra_epi16 ( _mm_sll_epi16 ( v, shift ), shift );
+			lo = _mm_srai_epi32 ( _mm_unpacklo_epi16 ( v, v ), 16 );
+			hi = _mm_srai_epi32 ( _mm_unpackhi_epi16 ( v, v ), 16 );
+		} else {
+			lo = _mm_unpacklo_epi16 ( v, zero );
+			hi = _mm_unpackhi_epi16 ( v, zero );
+		}
+		_mm_storeu_ps ( ( out + i ),
+				_mm_mul_ps ( _mm_cvtepi32_ps ( lo ), mul ) );
+		_mm_storeu_ps ( ( out + i + 4 ),
+				_mm_mul_ps ( _mm_cvtepi32_ps ( hi ), mul ) );
+	}
+	scalar_float16 ( ( in + ( 2 * i ) ), ( out + i ), ( samples - i ),
+			 bits, scale );
+}
+
+static SSE2 void sse2_stats16 ( const uint8_t *in, size_t samples,
+				uint16_t bias, struct qusb_stats_lanes *lanes ) {
+	__m128i xor = _mm_set1_epi16 ( bias );
+	__m128i zero = _mm_setzero_si128();
+	__m128i min = _mm_set1_epi16 ( INT16_MAX );
+	__m128i max = _mm_set1_epi16 ( INT16_MIN );
+	/* 64-bit accumulators of samples 0-1, 2-3, 4-5 and 6-7 */
+	__m128i sum[4] = { zero, zero, zero, zero };
+	__m128i sumsq[4] = { zero, zero, zero, zero };
+	__m128i sum32[2];
+	__m128i v, lo, hi, sq, sign;
+	size_t i = 0;
+	size_t end;
+	unsigned int k;
+
+	while ( ( i + 8 ) <= samples ) {
+		sum32[0] = sum32[1] = zero;
+		end = ( i + ( 8 * QUSB_STATS_FLUSH ) );
+		for ( ; ( ( i + 8 ) <= samples ) && ( i < end ) ; i += 8 ) {
+			v = _mm_loadu_si128 ( ( const __m128i * )
+					      ( in + ( 2 * i ) ) );
+			v = _mm_xor_si128 ( v, xor );
+			min = _mm_min_epi16 ( min, v );
+			max = _mm_max_epi16 ( max, v );
+			sum32[0] = _mm_add_epi32 ( sum32[0], _mm_srai_epi32 (
+				_mm_unpacklo_epi16 ( v, v ), 16 ) );
+			sum32[1] = _mm_add_epi32 ( sum32[1], _mm_srai_epi32 (
+				_mm_unpackhi_epi16 ( v, v ), 16 ) );
+			/* Squares are at most 2^30: 32 bits, unsigned */
+			lo = _mm_mullo_epi16 ( v, v );
+			hi = _mm_mulhi_epi16 ( v, v );
+			sq = _mm_unpacklo_epi16 ( lo, hi );
+			sumsq[0] = _mm_add_epi64 ( sumsq[0],
+					_mm_unpacklo_epi32 ( sq, zero ) );
+			sumsq[1] = _mm_add_epi64 ( sumsq[1],
+					_mm_unpackhi_epi32 ( sq, zero ) );
+			sq = _mm_unpackhi_epi16 ( lo, hi );
+			sumsq[2] = _mm_add_epi64 ( sumsq[2],
+					_mm_unpacklo_epi32 ( sq, zero ) );
+			sumsq[3] = _mm_add_epi64 ( sumsq[3],
+					_mm_unpackhi_epi32 ( sq, zero ) );
+		}
+		/* Sign-extend the 32-bit sums into the 64-bit ones */
+		for ( k = 0 ; k < 2 ; k++ ) {
+			sign = _mm_srai_epi32 ( sum32[k], 31 );
+			sum[2 * k] = _mm_add_epi64 ( sum[2 * k],
+				_mm_unpacklo_epi32 ( sum32[k], sign ) );
+			sum[( 2 * k ) + 1] = _mm_add_epi64 ( sum[( 2 * k ) + 1],
+				_mm_unpackhi_epi32 ( sum32[k], sign ) );
+		}
+	}
+
+	lanes->lanes = 8;
+	lanes->done = i;
+	_mm_storeu_si128 ( ( __m128i * ) lanes->min, min );
+	_mm_storeu_si128 ( ( __m128i * ) lanes->max, max );
+	for ( k = 0 ; k < 4 ; k++ ) {
+		_mm_storeu_si128 ( ( __m128i * ) &lanes->sum[2 * k], sum[k] );
+		_mm_storeu_si128 ( ( __m128i * ) &lanes->sumsq[2 * k],
+				   sumsq[k] );
+	}
+}
+
+static SSE2 size_t sse2_match16 ( const uint8_t *in, size_t samples,
+				  unsigned int pattern ) {
+	__m128i one = _mm_set1_epi16 ( 1 );
+	__m128i taps = _mm_set1_epi16 ( ( int16_t ) QUSB_LFSR_TAPS );
+	__m128i zero = _mm_setzero_si128();
+	__m128i prev, cur, next;
+	unsigned int mask;
+	size_t i;
+
+	/* Each word against the successor of the one before */
+	for ( i = 1 ; ( i + 8 ) <= samples ; i += 8 ) {
+		prev = _mm_loadu_si128 ( ( const __m128i * )
+					 ( in + ( 2 * i ) - 2 ) );
+		cur = _mm_loadu_si128 ( ( const __m128i * ) ( in + ( 2 * i ) ) );
+		if ( pattern == QUSB_MATCH_LFSR ) {
+			next = _mm_xor_si128 ( _mm_srli_epi16 ( prev, 1 ),
+				_mm_and_si128 ( taps, _mm_sub_epi16 ( zero,
+					_mm_and_si128 ( prev, one ) ) ) );
+		} else {
+			next = _mm_add_epi16 ( prev, one );
+		}
+		mask = _mm_movemask_epi8 ( _mm_cmpeq_epi16 ( cur, next ) );
+		if ( mask != 0xffff )
+			return ( i + ( __builtin_ctz ( ~mask ) / 2 ) );
+	}
+	if ( i >= samples )
+		return samples;
+	return ( ( i - 1 ) + scalar_match16 ( ( in + ( 2 * ( i - 1 ) ) ),
+					      ( samples - ( i - 1 ) ),
+					      pattern ) );
+}
+
+static const struct qusb_convert_ops qusb_convert_sse2 = {
+	.name = "sse2",
+	.supported = sse2_supported,
+	.swap16 = sse2_swap16,
+	.split8 = sse2_split8,
+	.sext16 = sse2_sext16,
+	.float16 = sse2_float16,
+	.stats16 = sse2_stats16,
+	.match16 = sse2_match16,
+};
+
+static int avx2_supported ( void ) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports ( "avx2" );
+}
+
+static AVX2 void avx2_swap16 ( const uint8_t *in, uint8_t *out,
+			       size_t samples ) {
+	__m256i v;
+	size_t i;
+
+	for ( i = 0 ; ( i + 16 ) <= samples ; i += 16 ) {
+		v = _mm256_loadu_si256 ( ( const __m256i * )
+					 ( in + ( 2 * i ) ) );
+		v = _mm256_or_si256 ( _mm256_slli_epi16 ( v, 8 ),
+				      _mm256_srli_epi16 ( v, 8 ) );
+		_mm256_storeu_si256 ( ( __m256i * ) ( out + ( 2 * i ) ), v );
+	}
+	scalar_swap16 ( ( in + ( 2 * i ) ), ( out + ( 2 * i ) ),
+			( samples - i ) );
+}
+
+static AVX2 void avx2_split8 ( const uint8_t *in, uint8_t *b, uint8_t *d,
+			       size_t samples ) {
+	__m256i mask = _mm256_set1_epi16 ( 0x00ff );
+	__m256i v0, v1, lo, hi;
+	size_t i;
+
+	for ( i = 0 ; ( i + 32 ) <= samples ; i += 32 ) {
+		v0 = _mm256_loadu_si256 ( ( const __m256i * )
+					  ( in + ( 2 * i ) ) );
+		v1 = _mm256_loadu_si256 ( ( const __m256i * )
+					  ( in + ( 2 * i ) + 32 ) );
+		lo = _mm256_packus_epi16 ( _mm256_and_si256 ( v0, mask ),
+					   _mm256_and_si256 ( v1, mask ) );
+		hi = _mm256_packus_epi16 ( _mm256_srli_epi16 ( v0, 8 ),
+					   _mm256_srli_epi16 ( v1, 8 ) );
+		/* Packing works within 128-bit lanes: put them back in order */
+		_mm256_storeu_si256 ( ( __m256i * ) ( b + i ),
+				      _mm256_permute4x64_epi64 ( lo, 0xd8 ) );
+		_mm256_storeu_si256 ( ( __m256i * ) ( d + i ),
+				      _mm256_permute4x64_epi64 ( hi, 0xd8 ) );
+	}
+	scalar_split8 ( ( in + ( 2 * i ) ), ( b + i ), ( d + i ),
+			( samples - i ) );
+}
+
+static AVX2 void avx2_sext16 ( const uint8_t *in, int16_t *out,
+			       size_t samples, unsigned int bits ) {
+	__m128i shift = _mm_cvtsi32_si128 ( 16 - bits );
+	__m256i v;
+	size_t i;
+
+	for ( i = 0 ; ( i + 16 ) <= samples ; i += 16 ) {
+		v = _mm256_loadu_si256 ( ( const __m256i * )
+					 ( in + ( 2 * i ) ) );
+		v = _mm256_sra_epi16 ( _mm256_sll_epi16 ( v, shift ), shift );
+		_mm256_storeu_si256 ( ( __m256i * ) ( out + i ), v );
+	}
+	scalar_sext16 ( ( in + ( 2 * i ) ), ( out + i ), ( samples - i ),
+			bits );
+}
+
+static AVX2 void avx2_float16 ( const uint8_t *in, float *out, size_t samples,
+				unsigned int bits, float scale ) {
+	__m128i shift = _mm_cvtsi32_si128 ( 16 - bits );
+	__m256 mul = _mm256_set1_ps ( scale );
+	__m128i v0, v1;
+	__m256i lo, hi;
+	size_t i;
+
+	for ( i = 0 ; ( i + 16 ) <= samples ; i += 16 ) {
+		v0 = _mm_loadu_si128 ( ( const __m128i * ) ( in + ( 2 * i ) ) );
+		v1 = _mm_loadu_si128 ( ( const __m128i * )
+				       ( in + ( 2 * i ) + 16 ) );
+		if ( bits ) {
+			v0 = _mm_sra_epi16 ( _mm_sll_epi16 ( v0, shift ), shift );
+			v1 = _mm_sra_epi16 ( _mm_sll_epi16 ( v1, shift ), shift );
+			lo = _mm256_cvtepi16_epi32 ( v0 );
+			hi = _mm256_cvtepi16_epi32 ( v1 );
+		} else {
+			lo = _mm256_cvtepu16_epi32 ( v0 );
+			hi = _mm256_cvtepu16_epi32 ( v1 );
+		}
+		_mm256_storeu_ps ( ( out + i ),
+				   _mm256_mul_ps ( _mm256_cvtepi32_ps ( lo ),
+						   mul ) );
+		_mm256_storeu_ps ( ( out + i + 8 ),
+				   _mm256_mul_ps ( _mm256_cvtepi32_ps ( hi ),
+						   mul ) );
+	}
+	scalar_float16 ( ( in + ( 2 * i ) ), ( out + i ), ( samples - i ),
+			 bits, scale );
+}
+
+static AVX2 void avx2_stats16 ( const uint8_t *in, size_t samples,
+				uint16_t bias, struct qusb_stats_lanes *lanes ) {
+	__m256i xor = _mm256_set1_epi16 ( bias );
+	__m256i zero = _mm256_setzero_si256();
+	__m256i min = _mm256_set1_epi16 ( INT16_MAX );
+	__m256i max = _mm256_set1_epi16 ( INT16_MIN );
+	/* 64-bit accumulators of samples 0-3, 4-7, 8-11 and 12-15 */
+	__m256i sum[4] = { zero, zero, zero, zero };
+	__m256i sumsq[4] = { zero, zero, zero, zero };
+	__m256i sum32[2];
+	__m256i v, w, sq;
+	size_t i = 0;
+	size_t end;
+	unsigned int k;
+
+	while ( ( i + 16 ) <= samples ) {
+		sum32[0] = sum32[1] = zero;
+		end = ( i + ( 16 * QUSB_STATS_FLUSH ) );
+		for ( ; ( ( i + 16 ) <= samples ) && ( i < end ) ; i += 16 ) {
+			v = _mm256_loadu_si256 ( ( const __m256i * )
+						 ( in + ( 2 * i ) ) );
+			v = _mm256_xor_si256 ( v, xor );
+			min = _mm256_min_epi16 ( min, v );
+			max = _mm256_max_epi16 ( max, v );
+			for ( k = 0 ; k < 2 ; k++ ) {
+				w = _mm256_cvtepi16_epi32 ( k ?
+					_mm256_extracti128_si256 ( v, 1 ) :
+					_mm256_castsi256_si128 ( v ) );
+				sum32[k] = _mm256_add_epi32 ( sum32[k], w );
+				/* At most 2^30: 32 bits, unsigned */
+				sq = _mm256_mullo_epi32 ( w, w );
+				sumsq[2 * k] = _mm256_add_epi64 ( sumsq[2 * k],
+					_mm256_cvtepu32_epi64 (
+						_mm256_castsi256_si128 ( sq ) ) );
+				sumsq[( 2 * k ) + 1] = _mm256_add_epi64 (
+					sumsq[( 2 * k ) + 1],
+					_mm256_cvtepu32_epi64 (
+						_mm256_extracti128_si256 ( sq, 1 ) ) );
+			}
+		}
+		for ( k = 0 ; k < 2 ; k++ ) {
+			sum[2 * k] = _mm256_add_epi64 ( sum[2 * k],
+				_mm256_cvtepi32_epi64 (
+					_mm256_castsi256_si128 ( sum32[k] ) ) );
+			sum[( 2 * k ) + 1] = _mm256_add_epi64 ( sum[( 2 * k ) + 1],
+				_mm256_cvtepi32_epi64 (
+					_mm256_extracti128_si256 ( sum32[k], 1 ) ) );
+		}
+	}
+
+	lanes->lanes = 16;
+	lanes->done = i;
+	_mm256_storeu_si256 ( ( __m256i * ) lanes->min, min );
+	_mm256_storeu_si256 ( ( __m256i * ) lanes->max, max );
+	for ( k = 0 ; k < 4 ; k++ ) {
+		_mm256_storeu_si256 ( ( __m256i * ) &lanes->sum[4 * k], sum[k] );
+		_mm256_storeu_si256 ( ( __m256i * ) &lanes->sumsq[4 * k],
+				      sumsq[k] );
+	}
+}
+
+static AVX2 size_t avx2_match16 ( const uint8_t *in, size_t samples,
+				  unsigned int pattern ) {
+	__m256i one = _mm256_set1_epi16 ( 1 );
+	__m256i taps = _mm256_set1_epi16 ( ( int16_t ) QUSB_LFSR_TAPS );
+	__m256i zero = _mm256_setzero_si256();
+	__m256i prev, cur, next;
+	unsigned int mask;
+	size_t i;
+
+	for ( i = 1 ; ( i + 16 ) <= samples ; i += 16 ) {
+		prev = _mm256_loadu_si256 ( ( const __m256i * )
+					    ( in + ( 2 * i ) - 2 ) );
+		cur = _mm256_loadu_si256 ( ( const __m256i * )
+					   ( in + ( 2 * i ) ) );
+		if ( pattern == QUSB_MATCH_LFSR ) {
+			next = _mm256_xor_si256 ( _mm256_srli_epi16 ( prev, 1 ),
+				_mm256_and_si256 ( taps, _mm256_sub_epi16 ( zero,
+					_mm256_and_si256 ( prev, one ) ) ) );
+		} else {
+			next = _mm256_add_epi16 ( prev, one );
+		}
+		mask = _mm256_movemask_epi8 ( _mm256_cmpeq_epi16 ( cur, next ) );
+		if ( mask != 0xffffffff )
+			return ( i + ( __builtin_ctz ( ~mask ) / 2 ) );
+	}
+	if ( i >= samples )
+		return samples;
+	return ( ( i - 1 ) + scalar_match16 ( ( in + ( 2 * ( i - 1 ) ) ),
+					      ( samples - ( i - 1 ) ),
+					      pattern ) );
+}
+
+static const struct qusb_convert_ops qusb_convert_avx2 = {
+	.name = "avx2",
+	.supported = avx2_supported,
+	.swap16 = avx2_swap16,
+	.split8 = avx2_split8,
+	.sext16 = avx2_sext16,
+	.float16 = avx2_float16,
+	.stats16 = avx2_stats16,
+	.match16 = avx2_match16,
+};
+
+#endif /* QUSB_CONVERT_X86 */
+
+/****************************************************************************
+ *
+ * NEON
+ *
+ * Always present on 64-bit ARM.
+ */
+
+#ifdef QUSB_CONVERT_NEON
+
+static int neon_supported ( void ) {
+	return 1;
+}
+
+static void neon_swap16 ( const uint8_t *in, uint8_t *out, size_t samples ) {
+	size_t i;
+
+	for ( i = 0 ; ( i + 8 ) <= samples ; i += 8 ) {
+		vst1q_u8 ( ( out + ( 2 * i ) ),
+			   vrev16q_u8 ( vld1q_u8 ( in + ( 2 * i ) ) ) );
+	}
+	scalar_swap16 ( ( in + ( 2 * i ) ), ( out + ( 2 * i ) ),
+			( samples - i ) );
+}
+
+static void neon_split8 ( const uint8_t *in, uint8_t *b, uint8_t *d,
+			  size_t samples ) {
+	uint8x16x2_t v;
+	size_t i;
+
+	for ( i = 0 ; ( i + 16 ) <= samples ; i += 16 ) {
+		v = vld2q_u8 ( in + ( 2 * i ) );
+		vst1q_u8 ( ( b + i ), v.val[0] );
+		vst1q_u8 ( ( d + i ), v.val[1] );
+	}
+	scalar_split8 ( ( in + ( 2 * i ) ), ( b + i ), ( d + i ),
+			( samples - i ) );
+}
+
+static void neon_sext16 ( const uint8_t *in, int16_t *out, size_t samples,
+			  unsigned int bits ) {
+	int16x8_t left = vdupq_n_s16 ( 16 - bits );
+	int16x8_t right = vdupq_n_s16 ( - ( int ) ( 16 - bits ) );
+	int16x8_t v;
+	size_t i;
+
+	for ( i = 0 ; ( i + 8 ) <= samples ; i += 8 ) {
+		v = vreinterpretq_s16_u8 ( vld1q_u8 ( in + ( 2 * i ) ) );
+		v = vshlq_s16 ( vshlq_s16 ( v, left ), right );
+		vst1q_s16 ( ( out + i ), v );
+	}
+	scalar_sext16 ( ( in + ( 2 * i ) ), ( out + i ), ( samples - i ),
+			bits );
+}
+
+static void neon_float16 ( const uint8_t *in, float *out, size_t samples,
+			   unsigned int bits, float scale ) {
+	int16x8_t left = vdupq_n_s16 ( 16 - bits );
+	int16x8_t right = vdupq_n_s16 ( - ( int ) ( 16 - bits ) );
+	uint16x8_t u;
+	int16x8_t s;
+	size_t i;
+
+	for ( i = 0 ; ( i + 8 ) <= samples ; i += 8 ) {
+		u = vreinterpretq_u16_u8 ( vld1q_u8 ( in + ( 2 * i ) ) );
+		if ( bits ) {
+			s = vreinterpretq_s16_u16 ( u );
+			s = vshlq_s16 ( vshlq_s16 ( s, left ), right );
+			vst1q_f32 ( ( out + i ),
+				    vmulq_n_f32 ( vcvtq_f32_s32 (
+					vmovl_s16 ( vget_low_s16 ( s ) ) ),
+						  scale ) );
+			vst1q_f32 ( ( out + i + 4 ),
+				    vmulq_n_f32 ( vcvtq_f32_s32 (
+					vmovl_s16 ( vget_high_s16 ( s ) ) ),
+						  scale ) );
+		} else {
+			vst1q_f32 ( ( out + i ),
+				    vmulq_n_f32 ( vcvtq_f32_u32 (
+					vmovl_u16 ( vget_low_u16 ( u ) ) ),
+						  scale ) );
+			vst1q_f32 ( ( out + i + 4 ),
+				    vmulq_n_f32 ( vcvtq_f32_u32 (
+					vmovl_u16 ( vget_high_u16 ( u ) ) ),
+						  scale ) );
+		}
+	}
+	scalar_float16 ( ( in + ( 2 * i ) ), ( out + i ), ( samples - i ),
+			 bits, scale );
+}
+
+static void neon_stats16 ( const uint8_t *in, size_t samples, uint16_t bias,
+			   struct qusb_stats_lanes *lanes ) {
+	int16x8_t xor = vdupq_n_s16 ( ( int16_t ) bias );
+	int16x8_t min = vdupq_n_s16 ( INT16_MAX );
+	int16x8_t max = vdupq_n_s16 ( INT16_MIN );
+	/* 64-bit accumulators of samples 0-1, 2-3, 4-5 and 6-7 */
+	int64x2_t sum[4];
+	uint64x2_t sumsq[4];
+	int32x4_t sum32[2];
+	int16x8_t v;
+	uint32x4_t sq;
+	size_t i = 0;
+	size_t end;
+	unsigned int k;
+
+	for ( k = 0 ; k < 4 ; k++ ) {
+		sum[k] = vdupq_n_s64 ( 0 );
+		sumsq[k] = vdupq_n_u64 ( 0 );
+	}
+
+	while ( ( i + 8 ) <= samples ) {
+		sum32[0] = sum32[1] = vdupq_n_s32 ( 0 );
+		end = ( i + ( 8 * QUSB_STATS_FLUSH ) );
+		for ( ; ( ( i + 8 ) <= samples ) && ( i < end ) ; i += 8 ) {
+			v = vreinterpretq_s16_u8 ( vld1q_u8 ( in + ( 2 * i ) ) );
+			v = veorq_s16 ( v, xor );
+			min = vminq_s16 ( min, v );
+			max = vmaxq_s16 ( max, v );
+			sum32[0] = vaddw_s16 ( sum32[0], vget_low_s16 ( v ) );
+			sum32[1] = vaddw_s16 ( sum32[1], vget_high_s16 ( v ) );
+			/* Squares are at most 2^30: 32 bits, unsigned */
+			sq = vreinterpretq_u32_s32 ( vmull_s16 ( vget_low_s16 ( v ),
+								 vget_low_s16 ( v ) ) );
+			sumsq[0] = vaddw_u32 ( sumsq[0], vget_low_u32 ( sq ) );
+			sumsq[1] = vaddw_u32 ( sumsq[1], vget_high_u32 ( sq ) );
+			sq = vreinterpretq_u32_s32 ( vmull_s16 ( vget_high_s16 ( v ),
+								 vget_high_s16 ( v ) ) );
+			sumsq[2] = vaddw_u32 ( sumsq[2], vget_low_u32 ( sq ) );
+			sumsq[3] = vaddw_u32 ( sumsq[3], vget_high_u32 ( sq ) );
+		}
+		for ( k = 0 ; k < 2 ; k++ ) {
+			sum[2 * k] = vaddw_s32 ( sum[2 * k],
+						 vget_low_s32 ( sum32[k] ) );
+			sum[( 2 * k ) + 1] = vaddw_s32 ( sum[( 2 * k ) + 1],
+						       vget_high_s32 ( sum32[k] ) );
+		}
+	}
+
+	lanes->lanes = 8;
+	lanes->done = i;
+	vst1q_s16 ( lanes->min, min );
+	vst1q_s16 ( lanes->max, max );
+	for ( k = 0 ; k < 4 ; k++ ) {
+		vst1q_s64 ( &lanes->sum[2 * k], sum[k] );
+		vst1q_u64 ( &lanes->sumsq[2 * k], sumsq[k] );
+	}
+}
+
+static size_t neon_match16 ( const uint8_t *in, size_t samples,
+			     unsigned int pattern ) {
+	uint16x8_t one = vdupq_n_u16 ( 1 );
+	uint16x8_t taps = vdupq_n_u16 ( QUSB_LFSR_TAPS );
+	uint16x8_t prev, cur, next;
+	size_t i;
+
+	for ( i = 1 ; ( i + 8 ) <= samples ; i += 8 ) {
+		prev = vreinterpretq_u16_u8 ( vld1q_u8 ( in + ( 2 * i ) - 2 ) );
+		cur = vreinterpretq_u16_u8 ( vld1q_u8 ( in + ( 2 * i ) ) );
+		if ( pattern == QUSB_MATCH_LFSR ) {
+			next = veorq_u16 ( vshrq_n_u16 ( prev, 1 ),
+				vandq_u16 ( taps, vsubq_u16 ( vdupq_n_u16 ( 0 ),
+					vandq_u16 ( prev, one ) ) ) );
+		} else {
+			next = vaddq_u16 ( prev, one );
+		}
+		/* Find which, the slow way, only when one differs */
+		if ( vminvq_u16 ( vceqq_u16 ( cur, next ) ) != 0xffff )
+			break;
+	}
+	if ( i >= samples )
+		return samples;
+	return ( ( i - 1 ) + scalar_match16 ( ( in + ( 2 * ( i - 1 ) ) ),
+					      ( samples - ( i - 1 ) ),
+					      pattern ) );
+}
+
+static const struct qusb_convert_ops qusb_convert_neon = {
+	.name = "neon",
+	.supported = neon_supported,
+	.swap16 = neon_swap16,
+	.split8 = neon_split8,
+	.sext16 = neon_sext16,
+	.float16 = neon_float16,
+	.stats16 = neon_stats16,
+	.match16 = neon_match16,
+};
+
+#endif /* QUSB_CONVERT_NEON */
+
+/****************************************************************************
+ *
+ * Selection
+ *
+ */
+
+/* Best first */
+static const struct qusb_convert_ops *qusb_convert_all[] = {
+#ifdef QUSB_CONVERT_X86
+	&qusb_convert_avx2,
+	&qusb_convert_sse2,
+#endif
+#ifdef QUSB_CONVERT_NEON
+	&qusb_convert_neon,
+#endif
+	&qusb_convert_scalar,
+};
+
+#define QUSB_CONVERT_COUNT \
+	( sizeof ( qusb_convert_all ) / sizeof ( qusb_convert_all[0] ) )
+
+static const struct qusb_convert_ops *qusb_convert_ops;
+
+/* Find the named (or, for NULL, the best) supported set */
+static const struct qusb_convert_ops * qusb_convert_find ( const char *isa ) {
+	const struct qusb_convert_ops *ops;
+	unsigned int i;
+
+	for ( i = 0 ; i < QUSB_CONVERT_COUNT ; i++ ) {
+		ops = qusb_convert_all[i];
+		if ( isa && ( strcmp ( isa, ops->name ) != 0 ) )
+			continue;
+		if ( ops->supported() )
+			return ops;
+	}
+	return NULL;
+}
+
+static const struct qusb_convert_ops * qusb_convert ( void ) {
+	const struct qusb_convert_ops *ops;
+	const char *env;
+
+	/* Choosing twice at once is harmless: both choose the same */
+	ops = __atomic_load_n ( &qusb_convert_ops, __ATOMIC_ACQUIRE );
+	if ( ! ops ) {
+		env = getenv ( "QUSB_CONVERT" );
+		if ( ! ( env && ( ops = qusb_convert_find ( env ) ) ) )
+			ops = qusb_convert_find ( NULL );
+		__atomic_store_n ( &qusb_convert_ops, ops, __ATOMIC_RELEASE );
+	}
+	return ops;
+}
+
+/**
+ * qusb_convert_select - choose the conversion implementation
+ *
+ * @isa: "scalar", "sse2", "avx2" or "neon", or NULL for the best
+ *
+ * Returns -ENOTSUP if this build or CPU doesn't have it.  This affects
+ * all threads, so is for benchmarks and tests, before converting.
+ */
+int qusb_convert_select ( const char *isa ) {
+	const struct qusb_convert_ops *ops;
+
+	if ( ! ( ops = qusb_convert_find ( isa ) ) )
+		return -ENOTSUP;
+	__atomic_store_n ( &qusb_convert_ops, ops, __ATOMIC_RELEASE );
+	return 0;
+}
+
+/**
+ * qusb_convert_isa - name the conversion implementation in use
+ */
+const char * qusb_convert_isa ( void ) {
+	return qusb_convert()->name;
+}
+
+/****************************************************************************
+ *
+ * Conversions
+ *
+ * In each, @in is @samples 16-bit little-endian words, with any
+ * alignment.
+ */
+
+/**
+ * qusb_swap16 - byte-swap each word
+ *
+ * @in: Samples
+ * @out: Swapped samples (may be @in)
+ * @samples: Number of samples
+ */
+void qusb_swap16 ( const void *in, void *out, size_t samples ) {
+	qusb_convert()->swap16 ( in, out, samples );
+}
+
+/**
+ * qusb_split8 - de-interleave the two byte lanes
+ *
+ * @in: Samples
+ * @b: Low bytes (port B)
+ * @d: High bytes (port D)
+ * @samples: Number of samples
+ */
+void qusb_split8 ( const void *in, uint8_t *b, uint8_t *d, size_t samples ) {
+	qusb_convert()->split8 ( in, b, d, samples );
+}
+
+/**
+ * qusb_sext16 - sign-extend N-bit samples
+ *
+ * @in: Samples, two's complement in the low @bits bits
+ * @out: Sign-extended samples
+ * @samples: Number of samples
+ * @bits: Sample width, 1 to 16
+ */
+int qusb_sext16 ( const void *in, int16_t *out, size_t samples,
+		  unsigned int bits ) {
+	if ( ( bits < 1 ) || ( bits > 16 ) )
+		return -EINVAL;
+	qusb_convert()->sext16 ( in, out, samples, bits );
+	return 0;
+}
+
+/**
+ * qusb_float16 - convert samples to scaled floats
+ *
+ * @in: Samples
+ * @out: ( sample * @scale )
+ * @samples: Number of samples
+ * @bits: Width of two's complement samples (1 to 16), or 0 if unsigned
+ * @scale: Multiplier, e.g. volts per count
+ */
+int qusb_float16 ( const void *in, float *out, size_t samples,
+		   unsigned int bits, float scale ) {
+	if ( bits > 16 )
+		return -EINVAL;
+	qusb_convert()->float16 ( in, out, samples, bits, scale );
+	return 0;
+}
+
+/**
+ * qusb_stats16 - summarise interleaved channels
+ *
+ * @in: Samples, channel 0 first
+ * @samples: Number of samples, of all channels (at most 2^32)
+ * @channels: Interleaved channels: 1, 2, 4 or 8
+ * @is_signed: Samples are two's complement, rather than unsigned
+ * @stats: Results, per channel
+ *
+ * A channel with no samples has a minimum and maximum of 0.
+ */
+int qusb_stats16 ( const void *in, size_t samples, unsigned int channels,
+		   int is_signed, struct qusb_stats16 *stats ) {
+	const uint8_t *data = in;
+	uint16_t bias = ( is_signed ? 0 : 0x8000 );
+	struct qusb_stats_lanes lanes;
+	struct qusb_stats16 *st;
+	int16_t value;
+	unsigned int i;
+	size_t n;
+
+	if ( ( channels < 1 ) || ( channels > QUSB_STATS_MAX_CHANNELS ) ||
+	     ( QUSB_STATS_MAX_CHANNELS % channels ) )
+		return -EINVAL;
+
+	/* Accumulate as signed values, whatever they are */
+	for ( i = 0 ; i < channels ; i++ ) {
+		st = &stats[i];
+		memset ( st, 0, sizeof ( *st ) );
+		st->min = INT16_MAX;
+		st->max = INT16_MIN;
+	}
+
+	qusb_convert()->stats16 ( data, samples, bias, &lanes );
+	if ( lanes.done ) {
+		for ( i = 0 ; i < lanes.lanes ; i++ ) {
+			st = &stats[i % channels];
+			st->count += ( lanes.done / lanes.lanes );
+			if ( lanes.min[i] < st->min )
+				st->min = lanes.min[i];
+			if ( lanes.max[i] > st->max )
+				st->max = lanes.max[i];
+			st->sum += lanes.sum[i];
+			st->sumsq += lanes.sumsq[i];
+		}
+	}
+	for ( n = lanes.done ; n < samples ; n++ ) {
+		st = &stats[n % channels];
+		value = ( ( data[2 * n] | ( data[( 2 * n ) + 1] << 8 ) ) ^ bias );
+		st->count++;
+		if ( value < st->min )
+			st->min = value;
+		if ( value > st->max )
+			st->max = value;
+		st->sum += value;
+		st->sumsq += ( value * value );
+	}
+
+	for ( i = 0 ; i < channels ; i++ ) {
+		st = &stats[i];
+		if ( ! st->count ) {
+			st->min = st->max = 0;
+			continue;
+		}
+		if ( ! is_signed ) {
+			/* ( x + 2^15 )^2 = x^2 + 2^16 x + 2^30 */
+			st->sumsq += ( ( uint64_t ) ( st->sum * 65536 ) +
+				       ( st->count << 30 ) );
+			st->sum += ( st->count * 32768 );
+			st->min += 32768;
+			st->max += 32768;
+		}
+	}
+	return 0;
+}
+
+/*
+ * qusb_match16 - find the first word that doesn't follow its predecessor
+ *
+ * @in: Samples
+ * @samples: Number of samples
+ * @pattern: QUSB_MATCH_COUNTER (each is one more than the last) or
+ *	QUSB_MATCH_LFSR (each is the next state of the 16-bit LFSR)
+ *
+ * Returns the index of the word (from 1), or @samples if all follow.
+ */
+size_t qusb_match16 ( const void *in, size_t samples, unsigned int pattern ) {
+	return qusb_convert()->match16 ( in, samples, pattern );
+}
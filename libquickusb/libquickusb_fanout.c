@@ -0,0 +1,677 @@
+/*
+ * libquickusb - shared-memory fan-out of a stream
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+/*
+ * One producer publishes blocks into a ring in a POSIX shared memory
+ * object; any number of consumers (up to QUSB_FANOUT_MAX_CONSUMERS)
+ * attach to it by name, each with its own cursor, and read the blocks
+ * in place.  Nothing is locked: the producer alone writes the slots and
+ * advances head, each consumer alone advances its own tail.
+ *
+ * Each slot carries the sequence number of the block in it (plus one),
+ * or 0 while it is being rewritten.  The producer clears it before it
+ * reuses the slot, and sets it (with release ordering) before it
+ * advances head, so a consumer that finds the number it expects both
+ * before and after reading the data knows that the data was not
+ * overwritten meanwhile: a seqlock per slot.
+ *
+ * A consumer is either QUSB_FANOUT_BLOCK, which the producer never
+ * laps (it waits, and so eventually does the board, for the consumer
+ * to release the oldest block), or QUSB_FANOUT_DROP, which it laps
+ * freely: the consumer then skips to the oldest block still intact,
+ * and counts the rest as dropped.  A block overwritten while a DROP
+ * consumer held it is reported by qusb_fanout_release().
+ *
+ * Waiting is on futexes in the shared mapping, and only costs a system
+ * call on either side when the other is actually waiting.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "libquickusb_internal.h"
+
+#define FANOUT_MAGIC		0x46435551	/* "QUCF" */
+#define FANOUT_VERSION		1
+
+/* Consumers' producer checks, when waiting without a timeout (ms) */
+#define FANOUT_POLL_MS		1000
+
+/* Cursor states */
+#define CURSOR_FREE		0
+#define CURSOR_CLAIMED		1	/* Being attached */
+#define CURSOR_ACTIVE		2
+
+struct fanout_cursor {
+	uint32_t state;			/* CURSOR_xxx */
+	uint32_t policy;		/* enum qusb_fanout_policy */
+	uint32_t pid;
+	uint32_t reserved;
+	uint64_t tail;			/* Next block to read */
+	uint64_t consumed;
+	uint64_t dropped;
+} __attribute__ (( aligned ( 64 ) ));
+
+struct fanout_slot {
+	uint64_t seq;			/* Block number + 1; 0 while written */
+	uint32_t len;
+	uint32_t reserved;
+};
+
+struct fanout_shm {
+	uint32_t magic;			/* FANOUT_MAGIC */
+	uint32_t version;		/* FANOUT_VERSION */
+	uint32_t block_size;
+	uint32_t blocks;
+	uint32_t stride;		/* Between slots' data */
+	uint32_t cursors;
+	uint64_t data_offset;
+	uint32_t producer_pid;
+	int32_t status;			/* Negative errno once the producer
+					 * has stopped */
+	uint64_t stalls;		/* Waits for a BLOCK consumer */
+	/* Producer */
+	uint64_t head __attribute__ (( aligned ( 64 ) ));
+	uint32_t head_futex;		/* Bumped with each block */
+	uint32_t readers_waiting;
+	/* Consumers */
+	uint32_t space_futex __attribute__ (( aligned ( 64 ) ));
+	uint32_t producer_waiting;
+	struct fanout_cursor cursor[QUSB_FANOUT_MAX_CONSUMERS];
+	struct fanout_slot slot[];
+};
+
+struct qusb_fanout {
+	char name[NAME_MAX];
+	struct fanout_shm *shm;
+	size_t map_size;
+	unsigned char *data;
+	uint64_t head;
+	int stalled;			/* Waiting for a BLOCK consumer */
+};
+
+struct qusb_fanout_reader {
+	struct fanout_shm *shm;
+	size_t map_size;
+	unsigned char *data;
+	struct fanout_cursor *cursor;
+	uint64_t tail;
+	int held;
+};
+
+/* Futexes, also used by the capture ring (libquickusb_ring.c) */
+int qusb_futex_wait ( uint32_t *addr, uint32_t val, int timeout_ms ) {
+	struct timespec ts;
+
+	ts.tv_sec = ( timeout_ms / 1000 );
+	ts.tv_nsec = ( ( timeout_ms % 1000 ) * 1000000L );
+	if ( syscall ( SYS_futex, addr, FUTEX_WAIT, val,
+		       ( ( timeout_ms < 0 ) ? NULL : &ts ), NULL, 0 ) < 0 )
+		return -errno;
+	return 0;
+}
+
+void qusb_futex_wake ( uint32_t *addr, int count ) {
+	syscall ( SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0 );
+}
+
+/* The shared memory object name for @name ("/name") */
+static int fanout_path ( const char *name, char *path, size_t len ) {
+	if ( ( size_t ) snprintf ( path, len, "/%s", name ) >= len )
+		return -ENAMETOOLONG;
+	return 0;
+}
+
+static int pid_gone ( uint32_t pid ) {
+	return ( ( kill ( pid, 0 ) < 0 ) && ( errno == ESRCH ) );
+}
+
+/****************************************************************************
+ *
+ * Producer
+ *
+ */
+
+/**
+ * qusb_fanout_create - create a fan-out ring
+ *
+ * @name: Shared memory object name (without the leading '/')
+ * @block_size: Largest block
+ * @blocks: Blocks in the ring (at least 2)
+ * @fanout: Fan-out ring to fill in
+ *
+ * Replaces any ring of the same name.  Returns 0 or a negative errno.
+ */
+int qusb_fanout_create ( const char *name, size_t block_size,
+			 unsigned int blocks, struct qusb_fanout **fanout ) {
+	struct qusb_fanout *f;
+	struct fanout_shm *shm;
+	long page = sysconf ( _SC_PAGESIZE );
+	size_t stride = ( ( block_size + page - 1 ) & ~( page - 1 ) );
+	size_t header;
+	int fd;
+	int rc;
+
+	if ( ( block_size == 0 ) || ( block_size > UINT32_MAX ) ||
+	     ( blocks < 2 ) || ( blocks > ( UINT32_MAX / stride ) ) )
+		return -EINVAL;
+	if ( ! ( f = calloc ( 1, sizeof ( *f ) ) ) )
+		return -ENOMEM;
+	if ( ( rc = fanout_path ( name, f->name, sizeof ( f->name ) ) ) != 0 )
+		goto err_name;
+
+	header = ( sizeof ( *shm ) + ( blocks * sizeof ( shm->slot[0] ) ) );
+	header = ( ( header + page - 1 ) & ~( page - 1 ) );
+	f->map_size = ( header + ( ( size_t ) blocks * stride ) );
+
+	shm_unlink ( f->name );
+	if ( ( fd = shm_open ( f->name, ( O_RDWR | O_CREAT | O_EXCL ),
+			       0644 ) ) < 0 ) {
+		rc = -errno;
+		goto err_open;
+	}
+	if ( ftruncate ( fd, f->map_size ) < 0 ) {
+		rc = -errno;
+		close ( fd );
+		goto err_truncate;
+	}
+	shm = mmap ( NULL, f->map_size, ( PROT_READ | PROT_WRITE ),
+		     MAP_SHARED, fd, 0 );
+	close ( fd );
+	if ( shm == MAP_FAILED ) {
+		rc = -errno;
+		goto err_truncate;
+	}
+
+	/* Fresh from ftruncate(): all zero, so every cursor is free */
+	shm->block_size = block_size;
+	shm->blocks = blocks;
+	shm->stride = stride;
+	shm->cursors = QUSB_FANOUT_MAX_CONSUMERS;
+	shm->data_offset = header;
+	shm->producer_pid = getpid();
+	shm->version = FANOUT_VERSION;
+	__atomic_store_n ( &shm->magic, FANOUT_MAGIC, __ATOMIC_RELEASE );
+
+	f->shm = shm;
+	f->data = ( ( unsigned char * ) shm + header );
+	*fanout = f;
+	return 0;
+
+ err_truncate:
+	shm_unlink ( f->name );
+ err_open:
+ err_name:
+	free ( f );
+	return rc;
+}
+
+/**
+ * qusb_fanout_destroy - stop publishing, and remove the ring
+ *
+ * @fanout: Fan-out ring
+ *
+ * Attached consumers read what is left, then get -EPIPE.
+ */
+void qusb_fanout_destroy ( struct qusb_fanout *fanout ) {
+	struct fanout_shm *shm = fanout->shm;
+
+	__atomic_store_n ( &shm->status, -EPIPE, __ATOMIC_RELEASE );
+	__atomic_add_fetch ( &shm->head_futex, 1, __ATOMIC_SEQ_CST );
+	qusb_futex_wake ( &shm->head_futex, INT_MAX );
+	shm_unlink ( fanout->name );
+	munmap ( shm, fanout->map_size );
+	free ( fanout );
+}
+
+/* Is there room for block @head?  Frees the cursors of dead consumers */
+static int fanout_room ( struct qusb_fanout *fanout, uint64_t head ) {
+	struct fanout_shm *shm = fanout->shm;
+	struct fanout_cursor *cursor;
+	uint64_t tail;
+	unsigned int i;
+	uint32_t state;
+	int room = 1;
+
+	for ( i = 0 ; i < shm->cursors ; i++ ) {
+		cursor = &shm->cursor[i];
+		state = __atomic_load_n ( &cursor->state, __ATOMIC_SEQ_CST );
+		if ( state != CURSOR_ACTIVE )
+			continue;
+		tail = __atomic_load_n ( &cursor->tail, __ATOMIC_SEQ_CST );
+		if ( ( head - tail ) < shm->blocks )
+			continue;
+		/* A whole ring behind: blocking, or (once a lap) dead? */
+		if ( ( cursor->policy != QUSB_FANOUT_BLOCK ) &&
+		     ( head % shm->blocks ) )
+			continue;
+		if ( pid_gone ( cursor->pid ) ) {
+			__atomic_compare_exchange_n ( &cursor->state, &state,
+						      CURSOR_FREE, 0,
+						      __ATOMIC_SEQ_CST,
+						      __ATOMIC_RELAXED );
+			continue;
+		}
+		if ( cursor->policy == QUSB_FANOUT_BLOCK )
+			room = 0;
+	}
+	return room;
+}
+
+/**
+ * qusb_fanout_get_block - get the next slot to fill
+ *
+ * @fanout: Fan-out ring
+ * @data: Slot data (block_size bytes) to fill in
+ *
+ * Returns 0, or -EAGAIN if a QUSB_FANOUT_BLOCK consumer has yet to
+ * release the oldest block (see qusb_fanout_wait()).  The slot is not
+ * seen by consumers until qusb_fanout_publish().
+ */
+int qusb_fanout_get_block ( struct qusb_fanout *fanout, void **data ) {
+	struct fanout_shm *shm = fanout->shm;
+	struct fanout_slot *slot;
+	unsigned int index = ( fanout->head % shm->blocks );
+
+	if ( ! fanout_room ( fanout, fanout->head ) ) {
+		if ( ! fanout->stalled ) {
+			fanout->stalled = 1;
+			__atomic_add_fetch ( &shm->stalls, 1,
+					     __ATOMIC_RELAXED );
+		}
+		return -EAGAIN;
+	}
+	fanout->stalled = 0;
+
+	/* Invalidate the slot before the data in it changes */
+	slot = &shm->slot[index];
+	__atomic_store_n ( &slot->seq, 0, __ATOMIC_RELAXED );
+	__atomic_thread_fence ( __ATOMIC_RELEASE );
+	*data = ( fanout->data + ( ( size_t ) index * shm->stride ) );
+	return 0;
+}
+
+/**
+ * qusb_fanout_publish - publish the slot filled
+ *
+ * @fanout: Fan-out ring
+ * @len: Bytes of data in it
+ */
+void qusb_fanout_publish ( struct qusb_fanout *fanout, size_t len ) {
+	struct fanout_shm *shm = fanout->shm;
+	struct fanout_slot *slot = &shm->slot[fanout->head % shm->blocks];
+
+	slot->len = len;
+	__atomic_store_n ( &slot->seq, ( fanout->head + 1 ),
+			   __ATOMIC_RELEASE );
+	fanout->head++;
+	__atomic_store_n ( &shm->head, fanout->head, __ATOMIC_RELEASE );
+	__atomic_add_fetch ( &shm->head_futex, 1, __ATOMIC_SEQ_CST );
+	if ( __atomic_load_n ( &shm->readers_waiting, __ATOMIC_SEQ_CST ) )
+		qusb_futex_wake ( &shm->head_futex, INT_MAX );
+}
+
+/**
+ * qusb_fanout_wait - wait for room for the next block
+ *
+ * @fanout: Fan-out ring
+ * @timeout_ms: Longest wait, or -1
+ *
+ * Returns 0 when qusb_fanout_get_block() will succeed, or -ETIMEDOUT
+ */
+int qusb_fanout_wait ( struct qusb_fanout *fanout, int timeout_ms ) {
+	struct fanout_shm *shm = fanout->shm;
+	uint32_t val;
+	int rc = 0;
+
+	__atomic_store_n ( &shm->producer_waiting, 1, __ATOMIC_SEQ_CST );
+	val = __atomic_load_n ( &shm->space_futex, __ATOMIC_SEQ_CST );
+	if ( ! fanout_room ( fanout, fanout->head ) ) {
+		rc = qusb_futex_wait ( &shm->space_futex, val, timeout_ms );
+		if ( ( rc == -EAGAIN ) || ( rc == -EINTR ) )
+			rc = 0;
+		if ( ( rc == 0 ) && ! fanout_room ( fanout, fanout->head ) )
+			rc = -ETIMEDOUT;
+	}
+	__atomic_store_n ( &shm->producer_waiting, 0, __ATOMIC_SEQ_CST );
+	return rc;
+}
+
+/****************************************************************************
+ *
+ * Consumers
+ *
+ */
+
+/* Map the ring @name, and check it */
+static int fanout_map ( const char *name, int prot,
+			struct fanout_shm **shm, size_t *map_size ) {
+	char path[NAME_MAX];
+	struct fanout_shm *s;
+	struct stat st;
+	int fd;
+	int rc;
+
+	if ( ( rc = fanout_path ( name, path, sizeof ( path ) ) ) != 0 )
+		return rc;
+	if ( ( fd = shm_open ( path, ( ( prot & PROT_WRITE ) ?
+				       O_RDWR : O_RDONLY ), 0 ) ) < 0 )
+		return -errno;
+	if ( fstat ( fd, &st ) < 0 ) {
+		rc = -errno;
+		close ( fd );
+		return rc;
+	}
+	if ( ( size_t ) st.st_size < sizeof ( *s ) ) {
+		close ( fd );
+		return -EPROTO;
+	}
+	s = mmap ( NULL, st.st_size, prot, MAP_SHARED, fd, 0 );
+	close ( fd );
+	if ( s == MAP_FAILED )
+		return -errno;
+
+	if ( ( __atomic_load_n ( &s->magic, __ATOMIC_ACQUIRE ) !=
+	       FANOUT_MAGIC ) || ( s->version != FANOUT_VERSION ) ||
+	     ( s->cursors > QUSB_FANOUT_MAX_CONSUMERS ) ||
+	     ( ( s->data_offset + ( ( uint64_t ) s->blocks * s->stride ) ) >
+	       ( uint64_t ) st.st_size ) ) {
+		munmap ( s, st.st_size );
+		return -EPROTO;
+	}
+	*shm = s;
+	*map_size = st.st_size;
+	return 0;
+}
+
+/**
+ * qusb_fanout_attach - attach to a fan-out ring as a consumer
+ *
+ * @name: Shared memory object name, as given to qusb_fanout_create()
+ * @policy: What the producer does when this consumer is a ring behind
+ * @reader: Consumer to fill in
+ *
+ * Reading starts from the next block published.  Returns 0, -ENOENT if
+ * there is no such ring, or -EUSERS if every cursor is in use.
+ */
+int qusb_fanout_attach ( const char *name, enum qusb_fanout_policy policy,
+			 struct qusb_fanout_reader **reader ) {
+	struct qusb_fanout_reader *r;
+	struct fanout_cursor *cursor;
+	struct fanout_shm *shm;
+	uint32_t state;
+	unsigned int i;
+	int rc;
+
+	if ( ( policy != QUSB_FANOUT_DROP ) && ( policy != QUSB_FANOUT_BLOCK ) )
+		return -EINVAL;
+	if ( ! ( r = calloc ( 1, sizeof ( *r ) ) ) )
+		return -ENOMEM;
+	if ( ( rc = fanout_map ( name, ( PROT_READ | PROT_WRITE ),
+				 &r->shm, &r->map_size ) ) != 0 )
+		goto err_map;
+	shm = r->shm;
+	r->data = ( ( unsigned char * ) shm + shm->data_offset );
+
+	for ( i = 0 ; i < shm->cursors ; i++ ) {
+		cursor = &shm->cursor[i];
+		state = CURSOR_FREE;
+		if ( __atomic_compare_exchange_n ( &cursor->state, &state,
+						   CURSOR_CLAIMED, 0,
+						   __ATOMIC_SEQ_CST,
+						   __ATOMIC_RELAXED ) )
+			break;
+	}
+	if ( i == shm->cursors ) {
+		rc = -EUSERS;
+		goto err_cursor;
+	}
+
+	cursor->policy = policy;
+	cursor->pid = getpid();
+	cursor->consumed = 0;
+	cursor->dropped = 0;
+	r->tail = __atomic_load_n ( &shm->head, __ATOMIC_ACQUIRE );
+	__atomic_store_n ( &cursor->tail, r->tail, __ATOMIC_SEQ_CST );
+	__atomic_store_n ( &cursor->state, CURSOR_ACTIVE, __ATOMIC_SEQ_CST );
+	r->cursor = cursor;
+	*reader = r;
+	return 0;
+
+ err_cursor:
+	munmap ( r->shm, r->map_size );
+ err_map:
+	free ( r );
+	return rc;
+}
+
+/**
+ * qusb_fanout_detach - detach from a fan-out ring
+ *
+ * @reader: Consumer
+ */
+void qusb_fanout_detach ( struct qusb_fanout_reader *reader ) {
+	__atomic_store_n ( &reader->cursor->state, CURSOR_FREE,
+			   __ATOMIC_SEQ_CST );
+	munmap ( reader->shm, reader->map_size );
+	free ( reader );
+}
+
+/* Let a waiting producer recheck for room */
+static void fanout_space ( struct fanout_shm *shm ) {
+	if ( __atomic_load_n ( &shm->producer_waiting, __ATOMIC_SEQ_CST ) ) {
+		__atomic_add_fetch ( &shm->space_futex, 1, __ATOMIC_SEQ_CST );
+		qusb_futex_wake ( &shm->space_futex, 1 );
+	}
+}
+
+/**
+ * qusb_fanout_acquire - take the next block
+ *
+ * @reader: Consumer
+ * @data: Block data to fill in (valid until qusb_fanout_release())
+ * @len: Block length to fill in
+ * @timeout_ms: Longest wait for a block, or -1
+ *
+ * A QUSB_FANOUT_DROP consumer that has been lapped skips to the oldest
+ * block still intact, counting those it missed as dropped.  Returns 0,
+ * -ETIMEDOUT, or -EPIPE once the producer has gone and every block it
+ * published has been read.
+ */
+int qusb_fanout_acquire ( struct qusb_fanout_reader *reader,
+			  const void **data, size_t *len, int timeout_ms ) {
+	struct fanout_shm *shm = reader->shm;
+	struct fanout_cursor *cursor = reader->cursor;
+	struct fanout_slot *slot;
+	struct timespec ts;
+	uint64_t deadline = 0;
+	uint64_t now;
+	uint64_t head;
+	uint64_t skip;
+	uint32_t val;
+	int wait;
+
+	if ( timeout_ms > 0 ) {
+		clock_gettime ( CLOCK_MONOTONIC, &ts );
+		deadline = ( ( ts.tv_sec * 1000ULL ) + ( ts.tv_nsec / 1000000 ) +
+			     timeout_ms );
+	}
+
+	while ( 1 ) {
+		val = __atomic_load_n ( &shm->head_futex, __ATOMIC_SEQ_CST );
+		head = __atomic_load_n ( &shm->head, __ATOMIC_ACQUIRE );
+
+		if ( reader->tail < head ) {
+			/* Lapped?  The slot of block head - blocks may be
+			 * being rewritten already (a BLOCK consumer is never
+			 * lapped: the producer waits for it) */
+			if ( ( cursor->policy == QUSB_FANOUT_DROP ) &&
+			     ( ( head - reader->tail ) >= shm->blocks ) ) {
+				skip = ( head - shm->blocks + 1 -
+					 reader->tail );
+				reader->tail += skip;
+				__atomic_add_fetch ( &cursor->dropped, skip,
+						     __ATOMIC_RELAXED );
+			}
+			slot = &shm->slot[reader->tail % shm->blocks];
+			if ( __atomic_load_n ( &slot->seq, __ATOMIC_ACQUIRE ) !=
+			     ( reader->tail + 1 ) )
+				continue;	/* Lapped meanwhile */
+			*data = ( reader->data +
+				  ( ( size_t ) ( reader->tail % shm->blocks ) *
+				    shm->stride ) );
+			*len = slot->len;
+			reader->held = 1;
+			return 0;
+		}
+
+		if ( __atomic_load_n ( &shm->status, __ATOMIC_ACQUIRE ) ||
+		     pid_gone ( shm->producer_pid ) )
+			return -EPIPE;
+
+		/* Wait for the next block */
+		wait = FANOUT_POLL_MS;
+		if ( timeout_ms == 0 )
+			return -ETIMEDOUT;
+		if ( timeout_ms > 0 ) {
+			clock_gettime ( CLOCK_MONOTONIC, &ts );
+			now = ( ( ts.tv_sec * 1000ULL ) +
+				( ts.tv_nsec / 1000000 ) );
+			if ( now >= deadline )
+				return -ETIMEDOUT;
+			if ( ( deadline - now ) < ( uint64_t ) wait )
+				wait = ( deadline - now );
+		}
+		__atomic_add_fetch ( &shm->readers_waiting, 1,
+				     __ATOMIC_SEQ_CST );
+		if ( __atomic_load_n ( &shm->head, __ATOMIC_SEQ_CST ) == head )
+			qusb_futex_wait ( &shm->head_futex, val, wait );
+		__atomic_sub_fetch ( &shm->readers_waiting, 1,
+				     __ATOMIC_SEQ_CST );
+	}
+}
+
+/**
+ * qusb_fanout_release - hand back the block taken
+ *
+ * @reader: Consumer
+ *
+ * Returns 0, or -ESTALE if the producer overwrote the block while it
+ * was held (a QUSB_FANOUT_DROP consumer falling a whole ring behind):
+ * the data read from it may be damaged, and it is counted as dropped.
+ */
+int qusb_fanout_release ( struct qusb_fanout_reader *reader ) {
+	struct fanout_shm *shm = reader->shm;
+	struct fanout_cursor *cursor = reader->cursor;
+	struct fanout_slot *slot = &shm->slot[reader->tail % shm->blocks];
+	int stale;
+
+	if ( ! reader->held )
+		return 0;
+	reader->held = 0;
+
+	__atomic_thread_fence ( __ATOMIC_ACQUIRE );
+	stale = ( __atomic_load_n ( &slot->seq, __ATOMIC_RELAXED ) !=
+		  ( reader->tail + 1 ) );
+	__atomic_add_fetch ( ( stale ? &cursor->dropped : &cursor->consumed ),
+			     1, __ATOMIC_RELAXED );
+	reader->tail++;
+	__atomic_store_n ( &cursor->tail, reader->tail, __ATOMIC_SEQ_CST );
+	if ( cursor->policy == QUSB_FANOUT_BLOCK )
+		fanout_space ( shm );
+	return ( stale ? -ESTALE : 0 );
+}
+
+/****************************************************************************
+ *
+ * Statistics
+ *
+ */
+
+static void fanout_consumer_stats ( struct fanout_cursor *cursor,
+				    uint64_t head,
+				    struct qusb_fanout_consumer *consumer ) {
+	uint64_t tail = __atomic_load_n ( &cursor->tail, __ATOMIC_ACQUIRE );
+
+	consumer->pid = cursor->pid;
+	consumer->policy = cursor->policy;
+	consumer->lag = ( ( head > tail ) ? ( head - tail ) : 0 );
+	consumer->consumed = __atomic_load_n ( &cursor->consumed,
+					       __ATOMIC_RELAXED );
+	consumer->dropped = __atomic_load_n ( &cursor->dropped,
+					      __ATOMIC_RELAXED );
+}
+
+/**
+ * qusb_fanout_stats - a fan-out ring's state, and its consumers' lag
+ *
+ * @name: Shared memory object name
+ * @stats: Statistics to fill in
+ *
+ * Needs no cursor, so can watch a ring from any process.
+ */
+int qusb_fanout_stats ( const char *name, struct qusb_fanout_stats *stats ) {
+	struct fanout_shm *shm;
+	struct fanout_cursor *cursor;
+	size_t map_size;
+	unsigned int i;
+	int rc;
+
+	if ( ( rc = fanout_map ( name, PROT_READ, &shm, &map_size ) ) != 0 )
+		return rc;
+
+	memset ( stats, 0, sizeof ( *stats ) );
+	stats->block_size = shm->block_size;
+	stats->blocks = shm->blocks;
+	stats->producer_pid = shm->producer_pid;
+	stats->status = __atomic_load_n ( &shm->status, __ATOMIC_ACQUIRE );
+	stats->published = __atomic_load_n ( &shm->head, __ATOMIC_ACQUIRE );
+	stats->stalls = __atomic_load_n ( &shm->stalls, __ATOMIC_RELAXED );
+	for ( i = 0 ; i < shm->cursors ; i++ ) {
+		cursor = &shm->cursor[i];
+		if ( __atomic_load_n ( &cursor->state, __ATOMIC_ACQUIRE ) !=
+		     CURSOR_ACTIVE )
+			continue;
+		fanout_consumer_stats ( cursor, stats->published,
+					&stats->consumer[stats->consumers++] );
+	}
+
+	munmap ( shm, map_size );
+	return 0;
+}
+
+/**
+ * qusb_fanout_reader_stats - a consumer's own lag and counts
+ *
+ * @reader: Consumer
+ * @consumer: Statistics to fill in
+ */
+void qusb_fanout_reader_stats ( struct qusb_fanout_reader *reader,
+				struct qusb_fanout_consumer *consumer ) {
+	struct fanout_shm *shm = reader->shm;
+
+	fanout_consumer_stats ( reader->cursor,
+				__atomic_load_n ( &shm->head,
+						  __ATOMIC_ACQUIRE ),
+				consumer );
+}
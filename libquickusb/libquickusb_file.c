@@ -0,0 +1,576 @@
+/*
+ * libquickusb - capture files
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libquickusb_internal.h"
+
+/* A file mapped for reading */
+struct qusb_file_map {
+	int fd;
+	const uint8_t *data;
+	size_t size;
+};
+
+struct qusb_file {
+	struct qusb_file_map map;	/* Or the manifest, if striped */
+	const struct qusb_file_header *header;
+	uint64_t blocks;
+	/* NULL if the file has no index (and is not packed) */
+	const struct qusb_file_index_entry *index;
+	/* Index built by scanning a packed file, or from a manifest */
+	struct qusb_file_index_entry *scanned;
+	/* One board's stream from a striped capture */
+	struct qusb_file_header stripe_header;
+	struct qusb_file_map *targets;
+	unsigned int ntargets;
+	const struct qusb_file_block **striped;	/* Per block, in order */
+};
+
+/****************************************************************************
+ *
+ * Writing
+ *
+ */
+
+/**
+ * qusb_file_header_init - describe a capture in a file header
+ *
+ * @dev: Board being captured, or NULL
+ * @header: Header to fill in
+ * @block_size: Size of each block, a multiple of QUSB_FILE_ALIGN
+ *
+ * The board's FIFOCONFIG setting and GPPIO directions and levels are
+ * recorded if they can be read.  Every file of a capture should have
+ * the same header (from the same start time).  The index fields are left for the
+ * writer to fill in when the file is complete.
+ */
+int qusb_file_header_init ( struct qusb_device *dev,
+			    struct qusb_file_header *header,
+			    uint32_t block_size ) {
+	struct timespec ts;
+	unsigned int port;
+
+	if ( ( block_size <= QUSB_FILE_BLOCK_HEADER_SIZE ) ||
+	     ( block_size % QUSB_FILE_ALIGN ) )
+		return -EINVAL;
+
+	memset ( header, 0, sizeof ( *header ) );
+	header->magic = QUSB_FILE_MAGIC;
+	header->version = QUSB_FILE_VERSION;
+	header->header_size = QUSB_FILE_HEADER_SIZE;
+	header->block_size = block_size;
+	clock_gettime ( CLOCK_REALTIME, &ts );
+	header->start_ns = ( ( ts.tv_sec * 1000000000ULL ) + ts.tv_nsec );
+
+	if ( ! dev )
+		return 0;
+
+	header->board = qusb_board ( dev );
+	if ( qusb_get_setting ( dev, QUICKUSB_SETTING_FIFOCONFIG,
+				&header->fifoconfig ) != 0 )
+		return 0;
+	for ( port = 0 ; port < QUSB_MAX_GPPIO ; port++ ) {
+		if ( ( qusb_gppio_get_outputs ( dev, port,
+					&header->gppio_outputs[port] ) != 0 ) ||
+		     ( qusb_gppio_read ( dev, port,
+					 &header->gppio_levels[port] ) != 0 ) )
+			return 0;
+	}
+	header->flags |= QUSB_FILE_SETTINGS;
+	return 0;
+}
+
+/****************************************************************************
+ *
+ * Reading
+ *
+ */
+
+/* Size of a block on disk */
+static uint64_t qusb_file_block_size ( const struct qusb_file_header *header,
+				       const struct qusb_file_block *block ) {
+	if ( ! ( header->flags & QUSB_FILE_PACKED ) )
+		return header->block_size;
+	return ( ( QUSB_FILE_BLOCK_HEADER_SIZE + block->stored +
+		   QUSB_FILE_ALIGN - 1 ) & ~( QUSB_FILE_ALIGN - 1 ) );
+}
+
+/*
+ * Index a packed file that has no index, by walking its block headers
+ * up to the first that is incomplete
+ */
+static int qusb_file_scan ( struct qusb_file *file, uint64_t data_end ) {
+	const struct qusb_file_header *header = file->header;
+	const struct qusb_file_block *block;
+	struct qusb_file_index_entry *scanned;
+	uint64_t position = header->header_size;
+	uint64_t max = 0;
+	uint64_t size;
+
+	while ( ( position + QUSB_FILE_BLOCK_HEADER_SIZE ) <= data_end ) {
+		block = ( const void * ) ( file->map.data + position );
+		size = qusb_file_block_size ( header, block );
+		if ( ( block->magic != QUSB_FILE_BLOCK_MAGIC ) ||
+		     ( ( position + size ) > data_end ) )
+			break;
+		if ( file->blocks == max ) {
+			max = ( max ? ( max * 2 ) : 1024 );
+			if ( ! ( scanned = realloc ( file->scanned,
+						     ( max * sizeof ( *scanned ) ) ) ) )
+				return -ENOMEM;
+			file->scanned = scanned;
+		}
+		file->scanned[file->blocks].offset = block->offset;
+		file->scanned[file->blocks].timestamp_ns = block->timestamp_ns;
+		file->scanned[file->blocks].position = position;
+		file->blocks++;
+		position += size;
+	}
+	file->index = file->scanned;
+	return 0;
+}
+
+/* Map a file, for the pages to be read only as they are touched */
+static int qusb_file_map ( const char *path, struct qusb_file_map *map ) {
+	struct stat st;
+	int rc;
+
+	if ( ( map->fd = open ( path, O_RDONLY ) ) < 0 )
+		return -errno;
+	if ( fstat ( map->fd, &st ) < 0 ) {
+		rc = -errno;
+		goto err;
+	}
+	if ( st.st_size == 0 ) {
+		rc = -EINVAL;
+		goto err;
+	}
+	map->size = st.st_size;
+	map->data = mmap ( NULL, map->size, PROT_READ, MAP_SHARED, map->fd, 0 );
+	if ( map->data == MAP_FAILED ) {
+		rc = -errno;
+		goto err;
+	}
+	madvise ( ( void * ) map->data, map->size, MADV_RANDOM );
+	return 0;
+
+ err:
+	close ( map->fd );
+	map->fd = -1;
+	return rc;
+}
+
+static void qusb_file_unmap ( struct qusb_file_map *map ) {
+	if ( map->fd < 0 )
+		return;
+	munmap ( ( void * ) map->data, map->size );
+	close ( map->fd );
+	map->fd = -1;
+}
+
+/**
+ * qusb_file_open - open a capture file for reading
+ *
+ * @path: File name
+ * @file: File handle to fill in
+ *
+ * The file is mapped, not read: only the pages touched by a search, or
+ * by the caller, are read from disk.  Trailing blocks that were never
+ * completely written are ignored.  (A packed file without an index has
+ * its block headers scanned, to build one.)
+ */
+int qusb_file_open ( const char *path, struct qusb_file **file ) {
+	const struct qusb_file_header *header;
+	const struct qusb_file_block *block;
+	uint64_t data_end;
+	int rc;
+
+	if ( ! ( *file = calloc ( 1, sizeof ( **file ) ) ) )
+		return -ENOMEM;
+
+	if ( ( rc = qusb_file_map ( path, &( *file )->map ) ) != 0 )
+		goto err_map;
+	if ( ( *file )->map.size < QUSB_FILE_HEADER_SIZE ) {
+		rc = -EINVAL;
+		goto err_header;
+	}
+
+	header = ( *file )->header = ( const void * ) ( *file )->map.data;
+	if ( ( header->magic != QUSB_FILE_MAGIC ) ||
+	     ( header->version != QUSB_FILE_VERSION ) ||
+	     ( header->header_size < sizeof ( *header ) ) ||
+	     ( header->header_size > ( *file )->map.size ) ||
+	     ( header->block_size <= QUSB_FILE_BLOCK_HEADER_SIZE ) ) {
+		rc = -EINVAL;
+		goto err_header;
+	}
+
+	/* Blocks end where the index starts, or at the end of the file */
+	data_end = ( *file )->map.size;
+	if ( header->index_offset &&
+	     ( header->index_offset >= header->header_size ) &&
+	     ( header->index_offset <= ( *file )->map.size ) &&
+	     ( header->index_count <=
+	       ( ( ( *file )->map.size - header->index_offset ) /
+		 sizeof ( struct qusb_file_index_entry ) ) ) ) {
+		( *file )->index = ( const void * ) ( ( *file )->map.data +
+						      header->index_offset );
+		data_end = header->index_offset;
+	}
+	if ( ( *file )->index ) {
+		( *file )->blocks = header->index_count;
+		if ( ( *file )->blocks &&
+		     ( ( ( *file )->index[( *file )->blocks - 1].position +
+			 QUSB_FILE_BLOCK_HEADER_SIZE ) > data_end ) ) {
+			rc = -EINVAL;
+			goto err_header;
+		}
+	} else if ( header->flags & QUSB_FILE_PACKED ) {
+		if ( ( rc = qusb_file_scan ( *file, data_end ) ) != 0 )
+			goto err_header;
+	} else {
+		( *file )->blocks = ( ( data_end - header->header_size ) /
+				      header->block_size );
+		while ( ( *file )->blocks ) {
+			block = qusb_file_block ( *file, ( ( *file )->blocks - 1 ) );
+			if ( block->magic == QUSB_FILE_BLOCK_MAGIC )
+				break;
+			( *file )->blocks--;
+		}
+	}
+
+	return 0;
+
+ err_header:
+	free ( ( *file )->scanned );
+	qusb_file_unmap ( &( *file )->map );
+ err_map:
+	free ( *file );
+	*file = NULL;
+	return rc;
+}
+
+void qusb_file_close ( struct qusb_file *file ) {
+	unsigned int i;
+
+	if ( ! file )
+		return;
+
+	qusb_file_unmap ( &file->map );
+	for ( i = 0 ; i < file->ntargets ; i++ )
+		qusb_file_unmap ( &file->targets[i] );
+	free ( file->targets );
+	free ( file->striped );
+	free ( file->scanned );
+	free ( file );
+}
+
+const struct qusb_file_header * qusb_file_header ( struct qusb_file *file ) {
+	return file->header;
+}
+
+uint64_t qusb_file_blocks ( struct qusb_file *file ) {
+	return file->blocks;
+}
+
+int qusb_file_indexed ( struct qusb_file *file ) {
+	if ( file->striped )
+		return 1;
+	return ( ( file->index != NULL ) && ( file->index != file->scanned ) );
+}
+
+/* The caller has checked that @block < qusb_file_blocks() */
+const struct qusb_file_block * qusb_file_block ( struct qusb_file *file,
+						 uint64_t block ) {
+	if ( file->striped )
+		return file->striped[block];
+	if ( file->index )
+		return ( const void * ) ( file->map.data +
+					  file->index[block].position );
+	return ( const void * ) ( file->map.data + file->header->header_size +
+				  ( block * file->header->block_size ) );
+}
+
+/* The data as stored: see qusb_file_unpack() for packed blocks */
+const void * qusb_file_data ( const struct qusb_file_block *block ) {
+	return ( ( const uint8_t * ) block + QUSB_FILE_BLOCK_HEADER_SIZE );
+}
+
+/**
+ * qusb_file_unpack - copy out a block's data
+ *
+ * @block: Block
+ * @data: Buffer for block->length bytes
+ *
+ * Returns the length, or -EINVAL if the block is corrupt.  Blocks are
+ * independent, so several may be unpacked in parallel.
+ */
+ssize_t qusb_file_unpack ( const struct qusb_file_block *block, void *data ) {
+	if ( block->flags & QUSB_FILE_BLOCK_PACKED ) {
+		return qusb_unpack16 ( qusb_file_data ( block ), block->stored,
+				       data, block->length );
+	}
+	memcpy ( data, qusb_file_data ( block ), block->length );
+	return block->length;
+}
+
+/* Stream offset of a block, from the index if there is one */
+static uint64_t qusb_file_offset ( struct qusb_file *file, uint64_t block ) {
+	if ( file->index )
+		return file->index[block].offset;
+	return qusb_file_block ( file, block )->offset;
+}
+
+static uint64_t qusb_file_timestamp ( struct qusb_file *file,
+				      uint64_t block ) {
+	if ( file->index )
+		return file->index[block].timestamp_ns;
+	return qusb_file_block ( file, block )->timestamp_ns;
+}
+
+/**
+ * qusb_file_seek_time - find the data at a time
+ *
+ * @file: File handle
+ * @timestamp_ns: CLOCK_REALTIME
+ *
+ * Returns the first block read at or after @timestamp_ns (i.e. the
+ * block holding the data arriving at that time), or -ERANGE if the
+ * capture ended before then.
+ */
+int64_t qusb_file_seek_time ( struct qusb_file *file, uint64_t timestamp_ns ) {
+	uint64_t low = 0;
+	uint64_t high = file->blocks;
+	uint64_t mid;
+
+	while ( low < high ) {
+		mid = ( low + ( ( high - low ) / 2 ) );
+		if ( qusb_file_timestamp ( file, mid ) < timestamp_ns ) {
+			low = ( mid + 1 );
+		} else {
+			high = mid;
+		}
+	}
+	if ( low == file->blocks )
+		return -ERANGE;
+	return low;
+}
+
+/**
+ * qusb_file_seek_offset - find the data at a stream offset
+ *
+ * @file: File handle
+ * @offset: Byte offset within the stream read from the board
+ *
+ * Returns the block holding the byte at @offset, -ERANGE if the file
+ * does not extend that far, or -ENOENT if the byte was lost (the
+ * capture dropped data) or is in another file of the capture.
+ */
+int64_t qusb_file_seek_offset ( struct qusb_file *file, uint64_t offset ) {
+	const struct qusb_file_block *block;
+	uint64_t low = 0;
+	uint64_t high = file->blocks;
+	uint64_t mid;
+
+	/* Last block starting at or before the offset */
+	while ( low < high ) {
+		mid = ( low + ( ( high - low ) / 2 ) );
+		if ( qusb_file_offset ( file, mid ) <= offset ) {
+			low = ( mid + 1 );
+		} else {
+			high = mid;
+		}
+	}
+	if ( low == 0 )
+		return -ENOENT;
+	block = qusb_file_block ( file, ( low - 1 ) );
+	if ( offset < ( block->offset + block->length ) )
+		return ( low - 1 );
+	return ( ( low == file->blocks ) ? -ERANGE : -ENOENT );
+}
+
+/****************************************************************************
+ *
+ * Striped captures
+ *
+ */
+
+static int qusb_stripe_compare ( const void *a, const void *b ) {
+	const struct qusb_stripe_entry *x = *( ( const void ** ) a );
+	const struct qusb_stripe_entry *y = *( ( const void ** ) b );
+
+	if ( x->sequence != y->sequence )
+		return ( ( x->sequence < y->sequence ) ? -1 : 1 );
+	return 0;
+}
+
+/* The block an entry points at, or NULL if it is not (all) on disk */
+static const struct qusb_file_block *
+qusb_stripe_block ( struct qusb_file *file,
+		    const struct qusb_stripe_entry *entry ) {
+	const struct qusb_file_block *block;
+	struct qusb_file_map *target;
+
+	if ( entry->target >= file->ntargets )
+		return NULL;
+	target = &file->targets[entry->target];
+	if ( ( entry->position < QUSB_FILE_HEADER_SIZE ) ||
+	     ( entry->position > target->size ) ||
+	     ( file->header->block_size >
+	       ( target->size - entry->position ) ) )
+		return NULL;
+	block = ( const void * ) ( target->data + entry->position );
+	if ( ( block->magic != QUSB_FILE_BLOCK_MAGIC ) ||
+	     ( block->board != file->header->board ) ||
+	     ( block->sequence != entry->sequence ) ||
+	     ( block->stored > ( file->header->block_size -
+				 QUSB_FILE_BLOCK_HEADER_SIZE ) ) )
+		return NULL;
+	return block;
+}
+
+/**
+ * qusb_stripe_open - open one board's stream from a striped capture
+ *
+ * @path: Manifest file name
+ * @board: Board number
+ * @file: File handle to fill in
+ *
+ * The manifest and every stripe file are mapped, and the board's
+ * entries are sorted into stream order, so the blocks can then be read,
+ * searched and extracted exactly as those of a capture file.  Entries
+ * whose block is missing or damaged (a stripe file was truncated) are
+ * left out, and show up as gaps in the stream offsets.  Returns -ENOENT
+ * if @board was not captured.
+ */
+int qusb_stripe_open ( const char *path, unsigned int board,
+		       struct qusb_file **file ) {
+	const struct qusb_stripe_manifest *manifest;
+	const struct qusb_stripe_entry *entries;
+	const struct qusb_stripe_entry **sorted = NULL;
+	const struct qusb_file_block *block;
+	struct qusb_file_index_entry *index;
+	uint64_t count;
+	uint64_t found = 0;
+	uint64_t i;
+	unsigned int b;
+	int rc;
+
+	if ( ! ( *file = calloc ( 1, sizeof ( **file ) ) ) )
+		return -ENOMEM;
+
+	if ( ( rc = qusb_file_map ( path, &( *file )->map ) ) != 0 )
+		goto err_map;
+	manifest = ( const void * ) ( *file )->map.data;
+	if ( ( ( *file )->map.size < sizeof ( *manifest ) ) ||
+	     ( manifest->magic != QUSB_STRIPE_MAGIC ) ||
+	     ( manifest->version != QUSB_STRIPE_VERSION ) ||
+	     ( manifest->header_size < sizeof ( *manifest ) ) ||
+	     ( manifest->header_size > ( *file )->map.size ) ||
+	     ( manifest->block_size <= QUSB_FILE_BLOCK_HEADER_SIZE ) ||
+	     ( manifest->boards > QUSB_STRIPE_MAX_BOARDS ) ||
+	     ( manifest->targets > QUSB_STRIPE_MAX_TARGETS ) ) {
+		rc = -EINVAL;
+		goto err_manifest;
+	}
+	for ( b = 0 ; b < manifest->boards ; b++ ) {
+		if ( manifest->board[b].board == board )
+			break;
+	}
+	if ( b == manifest->boards ) {
+		rc = -ENOENT;
+		goto err_manifest;
+	}
+
+	/* The board's header, as if its stream had been captured alone */
+	( *file )->stripe_header = manifest->board[b];
+	( *file )->stripe_header.block_size = manifest->block_size;
+	( *file )->stripe_header.index_offset = 0;
+	( *file )->stripe_header.index_count = 0;
+	( *file )->header = &( *file )->stripe_header;
+
+	if ( ! ( ( *file )->targets = calloc ( manifest->targets,
+					       sizeof ( ( *file )->targets[0] ) ) ) ) {
+		rc = -ENOMEM;
+		goto err_manifest;
+	}
+	for ( i = 0 ; i < manifest->targets ; i++ ) {
+		if ( ! memchr ( manifest->target[i], 0,
+				QUSB_STRIPE_PATH_MAX ) ) {
+			rc = -EINVAL;
+			goto err_targets;
+		}
+		if ( ( rc = qusb_file_map ( manifest->target[i],
+					    &( *file )->targets[i] ) ) != 0 )
+			goto err_targets;
+		( *file )->ntargets++;
+	}
+
+	/* Entries are in the order the writes completed */
+	entries = ( const void * ) ( ( *file )->map.data +
+				     manifest->header_size );
+	count = ( ( ( *file )->map.size - manifest->header_size ) /
+		  sizeof ( entries[0] ) );
+	for ( i = 0 ; i < count ; i++ ) {
+		if ( entries[i].board == b )
+			found++;
+	}
+	if ( ! ( sorted = calloc ( ( found + 1 ), sizeof ( sorted[0] ) ) ) ||
+	     ! ( ( *file )->scanned = calloc ( ( found + 1 ),
+					       sizeof ( ( *file )->scanned[0] ) ) ) ||
+	     ! ( ( *file )->striped = calloc ( ( found + 1 ),
+					       sizeof ( ( *file )->striped[0] ) ) ) ) {
+		rc = -ENOMEM;
+		goto err_entries;
+	}
+	for ( i = 0, found = 0 ; i < count ; i++ ) {
+		if ( entries[i].board == b )
+			sorted[found++] = &entries[i];
+	}
+	qsort ( sorted, found, sizeof ( sorted[0] ), qusb_stripe_compare );
+
+	for ( i = 0 ; i < found ; i++ ) {
+		if ( ! ( block = qusb_stripe_block ( *file, sorted[i] ) ) )
+			continue;
+		index = &( *file )->scanned[( *file )->blocks];
+		index->offset = block->offset;
+		index->timestamp_ns = block->timestamp_ns;
+		index->position = sorted[i]->position;
+		( *file )->striped[( *file )->blocks++] = block;
+	}
+	( *file )->index = ( *file )->scanned;
+
+	free ( sorted );
+	return 0;
+
+ err_entries:
+	free ( sorted );
+ err_targets:
+	for ( i = 0 ; i < ( *file )->ntargets ; i++ )
+		qusb_file_unmap ( &( *file )->targets[i] );
+	free ( ( *file )->targets );
+	free ( ( *file )->striped );
+	free ( ( *file )->scanned );
+ err_manifest:
+	qusb_file_unmap ( &( *file )->map );
+ err_map:
+	free ( *file );
+	*file = NULL;
+	return rc;
+}
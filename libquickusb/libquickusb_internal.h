@@ -0,0 +1,191 @@
+#ifndef LIBQUICKUSB_INTERNAL_H
+#define LIBQUICKUSB_INTERNAL_H
+
+/*
+ * libquickusb - definitions private to the library
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+#include "libquickusb.h"
+
+struct libusb_device_handle;
+struct libusb_transfer;
+
+/****************************************************************************
+ *
+ * Back-ends
+ *
+ */
+
+/*
+ * A back-end implements the device operations (in terms of the kernel
+ * driver's device nodes, or of the vendor protocol directly), and the
+ * submission of a stream's requests.  Unimplemented operations return
+ * -ENOTSUP.
+ */
+struct qusb_backend {
+	const char *name;
+	int ( * enumerate ) ( struct qusb_info *info, unsigned int max );
+	int ( * open ) ( struct qusb_device *dev );
+	void ( * close ) ( struct qusb_device *dev );
+	int ( * get_setting ) ( struct qusb_device *dev, unsigned int address,
+				uint16_t *value );
+	int ( * set_setting ) ( struct qusb_device *dev, unsigned int address,
+				uint16_t value );
+	/* QUICKUSB_IOC_GPPIO_xxx */
+	int ( * gppio_ioctl ) ( struct qusb_device *dev, unsigned int port,
+				unsigned long request,
+				quickusb_gppio_ioctl_data_t *data );
+	int ( * gppio_read ) ( struct qusb_device *dev, unsigned int port,
+			       uint8_t *value );
+	int ( * gppio_write ) ( struct qusb_device *dev, unsigned int port,
+				uint8_t value );
+	int ( * command_read ) ( struct qusb_device *dev, unsigned int address,
+				 void *data, size_t len );
+	int ( * command_write ) ( struct qusb_device *dev, unsigned int address,
+				  const void *data, size_t len );
+	/* QUICKUSB_IOC_HSPIO_xxx on the command port (optional) */
+	int ( * command_ioctl ) ( struct qusb_device *dev,
+				  unsigned long request, void *data );
+	ssize_t ( * read ) ( struct qusb_device *dev, void *data, size_t len );
+	ssize_t ( * write ) ( struct qusb_device *dev, const void *data,
+			      size_t len );
+	/* QUICKUSB_IOC_HSPIO_xxx */
+	int ( * data_ioctl ) ( struct qusb_device *dev, unsigned long request,
+			       void *data );
+	int ( * stream_open ) ( struct qusb_stream *stream );
+	void ( * stream_close ) ( struct qusb_stream *stream );
+	/* Submit the next chain, if the stream is running and idle */
+	void ( * stream_fill ) ( struct qusb_stream *stream );
+	void ( * stream_cancel ) ( struct qusb_stream *stream );
+	/* Handle completions arriving other than on the loop's io_uring */
+	int ( * events ) ( int timeout_ms );
+	/* NUMA node of the board's buffers, and the CPUs local to it */
+	int ( * numa_node ) ( struct qusb_device *dev );
+	int ( * local_cpus ) ( struct qusb_device *dev, char *cpus,
+			       size_t len );
+};
+
+extern const struct qusb_backend qusb_kernel_backend;
+#ifdef QUSB_LIBUSB
+extern const struct qusb_backend qusb_usb_backend;
+#endif
+
+/****************************************************************************
+ *
+ * Devices
+ *
+ */
+
+struct qusb_device {
+	const struct qusb_backend *backend;
+	unsigned int board;
+	/* Kernel back-end */
+	int data_fd;				/* /dev/quNhd */
+	int command_fd;				/* /dev/quNhc, opened on use */
+	int gppio_fd[QUSB_MAX_GPPIO];		/* /dev/quNg?, opened on use */
+	/* libusb back-end */
+	struct libusb_device_handle *handle;
+};
+
+/****************************************************************************
+ *
+ * Streams
+ *
+ */
+
+struct qusb_uring {
+	int fd;
+	unsigned int features;
+	/* Submission queue */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sq_pending;	/* Prepared, not yet submitted */
+	/* Completion queue */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Mappings */
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+struct qusb_writer {
+	struct qusb_uring ring;
+};
+
+struct qusb_loop {
+	struct qusb_uring ring;
+	int ring_error;			/* Why there is no ring, if not */
+	struct qusb_stream *streams;
+	unsigned int completions;	/* Callbacks made by this run */
+};
+
+struct qusb_stream {
+	struct qusb_loop *loop;
+	struct qusb_stream *next;
+	struct qusb_device *dev;
+	struct qusb_stream_config config;
+	int running;
+	/* Block pool */
+	void *pool;
+	size_t pool_size;
+	struct qusb_block *blocks;
+	unsigned int *free;		/* Stack of free block indices */
+	unsigned int nfree;
+	unsigned int *queue;		/* FIFO of blocks awaiting submission */
+	unsigned int queue_head;
+	unsigned int queue_len;
+	/* Current chain */
+	unsigned int *chain;		/* Block indices, in submission order */
+	unsigned int chain_len;
+	unsigned char *cancelled;	/* Per block: chain broken before it */
+	unsigned int inflight;
+	uint64_t sequence;
+	struct qusb_stream_stats stats;
+	/* Kernel back-end */
+	int fd;
+	/* libusb back-end */
+	struct libusb_transfer **transfers;	/* Per block */
+	struct libusb_transfer *announce;	/* HSPIO read length */
+	unsigned char announce_buf[12];		/* Setup packet and length */
+	int halted;				/* Endpoint needs clearing */
+};
+
+/* sysfs attributes */
+#define QUSB_SYSFS_MAX		4096
+
+extern int qusb_sysfs_read ( const char *path, char *buf, size_t len );
+
+extern unsigned int qusb_stream_chain ( struct qusb_stream *stream,
+					unsigned int max );
+extern void qusb_stream_complete ( struct qusb_stream *stream,
+				   struct qusb_block *block, ssize_t res );
+
+/* Futexes (libquickusb_fanout.c) */
+
+extern int qusb_futex_wait ( uint32_t *addr, uint32_t val, int timeout_ms );
+extern void qusb_futex_wake ( uint32_t *addr, int count );
+
+/* Sample conversion (libquickusb_convert.c) */
+
+#define QUSB_MATCH_COUNTER	0
+#define QUSB_MATCH_LFSR		1
+
+extern size_t qusb_match16 ( const void *in, size_t samples,
+			     unsigned int pattern );
+
+#endif /* LIBQUICKUSB_INTERNAL_H */
@@ -0,0 +1,188 @@
+/*
+ * libquickusb - compression of 16-bit sample streams
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+/*
+ * HSPIO data is a stream of 16-bit little-endian samples, which
+ * usually change slowly.  Each sample is replaced by its difference
+ * from the previous one (the first from zero), zigzag-coded so that
+ * small negative differences are small numbers too, and the results
+ * are bit-packed in groups of QUSB_PACK_GROUP samples: a byte giving
+ * the width in bits (0 to 16) of the largest value in the group, then
+ * the values at that width, least significant bit first, padded to a
+ * byte.  An odd final byte is stored as is.
+ *
+ * The per-group loops are simple enough for the compiler to vectorise.
+ * Each call is independent, so blocks may be packed (and unpacked) in
+ * parallel.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "libquickusb_internal.h"
+
+#define QUSB_PACK_GROUP		128
+
+/* Bytes needed for @count values of @bits bits */
+static size_t qusb_pack_bytes ( unsigned int count, unsigned int bits ) {
+	return ( ( ( count * bits ) + 7 ) / 8 );
+}
+
+/**
+ * qusb_pack16_bound - worst-case packed size
+ *
+ * @len: Bytes of samples
+ */
+size_t qusb_pack16_bound ( size_t len ) {
+	size_t groups = ( ( ( len / 2 ) + QUSB_PACK_GROUP - 1 ) /
+			  QUSB_PACK_GROUP );
+
+	return ( groups + len );
+}
+
+/**
+ * qusb_pack16 - compress 16-bit samples
+ *
+ * @in: Samples (little-endian)
+ * @len: Bytes of samples
+ * @out: Packed data
+ * @max: Size of @out
+ *
+ * Returns the packed size, or -ENOSPC if it would exceed @max (which
+ * cannot happen if @max is at least qusb_pack16_bound()).
+ */
+ssize_t qusb_pack16 ( const void *in, size_t len, void *out, size_t max ) {
+	const uint8_t *src = in;
+	uint8_t *dst = out;
+	uint8_t *end = ( dst + max );
+	size_t samples = ( len / 2 );
+	uint16_t values[QUSB_PACK_GROUP];
+	uint16_t prev = 0;
+	uint16_t sample;
+	uint16_t all;
+	int16_t delta;
+	unsigned int count;
+	unsigned int bits;
+	unsigned int i;
+	uint64_t acc;
+	unsigned int nbits;
+
+	while ( samples ) {
+		count = ( ( samples < QUSB_PACK_GROUP ) ?
+			  samples : QUSB_PACK_GROUP );
+
+		/* Zigzag-coded differences, and the width needed */
+		all = 0;
+		for ( i = 0 ; i < count ; i++ ) {
+			sample = ( src[0] | ( src[1] << 8 ) );
+			delta = ( int16_t ) ( sample - prev );
+			values[i] = ( ( ( uint16_t ) delta << 1 ) ^
+				      ( uint16_t ) ( delta >> 15 ) );
+			all |= values[i];
+			prev = sample;
+			src += 2;
+		}
+		for ( bits = 0 ; all ; bits++ )
+			all >>= 1;
+
+		if ( ( end - dst ) < ( ssize_t ) ( 1 + qusb_pack_bytes ( count,
+								       bits ) ) )
+			return -ENOSPC;
+		*(dst++) = bits;
+
+		acc = 0;
+		nbits = 0;
+		for ( i = 0 ; i < count ; i++ ) {
+			acc |= ( ( uint64_t ) values[i] << nbits );
+			nbits += bits;
+			while ( nbits >= 8 ) {
+				*(dst++) = acc;
+				acc >>= 8;
+				nbits -= 8;
+			}
+		}
+		if ( nbits )
+			*(dst++) = acc;
+
+		samples -= count;
+	}
+
+	if ( len & 1 ) {
+		if ( dst == end )
+			return -ENOSPC;
+		*(dst++) = *src;
+	}
+	return ( dst - ( uint8_t * ) out );
+}
+
+/**
+ * qusb_unpack16 - decompress 16-bit samples
+ *
+ * @in: Packed data
+ * @packed: Size of packed data
+ * @out: Samples
+ * @len: Bytes of samples (as given to qusb_pack16)
+ *
+ * Returns @len, or -EINVAL if the packed data is corrupt.
+ */
+ssize_t qusb_unpack16 ( const void *in, size_t packed, void *out, size_t len ) {
+	const uint8_t *src = in;
+	const uint8_t *end = ( src + packed );
+	uint8_t *dst = out;
+	size_t samples = ( len / 2 );
+	uint16_t prev = 0;
+	uint16_t value;
+	uint16_t mask;
+	unsigned int count;
+	unsigned int bits;
+	unsigned int i;
+	uint64_t acc;
+	unsigned int nbits;
+
+	while ( samples ) {
+		count = ( ( samples < QUSB_PACK_GROUP ) ?
+			  samples : QUSB_PACK_GROUP );
+		if ( src == end )
+			return -EINVAL;
+		bits = *(src++);
+		if ( ( bits > 16 ) ||
+		     ( ( end - src ) < ( ssize_t ) qusb_pack_bytes ( count,
+								    bits ) ) )
+			return -EINVAL;
+		mask = ( ( 1U << bits ) - 1 );
+
+		acc = 0;
+		nbits = 0;
+		for ( i = 0 ; i < count ; i++ ) {
+			while ( nbits < bits ) {
+				acc |= ( ( uint64_t ) *(src++) << nbits );
+				nbits += 8;
+			}
+			value = ( acc & mask );
+			acc >>= bits;
+			nbits -= bits;
+			prev += ( ( value >> 1 ) ^ -( value & 1 ) );
+			dst[0] = prev;
+			dst[1] = ( prev >> 8 );
+			dst += 2;
+		}
+
+		samples -= count;
+	}
+
+	if ( len & 1 ) {
+		if ( src == end )
+			return -EINVAL;
+		*dst = *src;
+	}
+	return len;
+}
@@ -0,0 +1,227 @@
+/*
+ * libquickusb - capture ring reader
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+/*
+ * The reader alone advances head and the consumer alone advances tail,
+ * each published with release/acquire ordering, so the ring is never
+ * locked.  A file reader waiting for room sleeps on space_futex, which
+ * the consumer bumps (only while the reader is waiting) as it releases
+ * blocks, and qusb_ring_stop() bumps to end the wait.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "libquickusb_internal.h"
+
+/**
+ * qusb_ring_block - find a block in the ring
+ *
+ * @ring: Capture ring
+ * @block: Block number, counted from the start of the stream
+ */
+unsigned char * qusb_ring_block ( struct qusb_ring *ring, uint64_t block ) {
+	return ( ring->blocks + ( ( block % ring->nblocks ) *
+				  ring->block_size ) );
+}
+
+/* Fill one block's data (only the last may be short); returns length or
+ * -errno */
+static ssize_t ring_read_block ( struct qusb_ring *ring,
+				 unsigned char *data ) {
+	size_t block_size = ( ring->block_size - ring->header_size );
+	size_t len = 0;
+	ssize_t rc;
+
+	while ( len < block_size ) {
+		if ( ring->dev ) {
+			rc = qusb_read ( ring->dev, ( data + len ),
+					 ( block_size - len ) );
+		} else {
+			rc = read ( ring->input_fd, ( data + len ),
+				    ( block_size - len ) );
+			if ( rc < 0 )
+				rc = -errno;
+		}
+		if ( rc == -EINTR ) {
+			if ( __atomic_load_n ( &ring->stop, __ATOMIC_ACQUIRE ) )
+				break;
+			continue;
+		}
+		if ( rc < 0 )
+			return rc;
+		if ( rc == 0 )
+			break;
+		len += rc;
+	}
+	return len;
+}
+
+/* Describe a block read */
+static void ring_block_header ( struct qusb_ring *ring,
+				struct qusb_file_block *block,
+				uint64_t offset, size_t len ) {
+	struct timespec ts;
+
+	clock_gettime ( CLOCK_REALTIME, &ts );
+	memset ( block, 0, sizeof ( *block ) );
+	block->magic = QUSB_FILE_BLOCK_MAGIC;
+	block->flags = ( ring->gap ? QUSB_FILE_BLOCK_GAP : 0 );
+	block->sequence = ring->sequence;
+	block->offset = offset;
+	block->timestamp_ns = ( ( ts.tv_sec * 1000000000ULL ) + ts.tv_nsec );
+	block->length = len;
+	block->stored = len;
+	block->board = ring->board;
+	ring->gap = 0;
+}
+
+/* Wait for the consumer to leave room for block @head, unless stopped;
+ * returns the tail */
+static uint64_t ring_wait ( struct qusb_ring *ring, uint64_t head ) {
+	uint64_t tail;
+	uint32_t val;
+
+	__atomic_store_n ( &ring->waiting, 1, __ATOMIC_SEQ_CST );
+	while ( 1 ) {
+		val = __atomic_load_n ( &ring->space_futex, __ATOMIC_SEQ_CST );
+		tail = __atomic_load_n ( &ring->tail, __ATOMIC_SEQ_CST );
+		if ( ( ( head - tail ) < ring->nblocks ) ||
+		     __atomic_load_n ( &ring->stop, __ATOMIC_SEQ_CST ) )
+			break;
+		qusb_futex_wait ( &ring->space_futex, val, -1 );
+	}
+	__atomic_store_n ( &ring->waiting, 0, __ATOMIC_SEQ_CST );
+	return tail;
+}
+
+/**
+ * qusb_ring_reader - read into the ring until stopped, or the end
+ *
+ * @arg: Capture ring
+ *
+ * A thread function: reads until qusb_ring_stop(), limit_bytes, a short
+ * block (the end of a file), or an error (left in error), then sets
+ * done.
+ */
+void * qusb_ring_reader ( void *arg ) {
+	struct qusb_ring *ring = arg;
+	size_t block_data = ( ring->block_size - ring->header_size );
+	uint64_t head = 0;
+	uint64_t tail;
+	uint64_t offset;
+	unsigned char *block;
+	unsigned int fill;
+	ssize_t len;
+	int overrun;
+
+	while ( ! __atomic_load_n ( &ring->stop, __ATOMIC_ACQUIRE ) ) {
+		tail = __atomic_load_n ( &ring->tail, __ATOMIC_ACQUIRE );
+		if ( ( ! ring->dev ) && ( ( head - tail ) >= ring->nblocks ) ) {
+			/* Only a board needs reading on time: let a file
+			 * or pipe wait for room in the ring */
+			tail = ring_wait ( ring, head );
+			if ( __atomic_load_n ( &ring->stop, __ATOMIC_ACQUIRE ) )
+				break;
+		}
+		overrun = ( ( head - tail ) >= ring->nblocks );
+		block = ( overrun ? ring->scratch :
+			  qusb_ring_block ( ring, head ) );
+
+		offset = ring->bytes_read;
+		if ( ( len = ring_read_block ( ring, ( block +
+						       ring->header_size ) ) )
+		     < 0 ) {
+			ring->error = len;
+			break;
+		}
+		if ( len == 0 )
+			break;
+		__atomic_add_fetch ( &ring->bytes_read, len,
+				     __ATOMIC_RELAXED );
+
+		if ( overrun ) {
+			__atomic_add_fetch ( &ring->bytes_dropped, len,
+					     __ATOMIC_RELAXED );
+			ring->gap = 1;
+		} else {
+			if ( ring->header_size ) {
+				ring_block_header ( ring, ( void * ) block,
+						    offset, len );
+			}
+			if ( ring->pad ) {
+				memset ( ( block + ring->header_size + len ),
+					 0, ( block_data - len ) );
+			}
+			if ( ring->lengths )
+				ring->lengths[head % ring->nblocks] = len;
+			if ( ring->offsets )
+				ring->offsets[head % ring->nblocks] = offset;
+			head++;
+			__atomic_store_n ( &ring->head, head,
+					   __ATOMIC_RELEASE );
+			/* A consumer that follows without holding blocks
+			 * relies on seeing this head before any reuse of
+			 * the block */
+			__atomic_thread_fence ( __ATOMIC_SEQ_CST );
+			fill = ( head - tail );
+			if ( fill > ring->fill_max )
+				__atomic_store_n ( &ring->fill_max, fill,
+						   __ATOMIC_RELAXED );
+		}
+		ring->sequence++;
+
+		if ( ( len < ( ssize_t ) block_data ) ||
+		     ( ring->limit_bytes &&
+		       ( ring->bytes_read >= ring->limit_bytes ) ) )
+			break;
+	}
+
+	__atomic_store_n ( &ring->done, 1, __ATOMIC_RELEASE );
+	return NULL;
+}
+
+/* Let a waiting reader recheck for room */
+static void ring_space ( struct qusb_ring *ring ) {
+	if ( __atomic_load_n ( &ring->waiting, __ATOMIC_SEQ_CST ) ) {
+		__atomic_add_fetch ( &ring->space_futex, 1, __ATOMIC_SEQ_CST );
+		qusb_futex_wake ( &ring->space_futex, 1 );
+	}
+}
+
+/**
+ * qusb_ring_release - free the blocks before @tail for reuse
+ *
+ * @ring: Capture ring
+ * @tail: Blocks consumed, in all
+ */
+void qusb_ring_release ( struct qusb_ring *ring, uint64_t tail ) {
+	if ( tail == __atomic_load_n ( &ring->tail, __ATOMIC_RELAXED ) )
+		return;
+	__atomic_store_n ( &ring->tail, tail, __ATOMIC_SEQ_CST );
+	ring_space ( ring );
+}
+
+/**
+ * qusb_ring_stop - make the reader finish
+ *
+ * @ring: Capture ring
+ *
+ * Ends a wait for room; a read in progress is ended by signalling the
+ * thread.
+ */
+void qusb_ring_stop ( struct qusb_ring *ring ) {
+	__atomic_store_n ( &ring->stop, 1, __ATOMIC_SEQ_CST );
+	ring_space ( ring );
+}
@@ -0,0 +1,643 @@
+/*
+ * libquickusb - libusb back-end
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+/*
+ * Speaks the QuickUSB vendor protocol (see kernel/quickusb.h) directly,
+ * for hosts where the kernel module cannot be loaded.  It mirrors the
+ * driver: the settings, HSPIO command and GPPIO control requests, and
+ * HSPIO reads announced by their 32-bit length before the bulk IN
+ * transfers.  Streams keep a chain of asynchronous bulk transfers in
+ * flight.  Triggered capture and framed reads live in the driver, and
+ * are not available here.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <libusb.h>
+
+#include "libquickusb_internal.h"
+
+#define QUICKUSB_VENDOR_ID	0x0fbb
+#define QUICKUSB_DEVICE_ID	0x0001
+
+/* As QUICKUSB_TIMEOUT in the driver, in ms */
+#define QUSB_USB_TIMEOUT	1000
+
+static libusb_context *qusb_usb_context;
+static unsigned int qusb_usb_users;
+
+static int qusb_usb_errno ( int rc ) {
+	switch ( rc ) {
+	case LIBUSB_ERROR_IO:			return -EIO;
+	case LIBUSB_ERROR_INVALID_PARAM:	return -EINVAL;
+	case LIBUSB_ERROR_ACCESS:		return -EACCES;
+	case LIBUSB_ERROR_NO_DEVICE:		return -ENODEV;
+	case LIBUSB_ERROR_NOT_FOUND:		return -ENOENT;
+	case LIBUSB_ERROR_BUSY:			return -EBUSY;
+	case LIBUSB_ERROR_TIMEOUT:		return -ETIMEDOUT;
+	case LIBUSB_ERROR_OVERFLOW:		return -EOVERFLOW;
+	case LIBUSB_ERROR_PIPE:			return -EPIPE;
+	case LIBUSB_ERROR_INTERRUPTED:		return -EINTR;
+	case LIBUSB_ERROR_NO_MEM:		return -ENOMEM;
+	case LIBUSB_ERROR_NOT_SUPPORTED:	return -ENOTSUP;
+	default:				return -EIO;
+	}
+}
+
+static int qusb_usb_get ( void ) {
+	int rc;
+
+	if ( qusb_usb_users++ == 0 ) {
+		if ( ( rc = libusb_init ( &qusb_usb_context ) ) != 0 ) {
+			qusb_usb_users = 0;
+			return qusb_usb_errno ( rc );
+		}
+	}
+	return 0;
+}
+
+static void qusb_usb_put ( void ) {
+	if ( --qusb_usb_users == 0 ) {
+		libusb_exit ( qusb_usb_context );
+		qusb_usb_context = NULL;
+	}
+}
+
+/****************************************************************************
+ *
+ * Devices
+ *
+ */
+
+/**
+ * qusb_usb_find - find the Nth QuickUSB board on the bus
+ *
+ * @board: Board index, or -1 to count the boards
+ * @info: Array to fill, or NULL
+ * @max: Size of array
+ * @device: Device found, with a reference held, or NULL
+ *
+ * Returns the number of boards found
+ */
+static int qusb_usb_find ( int board, struct qusb_info *info, unsigned int max,
+			   libusb_device **device ) {
+	struct libusb_device_descriptor desc;
+	libusb_device **list;
+	ssize_t count;
+	ssize_t i;
+	int found = 0;
+
+	if ( ( count = libusb_get_device_list ( qusb_usb_context,
+						&list ) ) < 0 )
+		return qusb_usb_errno ( count );
+
+	for ( i = 0 ; i < count ; i++ ) {
+		if ( libusb_get_device_descriptor ( list[i], &desc ) != 0 )
+			continue;
+		if ( ( desc.idVendor != QUICKUSB_VENDOR_ID ) ||
+		     ( desc.idProduct != QUICKUSB_DEVICE_ID ) )
+			continue;
+		if ( info && ( ( unsigned int ) found < max ) ) {
+			info[found].board = found;
+			snprintf ( info[found].data_path,
+				   sizeof ( info[found].data_path ),
+				   "usb:%03d:%03d",
+				   libusb_get_bus_number ( list[i] ),
+				   libusb_get_device_address ( list[i] ) );
+			strcpy ( info[found].command_path,
+				 info[found].data_path );
+		}
+		if ( device && ( found == board ) ) {
+			*device = libusb_ref_device ( list[i] );
+			found++;
+			break;
+		}
+		found++;
+	}
+
+	libusb_free_device_list ( list, 1 );
+	return found;
+}
+
+static int qusb_usb_enumerate ( struct qusb_info *info, unsigned int max ) {
+	int rc;
+
+	if ( ( rc = qusb_usb_get() ) != 0 )
+		return rc;
+	rc = qusb_usb_find ( -1, info, max, NULL );
+	qusb_usb_put();
+	return rc;
+}
+
+static int qusb_usb_control ( struct qusb_device *dev, int in,
+			      uint8_t request, uint16_t value, uint16_t index,
+			      void *data, uint16_t len ) {
+	int rc;
+
+	rc = libusb_control_transfer ( dev->handle,
+				       ( in ? QUICKUSB_BREQUESTTYPE_READ :
+					 QUICKUSB_BREQUESTTYPE_WRITE ),
+				       request, value, index, data, len,
+				       QUSB_USB_TIMEOUT );
+	if ( rc < 0 )
+		return qusb_usb_errno ( rc );
+	return rc;
+}
+
+static int qusb_usb_get_setting ( struct qusb_device *dev,
+				  unsigned int address, uint16_t *value ) {
+	uint16_t value_le;
+	int rc;
+
+	if ( ( rc = qusb_usb_control ( dev, 1, QUICKUSB_BREQUEST_SETTING,
+				       0, address, &value_le,
+				       sizeof ( value_le ) ) ) < 0 )
+		return rc;
+	*value = le16toh ( value_le );
+	return 0;
+}
+
+static int qusb_usb_set_setting ( struct qusb_device *dev,
+				  unsigned int address, uint16_t value ) {
+	uint16_t value_le = htole16 ( value );
+	int rc;
+
+	if ( ( rc = qusb_usb_control ( dev, 0, QUICKUSB_BREQUEST_SETTING,
+				       0, address, &value_le,
+				       sizeof ( value_le ) ) ) < 0 )
+		return rc;
+	return 0;
+}
+
+static int qusb_usb_open ( struct qusb_device *dev ) {
+	libusb_device *device = NULL;
+	uint16_t fifoconfig;
+	int rc;
+
+	if ( ( rc = qusb_usb_get() ) != 0 )
+		return rc;
+
+	if ( ( rc = qusb_usb_find ( dev->board, NULL, 0, &device ) ) < 0 )
+		goto err_find;
+	if ( ! device ) {
+		rc = -ENODEV;
+		goto err_find;
+	}
+	rc = libusb_open ( device, &dev->handle );
+	libusb_unref_device ( device );
+	if ( rc != 0 ) {
+		rc = qusb_usb_errno ( rc );
+		goto err_find;
+	}
+
+	/* Take the interface from usbserial, if bound */
+	libusb_set_auto_detach_kernel_driver ( dev->handle, 1 );
+	if ( ( rc = libusb_claim_interface ( dev->handle, 0 ) ) != 0 ) {
+		rc = qusb_usb_errno ( rc );
+		goto err_claim;
+	}
+
+	/* HSPIO master mode, as the driver's data node */
+	if ( ( rc = qusb_usb_get_setting ( dev, QUICKUSB_SETTING_FIFOCONFIG,
+					   &fifoconfig ) ) != 0 )
+		goto err_mode;
+	fifoconfig &= ~QUICKUSB_HSPPMODE_MASK;
+	fifoconfig |= QUICKUSB_HSPPMODE_MASTER;
+	if ( ( rc = qusb_usb_set_setting ( dev, QUICKUSB_SETTING_FIFOCONFIG,
+					   fifoconfig ) ) != 0 )
+		goto err_mode;
+
+	return 0;
+
+ err_mode:
+	libusb_release_interface ( dev->handle, 0 );
+ err_claim:
+	libusb_close ( dev->handle );
+	dev->handle = NULL;
+ err_find:
+	qusb_usb_put();
+	return rc;
+}
+
+static void qusb_usb_close ( struct qusb_device *dev ) {
+	libusb_release_interface ( dev->handle, 0 );
+	libusb_close ( dev->handle );
+	qusb_usb_put();
+}
+
+static int qusb_usb_gppio_ioctl ( struct qusb_device *dev, unsigned int port,
+				  unsigned long request,
+				  quickusb_gppio_ioctl_data_t *data ) {
+	uint8_t outputs;
+	int rc;
+
+	switch ( request ) {
+	case QUICKUSB_IOC_GPPIO_GET_OUTPUTS:
+		if ( ( rc = qusb_usb_control ( dev, 1, QUICKUSB_BREQUEST_GPPIO,
+					       port, QUICKUSB_WINDEX_GPPIO_DIR,
+					       &outputs,
+					       sizeof ( outputs ) ) ) < 0 )
+			return rc;
+		*data = outputs;
+		return 0;
+	case QUICKUSB_IOC_GPPIO_SET_OUTPUTS:
+		outputs = *data;
+		if ( ( rc = qusb_usb_control ( dev, 0, QUICKUSB_BREQUEST_GPPIO,
+					       port, QUICKUSB_WINDEX_GPPIO_DIR,
+					       &outputs,
+					       sizeof ( outputs ) ) ) < 0 )
+			return rc;
+		return 0;
+	default:
+		/* Defaults need a firmware patch; nor does the driver */
+		return -ENOTTY;
+	}
+}
+
+static int qusb_usb_gppio_read ( struct qusb_device *dev, unsigned int port,
+				 uint8_t *value ) {
+	int rc;
+
+	if ( ( rc = qusb_usb_control ( dev, 1, QUICKUSB_BREQUEST_GPPIO, port,
+				       QUICKUSB_WINDEX_GPPIO_DATA, value,
+				       sizeof ( *value ) ) ) < 0 )
+		return rc;
+	return 0;
+}
+
+static int qusb_usb_gppio_write ( struct qusb_device *dev, unsigned int port,
+				  uint8_t value ) {
+	int rc;
+
+	if ( ( rc = qusb_usb_control ( dev, 0, QUICKUSB_BREQUEST_GPPIO, port,
+				       QUICKUSB_WINDEX_GPPIO_DATA, &value,
+				       sizeof ( value ) ) ) < 0 )
+		return rc;
+	return 0;
+}
+
+static int qusb_usb_command ( struct qusb_device *dev, int in,
+			      unsigned int address, void *data, size_t len ) {
+	size_t frag_len;
+	int rc;
+
+	while ( len ) {
+		frag_len = ( ( len < QUICKUSB_MAX_DATA_LEN ) ?
+			     len : QUICKUSB_MAX_DATA_LEN );
+		if ( ( rc = qusb_usb_control ( dev, in,
+					       QUICKUSB_BREQUEST_HSPIO_COMMAND,
+					       frag_len, address, data,
+					       frag_len ) ) < 0 )
+			return rc;
+		data += frag_len;
+		address += frag_len;
+		len -= frag_len;
+	}
+	return 0;
+}
+
+static int qusb_usb_command_read ( struct qusb_device *dev,
+				   unsigned int address, void *data,
+				   size_t len ) {
+	return qusb_usb_command ( dev, 1, address, data, len );
+}
+
+static int qusb_usb_command_write ( struct qusb_device *dev,
+				    unsigned int address, const void *data,
+				    size_t len ) {
+	return qusb_usb_command ( dev, 0, address, ( void * ) data, len );
+}
+
+/* Time allowed for a synchronous bulk transfer: 1s, plus 1ms per 16kB */
+static unsigned int qusb_usb_bulk_timeout ( size_t len ) {
+	return ( QUSB_USB_TIMEOUT + ( len >> 14 ) );
+}
+
+static ssize_t qusb_usb_bulk ( struct qusb_device *dev, unsigned char ep,
+			       void *data, size_t len ) {
+	uint32_t len_le;
+	int actual;
+	int rc;
+
+	if ( len > ( 1U << 30 ) )
+		len = ( 1U << 30 );
+
+	if ( ep & LIBUSB_ENDPOINT_IN ) {
+		len_le = htole32 ( len );
+		if ( ( rc = qusb_usb_control ( dev, 0, QUICKUSB_BREQUEST_HSPIO,
+					       0, 0, &len_le,
+					       sizeof ( len_le ) ) ) < 0 )
+			return rc;
+	}
+
+	rc = libusb_bulk_transfer ( dev->handle, ep, data, len, &actual,
+				    qusb_usb_bulk_timeout ( len ) );
+	if ( ( rc != 0 ) && ( actual == 0 ) ) {
+		if ( rc == LIBUSB_ERROR_PIPE )
+			libusb_clear_halt ( dev->handle, ep );
+		return qusb_usb_errno ( rc );
+	}
+	return actual;
+}
+
+static ssize_t qusb_usb_read ( struct qusb_device *dev, void *data,
+			       size_t len ) {
+	return qusb_usb_bulk ( dev, QUICKUSB_BULK_IN_EP, data, len );
+}
+
+static ssize_t qusb_usb_write ( struct qusb_device *dev, const void *data,
+				size_t len ) {
+	return qusb_usb_bulk ( dev, QUICKUSB_BULK_OUT_EP, ( void * ) data, len );
+}
+
+static int qusb_usb_data_ioctl ( struct qusb_device *dev,
+				 unsigned long request, void *data ) {
+	return -ENOTSUP;
+}
+
+/****************************************************************************
+ *
+ * Streams
+ *
+ */
+
+static int qusb_usb_stream_open ( struct qusb_stream *stream ) {
+	unsigned int i;
+
+	stream->transfers = calloc ( stream->config.blocks,
+				     sizeof ( stream->transfers[0] ) );
+	if ( ! stream->transfers )
+		return -ENOMEM;
+	for ( i = 0 ; i < stream->config.blocks ; i++ ) {
+		if ( ! ( stream->transfers[i] = libusb_alloc_transfer ( 0 ) ) )
+			goto err_alloc;
+	}
+	if ( ! ( stream->announce = libusb_alloc_transfer ( 0 ) ) )
+		goto err_alloc;
+
+	return 0;
+
+ err_alloc:
+	while ( i-- )
+		libusb_free_transfer ( stream->transfers[i] );
+	free ( stream->transfers );
+	stream->transfers = NULL;
+	return -ENOMEM;
+}
+
+static void qusb_usb_stream_close ( struct qusb_stream *stream ) {
+	unsigned int i;
+
+	for ( i = 0 ; i < stream->config.blocks ; i++ )
+		libusb_free_transfer ( stream->transfers[i] );
+	libusb_free_transfer ( stream->announce );
+	free ( stream->transfers );
+}
+
+/* Cancel the chain's transfers from position @from on */
+static void qusb_usb_stream_cancel_from ( struct qusb_stream *stream,
+					  unsigned int from ) {
+	unsigned int i;
+
+	for ( i = from ; i < stream->chain_len ; i++ )
+		libusb_cancel_transfer ( stream->transfers[stream->chain[i]] );
+}
+
+/* Fail the chain from position @from: that request with @rc, the rest
+ * as never attempted */
+static void qusb_usb_stream_fail_from ( struct qusb_stream *stream,
+					unsigned int from, ssize_t rc ) {
+	unsigned int chain_len = stream->chain_len;
+	unsigned int i;
+
+	for ( i = from ; i < chain_len ; i++ ) {
+		qusb_stream_complete ( stream,
+				       &stream->blocks[stream->chain[i]],
+				       ( ( i == from ) ? rc : -ECANCELED ) );
+	}
+}
+
+static void LIBUSB_CALL qusb_usb_transfer_done ( struct libusb_transfer *xfer ) {
+	struct qusb_block *block = xfer->user_data;
+	struct qusb_stream *stream = block->stream;
+	ssize_t res;
+	unsigned int i;
+
+	switch ( xfer->status ) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		res = xfer->actual_length;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		res = ( xfer->actual_length ? xfer->actual_length : -ECANCELED );
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		res = -ETIMEDOUT;
+		break;
+	case LIBUSB_TRANSFER_STALL:
+		res = -EPIPE;
+		stream->halted = 1;
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		res = -ENODEV;
+		break;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		res = -EOVERFLOW;
+		break;
+	default:
+		res = -EIO;
+		break;
+	}
+
+	/* As for io_uring links, a failed or short request breaks the chain */
+	if ( ( ( res < 0 ) && ( res != -ECANCELED ) ) ||
+	     ( ( res >= 0 ) && ( res < xfer->length ) ) ) {
+		for ( i = 0 ; i < stream->chain_len ; i++ ) {
+			if ( stream->chain[i] == block->index ) {
+				qusb_usb_stream_cancel_from ( stream, i + 1 );
+				break;
+			}
+		}
+	}
+
+	qusb_stream_complete ( stream, block, res );
+}
+
+static void qusb_usb_stream_submit ( struct qusb_stream *stream ) {
+	unsigned char ep = ( ( stream->config.direction == QUSB_IN ) ?
+			     QUICKUSB_BULK_IN_EP : QUICKUSB_BULK_OUT_EP );
+	struct libusb_transfer *xfer;
+	struct qusb_block *block;
+	unsigned int i;
+	int rc;
+
+	for ( i = 0 ; i < stream->chain_len ; i++ ) {
+		block = &stream->blocks[stream->chain[i]];
+		xfer = stream->transfers[block->index];
+		/* Later requests wait for earlier ones: allow for that */
+		libusb_fill_bulk_transfer ( xfer, stream->dev->handle, ep,
+					    block->data, block->len,
+					    qusb_usb_transfer_done, block,
+					    ( QUSB_USB_TIMEOUT * ( i + 1 ) ) );
+		if ( ( rc = libusb_submit_transfer ( xfer ) ) != 0 ) {
+			qusb_usb_stream_fail_from ( stream, i,
+						    qusb_usb_errno ( rc ) );
+			return;
+		}
+	}
+}
+
+static void LIBUSB_CALL qusb_usb_announce_done ( struct libusb_transfer *xfer ) {
+	struct qusb_stream *stream = xfer->user_data;
+
+	switch ( xfer->status ) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		qusb_usb_stream_submit ( stream );
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		qusb_usb_stream_fail_from ( stream, 0, -ECANCELED );
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		qusb_usb_stream_fail_from ( stream, 0, -ENODEV );
+		break;
+	default:
+		qusb_usb_stream_fail_from ( stream, 0, -EIO );
+		break;
+	}
+}
+
+/*
+ * Submit the next chain.  For reads, the whole chain is announced with
+ * a single HSPIO length request (as the driver does for framed reads),
+ * and the bulk IN transfers are submitted when that completes.
+ */
+static void qusb_usb_stream_fill ( struct qusb_stream *stream ) {
+	unsigned char *setup = stream->announce_buf;
+	uint64_t total = 0;
+	uint32_t len_le;
+	unsigned int i;
+	int rc;
+
+	if ( stream->halted ) {
+		libusb_clear_halt ( stream->dev->handle,
+				    ( ( stream->config.direction == QUSB_IN ) ?
+				      QUICKUSB_BULK_IN_EP :
+				      QUICKUSB_BULK_OUT_EP ) );
+		stream->halted = 0;
+	}
+
+	if ( ! qusb_stream_chain ( stream, stream->config.depth ) )
+		return;
+
+	if ( stream->config.direction == QUSB_OUT ) {
+		qusb_usb_stream_submit ( stream );
+		return;
+	}
+
+	for ( i = 0 ; i < stream->chain_len ; i++ )
+		total += stream->blocks[stream->chain[i]].len;
+	if ( total > UINT32_MAX ) {
+		qusb_usb_stream_fail_from ( stream, 0, -EINVAL );
+		return;
+	}
+	len_le = htole32 ( total );
+	libusb_fill_control_setup ( setup, QUICKUSB_BREQUESTTYPE_WRITE,
+				    QUICKUSB_BREQUEST_HSPIO, 0, 0,
+				    sizeof ( len_le ) );
+	memcpy ( ( setup + LIBUSB_CONTROL_SETUP_SIZE ), &len_le,
+		 sizeof ( len_le ) );
+	libusb_fill_control_transfer ( stream->announce, stream->dev->handle,
+				       setup, qusb_usb_announce_done, stream,
+				       QUSB_USB_TIMEOUT );
+	if ( ( rc = libusb_submit_transfer ( stream->announce ) ) != 0 )
+		qusb_usb_stream_fail_from ( stream, 0, qusb_usb_errno ( rc ) );
+}
+
+static void qusb_usb_stream_cancel ( struct qusb_stream *stream ) {
+	libusb_cancel_transfer ( stream->announce );
+	qusb_usb_stream_cancel_from ( stream, 0 );
+}
+
+static int qusb_usb_events ( int timeout_ms ) {
+	struct timeval tv;
+	int rc;
+
+	if ( timeout_ms < 0 ) {
+		rc = libusb_handle_events_completed ( qusb_usb_context, NULL );
+	} else {
+		tv.tv_sec = ( timeout_ms / 1000 );
+		tv.tv_usec = ( ( timeout_ms % 1000 ) * 1000 );
+		rc = libusb_handle_events_timeout_completed ( qusb_usb_context,
+							      &tv, NULL );
+	}
+	if ( ( rc != 0 ) && ( rc != LIBUSB_ERROR_INTERRUPTED ) )
+		return qusb_usb_errno ( rc );
+	return 0;
+}
+
+/*
+ * The host controller is the parent of the root hub of the board's bus
+ * (/sys/bus/usb/devices/usbN), and carries its NUMA node and CPUs.
+ */
+static int qusb_usb_controller_attr ( struct qusb_device *dev,
+				      const char *attr, char *buf,
+				      size_t len ) {
+	char path[64];
+
+	snprintf ( path, sizeof ( path ), "/sys/bus/usb/devices/usb%u/../%s",
+		   libusb_get_bus_number ( libusb_get_device ( dev->handle ) ),
+		   attr );
+	return qusb_sysfs_read ( path, buf, len );
+}
+
+static int qusb_usb_numa_node ( struct qusb_device *dev ) {
+	char value[16];
+	int node;
+	int rc;
+
+	if ( ( rc = qusb_usb_controller_attr ( dev, "numa_node", value,
+					       sizeof ( value ) ) ) != 0 )
+		return rc;
+	node = atoi ( value );
+	return ( ( node >= 0 ) ? node : -ENOENT );
+}
+
+static int qusb_usb_local_cpus ( struct qusb_device *dev, char *cpus,
+				 size_t len ) {
+	return qusb_usb_controller_attr ( dev, "local_cpulist", cpus, len );
+}
+
+const struct qusb_backend qusb_usb_backend = {
+	.name		= "libusb",
+	.enumerate	= qusb_usb_enumerate,
+	.open		= qusb_usb_open,
+	.close		= qusb_usb_close,
+	.get_setting	= qusb_usb_get_setting,
+	.set_setting	= qusb_usb_set_setting,
+	.gppio_ioctl	= qusb_usb_gppio_ioctl,
+	.gppio_read	= qusb_usb_gppio_read,
+	.gppio_write	= qusb_usb_gppio_write,
+	.command_read	= qusb_usb_command_read,
+	.command_write	= qusb_usb_command_write,
+	.read		= qusb_usb_read,
+	.write		= qusb_usb_write,
+	.data_ioctl	= qusb_usb_data_ioctl,
+	.stream_open	= qusb_usb_stream_open,
+	.stream_close	= qusb_usb_stream_close,
+	.stream_fill	= qusb_usb_stream_fill,
+	.stream_cancel	= qusb_usb_stream_cancel,
+	.events		= qusb_usb_events,
+	.numa_node	= qusb_usb_numa_node,
+	.local_cpus	= qusb_usb_local_cpus,
+};
@@ -0,0 +1,560 @@
+/*
+ * libquickusb - verification of test-pattern streams
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+/*
+ * Checks a stream of 16-bit words against what the board (or the logic
+ * feeding its FIFO) was set to send, so that lost, repeated or damaged
+ * words can be proven, and located:
+ *
+ *   counter	each word is one more than the last
+ *   lfsr	each word is the next state of a 16-bit Galois LFSR
+ *		(QUSB_LFSR_TAPS), which exercises every bit
+ *   crc	frames of N words: a frame counter, N - 2 words of anything,
+ *		and the CRC-16/CCITT of the frame's first N - 1 words
+ *
+ * For the counter and the LFSR, runs of good words are found with the
+ * vectorised qusb_match16(), and only a word that doesn't follow the
+ * one before is looked at closely, with the word after it: if that
+ * follows on from where the sequence should have been, the one word
+ * was damaged (a single bit flipped, or more); otherwise the sequence
+ * jumped, forwards (words lost) or back (words repeated).  An LFSR
+ * state is located in its sequence through a table of positions, so
+ * jumps are measured just as for the counter.
+ *
+ * The stream may be given in pieces of any length.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libquickusb_internal.h"
+
+/* Sequence lengths */
+#define QUSB_COUNTER_PERIOD	65536
+#define QUSB_LFSR_PERIOD	65535
+
+struct qusb_verify {
+	enum qusb_verify_pattern pattern;
+	void ( * report ) ( void *priv, const struct qusb_verify_event *event );
+	void *priv;
+	struct qusb_verify_stats stats;
+	uint64_t offset;		/* Of the next byte */
+	uint8_t byte;			/* Odd byte carried over */
+	int have_byte;
+	/* Counter and LFSR */
+	uint16_t prev;			/* Last word accepted */
+	int have_prev;
+	uint16_t suspect;		/* Word not following prev */
+	uint64_t suspect_offset;
+	int have_suspect;
+	uint16_t *position;		/* LFSR: of each state */
+	/* CRC frames */
+	unsigned int frame_words;
+	uint8_t *frame;
+	size_t frame_len;		/* Bytes */
+	uint64_t frame_offset;
+	int synced;
+	int failed;			/* Last frame failed its CRC */
+	uint64_t searched;		/* Words passed, looking for a frame */
+	uint16_t frame_counter;
+	int have_counter;
+	uint16_t crc_table[256];
+};
+
+static inline uint16_t qusb_verify_word ( const uint8_t *data ) {
+	return ( data[0] | ( data[1] << 8 ) );
+}
+
+static uint16_t qusb_verify_next ( struct qusb_verify *verify,
+				   uint16_t word ) {
+	if ( verify->pattern == QUSB_PATTERN_LFSR )
+		return ( ( word >> 1 ) ^ ( ( word & 1 ) ? QUSB_LFSR_TAPS : 0 ) );
+	return ( word + 1 );
+}
+
+static void qusb_verify_event ( struct qusb_verify *verify, unsigned int type,
+				uint64_t offset, uint64_t count,
+				uint16_t expected, uint16_t actual ) {
+	struct qusb_verify_event event;
+
+	switch ( type ) {
+	case QUSB_VERIFY_GAP:
+		verify->stats.gaps++;
+		verify->stats.lost += count;
+		break;
+	case QUSB_VERIFY_DUPLICATE:
+		verify->stats.duplicates++;
+		verify->stats.repeated += count;
+		break;
+	case QUSB_VERIFY_FLIP:
+		verify->stats.flips++;
+		break;
+	case QUSB_VERIFY_CORRUPT:
+		verify->stats.corrupt++;
+		break;
+	case QUSB_VERIFY_CRC:
+		verify->stats.crc_errors++;
+		break;
+	case QUSB_VERIFY_SYNC:
+		verify->stats.resyncs++;
+		break;
+	}
+	if ( verify->report ) {
+		event.type = type;
+		event.offset = offset;
+		event.count = count;
+		event.expected = expected;
+		event.actual = actual;
+		verify->report ( verify->priv, &event );
+	}
+}
+
+/****************************************************************************
+ *
+ * Counter and LFSR
+ *
+ */
+
+/* Report a jump in the sequence, from prev to the suspect word */
+static void qusb_verify_jump ( struct qusb_verify *verify ) {
+	uint16_t expected = qusb_verify_next ( verify, verify->prev );
+	uint16_t actual = verify->suspect;
+	unsigned int period;
+	unsigned int distance;
+
+	if ( verify->pattern == QUSB_PATTERN_LFSR ) {
+		/* Zero is not an LFSR state at all */
+		if ( ! actual ) {
+			qusb_verify_event ( verify, QUSB_VERIFY_CORRUPT,
+					    verify->suspect_offset,
+					    __builtin_popcount ( expected ),
+					    expected, actual );
+			verify->prev = expected;
+			return;
+		}
+		period = QUSB_LFSR_PERIOD;
+		distance = ( ( verify->position[actual] + period -
+			       verify->position[verify->prev] ) % period );
+	} else {
+		period = QUSB_COUNTER_PERIOD;
+		distance = ( ( uint16_t ) ( actual - verify->prev ) );
+	}
+
+	if ( distance == 0 ) {
+		qusb_verify_event ( verify, QUSB_VERIFY_DUPLICATE,
+				    verify->suspect_offset, 1, expected, actual );
+	} else if ( distance < ( period / 2 ) ) {
+		qusb_verify_event ( verify, QUSB_VERIFY_GAP,
+				    verify->suspect_offset, ( distance - 1 ),
+				    expected, actual );
+	} else {
+		/* Back to a word already seen: all since, again */
+		qusb_verify_event ( verify, QUSB_VERIFY_DUPLICATE,
+				    verify->suspect_offset,
+				    ( period - distance + 1 ), expected,
+				    actual );
+	}
+	verify->prev = actual;
+}
+
+/* Check one word, at @offset */
+static void qusb_verify_one ( struct qusb_verify *verify, uint16_t word,
+			      uint64_t offset ) {
+	uint16_t expected;
+	unsigned int bits;
+
+	verify->stats.words++;
+	if ( ! verify->have_prev ) {
+		verify->prev = word;
+		verify->have_prev = 1;
+		return;
+	}
+
+	expected = qusb_verify_next ( verify, verify->prev );
+	if ( verify->have_suspect ) {
+		verify->have_suspect = 0;
+		if ( word == qusb_verify_next ( verify, expected ) ) {
+			/* Just the suspect was wrong */
+			bits = __builtin_popcount ( verify->suspect ^ expected );
+			qusb_verify_event ( verify, ( ( bits == 1 ) ?
+						      QUSB_VERIFY_FLIP :
+						      QUSB_VERIFY_CORRUPT ),
+					    verify->suspect_offset, bits,
+					    expected, verify->suspect );
+			verify->prev = word;
+			return;
+		}
+		qusb_verify_jump ( verify );
+		expected = qusb_verify_next ( verify, verify->prev );
+	}
+
+	if ( word == expected ) {
+		verify->prev = word;
+		return;
+	}
+	/* Decide what happened when the next word is seen */
+	verify->suspect = word;
+	verify->suspect_offset = offset;
+	verify->have_suspect = 1;
+}
+
+static void qusb_verify_words ( struct qusb_verify *verify,
+				const uint8_t *data, size_t words,
+				uint64_t offset ) {
+	unsigned int pattern = ( ( verify->pattern == QUSB_PATTERN_LFSR ) ?
+				 QUSB_MATCH_LFSR : QUSB_MATCH_COUNTER );
+	uint16_t word;
+	size_t i = 0;
+	size_t good;
+
+	while ( i < words ) {
+		word = qusb_verify_word ( data + ( 2 * i ) );
+		if ( ( ! verify->have_prev ) || verify->have_suspect ||
+		     ( word != qusb_verify_next ( verify, verify->prev ) ) ) {
+			qusb_verify_one ( verify, word, ( offset + ( 2 * i ) ) );
+			i++;
+			continue;
+		}
+		/* A run of words each following the one before */
+		good = qusb_match16 ( ( data + ( 2 * i ) ), ( words - i ),
+				      pattern );
+		verify->stats.words += good;
+		i += good;
+		verify->prev = qusb_verify_word ( data + ( 2 * ( i - 1 ) ) );
+	}
+}
+
+/****************************************************************************
+ *
+ * CRC frames
+ *
+ */
+
+static uint16_t qusb_verify_crc ( struct qusb_verify *verify,
+				  const uint8_t *data, size_t len ) {
+	uint16_t crc = 0xffff;
+	size_t i;
+
+	for ( i = 0 ; i < len ; i++ ) {
+		crc = ( ( crc << 8 ) ^
+			verify->crc_table[( ( crc >> 8 ) ^ data[i] ) & 0xff] );
+	}
+	return crc;
+}
+
+/* Check a whole frame (in verify->frame) */
+static void qusb_verify_frame ( struct qusb_verify *verify ) {
+	size_t frame_size = ( 2 * verify->frame_words );
+	uint16_t counter;
+	uint16_t expected;
+	uint16_t distance;
+
+	if ( qusb_verify_crc ( verify, verify->frame, ( frame_size - 2 ) ) ==
+	     qusb_verify_word ( verify->frame + frame_size - 2 ) ) {
+		if ( ! verify->synced ) {
+			if ( verify->searched ) {
+				qusb_verify_event ( verify, QUSB_VERIFY_SYNC,
+						    verify->frame_offset,
+						    verify->searched, 0, 0 );
+			}
+			verify->synced = 1;
+			verify->searched = 0;
+		}
+		counter = qusb_verify_word ( verify->frame );
+		expected = ( verify->frame_counter + 1 );
+		distance = ( counter - verify->frame_counter );
+		if ( ! verify->have_counter ) {
+			/* First frame */
+		} else if ( distance == 0 ) {
+			qusb_verify_event ( verify, QUSB_VERIFY_DUPLICATE,
+					    verify->frame_offset, 1, expected,
+					    counter );
+		} else if ( distance >= 0x8000 ) {
+			qusb_verify_event ( verify, QUSB_VERIFY_DUPLICATE,
+					    verify->frame_offset,
+					    ( 0x10000 - distance + 1 ),
+					    expected, counter );
+		} else if ( distance > 1 ) {
+			qusb_verify_event ( verify, QUSB_VERIFY_GAP,
+					    verify->frame_offset,
+					    ( distance - 1 ), expected,
+					    counter );
+		}
+		verify->frame_counter = counter;
+		verify->have_counter = 1;
+		verify->failed = 0;
+		verify->stats.frames++;
+	} else if ( verify->synced && ! verify->failed ) {
+		/* Damaged, or out of step: the next frame will tell */
+		qusb_verify_event ( verify, QUSB_VERIFY_CRC,
+				    verify->frame_offset, 1,
+				    qusb_verify_crc ( verify, verify->frame,
+						      ( frame_size - 2 ) ),
+				    qusb_verify_word ( verify->frame +
+						       frame_size - 2 ) );
+		verify->frame_counter++;
+		verify->failed = 1;
+	} else {
+		/* Look for a frame a word further on */
+		verify->synced = 0;
+		verify->searched++;
+		memmove ( verify->frame, ( verify->frame + 2 ),
+			  ( frame_size - 2 ) );
+		verify->frame_len = ( frame_size - 2 );
+		verify->frame_offset += 2;
+		return;
+	}
+	verify->frame_len = 0;
+	verify->frame_offset += frame_size;
+}
+
+static void qusb_verify_frames ( struct qusb_verify *verify,
+				 const uint8_t *data, size_t len ) {
+	size_t frame_size = ( 2 * verify->frame_words );
+	size_t chunk;
+
+	while ( len ) {
+		chunk = ( frame_size - verify->frame_len );
+		if ( chunk > len )
+			chunk = len;
+		memcpy ( ( verify->frame + verify->frame_len ), data, chunk );
+		verify->frame_len += chunk;
+		verify->stats.words += ( chunk / 2 );
+		data += chunk;
+		len -= chunk;
+		while ( verify->frame_len == frame_size )
+			qusb_verify_frame ( verify );
+	}
+}
+
+/****************************************************************************
+ *
+ * Streams
+ *
+ */
+
+/**
+ * qusb_verify_create - start checking a stream
+ *
+ * @pattern: What the stream should hold
+ * @frame_words: Words per frame, with QUSB_PATTERN_CRC (at least 3)
+ * @report: Called with each error found (or NULL)
+ * @priv: Passed to @report
+ * @verify: Checker to fill in
+ */
+int qusb_verify_create ( enum qusb_verify_pattern pattern,
+			 unsigned int frame_words,
+			 void ( * report ) ( void *priv,
+					     const struct qusb_verify_event *event ),
+			 void *priv, struct qusb_verify **verify ) {
+	struct qusb_verify *v;
+	uint16_t state;
+	uint16_t crc;
+	unsigned int i;
+	unsigned int j;
+
+	if ( ( pattern > QUSB_PATTERN_CRC ) ||
+	     ( ( pattern == QUSB_PATTERN_CRC ) &&
+	       ( ( frame_words < 3 ) || ( frame_words > 65536 ) ) ) )
+		return -EINVAL;
+	if ( ! ( v = calloc ( 1, sizeof ( *v ) ) ) )
+		return -ENOMEM;
+	v->pattern = pattern;
+	v->report = report;
+	v->priv = priv;
+	v->frame_words = frame_words;
+
+	if ( pattern == QUSB_PATTERN_LFSR ) {
+		if ( ! ( v->position = malloc ( 65536 *
+						sizeof ( v->position[0] ) ) ) )
+			goto err;
+		v->position[0] = 0;
+		for ( state = 1, i = 0 ; i < QUSB_LFSR_PERIOD ; i++ ) {
+			v->position[state] = i;
+			state = qusb_verify_next ( v, state );
+		}
+	}
+
+	if ( pattern == QUSB_PATTERN_CRC ) {
+		if ( ! ( v->frame = malloc ( 2 * frame_words ) ) )
+			goto err;
+		for ( i = 0 ; i < 256 ; i++ ) {
+			crc = ( i << 8 );
+			for ( j = 0 ; j < 8 ; j++ ) {
+				crc = ( ( crc & 0x8000 ) ?
+					( ( crc << 1 ) ^ 0x1021 ) : ( crc << 1 ) );
+			}
+			v->crc_table[i] = crc;
+		}
+	}
+
+	*verify = v;
+	return 0;
+
+ err:
+	qusb_verify_destroy ( v );
+	return -ENOMEM;
+}
+
+void qusb_verify_destroy ( struct qusb_verify *verify ) {
+	free ( verify->position );
+	free ( verify->frame );
+	free ( verify );
+}
+
+/**
+ * qusb_verify_data - check the next piece of the stream
+ *
+ * @verify: Checker
+ * @data: Stream data
+ * @len: Bytes (need not be even)
+ */
+void qusb_verify_data ( struct qusb_verify *verify, const void *data,
+			size_t len ) {
+	const uint8_t *bytes = data;
+	uint8_t word[2];
+
+	if ( ! len )
+		return;
+	if ( verify->pattern == QUSB_PATTERN_CRC ) {
+		qusb_verify_frames ( verify, bytes, len );
+		verify->offset += len;
+		return;
+	}
+
+	/* A word split between pieces */
+	if ( verify->have_byte ) {
+		word[0] = verify->byte;
+		word[1] = bytes[0];
+		qusb_verify_words ( verify, word, 1, ( verify->offset - 1 ) );
+		verify->have_byte = 0;
+		verify->offset++;
+		bytes++;
+		len--;
+	}
+	qusb_verify_words ( verify, bytes, ( len / 2 ), verify->offset );
+	verify->offset += ( len & ~( size_t ) 1 );
+	if ( len & 1 ) {
+		verify->byte = bytes[len - 1];
+		verify->have_byte = 1;
+		verify->offset++;
+	}
+}
+
+/**
+ * qusb_verify_skip - pass over data known to be missing
+ *
+ * @verify: Checker
+ * @len: Bytes
+ *
+ * For data lost elsewhere (e.g. by a capture whose buffer filled), so
+ * that offsets stay right; checking starts again after it.
+ */
+void qusb_verify_skip ( struct qusb_verify *verify, uint64_t len ) {
+	if ( ! len )
+		return;
+	qusb_verify_finish ( verify );
+	verify->have_prev = 0;
+	verify->have_byte = 0;
+	verify->frame_len = 0;
+	verify->synced = 0;
+	verify->failed = 0;
+	verify->searched = 0;
+	verify->have_counter = 0;
+	verify->offset += len;
+	verify->frame_offset = verify->offset;
+	verify->stats.skipped += len;
+}
+
+/**
+ * qusb_verify_finish - report anything still undecided, at the end
+ *
+ * @verify: Checker
+ *
+ * With no word after it, a last word one bit out is taken as a flip.
+ * Words left over without a whole frame found are reported as a resync
+ * that never happened.
+ */
+void qusb_verify_finish ( struct qusb_verify *verify ) {
+	uint16_t expected;
+
+	if ( ( verify->pattern == QUSB_PATTERN_CRC ) && ! verify->synced &&
+	     ( verify->searched || verify->frame_len ) ) {
+		/* No frame found in what is left */
+		qusb_verify_event ( verify, QUSB_VERIFY_SYNC,
+				    verify->frame_offset,
+				    ( verify->searched +
+				      ( verify->frame_len / 2 ) ), 0, 0 );
+		verify->searched = 0;
+		verify->frame_len = 0;
+	}
+	if ( ! verify->have_suspect )
+		return;
+	verify->have_suspect = 0;
+	expected = qusb_verify_next ( verify, verify->prev );
+	if ( __builtin_popcount ( verify->suspect ^ expected ) == 1 ) {
+		qusb_verify_event ( verify, QUSB_VERIFY_FLIP,
+				    verify->suspect_offset, 1, expected,
+				    verify->suspect );
+		verify->prev = expected;
+		return;
+	}
+	qusb_verify_jump ( verify );
+}
+
+const struct qusb_verify_stats *
+qusb_verify_stats ( struct qusb_verify *verify ) {
+	return &verify->stats;
+}
+
+const char * qusb_verify_event_name ( unsigned int type ) {
+	static const char *names[] = {
+		[QUSB_VERIFY_GAP] = "gap",
+		[QUSB_VERIFY_DUPLICATE] = "duplicate",
+		[QUSB_VERIFY_FLIP] = "bit flip",
+		[QUSB_VERIFY_CORRUPT] = "corrupt",
+		[QUSB_VERIFY_CRC] = "CRC error",
+		[QUSB_VERIFY_SYNC] = "resync",
+	};
+
+	if ( type >= ( sizeof ( names ) / sizeof ( names[0] ) ) )
+		return "?";
+	return names[type];
+}
+
+/**
+ * qusb_verify_parse - parse a pattern name
+ *
+ * @spec: "counter", "lfsr", or "crc" or "crc:N" (N words per frame)
+ * @pattern: Pattern to fill in
+ * @frame_words: Frame size to fill in (default 256)
+ */
+int qusb_verify_parse ( const char *spec, enum qusb_verify_pattern *pattern,
+			unsigned int *frame_words ) {
+	*frame_words = 256;
+	if ( strcmp ( spec, "counter" ) == 0 ) {
+		*pattern = QUSB_PATTERN_COUNTER;
+	} else if ( strcmp ( spec, "lfsr" ) == 0 ) {
+		*pattern = QUSB_PATTERN_LFSR;
+	} else if ( strncmp ( spec, "crc", 3 ) == 0 ) {
+		*pattern = QUSB_PATTERN_CRC;
+		if ( spec[3] == ':' )
+			*frame_words = strtoul ( ( spec + 4 ), NULL, 0 );
+		else if ( spec[3] )
+			return -EINVAL;
+		if ( ( *frame_words < 3 ) || ( *frame_words > 65536 ) )
+			return -EINVAL;
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
@@ -0,0 +1,770 @@
+/*
+ * qusb-bench - QuickUSB throughput and latency benchmark
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+/*
+ * Measures sustained throughput and per-call latency percentiles of each
+ * kind of access to a board: HSPIO data reads and writes (synchronous,
+ * and streamed asynchronously) over a sweep of transfer sizes, HSPIO
+ * command transfers, GPPIO reads and writes, ioctl round trips, and the
+ * cost of opening the board.  All access is through libquickusb, so the
+ * kernel driver and libusb back-ends can be compared with the same test;
+ * it runs equally against real hardware or qusb-emu.
+ *
+ * Results are one line per test and size (or JSON lines with -j), for
+ * comparing runs with scripts.
+ *
+ * The sample conversions of libquickusb can be measured too, in memory:
+ * each is run with every implementation this CPU has, and the output
+ * checked against the scalar one.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+
+#include "../libquickusb/libquickusb.h"
+
+#define eprintf(...) fprintf ( stderr, __VA_ARGS__ )
+
+#define MAX_SIZE		( 64 * 1024 * 1024 )
+
+struct options {
+	unsigned int board;
+	enum qusb_backend_type backend;
+	const char *tests;
+	size_t min_size;
+	size_t max_size;
+	double duration;		/* Seconds per test point */
+	unsigned long max_calls;	/* Calls per test point */
+	unsigned int port;		/* GPPIO port */
+	unsigned int depth;		/* Stream requests queued */
+	int writes;			/* Include tests that drive outputs */
+	int local;			/* Bind to the board's CPUs */
+	int json;
+};
+
+struct bench {
+	struct options *opts;
+	struct qusb_device *dev;
+	unsigned char *buffer;
+	unsigned char *output;		/* Conversion output */
+	unsigned char *reference;	/* Scalar conversion output */
+	size_t output_len;
+	double *samples;		/* Per-call latency, us */
+	unsigned long nsamples;
+	uint8_t gppio_value;
+};
+
+struct result {
+	unsigned long calls;
+	unsigned long errors;
+	unsigned long long bytes;
+	double seconds;			/* Wall time of the point */
+	int first_error;
+};
+
+#define TEST_WRITE	0x01	/* Drives the board's outputs */
+#define TEST_SIZED	0x02	/* Swept over transfer sizes */
+#define TEST_LOCAL	0x04	/* In memory, without a board; only with -t */
+
+/* Conversion implementations to compare, the first being the reference */
+static const char *isas[] = { "scalar", "sse2", "avx2", "neon" };
+
+#define NUM_ISAS ( sizeof ( isas ) / sizeof ( isas[0] ) )
+
+/* Sample width for sext16 and float16 (a 12-bit ADC, say) */
+#define CONVERT_BITS	12
+
+struct test {
+	const char *name;
+	unsigned int flags;
+	size_t max_size;
+	/* One call: bytes transferred, or negative errno */
+	ssize_t ( * call ) ( struct bench *bench, size_t size );
+	/* Or, the whole point */
+	int ( * run ) ( struct bench *bench, const struct test *test,
+			size_t size, struct result *result );
+};
+
+int parseopts ( const int, char **argv, struct options * );
+void printhelp ();
+
+/****************************************************************************
+ *
+ * Tests
+ *
+ */
+
+static ssize_t bench_hd_read ( struct bench *bench, size_t size ) {
+	return qusb_read ( bench->dev, bench->buffer, size );
+}
+
+static ssize_t bench_hd_write ( struct bench *bench, size_t size ) {
+	return qusb_write ( bench->dev, bench->buffer, size );
+}
+
+static ssize_t bench_hc_read ( struct bench *bench, size_t size ) {
+	int rc;
+
+	if ( ( rc = qusb_command_read ( bench->dev, 0, bench->buffer,
+					size ) ) != 0 )
+		return rc;
+	return size;
+}
+
+static ssize_t bench_hc_write ( struct bench *bench, size_t size ) {
+	int rc;
+
+	if ( ( rc = qusb_command_write ( bench->dev, 0, bench->buffer,
+					 size ) ) != 0 )
+		return rc;
+	return size;
+}
+
+static ssize_t bench_gppio_read ( struct bench *bench, size_t size ) {
+	int rc;
+
+	if ( ( rc = qusb_gppio_read ( bench->dev, bench->opts->port,
+				      &bench->gppio_value ) ) != 0 )
+		return rc;
+	return 1;
+}
+
+/* Rewrites the port's current value */
+static ssize_t bench_gppio_write ( struct bench *bench, size_t size ) {
+	int rc;
+
+	if ( ( rc = qusb_gppio_write ( bench->dev, bench->opts->port,
+				       bench->gppio_value ) ) != 0 )
+		return rc;
+	return 1;
+}
+
+static ssize_t bench_ioctl_setting ( struct bench *bench, size_t size ) {
+	uint16_t value;
+	int rc;
+
+	if ( ( rc = qusb_get_setting ( bench->dev, QUICKUSB_SETTING_FIFOCONFIG,
+				       &value ) ) != 0 )
+		return rc;
+	return 0;
+}
+
+static ssize_t bench_ioctl_outputs ( struct bench *bench, size_t size ) {
+	uint8_t outputs;
+	int rc;
+
+	if ( ( rc = qusb_gppio_get_outputs ( bench->dev, bench->opts->port,
+					     &outputs ) ) != 0 )
+		return rc;
+	return 0;
+}
+
+/* Opening the data node sets the HSPIO port mode (a read and a write of
+ * FIFOCONFIG) */
+static ssize_t bench_open ( struct bench *bench, size_t size ) {
+	struct qusb_device *dev;
+	int rc;
+
+	if ( ( rc = qusb_open_backend ( bench->opts->backend,
+					bench->opts->board, &dev ) ) != 0 )
+		return rc;
+	qusb_close ( dev );
+	return 0;
+}
+
+/* Conversions: bytes of samples converted */
+static ssize_t bench_swap16 ( struct bench *bench, size_t size ) {
+	qusb_swap16 ( bench->buffer, bench->output, ( size / 2 ) );
+	bench->output_len = ( size & ~1 );
+	return size;
+}
+
+static ssize_t bench_split8 ( struct bench *bench, size_t size ) {
+	qusb_split8 ( bench->buffer, bench->output,
+		      ( bench->output + ( size / 2 ) ), ( size / 2 ) );
+	bench->output_len = ( size & ~1 );
+	return size;
+}
+
+static ssize_t bench_sext16 ( struct bench *bench, size_t size ) {
+	int rc;
+
+	if ( ( rc = qusb_sext16 ( bench->buffer, ( int16_t * ) bench->output,
+				  ( size / 2 ), CONVERT_BITS ) ) != 0 )
+		return rc;
+	bench->output_len = ( size & ~1 );
+	return size;
+}
+
+static ssize_t bench_float16 ( struct bench *bench, size_t size ) {
+	int rc;
+
+	if ( ( rc = qusb_float16 ( bench->buffer, ( float * ) bench->output,
+				   ( size / 2 ), CONVERT_BITS,
+				   ( 1.0 / ( 1 << ( CONVERT_BITS - 1 ) ) ) ) ) != 0 )
+		return rc;
+	bench->output_len = ( 2 * ( size & ~1 ) );
+	return size;
+}
+
+/* Four interleaved channels */
+static ssize_t bench_stats16 ( struct bench *bench, size_t size ) {
+	int rc;
+
+	if ( ( rc = qusb_stats16 ( bench->buffer, ( size / 2 ), 4, 1,
+				   ( struct qusb_stats16 * ) bench->output ) ) != 0 )
+		return rc;
+	bench->output_len = ( 4 * sizeof ( struct qusb_stats16 ) );
+	return size;
+}
+
+struct stream_state {
+	struct bench *bench;
+	struct result *result;
+	double last_us;
+	double end_us;
+};
+
+static int bench_stream_complete ( struct qusb_block *block, void *priv ) {
+	struct stream_state *state = priv;
+	struct bench *bench = state->bench;
+	double t = qusb_now_us();
+
+	state->result->calls++;
+	if ( block->status < 0 ) {
+		state->result->errors++;
+		if ( ! state->result->first_error )
+			state->result->first_error = block->status;
+	} else {
+		state->result->bytes += block->status;
+	}
+	/* Blocks already in flight still complete after QUSB_STOP */
+	if ( bench->nsamples < bench->opts->max_calls )
+		bench->samples[bench->nsamples++] = ( t - state->last_us );
+	state->last_us = t;
+
+	if ( ( bench->nsamples >= bench->opts->max_calls ) ||
+	     ( t >= state->end_us ) )
+		return QUSB_STOP;
+	return QUSB_CONTINUE;
+}
+
+/*
+ * Asynchronous streaming through a libquickusb loop; the latency
+ * recorded is the interval between completions.
+ */
+static int bench_stream_read ( struct bench *bench, const struct test *test,
+			       size_t size, struct result *result ) {
+	struct qusb_stream_config config;
+	struct stream_state state;
+	struct qusb_stream *stream;
+	struct qusb_loop *loop;
+	double start;
+	int rc;
+
+	memset ( &config, 0, sizeof ( config ) );
+	config.direction = QUSB_IN;
+	config.block_size = size;
+	config.depth = bench->opts->depth;
+	config.blocks = ( 2 * config.depth );
+	config.complete = bench_stream_complete;
+	config.priv = &state;
+
+	if ( ( rc = qusb_loop_create ( config.blocks, &loop ) ) != 0 )
+		return rc;
+	if ( bench->opts->local &&
+	     ( ( rc = qusb_loop_bind_local ( loop, bench->dev ) ) != 0 ) )
+		goto err_stream;
+	if ( ( rc = qusb_stream_create ( loop, bench->dev, &config,
+					 &stream ) ) != 0 )
+		goto err_stream;
+
+	state.bench = bench;
+	state.result = result;
+	start = state.last_us = qusb_now_us();
+	state.end_us = ( start + ( bench->opts->duration * 1e6 ) );
+	qusb_stream_start ( stream );
+	while ( qusb_loop_active ( loop ) ) {
+		if ( ( rc = qusb_loop_run ( loop, 1000 ) ) < 0 )
+			break;
+		rc = 0;
+	}
+	result->seconds = ( ( qusb_now_us() - start ) / 1e6 );
+
+	qusb_stream_destroy ( stream );
+ err_stream:
+	qusb_loop_destroy ( loop );
+	return rc;
+}
+
+static const struct test tests[] = {
+	{ "hd-read",		TEST_SIZED,		MAX_SIZE,
+	  bench_hd_read,	NULL },
+	{ "hd-write",		TEST_SIZED | TEST_WRITE, MAX_SIZE,
+	  bench_hd_write,	NULL },
+	{ "stream-read",	TEST_SIZED,		MAX_SIZE,
+	  NULL,			bench_stream_read },
+	{ "hc-read",		TEST_SIZED,		QUICKUSB_MAX_DATA_LEN,
+	  bench_hc_read,	NULL },
+	{ "hc-write",		TEST_SIZED | TEST_WRITE, QUICKUSB_MAX_DATA_LEN,
+	  bench_hc_write,	NULL },
+	{ "gppio-read",		0,			1,
+	  bench_gppio_read,	NULL },
+	{ "gppio-write",	TEST_WRITE,		1,
+	  bench_gppio_write,	NULL },
+	{ "ioctl-setting",	0,			0,
+	  bench_ioctl_setting,	NULL },
+	{ "ioctl-outputs",	0,			0,
+	  bench_ioctl_outputs,	NULL },
+	{ "open",		0,			0,
+	  bench_open,		NULL },
+	{ "swap16",		TEST_SIZED | TEST_LOCAL, MAX_SIZE,
+	  bench_swap16,		NULL },
+	{ "split8",		TEST_SIZED | TEST_LOCAL, MAX_SIZE,
+	  bench_split8,		NULL },
+	{ "sext16",		TEST_SIZED | TEST_LOCAL, MAX_SIZE,
+	  bench_sext16,		NULL },
+	{ "float16",		TEST_SIZED | TEST_LOCAL, MAX_SIZE,
+	  bench_float16,	NULL },
+	{ "stats16",		TEST_SIZED | TEST_LOCAL, MAX_SIZE,
+	  bench_stats16,	NULL },
+};
+
+#define NUM_TESTS ( sizeof ( tests ) / sizeof ( tests[0] ) )
+
+/****************************************************************************
+ *
+ * Measurement and reporting
+ *
+ */
+
+/* Repeat one call for the duration (at least once), up to max_calls */
+static int run_calls ( struct bench *bench, const struct test *test,
+		       size_t size, struct result *result ) {
+	double start = qusb_now_us();
+	double end = ( start + ( bench->opts->duration * 1e6 ) );
+	double t0, t1 = start;
+	ssize_t rc;
+
+	do {
+		t0 = qusb_now_us();
+		rc = test->call ( bench, size );
+		t1 = qusb_now_us();
+		bench->samples[bench->nsamples++] = ( t1 - t0 );
+		result->calls++;
+		if ( rc < 0 ) {
+			result->errors++;
+			if ( ! result->first_error )
+				result->first_error = rc;
+			/* Not supported: one call is enough to say so */
+			if ( ( rc == -ENOTSUP ) || ( rc == -ENOTTY ) )
+				break;
+		} else {
+			result->bytes += rc;
+		}
+	} while ( ( t1 < end ) && ( bench->nsamples < bench->opts->max_calls ) );
+
+	result->seconds = ( ( t1 - start ) / 1e6 );
+	return 0;
+}
+
+static int compare_double ( const void *a, const void *b ) {
+	double da = *( const double * ) a;
+	double db = *( const double * ) b;
+
+	return ( ( da > db ) - ( da < db ) );
+}
+
+static double percentile ( const double *sorted, unsigned long n,
+			   double pct ) {
+	unsigned long i;
+
+	if ( ! n )
+		return 0;
+	i = ( ( pct / 100.0 ) * ( n - 1 ) + 0.5 );
+	return sorted[i];
+}
+
+static void report ( struct bench *bench, const char *name,
+		     size_t size, struct result *result ) {
+	double *s = bench->samples;
+	unsigned long n = bench->nsamples;
+	double mbps;
+
+	qsort ( s, n, sizeof ( s[0] ), compare_double );
+	mbps = ( result->seconds ? ( result->bytes / result->seconds / 1e6 ) : 0 );
+
+	if ( bench->opts->json ) {
+		printf ( "{\"test\":\"%s\",\"size\":%zu,\"calls\":%lu,"
+			 "\"errors\":%lu,\"bytes\":%llu,\"seconds\":%.6f,"
+			 "\"MBps\":%.3f,\"min_us\":%.1f,\"p50_us\":%.1f,"
+			 "\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,"
+			 "\"max_us\":%.1f,\"error\":\"%s\"}\n",
+			 name, size, result->calls, result->errors,
+			 result->bytes, result->seconds, mbps,
+			 ( n ? s[0] : 0 ), percentile ( s, n, 50 ),
+			 percentile ( s, n, 90 ), percentile ( s, n, 99 ),
+			 percentile ( s, n, 99.9 ), ( n ? s[n - 1] : 0 ),
+			 ( result->first_error ?
+			   strerror ( -result->first_error ) : "" ) );
+	} else {
+		printf ( "%-13s %9zu %7lu %6lu %12llu %9.3f %9.3f %9.1f %9.1f "
+			 "%9.1f %9.1f %9.1f %9.1f\n",
+			 name, size, result->calls, result->errors,
+			 result->bytes, result->seconds, mbps,
+			 ( n ? s[0] : 0 ), percentile ( s, n, 50 ),
+			 percentile ( s, n, 90 ), percentile ( s, n, 99 ),
+			 percentile ( s, n, 99.9 ), ( n ? s[n - 1] : 0 ) );
+		if ( result->first_error ) {
+			printf ( "# %s size %zu: %s\n", name, size,
+				 strerror ( -result->first_error ) );
+		}
+	}
+	fflush ( stdout );
+}
+
+static int selected ( struct options *opts, const struct test *test ) {
+	const char *p = opts->tests;
+	size_t len = strlen ( test->name );
+
+	if ( ! p ) {
+		return ( ( opts->writes || ! ( test->flags & TEST_WRITE ) ) &&
+			 ! ( test->flags & TEST_LOCAL ) );
+	}
+
+	/* Comma-separated list of names */
+	while ( ( p = strstr ( p, test->name ) ) ) {
+		if ( ( ( p == opts->tests ) || ( p[-1] == ',' ) ) &&
+		     ( ( p[len] == ',' ) || ( p[len] == '\0' ) ) )
+			return 1;
+		p += len;
+	}
+	return 0;
+}
+
+/* Driver tuning, recorded with the results */
+static void report_tuning ( struct options *opts ) {
+	static const char *attrs[] = { "chunk_size", "urbs", "pool_size",
+				       "numa_node", "local_cpus" };
+	char path[64];
+	char value[256];
+	unsigned int i;
+	FILE *file;
+
+	for ( i = 0 ; i < ( sizeof ( attrs ) / sizeof ( attrs[0] ) ) ; i++ ) {
+		snprintf ( path, sizeof ( path ),
+			   "/sys/class/quickusb/qu%uhd/%s", opts->board,
+			   attrs[i] );
+		if ( ! ( file = fopen ( path, "r" ) ) )
+			continue;
+		if ( fgets ( value, sizeof ( value ), file ) ) {
+			value[strcspn ( value, "\n" )] = '\0';
+			printf ( "# %s %s\n", attrs[i], value );
+		}
+		fclose ( file );
+	}
+}
+
+/* Time a conversion with each implementation, checking each against the
+ * scalar one; returns the number that differed */
+static unsigned int run_convert ( struct bench *bench, const struct test *test,
+				  size_t size ) {
+	struct result result;
+	unsigned char *output = bench->output;
+	unsigned int mismatches = 0;
+	char name[32];
+	unsigned int i;
+
+	/* Reference */
+	qusb_convert_select ( isas[0] );
+	bench->output = bench->reference;
+	test->call ( bench, size );
+	bench->output = output;
+
+	for ( i = 0 ; i < NUM_ISAS ; i++ ) {
+		if ( qusb_convert_select ( isas[i] ) != 0 )
+			continue;
+		memset ( &result, 0, sizeof ( result ) );
+		memset ( bench->output, 0, bench->output_len );
+		bench->nsamples = 0;
+		run_calls ( bench, test, size, &result );
+		snprintf ( name, sizeof ( name ), "%s/%s", test->name, isas[i] );
+		report ( bench, name, size, &result );
+		if ( memcmp ( bench->output, bench->reference,
+			      bench->output_len ) != 0 ) {
+			printf ( "# %s size %zu: output differs from %s\n",
+				 name, size, isas[0] );
+			mismatches++;
+		}
+	}
+	qusb_convert_select ( NULL );
+	return mismatches;
+}
+
+int main ( int argc, char* argv[] ) {
+	struct options opts;
+	struct bench bench;
+	struct result result;
+	const struct test *test;
+	unsigned int mismatches = 0;
+	int need_board = 0;
+	size_t size;
+	size_t min;
+	size_t max;
+	unsigned int i;
+	int rc;
+
+	memset ( &opts, 0, sizeof ( opts ) );
+	opts.min_size = 2;
+	opts.max_size = MAX_SIZE;
+	opts.duration = 1.0;
+	opts.max_calls = 100000;
+	opts.depth = 4;
+
+	parseopts ( argc, argv, &opts );
+	if ( ( opts.min_size < 1 ) || ( opts.max_size > MAX_SIZE ) ||
+	     ( opts.min_size > opts.max_size ) || ( opts.port >= QUSB_MAX_GPPIO ) ||
+	     ( ! opts.depth ) || ( ! opts.max_calls ) ) {
+		eprintf ( "Invalid options (see -h)\n" );
+		exit ( EXIT_FAILURE );
+	}
+
+	memset ( &bench, 0, sizeof ( bench ) );
+	bench.opts = &opts;
+	bench.buffer = malloc ( opts.max_size );
+	bench.samples = malloc ( opts.max_calls * sizeof ( bench.samples[0] ) );
+	/* Floats are twice the size of the samples */
+	bench.output = malloc ( 2 * opts.max_size );
+	bench.reference = malloc ( 2 * opts.max_size );
+	if ( ! ( bench.buffer && bench.samples && bench.output &&
+		 bench.reference ) ) {
+		eprintf ( "Error: out of memory\n" );
+		exit ( EXIT_FAILURE );
+	}
+	/* Incrementing 16-bit little-endian words for writes */
+	for ( size = 0 ; size < opts.max_size ; size++ )
+		bench.buffer[size] = ( ( size & 1 ) ? ( size >> 9 ) : ( size >> 1 ) );
+
+	for ( i = 0 ; i < NUM_TESTS ; i++ ) {
+		if ( selected ( &opts, &tests[i] ) &&
+		     ! ( tests[i].flags & TEST_LOCAL ) )
+			need_board = 1;
+	}
+
+	if ( need_board ) {
+		if ( ( rc = qusb_open_backend ( opts.backend, opts.board,
+						&bench.dev ) ) != 0 ) {
+			eprintf ( "Error: Could not open board %u: %s\n",
+				  opts.board, strerror ( -rc ) );
+			exit ( EXIT_FAILURE );
+		}
+		/* GPPIO writes rewrite the value the port already has */
+		qusb_gppio_read ( bench.dev, opts.port, &bench.gppio_value );
+	}
+
+	if ( ! opts.json ) {
+		if ( need_board ) {
+			printf ( "# qusb-bench board %u backend %s\n",
+				 opts.board, qusb_backend_name ( bench.dev ) );
+			report_tuning ( &opts );
+		} else {
+			printf ( "# qusb-bench\n" );
+		}
+		printf ( "# convert %s\n", qusb_convert_isa() );
+		printf ( "# test           size   calls errors        bytes   "
+			 "seconds      MB/s    min_us    p50_us    p90_us    "
+			 "p99_us   p999_us    max_us\n" );
+	}
+
+	for ( i = 0 ; i < NUM_TESTS ; i++ ) {
+		test = &tests[i];
+		if ( ! selected ( &opts, test ) )
+			continue;
+
+		if ( test->flags & TEST_SIZED ) {
+			min = opts.min_size;
+			max = ( ( opts.max_size < test->max_size ) ?
+				opts.max_size : test->max_size );
+		} else {
+			min = max = test->max_size;
+		}
+
+		for ( size = min ; size <= max ; size *= 2 ) {
+			if ( test->flags & TEST_LOCAL ) {
+				mismatches += run_convert ( &bench, test, size );
+				continue;
+			}
+			memset ( &result, 0, sizeof ( result ) );
+			bench.nsamples = 0;
+			if ( test->run ) {
+				rc = test->run ( &bench, test, size, &result );
+			} else {
+				rc = run_calls ( &bench, test, size, &result );
+			}
+			if ( ( rc != 0 ) && ! result.first_error )
+				result.first_error = rc;
+			report ( &bench, test->name, size, &result );
+			if ( ! size )
+				break;
+		}
+	}
+
+	if ( bench.dev )
+		qusb_close ( bench.dev );
+	free ( bench.reference );
+	free ( bench.output );
+	free ( bench.samples );
+	free ( bench.buffer );
+	return ( mismatches ? EXIT_FAILURE : 0 );
+}
+
+/*
+ * Parse command-line options and return index of last element in
+ * argument list that is not an option
+ */
+int parseopts ( const int argc, char **argv, struct options *opts ) {
+	int c;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "board", required_argument, NULL, 'b' },
+			{ "backend", required_argument, NULL, 'B' },
+			{ "tests", required_argument, NULL, 't' },
+			{ "min-size", required_argument, NULL, 'm' },
+			{ "max-size", required_argument, NULL, 'M' },
+			{ "duration", required_argument, NULL, 'd' },
+			{ "calls", required_argument, NULL, 'n' },
+			{ "port", required_argument, NULL, 'p' },
+			{ "depth", required_argument, NULL, 'D' },
+			{ "writes", 0, NULL, 'w' },
+			{ "local", 0, NULL, 'L' },
+			{ "json", 0, NULL, 'j' },
+			{ "help", 0, NULL, 'h' },
+			{ 0, 0, 0, 0 }
+		};
+
+		if ( ( c = getopt_long ( argc, argv, "b:B:t:m:M:d:n:p:D:wLjh", long_options, &option_index ) ) == -1 ) {
+			break;
+		}
+
+		switch ( c ) {
+		case 'b':
+			opts->board = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'B':
+			if ( strcmp ( optarg, "kernel" ) == 0 ) {
+				opts->backend = QUSB_BACKEND_KERNEL;
+			} else if ( strcmp ( optarg, "libusb" ) == 0 ) {
+				opts->backend = QUSB_BACKEND_LIBUSB;
+			} else {
+				eprintf ( "Unknown backend: %s\n", optarg );
+				exit ( EXIT_FAILURE );
+			}
+			break;
+		case 't':
+			opts->tests = optarg;
+			break;
+		case 'm':
+			opts->min_size = qusb_parse_size ( optarg );
+			break;
+		case 'M':
+			opts->max_size = qusb_parse_size ( optarg );
+			break;
+		case 'd':
+			opts->duration = strtod ( optarg, NULL );
+			break;
+		case 'n':
+			opts->max_calls = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'p':
+			opts->port = ( ( optarg[0] >= 'a' ) ?
+				       ( optarg[0] - 'a' ) :
+				       strtoul ( optarg, NULL, 0 ) );
+			break;
+		case 'D':
+			opts->depth = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'w':
+			opts->writes = 1;
+			break;
+		case 'L':
+			opts->local = 1;
+			break;
+		case 'j':
+			opts->json = 1;
+			break;
+		case 'h':
+			printhelp();
+			break;
+		case '?':
+		default:
+			eprintf ( "Unrecognised option: %c\n", c );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	return optind;
+}
+
+void printhelp () {
+	unsigned int i;
+
+	printf( "qusb-bench: QuickUSB throughput and latency benchmark.\n"
+	"\n"
+	"USAGE:	qusb-bench [OPTIONS]\n"
+	"\n"
+	"	Each test runs for DURATION (or CALLS calls) per transfer size,\n"
+	"	sizes doubling from MIN to MAX. One line of results per point:\n"
+	"	calls, errors, bytes, seconds, MB/s, and per-call latency\n"
+	"	min/p50/p90/p99/p99.9/max in us (stream-read: the interval\n"
+	"	between completions). Lines starting # are comments.\n"
+	"\n"
+	"OPTIONS:\n"
+	"	-b, --board=N		Board number (default 0)\n"
+	"	-B, --backend=B		kernel or libusb (default: $QUSB_BACKEND, else kernel)\n"
+	"	-t, --tests=LIST	Comma-separated tests (default: all but writes\n"
+	"				and conversions)\n"
+	"	-w, --writes		Include the tests that drive the outputs\n"
+	"	-m, --min-size=N	Smallest transfer (default 2; k, M suffixes)\n"
+	"	-M, --max-size=N	Largest transfer (default 64M)\n"
+	"	-d, --duration=S	Seconds per point (default 1)\n"
+	"	-n, --calls=N		Maximum calls per point (default 100000)\n"
+	"	-p, --port=P		GPPIO port, a-e (default a)\n"
+	"	-D, --depth=N		Requests queued by stream-read (default 4)\n"
+	"	-L, --local		Run on the CPUs local to the board's host\n"
+	"				controller (from stream-read on)\n"
+	"	-j, --json		JSON lines output\n"
+	"	-h, --help		Show this help\n"
+	"\n"
+	"TESTS:\n"
+	"	");
+	for ( i = 0 ; i < NUM_TESTS ; i++ ) {
+		printf ( "%s%s%s", tests[i].name,
+			 ( ( tests[i].flags & TEST_WRITE ) ? "(w)" : "" ),
+			 ( ( i < ( NUM_TESTS - 1 ) ) ? ", " : "\n" ) );
+	}
+	printf( "\n"
+	"	hd = /dev/quNhd data, hc = /dev/quNhc command cycles (at address 0),\n"
+	"	open = open and close the board (which sets the HSPIO port mode).\n"
+	"	gppio-write rewrites the port's current value.\n"
+	"	swap16, split8, sext16 (12-bit), float16 and stats16 (4 channels)\n"
+	"	time libquickusb's sample conversions in memory (no board needed),\n"
+	"	once with each implementation the CPU has, checking each against\n"
+	"	scalar; the exit status is non-zero if any differs.\n"
+	"\n");
+
+	exit(EXIT_SUCCESS);
+}
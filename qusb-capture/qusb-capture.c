@@ -0,0 +1,1419 @@
+/*
+ * qusb-capture - capture QuickUSB HSPIO data to disk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+/*
+ * A reader thread does nothing but read() the board's HSPIO data into a
+ * large ring of fixed-size blocks, so that the board's FIFO is drained
+ * at a steady rate whatever the disk is doing.  A writer thread takes
+ * the blocks from the ring and writes them out with O_DIRECT through
+ * io_uring, several at a time, so the page cache is bypassed and a
+ * slow write only delays the writer.  The ring absorbs the difference
+ * (e.g. 256 MiB is 12 seconds at 20 MB/s); if it ever fills, the
+ * reader carries on reading, discards the data, and counts it as
+ * dropped, rather than let the FIFO overflow.  A file or pipe (-i) has
+ * no FIFO to overflow, so its reader waits for the writer instead, and
+ * nothing is dropped.  The ring and its reader are libquickusb's (see
+ * struct qusb_ring), shared with qusb-stripe.
+ *
+ * The ring is lock-free: the reader alone advances its head and the
+ * writer alone advances its tail, each published with release/acquire
+ * ordering.
+ *
+ * The output is a capture file (see libquickusb.h): each block in the
+ * ring is a struct qusb_file_block, filled in by the reader, followed
+ * by the data; the writer adds the header and the index.  Or (-R) the
+ * data alone.
+ *
+ * With -z, a pool of packer threads compresses the blocks in the ring
+ * (qusb_pack16) between the reader and the writer.  Each packer claims
+ * the next block in turn, and the writer takes them in order as they
+ * are marked packed, so blocks are compressed in parallel but written
+ * in sequence.
+ *
+ * With -S, statistics of the data (per channel minimum, maximum, mean,
+ * variance and histogram, and a decimated preview; see libquickusb.h)
+ * are published in shared memory at a fixed rate.  They are computed
+ * by the packers, before packing, or without -z by a statistics thread
+ * which follows the reader through the ring without holding blocks:
+ * it checks after analysing a block that the reader has not since
+ * reused it, and if it falls behind it skips ahead.  Either way the
+ * reader never waits for it.  qusb-capture -W reads them.
+ *
+ * With -V, a verifier thread checks the data against a test pattern
+ * (see libquickusb_verify.c) as it is read, reporting the stream offset
+ * of each gap, duplicate or damaged word.  It follows the reader in
+ * order, and the packers and writer follow it, so every block is
+ * checked before it can be packed or reused; data dropped because the
+ * ring was full is skipped, not reported.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <math.h>
+
+#include "../libquickusb/libquickusb.h"
+
+#define eprintf(...) fprintf ( stderr, __VA_ARGS__ )
+
+/* O_DIRECT alignment of buffers, offsets and lengths */
+#define CAPTURE_ALIGN		4096
+
+/* Preview points per block */
+#define STATS_POINTS		16
+
+struct options {
+	unsigned int board;
+	enum qusb_backend_type backend;
+	const char *input;		/* File to read instead of a board */
+	const char *output;
+	size_t block_size;
+	size_t ring_size;
+	unsigned int depth;		/* Writes in flight */
+	unsigned long long rotate_bytes;
+	unsigned int rotate_secs;
+	unsigned long long limit_bytes;
+	unsigned int limit_secs;
+	double interval;		/* Statistics */
+	int buffered;			/* No O_DIRECT */
+	int raw;			/* Data only, not a capture file */
+	unsigned int packers;		/* Compression threads */
+	const char *stats_name;		/* Shared memory to publish in */
+	unsigned int channels;		/* Interleaved in the samples */
+	int is_signed;
+	double stats_rate;		/* Hz */
+	const char *watch;		/* Shared memory to print */
+	const char *verify;		/* Test pattern */
+	int verbose;
+};
+
+/* Statistics of one block, before they are merged */
+struct stats_result {
+	struct qusb_stats16 sum[QUSB_STATS_MAX_CHANNELS];
+	uint32_t histogram[QUSB_STATS_MAX_CHANNELS][QUSB_STATS_BINS];
+	struct qusb_stats_point points[STATS_POINTS];
+	unsigned int npoints;
+	uint32_t point_samples;
+};
+
+struct packer {
+	struct capture *cap;
+	pthread_t thread;
+	unsigned char *buf;		/* qusb_pack16_bound() of a block */
+	struct stats_result result;
+};
+
+struct capture {
+	struct options *opts;
+	/* Ring, and its reader (the board, or input) */
+	struct qusb_ring ring;
+	pthread_t reader_thread;
+	/* Packers */
+	struct packer *packers;
+	unsigned long long pack_next;	/* Next block to claim */
+	unsigned char *packed;		/* Per block: compressed */
+	/* Statistics */
+	pthread_t stats_thread;
+	pthread_mutex_t stats_lock;
+	struct qusb_stats_shm *stats;	/* Being gathered */
+	struct qusb_stats_shm *stats_shm;	/* Published */
+	struct qusb_stats16 stats_sum[QUSB_STATS_MAX_CHANNELS];	/* Interval */
+	double stats_start;		/* Of the interval, us */
+	/* Verifier */
+	pthread_t verify_thread;
+	struct qusb_verify *verify;
+	unsigned long long verified;	/* Blocks checked */
+	int verify_done;
+	unsigned int verify_events;	/* Reported */
+	/* Writer */
+	pthread_t writer_thread;
+	int writer_done;
+	int writer_error;
+	struct qusb_writer *uring;	/* Or NULL: write synchronously */
+	double *submitted;		/* Per block: submission time, us */
+	unsigned char *done;		/* Per block: written */
+	unsigned long long bytes_written;
+	unsigned long long bytes_stored;	/* On disk */
+	unsigned int latency_max;	/* Slowest write this interval, us */
+	unsigned int files;
+	/* Current output file */
+	int fd;
+	int fd_direct;
+	unsigned long long file_offset;	/* Including padding */
+	unsigned long long file_bytes;	/* Data only */
+	double file_start;
+	struct qusb_file_header *header;	/* Aligned header block */
+	struct qusb_file_index_entry *index;
+	unsigned long long index_len;
+	unsigned long long index_max;
+};
+
+static volatile sig_atomic_t stop;
+
+int parseopts ( const int, char **argv, struct options * );
+void printhelp ();
+
+/****************************************************************************
+ *
+ * Statistics
+ *
+ */
+
+/* Analyse one block's data, from stream @offset */
+static void stats_analyse ( struct capture *cap, const unsigned char *data,
+			    size_t len, unsigned long long offset,
+			    struct stats_result *result ) {
+	struct options *opts = cap->opts;
+	struct qusb_stats16 seg[QUSB_STATS_MAX_CHANNELS];
+	struct qusb_stats16 *sum;
+	struct qusb_stats_point *point;
+	size_t samples = ( len / 2 );
+	size_t per_point;
+	size_t start;
+	size_t n;
+	uint16_t bias = ( opts->is_signed ? 0x8000 : 0 );
+	unsigned int c;
+	unsigned int p;
+	size_t i;
+
+	memset ( result, 0, sizeof ( *result ) );
+
+	/* Whole numbers of every channel count, per point */
+	per_point = ( ( samples / STATS_POINTS ) &
+		      ~( size_t ) ( QUSB_STATS_MAX_CHANNELS - 1 ) );
+	result->npoints = ( per_point ? STATS_POINTS : 1 );
+	result->point_samples = ( per_point / opts->channels );
+	for ( p = 0 ; p < result->npoints ; p++ ) {
+		start = ( p * per_point );
+		n = ( ( p == ( result->npoints - 1 ) ) ?
+		      ( samples - start ) : per_point );
+		qusb_stats16 ( ( data + ( 2 * start ) ), n, opts->channels,
+			       opts->is_signed, seg );
+		point = &result->points[p];
+		point->offset = ( offset + ( 2 * start ) );
+		for ( c = 0 ; c < opts->channels ; c++ ) {
+			point->min[c] = seg[c].min;
+			point->max[c] = seg[c].max;
+			sum = &result->sum[c];
+			if ( ! seg[c].count )
+				continue;
+			if ( ( ! sum->count ) || ( seg[c].min < sum->min ) )
+				sum->min = seg[c].min;
+			if ( ( ! sum->count ) || ( seg[c].max > sum->max ) )
+				sum->max = seg[c].max;
+			sum->count += seg[c].count;
+			sum->sum += seg[c].sum;
+			sum->sumsq += seg[c].sumsq;
+		}
+	}
+
+	for ( i = 0 ; i < samples ; i++ ) {
+		result->histogram[i % opts->channels]
+			[( ( data[( 2 * i ) + 1] << 8 ) ^ bias ) >> 8]++;
+	}
+}
+
+/* Add one block's statistics to the interval's */
+static void stats_merge ( struct capture *cap, struct stats_result *result ) {
+	struct qusb_stats_shm *stats = cap->stats;
+	struct qusb_stats16 *sum;
+	unsigned int c;
+	unsigned int p;
+	unsigned int b;
+
+	pthread_mutex_lock ( &cap->stats_lock );
+	for ( c = 0 ; c < cap->opts->channels ; c++ ) {
+		sum = &cap->stats_sum[c];
+		if ( result->sum[c].count ) {
+			if ( ( ! sum->count ) || ( result->sum[c].min < sum->min ) )
+				sum->min = result->sum[c].min;
+			if ( ( ! sum->count ) || ( result->sum[c].max > sum->max ) )
+				sum->max = result->sum[c].max;
+			sum->count += result->sum[c].count;
+			sum->sum += result->sum[c].sum;
+			sum->sumsq += result->sum[c].sumsq;
+		}
+		for ( b = 0 ; b < QUSB_STATS_BINS ; b++ ) {
+			stats->channel[c].histogram[b] +=
+				result->histogram[c][b];
+		}
+	}
+	for ( p = 0 ; p < result->npoints ; p++ ) {
+		stats->preview[stats->preview_count % QUSB_STATS_PREVIEW] =
+			result->points[p];
+		stats->preview_count++;
+	}
+	if ( result->point_samples )
+		stats->preview_samples = result->point_samples;
+	stats->blocks++;
+	pthread_mutex_unlock ( &cap->stats_lock );
+}
+
+/* Publish the interval's statistics, and start the next interval */
+static void stats_publish ( struct capture *cap ) {
+	struct qusb_stats_shm *stats = cap->stats;
+	struct qusb_stats_channel *channel;
+	struct qusb_stats16 *sum;
+	struct timespec ts;
+	double t = qusb_now_us();
+	double mean;
+	unsigned int c;
+
+	clock_gettime ( CLOCK_REALTIME, &ts );
+	pthread_mutex_lock ( &cap->stats_lock );
+	for ( c = 0 ; c < cap->opts->channels ; c++ ) {
+		sum = &cap->stats_sum[c];
+		channel = &stats->channel[c];
+		mean = ( sum->count ? ( ( double ) sum->sum / sum->count ) : 0 );
+		channel->min = sum->min;
+		channel->max = sum->max;
+		channel->mean = mean;
+		channel->variance = ( sum->count ?
+				      ( ( ( double ) sum->sumsq / sum->count ) -
+					( mean * mean ) ) : 0 );
+	}
+	stats->updated_ns = ( ( ts.tv_sec * 1000000000ULL ) + ts.tv_nsec );
+	stats->interval_ns = ( ( t - cap->stats_start ) * 1e3 );
+	stats->samples = cap->stats_sum[0].count;
+	stats->bytes_read = __atomic_load_n ( &cap->ring.bytes_read,
+					      __ATOMIC_RELAXED );
+	stats->bytes_dropped = __atomic_load_n ( &cap->ring.bytes_dropped,
+						 __ATOMIC_RELAXED );
+
+	/* Seqlock: odd while the copy is inconsistent */
+	stats->sequence++;
+	__atomic_store_n ( &cap->stats_shm->sequence, stats->sequence,
+			   __ATOMIC_RELAXED );
+	__atomic_thread_fence ( __ATOMIC_RELEASE );
+	memcpy ( cap->stats_shm, stats, sizeof ( *stats ) );
+	stats->sequence++;
+	__atomic_store_n ( &cap->stats_shm->sequence, stats->sequence,
+			   __ATOMIC_RELEASE );
+
+	memset ( cap->stats_sum, 0, sizeof ( cap->stats_sum ) );
+	for ( c = 0 ; c < cap->opts->channels ; c++ ) {
+		memset ( stats->channel[c].histogram, 0,
+			 sizeof ( stats->channel[c].histogram ) );
+	}
+	cap->stats_start = t;
+	pthread_mutex_unlock ( &cap->stats_lock );
+}
+
+/* Without packers, follow the reader through the ring */
+static void * stats_thread ( void *arg ) {
+	struct capture *cap = arg;
+	struct stats_result *result;
+	struct qusb_file_block *block;
+	unsigned long long seq = 0;
+	unsigned long long head;
+	unsigned long long offset;
+	unsigned char *data;
+	unsigned int slot;
+	size_t len;
+
+	if ( ! ( result = malloc ( sizeof ( *result ) ) ) )
+		return NULL;
+
+	while ( 1 ) {
+		head = __atomic_load_n ( &cap->ring.head, __ATOMIC_ACQUIRE );
+		if ( seq >= head ) {
+			if ( __atomic_load_n ( &cap->ring.done,
+					       __ATOMIC_ACQUIRE ) &&
+			     ( seq >= __atomic_load_n ( &cap->ring.head,
+							__ATOMIC_ACQUIRE ) ) )
+				break;
+			usleep ( 1000 );
+			continue;
+		}
+		/* Well behind: catch up, rather than race the reader */
+		if ( ( head - seq ) > ( cap->ring.nblocks / 2 ) ) {
+			__atomic_add_fetch ( &cap->stats->blocks_skipped,
+					     ( head - 1 - seq ),
+					     __ATOMIC_RELAXED );
+			seq = ( head - 1 );
+		}
+
+		slot = ( seq % cap->ring.nblocks );
+		block = ( void * ) qusb_ring_block ( &cap->ring, seq );
+		data = ( ( unsigned char * ) block + cap->ring.header_size );
+		len = cap->ring.lengths[slot];
+		offset = ( cap->opts->raw ? ( seq * cap->opts->block_size ) :
+			   block->offset );
+		stats_analyse ( cap, data, len, offset, result );
+
+		/* Discard it if the reader has reused the block meanwhile */
+		__atomic_thread_fence ( __ATOMIC_SEQ_CST );
+		if ( ( __atomic_load_n ( &cap->ring.head, __ATOMIC_RELAXED ) - seq ) <
+		     cap->ring.nblocks ) {
+			stats_merge ( cap, result );
+		} else {
+			__atomic_add_fetch ( &cap->stats->blocks_skipped, 1,
+					     __ATOMIC_RELAXED );
+		}
+		seq++;
+	}
+
+	free ( result );
+	return NULL;
+}
+
+/* Create the shared memory object */
+static int stats_init ( struct capture *cap ) {
+	struct options *opts = cap->opts;
+	char name[256];
+	int fd;
+
+	snprintf ( name, sizeof ( name ), "/%s", opts->stats_name );
+	if ( ( fd = shm_open ( name, ( O_RDWR | O_CREAT | O_TRUNC ),
+			       0644 ) ) < 0 )
+		return -errno;
+	if ( ftruncate ( fd, sizeof ( *cap->stats_shm ) ) < 0 ) {
+		close ( fd );
+		return -errno;
+	}
+	cap->stats_shm = mmap ( NULL, sizeof ( *cap->stats_shm ),
+				( PROT_READ | PROT_WRITE ), MAP_SHARED, fd, 0 );
+	close ( fd );
+	if ( cap->stats_shm == MAP_FAILED )
+		return -errno;
+
+	if ( ! ( cap->stats = calloc ( 1, sizeof ( *cap->stats ) ) ) )
+		return -ENOMEM;
+	cap->stats->magic = QUSB_STATS_MAGIC;
+	cap->stats->version = QUSB_STATS_VERSION;
+	cap->stats->flags = ( opts->is_signed ? QUSB_STATS_SIGNED : 0 );
+	cap->stats->channels = opts->channels;
+	pthread_mutex_init ( &cap->stats_lock, NULL );
+	cap->stats_start = qusb_now_us();
+	return 0;
+}
+
+static void stats_cleanup ( struct capture *cap ) {
+	char name[256];
+
+	snprintf ( name, sizeof ( name ), "/%s", cap->opts->stats_name );
+	shm_unlink ( name );
+	munmap ( cap->stats_shm, sizeof ( *cap->stats_shm ) );
+	free ( cap->stats );
+}
+
+/* Print another capture's statistics, until it stops */
+static int watch ( struct options *opts ) {
+	const struct qusb_stats_shm *shm;
+	struct qusb_stats_shm *stats;
+	struct timespec ts;
+	unsigned long long now;
+	uint64_t last = 0;
+	uint32_t seq;
+	char name[256];
+	unsigned int c;
+	int fd;
+
+	snprintf ( name, sizeof ( name ), "/%s", opts->watch );
+	if ( ( fd = shm_open ( name, O_RDONLY, 0 ) ) < 0 ) {
+		eprintf ( "Error: Could not open %s: %s\n", name,
+			  strerror ( errno ) );
+		return -errno;
+	}
+	shm = mmap ( NULL, sizeof ( *shm ), PROT_READ, MAP_SHARED, fd, 0 );
+	close ( fd );
+	if ( ( shm == MAP_FAILED ) ||
+	     ! ( stats = malloc ( sizeof ( *stats ) ) ) ) {
+		eprintf ( "Error: Could not map %s\n", name );
+		return -ENOMEM;
+	}
+
+	printf ( "# seconds samples blocks_skipped bytes_dropped "
+		 "[min max mean stddev] per channel\n" );
+	while ( ! stop ) {
+		do {
+			seq = __atomic_load_n ( &shm->sequence,
+						__ATOMIC_ACQUIRE );
+			memcpy ( stats, shm, sizeof ( *stats ) );
+			__atomic_thread_fence ( __ATOMIC_ACQUIRE );
+		} while ( ( seq & 1 ) ||
+			  ( seq != __atomic_load_n ( &shm->sequence,
+						     __ATOMIC_RELAXED ) ) );
+
+		clock_gettime ( CLOCK_REALTIME, &ts );
+		now = ( ( ts.tv_sec * 1000000000ULL ) + ts.tv_nsec );
+		if ( stats->magic != QUSB_STATS_MAGIC ) {
+			/* Not yet published */
+		} else if ( stats->updated_ns != last ) {
+			last = stats->updated_ns;
+			printf ( "%.3f %llu %llu %llu", ( last / 1e9 ),
+				 ( unsigned long long ) stats->samples,
+				 ( unsigned long long ) stats->blocks_skipped,
+				 ( unsigned long long ) stats->bytes_dropped );
+			for ( c = 0 ; ( ( c < stats->channels ) &&
+					( c < QUSB_STATS_MAX_CHANNELS ) ) ; c++ ) {
+				printf ( "  %d %d %.2f %.2f",
+					 stats->channel[c].min,
+					 stats->channel[c].max,
+					 stats->channel[c].mean,
+					 sqrt ( stats->channel[c].variance ) );
+			}
+			printf ( "\n" );
+			fflush ( stdout );
+		} else if ( ( now - last ) > ( 10 * ( stats->interval_ns +
+						      1000000000ULL ) ) ) {
+			/* The capture has stopped */
+			break;
+		}
+		usleep ( opts->interval * 1e6 );
+	}
+
+	free ( stats );
+	munmap ( ( void * ) shm, sizeof ( *shm ) );
+	return 0;
+}
+
+/****************************************************************************
+ *
+ * Verifier
+ *
+ */
+
+/* Blocks the packers and writer may take: read, and checked if -V;
+ * done is set first if no more will come */
+static unsigned long long ring_ready ( struct capture *cap, int *done ) {
+	if ( cap->verify ) {
+		*done = __atomic_load_n ( &cap->verify_done, __ATOMIC_ACQUIRE );
+		return __atomic_load_n ( &cap->verified, __ATOMIC_ACQUIRE );
+	}
+	*done = __atomic_load_n ( &cap->ring.done, __ATOMIC_ACQUIRE );
+	return __atomic_load_n ( &cap->ring.head, __ATOMIC_ACQUIRE );
+}
+
+/* Events reported in full; the rest are only counted */
+#define VERIFY_EVENTS_MAX	1000
+
+static void verify_report ( void *priv,
+			    const struct qusb_verify_event *event ) {
+	struct capture *cap = priv;
+
+	if ( cap->verify_events++ >= VERIFY_EVENTS_MAX ) {
+		if ( cap->verify_events == ( VERIFY_EVENTS_MAX + 1 ) )
+			eprintf ( "# verify: further errors only counted\n" );
+		return;
+	}
+	eprintf ( "# verify: %s at byte %llu count %llu expected 0x%04x "
+		  "actual 0x%04x\n", qusb_verify_event_name ( event->type ),
+		  ( unsigned long long ) event->offset,
+		  ( unsigned long long ) event->count, event->expected,
+		  event->actual );
+}
+
+static void * verify_thread ( void *arg ) {
+	struct capture *cap = arg;
+	unsigned long long seq = 0;
+	unsigned long long offset = 0;	/* Expected next */
+	unsigned char *data;
+	unsigned int i;
+	int done;
+
+	while ( 1 ) {
+		done = __atomic_load_n ( &cap->ring.done, __ATOMIC_ACQUIRE );
+		if ( seq >= __atomic_load_n ( &cap->ring.head, __ATOMIC_ACQUIRE ) ) {
+			if ( done )
+				break;
+			usleep ( 1000 );
+			continue;
+		}
+		i = ( seq % cap->ring.nblocks );
+		data = ( qusb_ring_block ( &cap->ring, seq ) +
+			 cap->ring.header_size );
+		/* Dropped by the reader, not lost by the board */
+		qusb_verify_skip ( cap->verify, ( cap->ring.offsets[i] - offset ) );
+		qusb_verify_data ( cap->verify, data, cap->ring.lengths[i] );
+		offset = ( cap->ring.offsets[i] + cap->ring.lengths[i] );
+		seq++;
+		__atomic_store_n ( &cap->verified, seq, __ATOMIC_RELEASE );
+	}
+	qusb_verify_skip ( cap->verify, ( cap->ring.bytes_read - offset ) );
+	qusb_verify_finish ( cap->verify );
+	__atomic_store_n ( &cap->verify_done, 1, __ATOMIC_RELEASE );
+	return NULL;
+}
+
+/* Print the totals; returns nonzero if anything was wrong */
+static int verify_summary ( struct capture *cap ) {
+	const struct qusb_verify_stats *stats =
+		qusb_verify_stats ( cap->verify );
+
+	eprintf ( "# verify words %llu gaps %llu lost %llu duplicates %llu "
+		  "repeated %llu flips %llu corrupt %llu frames %llu "
+		  "crc_errors %llu resyncs %llu skipped_bytes %llu\n",
+		  ( unsigned long long ) stats->words,
+		  ( unsigned long long ) stats->gaps,
+		  ( unsigned long long ) stats->lost,
+		  ( unsigned long long ) stats->duplicates,
+		  ( unsigned long long ) stats->repeated,
+		  ( unsigned long long ) stats->flips,
+		  ( unsigned long long ) stats->corrupt,
+		  ( unsigned long long ) stats->frames,
+		  ( unsigned long long ) stats->crc_errors,
+		  ( unsigned long long ) stats->resyncs,
+		  ( unsigned long long ) stats->skipped );
+	return ( stats->gaps || stats->duplicates || stats->flips ||
+		 stats->corrupt || stats->crc_errors || stats->resyncs );
+}
+
+/****************************************************************************
+ *
+ * Packers
+ *
+ */
+
+static size_t packer_buf_size ( struct capture *cap ) {
+	return qusb_pack16_bound ( cap->opts->block_size - cap->ring.header_size );
+}
+
+static void * packer ( void *arg ) {
+	struct packer *packer = arg;
+	struct capture *cap = packer->cap;
+	struct qusb_file_block *block;
+	unsigned long long seq;
+	size_t max = packer_buf_size ( cap );
+	unsigned char *data;
+	ssize_t len;
+	int done;
+
+	while ( 1 ) {
+		seq = __atomic_fetch_add ( &cap->pack_next, 1,
+					   __ATOMIC_RELAXED );
+
+		/* Wait for the block to be read (and verified) */
+		while ( seq >= ring_ready ( cap, &done ) ) {
+			if ( done )
+				return NULL;
+			usleep ( 1000 );
+		}
+
+		block = ( void * ) qusb_ring_block ( &cap->ring, seq );
+		data = ( ( unsigned char * ) block + cap->ring.header_size );
+		if ( cap->stats ) {
+			stats_analyse ( cap, data, block->length, block->offset,
+					&packer->result );
+			stats_merge ( cap, &packer->result );
+		}
+		len = qusb_pack16 ( data, block->length, packer->buf, max );
+		/* Incompressible data is left as it is */
+		if ( ( len > 0 ) && ( len < block->length ) ) {
+			memcpy ( data, packer->buf, len );
+			block->stored = len;
+			block->flags |= QUSB_FILE_BLOCK_PACKED;
+		}
+		__atomic_store_n ( &cap->packed[seq % cap->ring.nblocks], 1,
+				   __ATOMIC_RELEASE );
+	}
+}
+
+/****************************************************************************
+ *
+ * Writer
+ *
+ */
+
+static int file_open ( struct capture *cap ) {
+	struct options *opts = cap->opts;
+	char name[4096];
+	int flags = ( O_WRONLY | O_CREAT | O_TRUNC );
+
+	if ( opts->rotate_bytes || opts->rotate_secs ) {
+		snprintf ( name, sizeof ( name ), "%s.%05u", opts->output,
+			   cap->files );
+	} else {
+		snprintf ( name, sizeof ( name ), "%s", opts->output );
+	}
+
+	cap->fd_direct = ! opts->buffered;
+	cap->fd = open ( name, ( flags | ( cap->fd_direct ? O_DIRECT : 0 ) ),
+			 0644 );
+	if ( ( cap->fd < 0 ) && ( errno == EINVAL ) && cap->fd_direct ) {
+		/* e.g. tmpfs */
+		if ( cap->files == 0 )
+			eprintf ( "Warning: %s does not support O_DIRECT\n",
+				  name );
+		cap->fd_direct = 0;
+		cap->fd = open ( name, flags, 0644 );
+	}
+	if ( cap->fd < 0 ) {
+		eprintf ( "Error: Could not open %s: %s\n", name,
+			  strerror ( errno ) );
+		return -errno;
+	}
+	if ( opts->verbose )
+		eprintf ( "# file %s\n", name );
+
+	cap->files++;
+	cap->file_offset = 0;
+	cap->file_bytes = 0;
+	cap->file_start = qusb_now_us();
+	cap->index_len = 0;
+
+	if ( ! opts->raw ) {
+		/* The index is filled in on closing */
+		cap->header->index_offset = 0;
+		cap->header->index_count = 0;
+		if ( pwrite ( cap->fd, cap->header, QUSB_FILE_HEADER_SIZE,
+			      0 ) != QUSB_FILE_HEADER_SIZE )
+			return ( ( errno > 0 ) ? -errno : -ENOSPC );
+		cap->file_offset = QUSB_FILE_HEADER_SIZE;
+	}
+	return 0;
+}
+
+/* Record a block in the index */
+static int file_index ( struct capture *cap, const void *block,
+			unsigned long long position ) {
+	const struct qusb_file_block *header = block;
+	struct qusb_file_index_entry *index;
+	unsigned long long max;
+
+	if ( cap->index_len == cap->index_max ) {
+		max = ( cap->index_max ? ( cap->index_max * 2 ) : 4096 );
+		if ( ! ( index = realloc ( cap->index,
+					   ( max * sizeof ( *index ) ) ) ) )
+			return -ENOMEM;
+		cap->index = index;
+		cap->index_max = max;
+	}
+	cap->index[cap->index_len].offset = header->offset;
+	cap->index[cap->index_len].timestamp_ns = header->timestamp_ns;
+	cap->index[cap->index_len].position = position;
+	cap->index_len++;
+	return 0;
+}
+
+/* Append the index (all writes have completed), and point the header
+ * at it */
+static int file_write_index ( struct capture *cap ) {
+	size_t len = ( cap->index_len * sizeof ( cap->index[0] ) );
+	size_t padded = ( ( len + CAPTURE_ALIGN - 1 ) & ~( CAPTURE_ALIGN - 1 ) );
+	void *buf;
+	int rc = 0;
+
+	if ( posix_memalign ( &buf, CAPTURE_ALIGN, padded ) != 0 )
+		return -ENOMEM;
+	memset ( ( buf + len ), 0, ( padded - len ) );
+	memcpy ( buf, cap->index, len );
+	if ( pwrite ( cap->fd, buf, padded, cap->file_offset ) !=
+	     ( ssize_t ) padded ) {
+		rc = ( ( errno > 0 ) ? -errno : -ENOSPC );
+		goto err;
+	}
+
+	cap->header->index_offset = cap->file_offset;
+	cap->header->index_count = cap->index_len;
+	if ( pwrite ( cap->fd, cap->header, QUSB_FILE_HEADER_SIZE, 0 ) !=
+	     QUSB_FILE_HEADER_SIZE ) {
+		rc = ( ( errno > 0 ) ? -errno : -ENOSPC );
+		goto err;
+	}
+	cap->file_offset += padded;
+
+ err:
+	free ( buf );
+	return rc;
+}
+
+static int file_close ( struct capture *cap ) {
+	int rc = 0;
+
+	if ( ! cap->opts->raw ) {
+		rc = file_write_index ( cap );
+	} else if ( ( cap->file_offset != cap->file_bytes ) &&
+		    ( ftruncate ( cap->fd, cap->file_bytes ) < 0 ) ) {
+		/* Remove the padding after a short final block */
+		rc = -errno;
+	}
+	if ( ( close ( cap->fd ) < 0 ) && ! rc )
+		rc = -errno;
+	cap->fd = -1;
+	return rc;
+}
+
+static int file_full ( struct capture *cap ) {
+	struct options *opts = cap->opts;
+
+	return ( ( opts->rotate_bytes &&
+		   ( cap->file_offset >= opts->rotate_bytes ) ) ||
+		 ( opts->rotate_secs &&
+		   ( ( qusb_now_us() - cap->file_start ) >=
+		     ( opts->rotate_secs * 1e6 ) ) ) );
+}
+
+/* A block has been written */
+static void write_done ( struct capture *cap, unsigned long long seq ) {
+	unsigned int i = ( seq % cap->ring.nblocks );
+	unsigned int latency = ( qusb_now_us() - cap->submitted[i] );
+
+	if ( latency > cap->latency_max )
+		__atomic_store_n ( &cap->latency_max, latency,
+				   __ATOMIC_RELAXED );
+	__atomic_add_fetch ( &cap->bytes_written, cap->ring.lengths[i],
+			     __ATOMIC_RELAXED );
+	cap->done[i] = 1;
+}
+
+static void * writer ( void *arg ) {
+	struct capture *cap = arg;
+	struct options *opts = cap->opts;
+	unsigned long long next = 0;	/* Next block to submit */
+	unsigned long long tail = 0;
+	unsigned long long head;
+	unsigned int inflight = 0;
+	unsigned int queued;
+	struct qusb_write_done done;
+	struct qusb_file_block *block;
+	unsigned char *data;
+	size_t len;
+	size_t padded;
+	ssize_t res;
+	int rotate = 0;
+	int blocked;
+	int reader_done;
+	int rc;
+
+	if ( ( rc = file_open ( cap ) ) != 0 )
+		goto err;
+
+	while ( 1 ) {
+		head = ring_ready ( cap, &reader_done );
+
+		/* Queue writes of the blocks read (and packed) */
+		blocked = 0;
+		for ( queued = 0 ; ( ( next < head ) &&
+				     ( inflight < opts->depth ) ) ; next++ ) {
+			if ( ! rotate && file_full ( cap ) )
+				rotate = 1;
+			if ( rotate )
+				break;
+			if ( opts->packers &&
+			     ! __atomic_load_n ( &cap->packed[next % cap->ring.nblocks],
+						 __ATOMIC_ACQUIRE ) ) {
+				blocked = 1;
+				break;
+			}
+			data = qusb_ring_block ( &cap->ring, next );
+			len = cap->ring.lengths[next % cap->ring.nblocks];
+			if ( ! opts->raw ) {
+				/* Whole blocks, for the index to work, or
+				 * as little as will hold the packed data */
+				block = ( void * ) data;
+				padded = opts->block_size;
+				if ( opts->packers ) {
+					padded = ( ( cap->ring.header_size +
+						     block->stored +
+						     CAPTURE_ALIGN - 1 ) &
+						   ~( CAPTURE_ALIGN - 1 ) );
+				}
+				memset ( ( data + cap->ring.header_size +
+					   block->stored ), 0,
+					 ( padded - cap->ring.header_size -
+					   block->stored ) );
+				if ( ( rc = file_index ( cap, data,
+							 cap->file_offset ) ) != 0 )
+					goto err_write;
+			} else {
+				padded = len;
+				if ( cap->fd_direct && ( len % CAPTURE_ALIGN ) ) {
+					padded = ( ( len + CAPTURE_ALIGN - 1 ) &
+						   ~( CAPTURE_ALIGN - 1 ) );
+					memset ( ( data + len ), 0,
+						 ( padded - len ) );
+				}
+			}
+			cap->submitted[next % cap->ring.nblocks] = qusb_now_us();
+			if ( cap->uring ) {
+				if ( ( rc = qusb_writer_write ( cap->uring,
+								cap->fd, data,
+								padded,
+								cap->file_offset,
+								next ) ) != 0 )
+					goto err_write;
+				queued++;
+				inflight++;
+			} else {
+				res = pwrite ( cap->fd, data, padded,
+					       cap->file_offset );
+				if ( res != ( ssize_t ) padded ) {
+					rc = ( ( res < 0 ) ? -errno : -ENOSPC );
+					goto err_write;
+				}
+				write_done ( cap, next );
+				queued++;
+			}
+			cap->file_offset += padded;
+			cap->file_bytes += len;
+			cap->bytes_stored += padded;
+		}
+
+		/* Submit, and wait for a completion if there is nothing
+		 * else to do */
+		if ( cap->uring && ( queued || inflight ) ) {
+			if ( ( rc = qusb_writer_submit ( cap->uring,
+					( ( ( next < head ) && ! rotate &&
+					    ( inflight < opts->depth ) ) ?
+					  ( blocked ? 1 : 0 ) : 100 ) ) ) != 0 )
+				goto err_write;
+		}
+
+		/* Reap completions */
+		while ( cap->uring && qusb_writer_reap ( cap->uring, &done ) ) {
+			if ( done.res < 0 ) {
+				rc = done.res;
+				goto err_write;
+			}
+			write_done ( cap, done.user_data );
+			inflight--;
+		}
+
+		/* Release written blocks to the reader, in order */
+		while ( ( tail < next ) && cap->done[tail % cap->ring.nblocks] ) {
+			cap->done[tail % cap->ring.nblocks] = 0;
+			if ( opts->packers )
+				cap->packed[tail % cap->ring.nblocks] = 0;
+			tail++;
+		}
+		qusb_ring_release ( &cap->ring, tail );
+
+		if ( rotate && ! inflight ) {
+			if ( ( rc = file_close ( cap ) ) != 0 )
+				goto err_write;
+			if ( ( rc = file_open ( cap ) ) != 0 )
+				goto err;
+			rotate = 0;
+		}
+
+		if ( reader_done && ( tail == head ) )
+			break;
+		if ( ! queued && ! inflight ) {
+			/* Idle: wait for the reader, or the packers */
+			usleep ( 1000 );
+		}
+	}
+
+	if ( ( rc = file_close ( cap ) ) != 0 )
+		goto err;
+	__atomic_store_n ( &cap->writer_done, 1, __ATOMIC_RELEASE );
+	return NULL;
+
+ err_write:
+	file_close ( cap );
+ err:
+	cap->writer_error = rc;
+	/* Stop reading too: nothing more can be written */
+	stop = 1;
+	__atomic_store_n ( &cap->writer_done, 1, __ATOMIC_RELEASE );
+	return NULL;
+}
+
+/****************************************************************************
+ *
+ * Main
+ *
+ */
+
+static void handle_signal ( int sig ) {
+	stop = 1;
+}
+
+/* Interrupts the reader's read() (no SA_RESTART) */
+static void handle_wakeup ( int sig ) {
+}
+
+static void report ( struct capture *cap, double start, int final ) {
+	static unsigned long long last_read;
+	static unsigned long long last_written;
+	static double last;
+	unsigned long long bytes_read;
+	unsigned long long bytes_written;
+	unsigned long long head;
+	unsigned long long tail;
+	double t = qusb_now_us();
+	double dt = ( ( final ? ( t - start ) : ( t - last ) ) / 1e6 );
+
+	if ( dt <= 0 )
+		dt = 1e-6;
+	bytes_read = __atomic_load_n ( &cap->ring.bytes_read, __ATOMIC_RELAXED );
+	bytes_written = __atomic_load_n ( &cap->bytes_written,
+					  __ATOMIC_RELAXED );
+	head = __atomic_load_n ( &cap->ring.head, __ATOMIC_RELAXED );
+	tail = __atomic_load_n ( &cap->ring.tail, __ATOMIC_RELAXED );
+
+	eprintf ( "%s%.1f %.3f %.3f %.1f %.1f %llu %.1f %u\n",
+		  ( final ? "# total " : "" ), ( ( t - start ) / 1e6 ),
+		  ( ( final ? bytes_read : ( bytes_read - last_read ) ) /
+		    dt / 1e6 ),
+		  ( ( final ? bytes_written :
+		      ( bytes_written - last_written ) ) / dt / 1e6 ),
+		  ( ( ( head - tail ) * 100.0 ) / cap->ring.nblocks ),
+		  ( ( __atomic_load_n ( &cap->ring.fill_max, __ATOMIC_RELAXED ) *
+		      100.0 ) / cap->ring.nblocks ),
+		  ( unsigned long long )
+		  __atomic_load_n ( &cap->ring.bytes_dropped, __ATOMIC_RELAXED ),
+		  ( __atomic_exchange_n ( &cap->latency_max, 0,
+					  __ATOMIC_RELAXED ) / 1e3 ),
+		  cap->files );
+
+	last_read = bytes_read;
+	last_written = bytes_written;
+	last = t;
+}
+
+int main ( int argc, char* argv[] ) {
+	static struct capture cap;
+	struct options opts;
+	struct sigaction sa;
+	double start;
+	double next_report;
+	double next_stats;
+	enum qusb_verify_pattern pattern;
+	unsigned int frame_words;
+	unsigned int i;
+	int rc;
+
+	memset ( &opts, 0, sizeof ( opts ) );
+	opts.block_size = ( 1024 * 1024 );
+	opts.ring_size = ( 256 * 1024 * 1024 );
+	opts.depth = 4;
+	opts.interval = 1.0;
+	opts.channels = 1;
+	opts.stats_rate = 10;
+
+	memset ( &sa, 0, sizeof ( sa ) );
+	sa.sa_handler = handle_signal;
+	sigaction ( SIGINT, &sa, NULL );
+	sigaction ( SIGTERM, &sa, NULL );
+	sa.sa_handler = handle_wakeup;
+	sigaction ( SIGUSR1, &sa, NULL );
+
+	i = parseopts ( argc, argv, &opts );
+	if ( opts.watch ) {
+		if ( opts.interval <= 0 ) {
+			eprintf ( "Invalid options (see -h)\n" );
+			exit ( EXIT_FAILURE );
+		}
+		exit ( ( watch ( &opts ) == 0 ) ? EXIT_SUCCESS : EXIT_FAILURE );
+	}
+	if ( i != ( unsigned int ) ( argc - 1 ) ) {
+		eprintf ( "Error: no output file given (see -h)\n" );
+		exit ( EXIT_FAILURE );
+	}
+	opts.output = argv[argc - 1];
+	if ( ( opts.block_size < CAPTURE_ALIGN ) ||
+	     ( opts.block_size % CAPTURE_ALIGN ) ||
+	     ( opts.ring_size < ( 2 * opts.block_size ) ) ||
+	     ( opts.depth < 1 ) || ( opts.depth > 256 ) ||
+	     ( opts.interval <= 0 ) || ( opts.packers > 64 ) ||
+	     ( opts.packers && opts.raw ) || ( opts.channels < 1 ) ||
+	     ( QUSB_STATS_MAX_CHANNELS % opts.channels ) ||
+	     ( opts.stats_rate <= 0 ) ) {
+		eprintf ( "Invalid options (see -h)\n" );
+		exit ( EXIT_FAILURE );
+	}
+
+	memset ( &cap, 0, sizeof ( cap ) );
+	cap.opts = &opts;
+	cap.fd = -1;
+	cap.ring.nblocks = ( opts.ring_size / opts.block_size );
+	cap.ring.block_size = opts.block_size;
+	cap.ring.header_size = ( opts.raw ? 0 : QUSB_FILE_BLOCK_HEADER_SIZE );
+	cap.ring.limit_bytes = opts.limit_bytes;
+	if ( opts.depth > cap.ring.nblocks )
+		opts.depth = cap.ring.nblocks;
+	if ( ( posix_memalign ( ( void ** ) &cap.ring.blocks, CAPTURE_ALIGN,
+				( ( size_t ) cap.ring.nblocks *
+				  opts.block_size ) ) != 0 ) ||
+	     ( posix_memalign ( ( void ** ) &cap.ring.scratch, CAPTURE_ALIGN,
+				opts.block_size ) != 0 ) ||
+	     ( posix_memalign ( ( void ** ) &cap.header, CAPTURE_ALIGN,
+				QUSB_FILE_HEADER_SIZE ) != 0 ) ||
+	     ! ( cap.ring.lengths = calloc ( cap.ring.nblocks,
+					     sizeof ( cap.ring.lengths[0] ) ) ) ||
+	     ! ( cap.ring.offsets = calloc ( cap.ring.nblocks,
+					     sizeof ( cap.ring.offsets[0] ) ) ) ||
+	     ! ( cap.submitted = calloc ( cap.ring.nblocks,
+					  sizeof ( cap.submitted[0] ) ) ) ||
+	     ! ( cap.done = calloc ( cap.ring.nblocks, sizeof ( cap.done[0] ) ) ) ||
+	     ! ( cap.packed = calloc ( cap.ring.nblocks,
+				       sizeof ( cap.packed[0] ) ) ) ||
+	     ! ( cap.packers = calloc ( ( opts.packers + 1 ),
+					sizeof ( cap.packers[0] ) ) ) ) {
+		eprintf ( "Error: out of memory\n" );
+		exit ( EXIT_FAILURE );
+	}
+	for ( i = 0 ; i < opts.packers ; i++ ) {
+		cap.packers[i].cap = &cap;
+		if ( ! ( cap.packers[i].buf = malloc ( packer_buf_size ( &cap ) ) ) ) {
+			eprintf ( "Error: out of memory\n" );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	/* Fault the ring in now, and keep it resident if allowed */
+	memset ( cap.ring.blocks, 0,
+		 ( ( size_t ) cap.ring.nblocks * opts.block_size ) );
+	if ( ( mlock ( cap.ring.blocks, ( ( size_t ) cap.ring.nblocks *
+				   opts.block_size ) ) < 0 ) && opts.verbose )
+		eprintf ( "Warning: could not lock the ring in memory: %s\n",
+			  strerror ( errno ) );
+
+	if ( ( rc = qusb_writer_create ( opts.depth, &cap.uring ) ) != 0 ) {
+		eprintf ( "Warning: io_uring unavailable (%s), writing "
+			  "synchronously\n", strerror ( -rc ) );
+	}
+
+	if ( opts.input ) {
+		cap.ring.input_fd = ( strcmp ( opts.input, "-" ) ?
+				      open ( opts.input, O_RDONLY ) : 0 );
+		if ( cap.ring.input_fd < 0 ) {
+			eprintf ( "Error: Could not open %s: %s\n", opts.input,
+				  strerror ( errno ) );
+			exit ( EXIT_FAILURE );
+		}
+	} else if ( ( rc = qusb_open_backend ( opts.backend, opts.board,
+					       &cap.ring.dev ) ) != 0 ) {
+		eprintf ( "Error: Could not open board %u: %s\n", opts.board,
+			  strerror ( -rc ) );
+		exit ( EXIT_FAILURE );
+	}
+
+	/* The board's settings, as the capture starts, head each file */
+	memset ( cap.header, 0, QUSB_FILE_HEADER_SIZE );
+	qusb_file_header_init ( cap.ring.dev, cap.header, opts.block_size );
+	if ( opts.packers )
+		cap.header->flags |= QUSB_FILE_PACKED;
+
+	if ( opts.verify ) {
+		if ( ( ( rc = qusb_verify_parse ( opts.verify, &pattern,
+						  &frame_words ) ) != 0 ) ||
+		     ( ( rc = qusb_verify_create ( pattern, frame_words,
+						   verify_report, &cap,
+						   &cap.verify ) ) != 0 ) ) {
+			eprintf ( "Error: Could not verify %s: %s\n",
+				  opts.verify, strerror ( -rc ) );
+			exit ( EXIT_FAILURE );
+		}
+	}
+
+	if ( opts.stats_name && ( ( rc = stats_init ( &cap ) ) != 0 ) ) {
+		eprintf ( "Error: Could not create /%s: %s\n", opts.stats_name,
+			  strerror ( -rc ) );
+		exit ( EXIT_FAILURE );
+	}
+
+	start = qusb_now_us();
+	if ( ( ( rc = pthread_create ( &cap.writer_thread, NULL, writer,
+				       &cap ) ) != 0 ) ||
+	     ( ( rc = pthread_create ( &cap.reader_thread, NULL,
+				       qusb_ring_reader, &cap.ring ) ) != 0 ) ) {
+		eprintf ( "Error: Could not start threads: %s\n",
+			  strerror ( rc ) );
+		exit ( EXIT_FAILURE );
+	}
+	for ( i = 0 ; i < opts.packers ; i++ ) {
+		if ( ( rc = pthread_create ( &cap.packers[i].thread, NULL,
+					     packer, &cap.packers[i] ) ) != 0 ) {
+			eprintf ( "Error: Could not start threads: %s\n",
+				  strerror ( rc ) );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	if ( cap.stats && ( ! opts.packers ) &&
+	     ( ( rc = pthread_create ( &cap.stats_thread, NULL, stats_thread,
+				       &cap ) ) != 0 ) ) {
+		eprintf ( "Error: Could not start threads: %s\n",
+			  strerror ( rc ) );
+		exit ( EXIT_FAILURE );
+	}
+	if ( cap.verify &&
+	     ( ( rc = pthread_create ( &cap.verify_thread, NULL, verify_thread,
+				       &cap ) ) != 0 ) ) {
+		eprintf ( "Error: Could not start threads: %s\n",
+			  strerror ( rc ) );
+		exit ( EXIT_FAILURE );
+	}
+
+	eprintf ( "# seconds read_MBps write_MBps ring_pct ring_max_pct "
+		  "dropped_bytes write_max_ms files\n" );
+	next_report = ( start + ( opts.interval * 1e6 ) );
+	next_stats = ( start + ( 1e6 / opts.stats_rate ) );
+	while ( ! __atomic_load_n ( &cap.writer_done, __ATOMIC_ACQUIRE ) ) {
+		usleep ( 10000 );
+		if ( opts.limit_secs &&
+		     ( ( qusb_now_us() - start ) >= ( opts.limit_secs * 1e6 ) ) )
+			stop = 1;
+		if ( stop && ! __atomic_load_n ( &cap.ring.done,
+						 __ATOMIC_ACQUIRE ) ) {
+			qusb_ring_stop ( &cap.ring );
+			pthread_kill ( cap.reader_thread, SIGUSR1 );
+		}
+		if ( qusb_now_us() >= next_report ) {
+			report ( &cap, start, 0 );
+			next_report += ( opts.interval * 1e6 );
+		}
+		if ( cap.stats && ( qusb_now_us() >= next_stats ) ) {
+			stats_publish ( &cap );
+			next_stats += ( 1e6 / opts.stats_rate );
+		}
+	}
+	/* The writer gave up: the reader is stopping */
+	qusb_ring_stop ( &cap.ring );
+	while ( ! __atomic_load_n ( &cap.ring.done, __ATOMIC_ACQUIRE ) ) {
+		pthread_kill ( cap.reader_thread, SIGUSR1 );
+		usleep ( 10000 );
+	}
+	pthread_join ( cap.reader_thread, NULL );
+	pthread_join ( cap.writer_thread, NULL );
+	for ( i = 0 ; i < opts.packers ; i++ )
+		pthread_join ( cap.packers[i].thread, NULL );
+	if ( cap.stats && ( ! opts.packers ) )
+		pthread_join ( cap.stats_thread, NULL );
+	if ( cap.verify )
+		pthread_join ( cap.verify_thread, NULL );
+	report ( &cap, start, 1 );
+	if ( opts.packers && cap.bytes_written ) {
+		eprintf ( "# stored_bytes %llu ratio %.3f\n", cap.bytes_stored,
+			  ( ( double ) cap.bytes_stored / cap.bytes_written ) );
+	}
+
+	rc = EXIT_SUCCESS;
+	if ( cap.ring.error ) {
+		eprintf ( "Error: read failed: %s\n",
+			  strerror ( -cap.ring.error ) );
+		rc = EXIT_FAILURE;
+	}
+	if ( cap.writer_error ) {
+		eprintf ( "Error: write failed: %s\n",
+			  strerror ( -cap.writer_error ) );
+		rc = EXIT_FAILURE;
+	}
+	if ( cap.ring.bytes_dropped ) {
+		eprintf ( "Warning: %llu bytes dropped (ring full)\n",
+			  ( unsigned long long ) cap.ring.bytes_dropped );
+	}
+	if ( cap.verify ) {
+		if ( verify_summary ( &cap ) ) {
+			eprintf ( "Error: data does not match %s\n",
+				  opts.verify );
+			rc = EXIT_FAILURE;
+		}
+		qusb_verify_destroy ( cap.verify );
+	}
+
+	if ( cap.stats ) {
+		stats_publish ( &cap );
+		stats_cleanup ( &cap );
+	}
+	if ( cap.ring.dev )
+		qusb_close ( cap.ring.dev );
+	qusb_writer_destroy ( cap.uring );
+	return rc;
+}
+
+/*
+ * Parse command-line options and return index of last element in
+ * argument list that is not an option
+ */
+int parseopts ( const int argc, char **argv, struct options *opts ) {
+	int c;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "board", required_argument, NULL, 'b' },
+			{ "backend", required_argument, NULL, 'B' },
+			{ "input", required_argument, NULL, 'i' },
+			{ "block-size", required_argument, NULL, 'c' },
+			{ "ring-size", required_argument, NULL, 'r' },
+			{ "depth", required_argument, NULL, 'q' },
+			{ "rotate-size", required_argument, NULL, 's' },
+			{ "rotate-time", required_argument, NULL, 'T' },
+			{ "bytes", required_argument, NULL, 'n' },
+			{ "time", required_argument, NULL, 't' },
+			{ "interval", required_argument, NULL, 'I' },
+			{ "buffered", 0, NULL, 'u' },
+			{ "raw", 0, NULL, 'R' },
+			{ "compress", required_argument, NULL, 'z' },
+			{ "stats", required_argument, NULL, 'S' },
+			{ "channels", required_argument, NULL, 'C' },
+			{ "signed", 0, NULL, 'k' },
+			{ "stats-rate", required_argument, NULL, 'F' },
+			{ "watch", required_argument, NULL, 'W' },
+			{ "verify", required_argument, NULL, 'V' },
+			{ "verbose", 0, NULL, 'v' },
+			{ "help", 0, NULL, 'h' },
+			{ 0, 0, 0, 0 }
+		};
+
+		if ( ( c = getopt_long ( argc, argv, "b:B:i:c:r:q:s:T:n:t:I:uRz:S:C:kF:W:V:vh", long_options, &option_index ) ) == -1 ) {
+			break;
+		}
+
+		switch ( c ) {
+		case 'b':
+			opts->board = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'B':
+			if ( strcmp ( optarg, "kernel" ) == 0 ) {
+				opts->backend = QUSB_BACKEND_KERNEL;
+			} else if ( strcmp ( optarg, "libusb" ) == 0 ) {
+				opts->backend = QUSB_BACKEND_LIBUSB;
+			} else {
+				eprintf ( "Unknown backend: %s\n", optarg );
+				exit ( EXIT_FAILURE );
+			}
+			break;
+		case 'i':
+			opts->input = optarg;
+			break;
+		case 'c':
+			opts->block_size = qusb_parse_size ( optarg );
+			break;
+		case 'r':
+			opts->ring_size = qusb_parse_size ( optarg );
+			break;
+		case 'q':
+			opts->depth = strtoul ( optarg, NULL, 0 );
+			break;
+		case 's':
+			opts->rotate_bytes = qusb_parse_size ( optarg );
+			break;
+		case 'T':
+			opts->rotate_secs = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'n':
+			opts->limit_bytes = qusb_parse_size ( optarg );
+			break;
+		case 't':
+			opts->limit_secs = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'I':
+			opts->interval = strtod ( optarg, NULL );
+			break;
+		case 'u':
+			opts->buffered = 1;
+			break;
+		case 'R':
+			opts->raw = 1;
+			break;
+		case 'z':
+			opts->packers = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'S':
+			opts->stats_name = optarg;
+			break;
+		case 'C':
+			opts->channels = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'k':
+			opts->is_signed = 1;
+			break;
+		case 'F':
+			opts->stats_rate = strtod ( optarg, NULL );
+			break;
+		case 'W':
+			opts->watch = optarg;
+			break;
+		case 'V':
+			opts->verify = optarg;
+			break;
+		case 'v':
+			opts->verbose = 1;
+			break;
+		case 'h':
+			printhelp();
+			break;
+		case '?':
+		default:
+			eprintf ( "Unrecognised option: %c\n", c );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	return optind;
+}
+
+void printhelp () {
+	printf( "qusb-capture: capture QuickUSB HSPIO data to disk.\n"
+	"\n"
+	"USAGE:	qusb-capture [OPTIONS] OUTPUT\n"
+	"	qusb-capture -W NAME [-I INTERVAL]\n"
+	"\n"
+	"	Reads /dev/quNhd (through libquickusb) continuously into a ring\n"
+	"	buffer, and writes it to OUTPUT with O_DIRECT, through io_uring.\n"
+	"	With rotation, the files are OUTPUT.00000, OUTPUT.00001, ...\n"
+	"	Stops on SIGINT/SIGTERM, or at the given limits.\n"
+	"\n"
+	"	Every INTERVAL, prints to stderr: seconds, read and write MB/s,\n"
+	"	ring fill and its maximum (%%), bytes dropped because the ring was\n"
+	"	full (total), the slowest write in the interval (ms), and the\n"
+	"	number of files.\n"
+	"\n"
+	"OPTIONS:\n"
+	"	-b, --board=N		Board number (default 0)\n"
+	"	-B, --backend=B		kernel or libusb (default: $QUSB_BACKEND, else kernel)\n"
+	"	-i, --input=FILE	Read FILE (or - for stdin) instead of a board\n"
+	"				(waiting when the ring is full, not dropping)\n"
+	"	-c, --block-size=N	Read and write size (default 1M; multiple of 4k)\n"
+	"	-r, --ring-size=N	Ring buffer size (default 256M)\n"
+	"	-q, --depth=N		Writes in flight (default 4)\n"
+	"	-s, --rotate-size=N	Start a new file after N bytes on disk\n"
+	"	-T, --rotate-time=S	Start a new file after S seconds\n"
+	"	-n, --bytes=N		Stop after N bytes\n"
+	"	-t, --time=S		Stop after S seconds\n"
+	"	-I, --interval=S	Statistics interval (default 1)\n"
+	"	-u, --buffered		Write through the page cache (no O_DIRECT)\n"
+	"	-R, --raw		Write the data alone, not a capture file\n"
+	"	-z, --compress=N	Compress 16-bit samples, with N threads\n"
+	"	-S, --stats=NAME	Publish live statistics in /dev/shm/NAME\n"
+	"	-C, --channels=N	Interleaved channels: 1, 2, 4 or 8 (default 1)\n"
+	"	-k, --signed		Samples are two's complement (default unsigned)\n"
+	"	-F, --stats-rate=HZ	Statistics updates per second (default 10)\n"
+	"	-W, --watch=NAME	Print the statistics another capture publishes\n"
+	"	-V, --verify=PATTERN	Check the data: counter, lfsr, or crc[:N]\n"
+	"	-v, --verbose		Report each file, and failure to mlock the ring\n"
+	"	-h, --help		Show this help\n"
+	"\n"
+	"	Sizes take k, M, G suffixes. Rotation is at block boundaries.\n"
+	"\n"
+	"	A capture file records the board's settings, and the stream offset\n"
+	"	and time of each block, with an index; see qusb-file. Each block\n"
+	"	holds BLOCK-SIZE less 64 bytes of data; compressed (delta, zigzag\n"
+	"	and bit-packing), it takes only as many 4k pages as it needs.\n"
+	"\n"
+	"	Live statistics (-S) are each channel's min, max, mean, variance\n"
+	"	and histogram over the last 1/HZ seconds, and a preview of the\n"
+	"	min and max of every 1/16th of a block; see libquickusb.h. Taking\n"
+	"	them never delays reading: blocks may be skipped instead.\n"
+	"\n"
+	"	Verification (-V) reports each gap, duplicate and damaged word,\n"
+	"	at its byte offset in the stream, and fails the capture if any\n"
+	"	are found. The data is 16-bit words, each one more than the last\n"
+	"	(counter), or the next state of the LFSR in libquickusb.h (lfsr),\n"
+	"	or frames of N words (default 256): a frame counter, data, and\n"
+	"	the CRC-16/CCITT of the rest of the frame (crc). Data dropped\n"
+	"	because the ring was full is not checked.\n"
+	"\n");
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,839 @@
+/*
+ * qusb-emu - emulate a QuickUSB board with a USB gadget
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+/*
+ * Presents a 0fbb:0001 device through Raw Gadget (normally on the
+ * dummy_hcd loopback controller), so that the real quickusb driver
+ * can be exercised, benchmarked and profiled without a board:
+ *
+ *   modprobe dummy_hcd ; modprobe raw_gadget ; qusb-emu
+ *
+ * It implements the vendor requests the driver uses (settings, HSPIO
+ * command cycles, GPPIO and the HSPIO read length handshake), and the
+ * bulk endpoints 0x86 (sourcing a data pattern) and 0x02 (sinking and
+ * optionally checking one), with configurable rate and latency, and
+ * injected stalls, short packets and timeouts.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#include "../kernel/quickusb.h"
+
+#define eprintf(...) fprintf ( stderr, __VA_ARGS__ )
+
+#define QUICKUSB_VENDOR_ID	0x0fbb
+#define QUICKUSB_DEVICE_ID	0x0001
+
+#define EMU_MAX_PACKET		512
+#define EMU_EP0_MAX		4096
+#define EMU_MAX_CHUNK		( 1024 * 1024 )
+#define EMU_NUM_SETTINGS	16
+#define EMU_NUM_GPPIO		5
+#define EMU_COMMAND_SPACE	65536
+
+enum pattern {
+	PATTERN_COUNTER = 0,	/* Incrementing 16-bit words */
+	PATTERN_LFSR,		/* 16-bit maximal-length LFSR words */
+	PATTERN_ZERO,
+};
+
+struct options {
+	const char *driver;
+	const char *device;
+	enum pattern pattern;
+	unsigned long long rate;	/* Bytes per second, 0 = unlimited */
+	unsigned int latency_us;	/* Delay before answering a read */
+	unsigned int chunk;		/* Bytes per bulk IN request */
+	int check;			/* Check bulk OUT data */
+	unsigned int stall_every;	/* Stall every Nth read */
+	unsigned int short_every;	/* Short packet every Nth read */
+	unsigned int timeout_every;	/* Ignore every Nth read */
+	int verbose;
+};
+
+struct emu {
+	int fd;
+	struct options opts;
+	/* Device state */
+	uint16_t settings[EMU_NUM_SETTINGS];
+	uint8_t gppio_dir[EMU_NUM_GPPIO];
+	uint8_t gppio_data[EMU_NUM_GPPIO];
+	uint8_t command[EMU_COMMAND_SPACE];
+	/* Bulk endpoint handles, once configured */
+	int ep_in;
+	int ep_out;
+	/* Bytes announced by the HSPIO length handshake */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long long pending;
+	unsigned long reads;
+	/* Statistics */
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	unsigned long long out_errors;
+	unsigned long controls;
+	unsigned long stalls;
+	unsigned long shorts;
+	unsigned long timeouts;
+};
+
+struct emu_control_event {
+	struct usb_raw_event inner;
+	struct usb_ctrlrequest ctrl;
+};
+
+struct emu_control_io {
+	struct usb_raw_ep_io inner;
+	uint8_t data[EMU_EP0_MAX];
+};
+
+struct emu_bulk_io {
+	struct usb_raw_ep_io inner;
+	uint8_t data[EMU_MAX_CHUNK];
+};
+
+static volatile sig_atomic_t stop;
+
+int parseopts ( const int, char **argv, struct options * );
+void printhelp ();
+
+/****************************************************************************
+ *
+ * Descriptors
+ *
+ */
+
+static const struct usb_device_descriptor emu_device_desc = {
+	.bLength		= USB_DT_DEVICE_SIZE,
+	.bDescriptorType	= USB_DT_DEVICE,
+	.bcdUSB			= 0x0200,
+	.bDeviceClass		= USB_CLASS_VENDOR_SPEC,
+	.bDeviceSubClass	= 0xff,
+	.bDeviceProtocol	= 0xff,
+	.bMaxPacketSize0	= 64,
+	.idVendor		= QUICKUSB_VENDOR_ID,
+	.idProduct		= QUICKUSB_DEVICE_ID,
+	.bcdDevice		= 0x0211,
+	.iManufacturer		= 1,
+	.iProduct		= 2,
+	.iSerialNumber		= 3,
+	.bNumConfigurations	= 1,
+};
+
+static const struct usb_config_descriptor emu_config_desc = {
+	.bLength		= USB_DT_CONFIG_SIZE,
+	.bDescriptorType	= USB_DT_CONFIG,
+	.bNumInterfaces		= 1,
+	.bConfigurationValue	= 1,
+	.bmAttributes		= USB_CONFIG_ATT_ONE,
+	.bMaxPower		= 250,
+};
+
+static const struct usb_interface_descriptor emu_interface_desc = {
+	.bLength		= USB_DT_INTERFACE_SIZE,
+	.bDescriptorType	= USB_DT_INTERFACE,
+	.bNumEndpoints		= 2,
+	.bInterfaceClass	= USB_CLASS_VENDOR_SPEC,
+	.bInterfaceSubClass	= 0xff,
+	.bInterfaceProtocol	= 0xff,
+};
+
+static const struct usb_endpoint_descriptor emu_ep_in_desc = {
+	.bLength		= USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType	= USB_DT_ENDPOINT,
+	.bEndpointAddress	= QUICKUSB_BULK_IN_EP,
+	.bmAttributes		= USB_ENDPOINT_XFER_BULK,
+	.wMaxPacketSize		= EMU_MAX_PACKET,
+};
+
+static const struct usb_endpoint_descriptor emu_ep_out_desc = {
+	.bLength		= USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType	= USB_DT_ENDPOINT,
+	.bEndpointAddress	= QUICKUSB_BULK_OUT_EP,
+	.bmAttributes		= USB_ENDPOINT_XFER_BULK,
+	.wMaxPacketSize		= EMU_MAX_PACKET,
+};
+
+/* Build the full configuration descriptor into @buf, returning its length */
+static int emu_config_desc_build ( uint8_t *buf ) {
+	struct usb_config_descriptor *config = ( void * ) buf;
+	int len = 0;
+
+	memcpy ( buf + len, &emu_config_desc, USB_DT_CONFIG_SIZE );
+	len += USB_DT_CONFIG_SIZE;
+	memcpy ( buf + len, &emu_interface_desc, USB_DT_INTERFACE_SIZE );
+	len += USB_DT_INTERFACE_SIZE;
+	memcpy ( buf + len, &emu_ep_in_desc, USB_DT_ENDPOINT_SIZE );
+	len += USB_DT_ENDPOINT_SIZE;
+	memcpy ( buf + len, &emu_ep_out_desc, USB_DT_ENDPOINT_SIZE );
+	len += USB_DT_ENDPOINT_SIZE;
+	config->wTotalLength = htole16 ( len );
+	return len;
+}
+
+static const char *emu_strings[] = {
+	NULL,
+	"Bitwise Systems",
+	"QuickUSB QUSB2 Module v2.11rc7 (FIFO Handshake)",
+	"EMU00000",
+};
+
+/* Build string descriptor @index into @buf, returning its length */
+static int emu_string_desc ( unsigned int index, uint8_t *buf ) {
+	const char *str;
+	int len = 2;
+
+	if ( index == 0 ) {
+		/* Language IDs: US English only */
+		buf[2] = 0x09;
+		buf[3] = 0x04;
+		len = 4;
+	} else if ( index < ( sizeof ( emu_strings ) /
+			      sizeof ( emu_strings[0] ) ) ) {
+		for ( str = emu_strings[index] ; *str ; str++ ) {
+			buf[len++] = *str;
+			buf[len++] = 0;
+		}
+	} else {
+		return -1;
+	}
+	buf[0] = len;
+	buf[1] = USB_DT_STRING;
+	return len;
+}
+
+/****************************************************************************
+ *
+ * Data patterns
+ *
+ */
+
+struct pattern_state {
+	enum pattern pattern;
+	uint16_t word;
+	int odd;		/* Next byte is the high byte of word */
+};
+
+static uint16_t pattern_next_word ( struct pattern_state *state,
+				    uint16_t word ) {
+	unsigned int bit;
+
+	switch ( state->pattern ) {
+	case PATTERN_COUNTER:
+		return ( word + 1 );
+	case PATTERN_LFSR:
+		/* x^16 + x^14 + x^13 + x^11 + 1 */
+		bit = ( ( word >> 0 ) ^ ( word >> 2 ) ^ ( word >> 3 ) ^
+			( word >> 5 ) ) & 1;
+		return ( ( word >> 1 ) | ( bit << 15 ) );
+	default:
+		return 0;
+	}
+}
+
+static void pattern_init ( struct pattern_state *state,
+			   enum pattern pattern ) {
+	state->pattern = pattern;
+	state->word = ( ( pattern == PATTERN_LFSR ) ? 0xace1 : 0 );
+	state->odd = 0;
+}
+
+/* Fill @buf with the next @len bytes: little-endian, byte B first */
+static void pattern_fill ( struct pattern_state *state, uint8_t *buf,
+			   size_t len ) {
+	size_t i;
+
+	for ( i = 0 ; i < len ; i++ ) {
+		if ( state->odd ) {
+			buf[i] = ( state->word >> 8 );
+			state->word = pattern_next_word ( state, state->word );
+		} else {
+			buf[i] = ( state->word & 0xff );
+		}
+		state->odd = ! state->odd;
+	}
+}
+
+/* Check @buf against the next @len bytes, returning the mismatch count */
+static size_t pattern_check ( struct pattern_state *state,
+			      const uint8_t *buf, size_t len ) {
+	uint8_t expected[4096];
+	size_t errors = 0;
+	size_t frag_len;
+	size_t i;
+
+	while ( len ) {
+		frag_len = ( ( len < sizeof ( expected ) ) ?
+			     len : sizeof ( expected ) );
+		pattern_fill ( state, expected, frag_len );
+		for ( i = 0 ; i < frag_len ; i++ )
+			errors += ( buf[i] != expected[i] );
+		buf += frag_len;
+		len -= frag_len;
+	}
+	return errors;
+}
+
+/****************************************************************************
+ *
+ * Pacing
+ *
+ */
+
+static double now ( void ) {
+	struct timespec ts;
+
+	clock_gettime ( CLOCK_MONOTONIC, &ts );
+	return ( ts.tv_sec + ( ts.tv_nsec / 1e9 ) );
+}
+
+static void sleep_until ( double when ) {
+	struct timespec ts;
+
+	ts.tv_sec = when;
+	ts.tv_nsec = ( ( when - ts.tv_sec ) * 1e9 );
+	while ( clock_nanosleep ( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				  NULL ) == EINTR && ! stop )
+		;
+}
+
+/* Delay so that @bytes since @start do not exceed the configured rate */
+static void pace ( struct emu *emu, double start,
+		   unsigned long long bytes ) {
+	if ( emu->opts.rate )
+		sleep_until ( start + ( ( double ) bytes / emu->opts.rate ) );
+}
+
+/****************************************************************************
+ *
+ * Bulk endpoints
+ *
+ */
+
+static void *emu_bulk_in ( void *arg ) {
+	struct emu *emu = arg;
+	struct pattern_state state;
+	struct emu_bulk_io *io;
+	unsigned long long sent = 0;
+	unsigned long long len;
+	unsigned long read;
+	double start = now();
+	int truncate;
+	int rc;
+
+	if ( ! ( io = malloc ( sizeof ( *io ) ) ) ) {
+		eprintf ( "Error: out of memory\n" );
+		exit ( EXIT_FAILURE );
+	}
+	pattern_init ( &state, emu->opts.pattern );
+
+	while ( ! stop ) {
+		/* Wait for the host to announce a read */
+		pthread_mutex_lock ( &emu->lock );
+		while ( ( ! emu->pending ) && ( ! stop ) )
+			pthread_cond_wait ( &emu->cond, &emu->lock );
+		len = emu->pending;
+		read = emu->reads;
+		pthread_mutex_unlock ( &emu->lock );
+		if ( stop )
+			break;
+
+		if ( emu->opts.latency_us )
+			usleep ( emu->opts.latency_us );
+
+		/* Injected faults, applied once per announced read */
+		if ( emu->opts.timeout_every &&
+		     ( ( read % emu->opts.timeout_every ) == 0 ) ) {
+			/* Drop the read; the host must time out */
+			emu->timeouts++;
+			goto consumed;
+		}
+		if ( emu->opts.stall_every &&
+		     ( ( read % emu->opts.stall_every ) == 0 ) ) {
+			/* Halted until the host clears it, then resend */
+			emu->stalls++;
+			ioctl ( emu->fd, USB_RAW_IOCTL_EP_SET_HALT,
+				emu->ep_in );
+			goto consumed;
+		}
+		truncate = ( emu->opts.short_every &&
+			     ( ( read % emu->opts.short_every ) == 0 ) );
+
+		if ( len > emu->opts.chunk )
+			len = emu->opts.chunk;
+		if ( truncate && ( len > EMU_MAX_PACKET ) ) {
+			/* End the transfer early with a short packet */
+			len = ( EMU_MAX_PACKET / 2 );
+			emu->shorts++;
+		}
+		pattern_fill ( &state, io->data, len );
+		io->inner.ep = emu->ep_in;
+		io->inner.flags = 0;
+		io->inner.length = len;
+		rc = ioctl ( emu->fd, USB_RAW_IOCTL_EP_WRITE, io );
+		if ( rc < 0 ) {
+			if ( emu->opts.verbose )
+				eprintf ( "Bulk IN: %s\n", strerror ( errno ) );
+			continue;
+		}
+		sent += rc;
+		emu->bytes_in += rc;
+		pace ( emu, start, sent );
+
+		pthread_mutex_lock ( &emu->lock );
+		emu->pending -= ( ( ( unsigned long long ) rc < emu->pending ) ?
+				  rc : emu->pending );
+		if ( truncate )
+			emu->pending = 0;
+		pthread_mutex_unlock ( &emu->lock );
+		continue;
+
+	consumed:
+		pthread_mutex_lock ( &emu->lock );
+		if ( emu->reads == read )
+			emu->pending = 0;
+		pthread_mutex_unlock ( &emu->lock );
+	}
+
+	free ( io );
+	return NULL;
+}
+
+static void *emu_bulk_out ( void *arg ) {
+	struct emu *emu = arg;
+	struct pattern_state state;
+	struct emu_bulk_io *io;
+	unsigned long long received = 0;
+	double start = now();
+	int rc;
+
+	if ( ! ( io = malloc ( sizeof ( *io ) ) ) ) {
+		eprintf ( "Error: out of memory\n" );
+		exit ( EXIT_FAILURE );
+	}
+	pattern_init ( &state, emu->opts.pattern );
+
+	while ( ! stop ) {
+		io->inner.ep = emu->ep_out;
+		io->inner.flags = 0;
+		io->inner.length = emu->opts.chunk;
+		rc = ioctl ( emu->fd, USB_RAW_IOCTL_EP_READ, io );
+		if ( rc < 0 ) {
+			if ( emu->opts.verbose )
+				eprintf ( "Bulk OUT: %s\n", strerror ( errno ) );
+			continue;
+		}
+		if ( emu->opts.check )
+			emu->out_errors += pattern_check ( &state, io->data, rc );
+		received += rc;
+		emu->bytes_out += rc;
+		pace ( emu, start, received );
+	}
+
+	free ( io );
+	return NULL;
+}
+
+/****************************************************************************
+ *
+ * Control endpoint
+ *
+ */
+
+static void emu_configure ( struct emu *emu ) {
+	static pthread_t in_thread, out_thread;
+	struct usb_endpoint_descriptor desc;
+
+	if ( emu->ep_in >= 0 )
+		return;
+
+	desc = emu_ep_in_desc;
+	emu->ep_in = ioctl ( emu->fd, USB_RAW_IOCTL_EP_ENABLE, &desc );
+	desc = emu_ep_out_desc;
+	emu->ep_out = ioctl ( emu->fd, USB_RAW_IOCTL_EP_ENABLE, &desc );
+	if ( ( emu->ep_in < 0 ) || ( emu->ep_out < 0 ) ) {
+		eprintf ( "Error: Could not enable bulk endpoints: %s\n",
+			  strerror ( errno ) );
+		exit ( EXIT_FAILURE );
+	}
+	ioctl ( emu->fd, USB_RAW_IOCTL_VBUS_DRAW, 250 );
+	ioctl ( emu->fd, USB_RAW_IOCTL_CONFIGURE, 0 );
+
+	pthread_create ( &in_thread, NULL, emu_bulk_in, emu );
+	pthread_create ( &out_thread, NULL, emu_bulk_out, emu );
+}
+
+/*
+ * Handle a standard or vendor control request.  Returns the length of
+ * the IN data stage (placed in @data), 0 for no data, or -1 to stall.
+ * OUT data stages have already been read into @data.
+ */
+static int emu_control ( struct emu *emu, struct usb_ctrlrequest *ctrl,
+			 uint8_t *data ) {
+	unsigned int value = ctrl->wValue;
+	unsigned int index = ctrl->wIndex;
+	unsigned int length = ctrl->wLength;
+	int in = ( ctrl->bRequestType & USB_DIR_IN );
+	uint32_t len_le;
+	unsigned int i;
+
+	emu->controls++;
+
+	if ( ( ctrl->bRequestType & USB_TYPE_MASK ) == USB_TYPE_STANDARD ) {
+		switch ( ctrl->bRequest ) {
+		case USB_REQ_GET_DESCRIPTOR:
+			switch ( value >> 8 ) {
+			case USB_DT_DEVICE:
+				memcpy ( data, &emu_device_desc,
+					 sizeof ( emu_device_desc ) );
+				return sizeof ( emu_device_desc );
+			case USB_DT_CONFIG:
+				return emu_config_desc_build ( data );
+			case USB_DT_STRING:
+				return emu_string_desc ( ( value & 0xff ),
+							 data );
+			default:
+				return -1;
+			}
+		case USB_REQ_SET_CONFIGURATION:
+			emu_configure ( emu );
+			return 0;
+		case USB_REQ_GET_CONFIGURATION:
+			data[0] = 1;
+			return 1;
+		case USB_REQ_SET_INTERFACE:
+			return 0;
+		case USB_REQ_GET_INTERFACE:
+			data[0] = 0;
+			return 1;
+		case USB_REQ_GET_STATUS:
+			data[0] = data[1] = 0;
+			return 2;
+		case USB_REQ_CLEAR_FEATURE:
+			if ( value == USB_ENDPOINT_HALT ) {
+				ioctl ( emu->fd, USB_RAW_IOCTL_EP_CLEAR_HALT,
+					( ( index == QUICKUSB_BULK_IN_EP ) ?
+					  emu->ep_in : emu->ep_out ) );
+			}
+			return 0;
+		default:
+			return -1;
+		}
+	}
+
+	switch ( ctrl->bRequest ) {
+	case QUICKUSB_BREQUEST_SETTING:
+		if ( index >= EMU_NUM_SETTINGS )
+			return -1;
+		if ( ! in ) {
+			emu->settings[index] = ( data[0] | ( data[1] << 8 ) );
+			return 0;
+		}
+		data[0] = ( emu->settings[index] & 0xff );
+		data[1] = ( emu->settings[index] >> 8 );
+		return 2;
+
+	case QUICKUSB_BREQUEST_HSPIO_COMMAND:
+		/* wValue is the length, wIndex the starting address */
+		for ( i = 0 ; i < length ; i++ ) {
+			if ( in ) {
+				data[i] = emu->command[ ( index + i ) %
+						       EMU_COMMAND_SPACE ];
+			} else {
+				emu->command[ ( index + i ) %
+					      EMU_COMMAND_SPACE ] = data[i];
+			}
+		}
+		return ( in ? ( int ) length : 0 );
+
+	case QUICKUSB_BREQUEST_GPPIO:
+		/* wValue is the port, wIndex selects direction or data */
+		if ( value >= EMU_NUM_GPPIO )
+			return -1;
+		if ( index == QUICKUSB_WINDEX_GPPIO_DIR ) {
+			if ( ! in ) {
+				emu->gppio_dir[value] = data[0];
+				return 0;
+			}
+			data[0] = emu->gppio_dir[value];
+			return 1;
+		}
+		if ( ! in ) {
+			if ( length )
+				emu->gppio_data[value] = data[length - 1];
+			return 0;
+		}
+		/* Inputs read back as the complement of the outputs */
+		for ( i = 0 ; i < length ; i++ ) {
+			data[i] = ( ( emu->gppio_data[value] &
+				      emu->gppio_dir[value] ) |
+				    ( ~emu->gppio_data[value] &
+				      ~emu->gppio_dir[value] ) );
+		}
+		return length;
+
+	case QUICKUSB_BREQUEST_HSPIO:
+		/* Read length handshake: 32-bit little-endian byte count */
+		if ( in || ( length != sizeof ( len_le ) ) )
+			return -1;
+		memcpy ( &len_le, data, sizeof ( len_le ) );
+		pthread_mutex_lock ( &emu->lock );
+		emu->pending = le32toh ( len_le );
+		emu->reads++;
+		pthread_cond_signal ( &emu->cond );
+		pthread_mutex_unlock ( &emu->lock );
+		return 0;
+
+	default:
+		return -1;
+	}
+}
+
+static void emu_ep0_loop ( struct emu *emu ) {
+	struct emu_control_event event;
+	struct emu_control_io io;
+	int in;
+	int rc;
+
+	while ( ! stop ) {
+		event.inner.type = 0;
+		event.inner.length = sizeof ( event.ctrl );
+		if ( ioctl ( emu->fd, USB_RAW_IOCTL_EVENT_FETCH, &event ) < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			eprintf ( "Error: event fetch: %s\n", strerror ( errno ) );
+			return;
+		}
+		if ( event.inner.type == USB_RAW_EVENT_CONNECT ) {
+			if ( emu->opts.verbose )
+				eprintf ( "Connected\n" );
+			continue;
+		}
+		if ( event.inner.type != USB_RAW_EVENT_CONTROL )
+			continue;
+
+		in = ( event.ctrl.bRequestType & USB_DIR_IN );
+		io.inner.ep = 0;
+		io.inner.flags = 0;
+		io.inner.length = event.ctrl.wLength;
+		if ( io.inner.length > sizeof ( io.data ) )
+			io.inner.length = sizeof ( io.data );
+
+		/* Fetch OUT data stage before acting on the request */
+		if ( ( ! in ) && io.inner.length ) {
+			if ( ioctl ( emu->fd, USB_RAW_IOCTL_EP0_READ, &io ) < 0 )
+				continue;
+		}
+
+		rc = emu_control ( emu, &event.ctrl, io.data );
+		if ( emu->opts.verbose > 1 ) {
+			eprintf ( "ctrl %02x %02x %04x %04x %04x -> %d\n",
+				  event.ctrl.bRequestType, event.ctrl.bRequest,
+				  event.ctrl.wValue, event.ctrl.wIndex,
+				  event.ctrl.wLength, rc );
+		}
+		if ( rc < 0 ) {
+			ioctl ( emu->fd, USB_RAW_IOCTL_EP0_STALL, 0 );
+		} else if ( in ) {
+			if ( ( unsigned int ) rc < io.inner.length )
+				io.inner.length = rc;
+			ioctl ( emu->fd, USB_RAW_IOCTL_EP0_WRITE, &io );
+		} else if ( ! event.ctrl.wLength ) {
+			/* Acknowledge with a zero-length status stage */
+			io.inner.length = 0;
+			ioctl ( emu->fd, USB_RAW_IOCTL_EP0_READ, &io );
+		}
+	}
+}
+
+static void handle_signal ( int sig ) {
+	stop = 1;
+}
+
+int main ( int argc, char* argv[] ) {
+	static struct emu emu;
+	struct usb_raw_init init;
+
+	memset ( &emu, 0, sizeof ( emu ) );
+	emu.opts.driver = "dummy_udc";
+	emu.opts.device = "dummy_udc.0";
+	emu.opts.chunk = ( 64 * 1024 );
+	emu.ep_in = emu.ep_out = -1;
+	pthread_mutex_init ( &emu.lock, NULL );
+	pthread_cond_init ( &emu.cond, NULL );
+	/* FIFOCONFIG as shipped: GPIO mode */
+	emu.settings[QUICKUSB_SETTING_FIFOCONFIG] = 0x00fa;
+
+	parseopts ( argc, argv, &emu.opts );
+	if ( ( emu.opts.chunk < EMU_MAX_PACKET ) ||
+	     ( emu.opts.chunk > EMU_MAX_CHUNK ) ||
+	     ( emu.opts.chunk % EMU_MAX_PACKET ) ) {
+		eprintf ( "Chunk must be a multiple of %d, up to %d\n",
+			  EMU_MAX_PACKET, EMU_MAX_CHUNK );
+		exit ( EXIT_FAILURE );
+	}
+
+	emu.fd = open ( "/dev/raw-gadget", O_RDWR );
+	if ( emu.fd < 0 ) {
+		eprintf ( "Error: Could not open /dev/raw-gadget: %s\n"
+			  "(modprobe dummy_hcd raw_gadget?)\n",
+			  strerror ( errno ) );
+		exit ( EXIT_FAILURE );
+	}
+	memset ( &init, 0, sizeof ( init ) );
+	strncpy ( ( char * ) init.driver_name, emu.opts.driver,
+		  ( UDC_NAME_LENGTH_MAX - 1 ) );
+	strncpy ( ( char * ) init.device_name, emu.opts.device,
+		  ( UDC_NAME_LENGTH_MAX - 1 ) );
+	init.speed = USB_SPEED_HIGH;
+	if ( ( ioctl ( emu.fd, USB_RAW_IOCTL_INIT, &init ) < 0 ) ||
+	     ( ioctl ( emu.fd, USB_RAW_IOCTL_RUN, 0 ) < 0 ) ) {
+		eprintf ( "Error: Could not start gadget on %s: %s\n",
+			  emu.opts.device, strerror ( errno ) );
+		exit ( EXIT_FAILURE );
+	}
+
+	signal ( SIGINT, handle_signal );
+	signal ( SIGTERM, handle_signal );
+	emu_ep0_loop ( &emu );
+
+	printf ( "bytes_in %llu\nbytes_out %llu\nout_errors %llu\n"
+		 "controls %lu\nreads %lu\nstalls %lu\nshorts %lu\n"
+		 "timeouts %lu\n", emu.bytes_in, emu.bytes_out,
+		 emu.out_errors, emu.controls, emu.reads, emu.stalls,
+		 emu.shorts, emu.timeouts );
+	close ( emu.fd );
+	return 0;
+}
+
+/*
+ * Parse command-line options and return index of last element in
+ * argument list that is not an option
+ */
+int parseopts ( const int argc, char **argv, struct options *opts ) {
+	int c;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "udc-driver", required_argument, NULL, 'D' },
+			{ "udc-device", required_argument, NULL, 'U' },
+			{ "pattern", required_argument, NULL, 'p' },
+			{ "rate", required_argument, NULL, 'r' },
+			{ "latency", required_argument, NULL, 'l' },
+			{ "chunk", required_argument, NULL, 'c' },
+			{ "check", 0, NULL, 'k' },
+			{ "stall", required_argument, NULL, 'S' },
+			{ "short", required_argument, NULL, 's' },
+			{ "timeout", required_argument, NULL, 't' },
+			{ "verbose", 0, NULL, 'v' },
+			{ "help", 0, NULL, 'h' },
+			{ 0, 0, 0, 0 }
+		};
+
+		if ( ( c = getopt_long ( argc, argv, "D:U:p:r:l:c:kS:s:t:vh", long_options, &option_index ) ) == -1 ) {
+			break;
+		}
+
+		switch ( c ) {
+		case 'D':
+			opts->driver = optarg;
+			break;
+		case 'U':
+			opts->device = optarg;
+			break;
+		case 'p':
+			if ( strcmp ( optarg, "counter" ) == 0 ) {
+				opts->pattern = PATTERN_COUNTER;
+			} else if ( strcmp ( optarg, "lfsr" ) == 0 ) {
+				opts->pattern = PATTERN_LFSR;
+			} else if ( strcmp ( optarg, "zero" ) == 0 ) {
+				opts->pattern = PATTERN_ZERO;
+			} else {
+				eprintf ( "Unknown pattern: %s\n", optarg );
+				exit ( EXIT_FAILURE );
+			}
+			break;
+		case 'r':
+			opts->rate = strtoull ( optarg, NULL, 0 );
+			break;
+		case 'l':
+			opts->latency_us = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'c':
+			opts->chunk = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'k':
+			opts->check = 1;
+			break;
+		case 'S':
+			opts->stall_every = strtoul ( optarg, NULL, 0 );
+			break;
+		case 's':
+			opts->short_every = strtoul ( optarg, NULL, 0 );
+			break;
+		case 't':
+			opts->timeout_every = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'v':
+			opts->verbose++;
+			break;
+		case 'h':
+			printhelp();
+			break;
+		case '?':
+		default:
+			eprintf ( "Unrecognised option: %c\n", c );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	return optind;
+}
+
+void printhelp () {
+	printf( "qusb-emu: emulate a QuickUSB board (0fbb:0001) with Raw Gadget.\n"
+	"\n"
+	"USAGE:	modprobe dummy_hcd; modprobe raw_gadget; qusb-emu [OPTIONS]\n"
+	"\n"
+	"	The quickusb driver then binds to the emulated board, as qu0*.\n"
+	"	Statistics are printed on exit (Ctrl-C).\n"
+	"\n"
+	"OPTIONS:\n"
+	"	-D, --udc-driver=NAME	UDC driver (default dummy_udc)\n"
+	"	-U, --udc-device=NAME	UDC instance (default dummy_udc.0)\n"
+	"	-p, --pattern=P		Bulk data: counter (default), lfsr, zero.\n"
+	"				16-bit words, little-endian (byte B first).\n"
+	"	-r, --rate=N		Limit bulk IN and OUT to N bytes/s\n"
+	"	-l, --latency=US	Delay each HSPIO read by US microseconds\n"
+	"	-c, --chunk=N		Bulk request size (default 65536)\n"
+	"	-k, --check		Check bulk OUT data against the pattern\n"
+	"	-S, --stall=N		Stall the bulk IN endpoint on every Nth read\n"
+	"	-s, --short=N		End every Nth read with a short packet\n"
+	"	-t, --timeout=N		Ignore every Nth read (host times out)\n"
+	"	-v, --verbose		Report errors (twice: every control request)\n"
+	"	-h, --help		Show this help\n"
+	"\n");
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,588 @@
+/*
+ * qusb-fanout - share one QuickUSB HSPIO stream between processes
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+/*
+ * Only one process can read /dev/quNhd, yet archiving, quick-look and
+ * trigger analysis may all want the same data.  Teeing it through pipes
+ * copies it once per pipe per process; instead, qusb-fanout reads the
+ * board through a libquickusb IN stream, and copies each block once,
+ * into a libquickusb fan-out ring in shared memory (/dev/shm/NAME).
+ * Consumers attach to the ring by name (qusb_fanout_attach(), or
+ * qusb-fanout -a), each with its own cursor, and read the blocks in
+ * place.
+ *
+ * A consumer attached with QUSB_FANOUT_BLOCK that falls a whole ring
+ * behind holds the producer back: completed blocks are then held in
+ * the stream (QUSB_HOLD) in order, and published as room appears, so
+ * that once the stream's pool is used up the board itself waits.  A
+ * QUSB_FANOUT_DROP consumer never holds anything back.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <signal.h>
+
+#include "../libquickusb/libquickusb.h"
+
+#define eprintf(...) fprintf ( stderr, __VA_ARGS__ )
+
+enum mode {
+	MODE_PRODUCE,
+	MODE_ATTACH,
+	MODE_LIST,
+};
+
+struct options {
+	enum mode mode;
+	unsigned int board;
+	enum qusb_backend_type backend;
+	const char *name;
+	const char *input;		/* File to read instead of a board */
+	const char *output;		/* Consumer: file to write */
+	size_t block_size;
+	unsigned int blocks;		/* In the ring */
+	unsigned int depth;		/* Reads outstanding */
+	enum qusb_fanout_policy policy;
+	double interval;		/* Statistics */
+	int verbose;
+};
+
+struct producer {
+	struct options *opts;
+	struct qusb_device *dev;
+	struct qusb_fanout *fanout;
+	/* Blocks completed, waiting for room in the ring */
+	struct qusb_block **held;
+	unsigned int nheld;
+	unsigned int held_head;
+	unsigned int held_tail;
+	unsigned long long bytes;
+	unsigned long long blocks;
+	int error;
+};
+
+static volatile sig_atomic_t stop;
+
+int parseopts ( const int, char **argv, struct options * );
+void printhelp ();
+
+static const char * policy_name ( unsigned int policy ) {
+	return ( ( policy == QUSB_FANOUT_BLOCK ) ? "block" : "drop" );
+}
+
+/****************************************************************************
+ *
+ * Producer
+ *
+ */
+
+/* Copy a block into the ring: returns 1, or 0 if there is no room */
+static int publish ( struct producer *prod, const void *data, size_t len ) {
+	void *slot;
+
+	if ( qusb_fanout_get_block ( prod->fanout, &slot ) != 0 )
+		return 0;
+	memcpy ( slot, data, len );
+	qusb_fanout_publish ( prod->fanout, len );
+	prod->bytes += len;
+	prod->blocks++;
+	return 1;
+}
+
+static int produce_complete ( struct qusb_block *block, void *priv ) {
+	struct producer *prod = priv;
+
+	if ( block->status < 0 ) {
+		prod->error = block->status;
+		return QUSB_STOP;
+	}
+	/* In order: behind any already waiting */
+	if ( ( prod->held_head == prod->held_tail ) &&
+	     publish ( prod, block->data, block->len ) )
+		return QUSB_CONTINUE;
+	prod->held[prod->held_head++ % prod->nheld] = block;
+	return QUSB_HOLD;
+}
+
+/* Publish held blocks as room allows: returns the number still held */
+static unsigned int produce_drain ( struct producer *prod ) {
+	struct qusb_block *block;
+
+	while ( prod->held_tail != prod->held_head ) {
+		block = prod->held[prod->held_tail % prod->nheld];
+		if ( ! publish ( prod, block->data, block->len ) )
+			break;
+		qusb_block_release ( block );
+		prod->held_tail++;
+	}
+	return ( prod->held_head - prod->held_tail );
+}
+
+static void report ( struct producer *prod, double start, int final ) {
+	static unsigned long long last_bytes;
+	static double last;
+	struct qusb_fanout_stats stats;
+	struct qusb_fanout_consumer *consumer;
+	double t = qusb_now_us();
+	double dt;
+	unsigned int i;
+
+	if ( ! last )
+		last = start;
+	dt = ( ( final ? ( t - start ) : ( t - last ) ) / 1e6 );
+	if ( dt <= 0 )
+		dt = 1e-6;
+	if ( qusb_fanout_stats ( prod->opts->name, &stats ) != 0 )
+		memset ( &stats, 0, sizeof ( stats ) );
+
+	eprintf ( "%s%.1f %.3f %llu %llu", ( final ? "# total " : "" ),
+		  ( ( t - start ) / 1e6 ),
+		  ( ( final ? prod->bytes : ( prod->bytes - last_bytes ) ) /
+		    dt / 1e6 ), prod->blocks,
+		  ( unsigned long long ) stats.stalls );
+	for ( i = 0 ; i < stats.consumers ; i++ ) {
+		consumer = &stats.consumer[i];
+		eprintf ( " %u:%s:%llu:%llu", consumer->pid,
+			  policy_name ( consumer->policy ),
+			  ( unsigned long long ) consumer->lag,
+			  ( unsigned long long ) consumer->dropped );
+	}
+	eprintf ( "\n" );
+
+	last_bytes = prod->bytes;
+	last = t;
+}
+
+/* Read a board, through a stream */
+static int produce_board ( struct producer *prod, double start ) {
+	struct options *opts = prod->opts;
+	struct qusb_stream_config config;
+	struct qusb_stream *stream;
+	struct qusb_loop *loop;
+	double next_report = ( start + ( opts->interval * 1e6 ) );
+	int rc;
+
+	memset ( &config, 0, sizeof ( config ) );
+	config.direction = QUSB_IN;
+	config.block_size = opts->block_size;
+	config.depth = opts->depth;
+	config.blocks = ( 2 * config.depth );
+	config.complete = produce_complete;
+	config.priv = prod;
+
+	prod->nheld = config.blocks;
+	if ( ! ( prod->held = calloc ( prod->nheld,
+				       sizeof ( prod->held[0] ) ) ) )
+		return -ENOMEM;
+	if ( ( rc = qusb_loop_create ( config.blocks, &loop ) ) != 0 )
+		goto err_loop;
+	if ( ( rc = qusb_stream_create ( loop, prod->dev, &config,
+					 &stream ) ) != 0 )
+		goto err_stream;
+
+	qusb_stream_start ( stream );
+	while ( ! stop && qusb_stream_running ( stream ) ) {
+		if ( produce_drain ( prod ) ) {
+			/* Held back by a consumer: wait for it, briefly, then
+			 * see to the board */
+			qusb_fanout_wait ( prod->fanout, 10 );
+			produce_drain ( prod );
+			rc = qusb_loop_run ( loop, 0 );
+		} else {
+			rc = qusb_loop_run ( loop, 100 );
+		}
+		if ( rc < 0 )
+			break;
+		rc = 0;
+		if ( qusb_now_us() >= next_report ) {
+			report ( prod, start, 0 );
+			next_report += ( opts->interval * 1e6 );
+		}
+	}
+
+	/* Give back whatever is still held */
+	while ( prod->held_tail != prod->held_head )
+		qusb_block_release ( prod->held[prod->held_tail++ %
+						prod->nheld] );
+	qusb_stream_destroy ( stream );
+ err_stream:
+	qusb_loop_destroy ( loop );
+ err_loop:
+	free ( prod->held );
+	return rc;
+}
+
+/* Read a file (for testing), straight into the ring */
+static int produce_file ( struct producer *prod, double start ) {
+	struct options *opts = prod->opts;
+	double next_report = ( start + ( opts->interval * 1e6 ) );
+	void *slot;
+	ssize_t len;
+	int fd;
+
+	if ( ( fd = ( strcmp ( opts->input, "-" ) ?
+		      open ( opts->input, O_RDONLY ) : 0 ) ) < 0 )
+		return -errno;
+	while ( ! stop ) {
+		if ( qusb_fanout_get_block ( prod->fanout, &slot ) != 0 ) {
+			qusb_fanout_wait ( prod->fanout, 100 );
+			continue;
+		}
+		if ( ( len = read ( fd, slot, opts->block_size ) ) < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			prod->error = -errno;
+			break;
+		}
+		if ( len == 0 )
+			break;
+		qusb_fanout_publish ( prod->fanout, len );
+		prod->bytes += len;
+		prod->blocks++;
+		if ( qusb_now_us() >= next_report ) {
+			report ( prod, start, 0 );
+			next_report += ( opts->interval * 1e6 );
+		}
+	}
+	if ( fd )
+		close ( fd );
+	return 0;
+}
+
+static int produce ( struct options *opts ) {
+	struct producer prod;
+	double start;
+	int rc;
+
+	memset ( &prod, 0, sizeof ( prod ) );
+	prod.opts = opts;
+	if ( ( ! opts->input ) &&
+	     ( ( rc = qusb_open_backend ( opts->backend, opts->board,
+					  &prod.dev ) ) != 0 ) ) {
+		eprintf ( "Error: Could not open board %u: %s\n", opts->board,
+			  strerror ( -rc ) );
+		return rc;
+	}
+	if ( ( rc = qusb_fanout_create ( opts->name, opts->block_size,
+					 opts->blocks, &prod.fanout ) ) != 0 ) {
+		eprintf ( "Error: Could not create /dev/shm/%s: %s\n",
+			  opts->name, strerror ( -rc ) );
+		goto err_create;
+	}
+
+	eprintf ( "# seconds MBps blocks stalls "
+		  "[pid:policy:lag:dropped] per consumer\n" );
+	start = qusb_now_us();
+	if ( prod.dev ) {
+		rc = produce_board ( &prod, start );
+	} else {
+		rc = produce_file ( &prod, start );
+	}
+	report ( &prod, start, 1 );
+	if ( prod.error || ( rc < 0 ) ) {
+		eprintf ( "Error: read failed: %s\n",
+			  strerror ( prod.error ? -prod.error : -rc ) );
+		rc = -1;
+	}
+
+	qusb_fanout_destroy ( prod.fanout );
+ err_create:
+	if ( prod.dev )
+		qusb_close ( prod.dev );
+	return rc;
+}
+
+/****************************************************************************
+ *
+ * Consumer
+ *
+ */
+
+/* Copy the ring to a file, until the producer stops */
+static int attach ( struct options *opts ) {
+	struct qusb_fanout_reader *reader;
+	struct qusb_fanout_consumer stats;
+	const void *data;
+	unsigned long long torn = 0;
+	size_t len;
+	int fd;
+	int rc;
+
+	fd = ( ( opts->output && strcmp ( opts->output, "-" ) ) ?
+	       open ( opts->output, ( O_WRONLY | O_CREAT | O_TRUNC ), 0666 ) :
+	       1 );
+	if ( fd < 0 ) {
+		eprintf ( "Error: Could not open %s: %s\n", opts->output,
+			  strerror ( errno ) );
+		return -errno;
+	}
+	if ( ( rc = qusb_fanout_attach ( opts->name, opts->policy,
+					 &reader ) ) != 0 ) {
+		eprintf ( "Error: Could not attach to /dev/shm/%s: %s\n",
+			  opts->name, strerror ( -rc ) );
+		goto err_attach;
+	}
+
+	while ( ! stop ) {
+		if ( ( rc = qusb_fanout_acquire ( reader, &data, &len,
+						  100 ) ) != 0 ) {
+			if ( rc == -ETIMEDOUT )
+				continue;
+			if ( rc == -EPIPE )
+				rc = 0;
+			break;
+		}
+		if ( write ( fd, data, len ) != ( ssize_t ) len ) {
+			rc = -errno;
+			eprintf ( "Error: write failed: %s\n",
+				  strerror ( errno ) );
+			qusb_fanout_release ( reader );
+			break;
+		}
+		if ( qusb_fanout_release ( reader ) == -ESTALE )
+			torn++;
+	}
+
+	qusb_fanout_reader_stats ( reader, &stats );
+	if ( opts->verbose || stats.dropped ) {
+		eprintf ( "# %llu blocks read, %llu dropped (%llu while being "
+			  "read)\n", ( unsigned long long ) stats.consumed,
+			  ( unsigned long long ) stats.dropped, torn );
+	}
+	qusb_fanout_detach ( reader );
+ err_attach:
+	if ( fd != 1 )
+		close ( fd );
+	return rc;
+}
+
+/* Describe a ring and its consumers */
+static int list ( struct options *opts ) {
+	struct qusb_fanout_stats stats;
+	struct qusb_fanout_consumer *consumer;
+	unsigned int i;
+	int rc;
+
+	if ( ( rc = qusb_fanout_stats ( opts->name, &stats ) ) != 0 ) {
+		eprintf ( "Error: Could not open /dev/shm/%s: %s\n",
+			  opts->name, strerror ( -rc ) );
+		return rc;
+	}
+	printf ( "%s: %u x %u bytes, producer %u%s, %llu blocks published, "
+		 "%llu stalls\n", opts->name, stats.blocks, stats.block_size,
+		 stats.producer_pid, ( stats.status ? " (stopped)" : "" ),
+		 ( unsigned long long ) stats.published,
+		 ( unsigned long long ) stats.stalls );
+	printf ( "# pid policy lag consumed dropped\n" );
+	for ( i = 0 ; i < stats.consumers ; i++ ) {
+		consumer = &stats.consumer[i];
+		printf ( "%u %s %llu %llu %llu\n", consumer->pid,
+			 policy_name ( consumer->policy ),
+			 ( unsigned long long ) consumer->lag,
+			 ( unsigned long long ) consumer->consumed,
+			 ( unsigned long long ) consumer->dropped );
+	}
+	return 0;
+}
+
+/****************************************************************************
+ *
+ * Main
+ *
+ */
+
+static void handle_signal ( int sig ) {
+	stop = 1;
+}
+
+int main ( int argc, char* argv[] ) {
+	struct options opts;
+	struct sigaction sa;
+	int rc;
+
+	memset ( &opts, 0, sizeof ( opts ) );
+	opts.block_size = ( 1024 * 1024 );
+	opts.blocks = 64;
+	opts.depth = 8;
+	opts.interval = 1.0;
+
+	if ( parseopts ( argc, argv, &opts ) != ( argc - 1 ) ) {
+		eprintf ( "Error: no ring name given (see -h)\n" );
+		exit ( EXIT_FAILURE );
+	}
+	opts.name = argv[argc - 1];
+	if ( ( opts.block_size < 2 ) || ( opts.block_size % 2 ) ||
+	     ( opts.blocks < 2 ) || ( opts.depth < 1 ) ||
+	     ( opts.depth > 256 ) || ( opts.interval <= 0 ) ||
+	     strchr ( opts.name, '/' ) ) {
+		eprintf ( "Invalid options (see -h)\n" );
+		exit ( EXIT_FAILURE );
+	}
+
+	memset ( &sa, 0, sizeof ( sa ) );
+	sa.sa_handler = handle_signal;
+	sigaction ( SIGINT, &sa, NULL );
+	sigaction ( SIGTERM, &sa, NULL );
+	signal ( SIGPIPE, SIG_IGN );
+
+	switch ( opts.mode ) {
+	case MODE_ATTACH:
+		rc = attach ( &opts );
+		break;
+	case MODE_LIST:
+		rc = list ( &opts );
+		break;
+	default:
+		rc = produce ( &opts );
+		break;
+	}
+	return ( rc ? EXIT_FAILURE : EXIT_SUCCESS );
+}
+
+/*
+ * Parse command-line options and return index of last element in
+ * argument list that is not an option
+ */
+int parseopts ( const int argc, char **argv, struct options *opts ) {
+	int c;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "board", required_argument, NULL, 'b' },
+			{ "backend", required_argument, NULL, 'B' },
+			{ "input", required_argument, NULL, 'i' },
+			{ "block-size", required_argument, NULL, 'c' },
+			{ "blocks", required_argument, NULL, 'n' },
+			{ "depth", required_argument, NULL, 'q' },
+			{ "interval", required_argument, NULL, 'I' },
+			{ "attach", 0, NULL, 'a' },
+			{ "policy", required_argument, NULL, 'p' },
+			{ "output", required_argument, NULL, 'o' },
+			{ "list", 0, NULL, 'l' },
+			{ "verbose", 0, NULL, 'v' },
+			{ "help", 0, NULL, 'h' },
+			{ 0, 0, 0, 0 }
+		};
+
+		if ( ( c = getopt_long ( argc, argv, "b:B:i:c:n:q:I:ap:o:lvh", long_options, &option_index ) ) == -1 ) {
+			break;
+		}
+
+		switch ( c ) {
+		case 'b':
+			opts->board = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'B':
+			if ( strcmp ( optarg, "kernel" ) == 0 ) {
+				opts->backend = QUSB_BACKEND_KERNEL;
+			} else if ( strcmp ( optarg, "libusb" ) == 0 ) {
+				opts->backend = QUSB_BACKEND_LIBUSB;
+			} else {
+				eprintf ( "Unknown backend: %s\n", optarg );
+				exit ( EXIT_FAILURE );
+			}
+			break;
+		case 'i':
+			opts->input = optarg;
+			break;
+		case 'c':
+			opts->block_size = qusb_parse_size ( optarg );
+			break;
+		case 'n':
+			opts->blocks = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'q':
+			opts->depth = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'I':
+			opts->interval = strtod ( optarg, NULL );
+			break;
+		case 'a':
+			opts->mode = MODE_ATTACH;
+			break;
+		case 'p':
+			if ( strcmp ( optarg, "drop" ) == 0 ) {
+				opts->policy = QUSB_FANOUT_DROP;
+			} else if ( strcmp ( optarg, "block" ) == 0 ) {
+				opts->policy = QUSB_FANOUT_BLOCK;
+			} else {
+				eprintf ( "Unknown policy: %s\n", optarg );
+				exit ( EXIT_FAILURE );
+			}
+			break;
+		case 'o':
+			opts->output = optarg;
+			break;
+		case 'l':
+			opts->mode = MODE_LIST;
+			break;
+		case 'v':
+			opts->verbose = 1;
+			break;
+		case 'h':
+			printhelp();
+			break;
+		case '?':
+		default:
+			eprintf ( "Unrecognised option: %c\n", c );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	return optind;
+}
+
+void printhelp () {
+	printf( "qusb-fanout: share one QuickUSB HSPIO stream between processes.\n"
+	"\n"
+	"USAGE:	qusb-fanout [OPTIONS] NAME		(producer)\n"
+	"	qusb-fanout -a [-p POLICY] [-o FILE] NAME	(consumer)\n"
+	"	qusb-fanout -l NAME			(list consumers)\n"
+	"\n"
+	"	The producer reads /dev/quNhd (through libquickusb) into a ring\n"
+	"	of blocks in the shared memory object /dev/shm/NAME, until\n"
+	"	SIGINT/SIGTERM. Any number of consumers (up to %u) attach to it,\n"
+	"	each reading every block from where it attached, in place; with\n"
+	"	-a, qusb-fanout is one, copying the stream to FILE (or stdout).\n"
+	"	Programs attach with qusb_fanout_attach().\n"
+	"\n"
+	"	Every INTERVAL, the producer prints to stderr: seconds, MB/s,\n"
+	"	blocks published, stalls (waits for a blocking consumer), and for\n"
+	"	each consumer, pid:policy:lag (blocks):dropped (blocks).\n"
+	"\n"
+	"OPTIONS:\n"
+	"	-b, --board=N		Board number (default 0)\n"
+	"	-B, --backend=B		kernel or libusb (default: $QUSB_BACKEND, else kernel)\n"
+	"	-i, --input=FILE	Read FILE (or - for stdin) instead of a board\n"
+	"	-c, --block-size=N	Read size (default 1M; even)\n"
+	"	-n, --blocks=N		Blocks in the ring (default 64)\n"
+	"	-q, --depth=N		Reads outstanding (default 8)\n"
+	"	-I, --interval=S	Statistics interval (default 1)\n"
+	"	-a, --attach		Attach to ring NAME, as a consumer\n"
+	"	-p, --policy=P		When the consumer is a whole ring behind:\n"
+	"				drop: skip what is overwritten (default)\n"
+	"				block: hold the producer (and the board) back\n"
+	"	-o, --output=FILE	Consumer output (default: stdout)\n"
+	"	-l, --list		Show ring NAME and its consumers' lag\n"
+	"	-v, --verbose		Consumer: report blocks read on exit\n"
+	"	-h, --help		Show this help\n"
+	"\n"
+	"	Sizes take k, M, G suffixes.\n"
+	"\n", QUSB_FANOUT_MAX_CONSUMERS );
+
+	exit(EXIT_SUCCESS);
+}
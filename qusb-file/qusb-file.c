@@ -0,0 +1,514 @@
+/*
+ * qusb-file - inspect, search and extract QuickUSB capture files
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+/*
+ * Capture files are written by qusb-capture, and read here through
+ * libquickusb: the file is mapped, and a seek to a time or a sample is
+ * a binary search of the index (or of the block headers, if the capture
+ * was interrupted before the index was written), so it costs the same
+ * for a 500 GB file as for a small one.  A board's stream from a
+ * striped capture (-m) is read the same way, through qusb_stripe_open().
+ *
+ * Compressed blocks are unpacked by a pool of threads, a batch at a
+ * time, and written out (or verified, with -V) in order.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../libquickusb/libquickusb.h"
+
+#define eprintf(...) fprintf ( stderr, __VA_ARGS__ )
+
+struct options {
+	int list;
+	int extract;
+	const char *time;		/* Seek to a time */
+	int seek_offset;		/* Seek to offset */
+	uint64_t offset;
+	uint64_t bytes;			/* Extract at most */
+	unsigned int jobs;		/* Unpacking threads */
+	const char *verify;		/* Test pattern */
+	int striped;			/* FILE is a stripe manifest */
+	unsigned int board;
+};
+
+/* Blocks unpacked per thread, per batch */
+#define BATCH_PER_JOB 4
+
+struct unpacker {
+	struct qusb_file *file;
+	pthread_t thread;
+	uint64_t first;			/* Block */
+	unsigned int count;
+	unsigned int stride;		/* Every stride'th block from first */
+	uint8_t **bufs;			/* Per block of the batch */
+	ssize_t *lens;
+};
+
+int parseopts ( const int, char **argv, struct options * );
+void printhelp ();
+
+/* "+S.S" from the start of the capture, or "S.S" since the epoch */
+static uint64_t parsetime ( struct qusb_file *file, const char *arg ) {
+	double secs = strtod ( arg, NULL );
+
+	if ( arg[0] == '+' )
+		return ( qusb_file_header ( file )->start_ns + ( secs * 1e9 ) );
+	return ( secs * 1e9 );
+}
+
+static void print_time ( const char *name, uint64_t ns ) {
+	time_t secs = ( ns / 1000000000ULL );
+	char buf[64];
+
+	strftime ( buf, sizeof ( buf ), "%Y-%m-%dT%H:%M:%S", gmtime ( &secs ) );
+	printf ( "%s %llu.%09llu %s.%06lluZ\n", name,
+		 ( unsigned long long ) secs,
+		 ( unsigned long long ) ( ns % 1000000000ULL ), buf,
+		 ( unsigned long long ) ( ( ns % 1000000000ULL ) / 1000 ) );
+}
+
+static void info ( struct qusb_file *file ) {
+	const struct qusb_file_header *header = qusb_file_header ( file );
+	const struct qusb_file_block *first;
+	const struct qusb_file_block *last;
+	uint64_t blocks = qusb_file_blocks ( file );
+	unsigned int port;
+
+	printf ( "version %u\nblock_size %u\nblocks %llu\nindexed %s\n",
+		 header->version, header->block_size,
+		 ( unsigned long long ) blocks,
+		 ( qusb_file_indexed ( file ) ? "yes" : "no" ) );
+	print_time ( "start", header->start_ns );
+	if ( header->flags & QUSB_FILE_SETTINGS ) {
+		printf ( "board %u\nfifoconfig 0x%04x\n", header->board,
+			 header->fifoconfig );
+		for ( port = 0 ; port < QUSB_MAX_GPPIO ; port++ ) {
+			printf ( "gppio_%c outputs 0x%02x levels 0x%02x\n",
+				 ( 'a' + port ), header->gppio_outputs[port],
+				 header->gppio_levels[port] );
+		}
+	}
+	if ( ! blocks )
+		return;
+	first = qusb_file_block ( file, 0 );
+	last = qusb_file_block ( file, ( blocks - 1 ) );
+	printf ( "first_offset %llu\nend_offset %llu\n",
+		 ( unsigned long long ) first->offset,
+		 ( unsigned long long ) ( last->offset + last->length ) );
+	print_time ( "first_block", first->timestamp_ns );
+	print_time ( "last_block", last->timestamp_ns );
+}
+
+static void list ( struct qusb_file *file, uint64_t from ) {
+	const struct qusb_file_block *block;
+	uint64_t blocks = qusb_file_blocks ( file );
+	uint64_t i;
+
+	printf ( "# block sequence offset timestamp_ns length stored "
+		 "flags\n" );
+	for ( i = from ; i < blocks ; i++ ) {
+		block = qusb_file_block ( file, i );
+		printf ( "%llu %llu %llu %llu %u %u %s%s\n",
+			 ( unsigned long long ) i,
+			 ( unsigned long long ) block->sequence,
+			 ( unsigned long long ) block->offset,
+			 ( unsigned long long ) block->timestamp_ns,
+			 block->length, block->stored,
+			 ( ( block->flags & QUSB_FILE_BLOCK_GAP ) ?
+			   "gap," : "" ),
+			 ( ( block->flags & QUSB_FILE_BLOCK_PACKED ) ?
+			   "packed" : "-" ) );
+	}
+}
+
+static void * unpack_blocks ( void *arg ) {
+	struct unpacker *unpacker = arg;
+	unsigned int i;
+
+	for ( i = 0 ; i < unpacker->count ; i += unpacker->stride ) {
+		unpacker->lens[i] =
+			qusb_file_unpack ( qusb_file_block ( unpacker->file,
+							     ( unpacker->first + i ) ),
+					   unpacker->bufs[i] );
+	}
+	return NULL;
+}
+
+/* Unpack @count blocks from @first, in parallel */
+static int unpack_batch ( struct unpacker *unpackers, unsigned int jobs,
+			  uint64_t first, unsigned int count, uint8_t **bufs,
+			  ssize_t *lens ) {
+	unsigned int i;
+	int rc;
+
+	for ( i = 0 ; ( ( i < jobs ) && ( i < count ) ) ; i++ ) {
+		unpackers[i].first = ( first + i );
+		unpackers[i].count = ( count - i );
+		unpackers[i].stride = jobs;
+		unpackers[i].bufs = ( bufs + i );
+		unpackers[i].lens = ( lens + i );
+		if ( ( rc = pthread_create ( &unpackers[i].thread, NULL,
+					     unpack_blocks,
+					     &unpackers[i] ) ) != 0 ) {
+			/* Do it here instead */
+			unpack_blocks ( &unpackers[i] );
+			unpackers[i].count = 0;
+		}
+	}
+	for ( i = 0 ; ( ( i < jobs ) && ( i < count ) ) ; i++ ) {
+		if ( unpackers[i].count )
+			pthread_join ( unpackers[i].thread, NULL );
+	}
+	return 0;
+}
+
+static void verify_report ( void *priv,
+			    const struct qusb_verify_event *event ) {
+	printf ( "%s at byte %llu count %llu expected 0x%04x actual 0x%04x\n",
+		 qusb_verify_event_name ( event->type ),
+		 ( unsigned long long ) event->offset,
+		 ( unsigned long long ) event->count, event->expected,
+		 event->actual );
+}
+
+/* Write the data from @offset within block @from to stdout, or check it
+ * with @verify */
+static int extract ( struct qusb_file *file, uint64_t from, uint64_t offset,
+		     uint64_t bytes, unsigned int jobs,
+		     struct qusb_verify *verify ) {
+	const struct qusb_file_header *header = qusb_file_header ( file );
+	const struct qusb_file_block *block;
+	uint64_t blocks = qusb_file_blocks ( file );
+	unsigned int batch = ( jobs * BATCH_PER_JOB );
+	struct unpacker unpackers[jobs];
+	uint8_t *bufs[batch];
+	ssize_t lens[batch];
+	unsigned int count = 0;
+	unsigned int k;
+	const uint8_t *data;
+	size_t len;
+	size_t skip;
+	uint64_t next = UINT64_MAX;	/* Offset following the last data */
+	uint64_t i;
+	int rc = 0;
+
+	if ( header->flags & QUSB_FILE_PACKED ) {
+		memset ( bufs, 0, sizeof ( bufs ) );
+		for ( k = 0 ; k < batch ; k++ ) {
+			unpackers[k % jobs].file = file;
+			if ( ! ( bufs[k] = malloc ( header->block_size ) ) ) {
+				rc = -ENOMEM;
+				goto err;
+			}
+		}
+	}
+
+	for ( i = from ; ( ( i < blocks ) && bytes ) ; i++ ) {
+		block = qusb_file_block ( file, i );
+		if ( ( block->flags & QUSB_FILE_BLOCK_GAP ) && ( i != from ) ) {
+			eprintf ( "Warning: data lost before offset %llu\n",
+				  ( unsigned long long ) block->offset );
+		}
+		skip = ( ( offset > block->offset ) ?
+			 ( offset - block->offset ) : 0 );
+		if ( skip >= block->length )
+			continue;
+
+		if ( header->flags & QUSB_FILE_PACKED ) {
+			/* Unpack the next batch, when this one is done */
+			k = ( ( i - from ) % batch );
+			if ( k == 0 ) {
+				count = ( ( ( blocks - i ) < batch ) ?
+					  ( blocks - i ) : batch );
+				unpack_batch ( unpackers, jobs, i, count,
+					       bufs, lens );
+			}
+			if ( ( lens[k] < 0 ) || ( lens[k] != block->length ) ) {
+				eprintf ( "Error: block %llu is corrupt\n",
+					  ( unsigned long long ) i );
+				rc = -EINVAL;
+				goto err;
+			}
+			data = ( bufs[k] + skip );
+		} else {
+			data = ( ( const uint8_t * ) qusb_file_data ( block ) +
+				 skip );
+		}
+
+		len = ( block->length - skip );
+		if ( len > bytes )
+			len = bytes;
+		if ( verify ) {
+			/* Not data the board sent wrongly */
+			if ( next != UINT64_MAX )
+				qusb_verify_skip ( verify, ( block->offset +
+							     skip - next ) );
+			qusb_verify_data ( verify, data, len );
+			next = ( block->offset + skip + len );
+		} else if ( fwrite ( data, 1, len, stdout ) != len ) {
+			eprintf ( "Error: write failed: %s\n",
+				  strerror ( errno ) );
+			rc = -EIO;
+			goto err;
+		}
+		bytes -= len;
+	}
+
+ err:
+	if ( header->flags & QUSB_FILE_PACKED ) {
+		for ( k = 0 ; k < batch ; k++ )
+			free ( bufs[k] );
+	}
+	return rc;
+}
+
+/* Check the data (from the seek) against a test pattern */
+static int verify_file ( struct qusb_file *file, uint64_t from,
+			 uint64_t offset,
+		    struct options *opts ) {
+	const struct qusb_verify_stats *stats;
+	enum qusb_verify_pattern pattern;
+	struct qusb_verify *verify;
+	unsigned int frame_words;
+	int rc;
+
+	if ( ( ( rc = qusb_verify_parse ( opts->verify, &pattern,
+					  &frame_words ) ) != 0 ) ||
+	     ( ( rc = qusb_verify_create ( pattern, frame_words,
+					   verify_report, NULL,
+					   &verify ) ) != 0 ) ) {
+		eprintf ( "Error: Could not verify %s: %s\n", opts->verify,
+			  strerror ( -rc ) );
+		return rc;
+	}
+	if ( ( rc = extract ( file, from, offset, opts->bytes, opts->jobs,
+			      verify ) ) != 0 )
+		goto err;
+	qusb_verify_finish ( verify );
+
+	stats = qusb_verify_stats ( verify );
+	printf ( "words %llu\ngaps %llu\nlost %llu\nduplicates %llu\n"
+		 "repeated %llu\nflips %llu\ncorrupt %llu\nframes %llu\n"
+		 "crc_errors %llu\nresyncs %llu\nskipped_bytes %llu\n",
+		 ( unsigned long long ) stats->words,
+		 ( unsigned long long ) stats->gaps,
+		 ( unsigned long long ) stats->lost,
+		 ( unsigned long long ) stats->duplicates,
+		 ( unsigned long long ) stats->repeated,
+		 ( unsigned long long ) stats->flips,
+		 ( unsigned long long ) stats->corrupt,
+		 ( unsigned long long ) stats->frames,
+		 ( unsigned long long ) stats->crc_errors,
+		 ( unsigned long long ) stats->resyncs,
+		 ( unsigned long long ) stats->skipped );
+	if ( stats->gaps || stats->duplicates || stats->flips ||
+	     stats->corrupt || stats->crc_errors || stats->resyncs )
+		rc = -EILSEQ;
+
+ err:
+	qusb_verify_destroy ( verify );
+	return rc;
+}
+
+int main ( int argc, char* argv[] ) {
+	struct options opts;
+	struct qusb_file *file;
+	const char *path;
+	int64_t block = 0;
+	uint64_t offset = 0;
+	int rc;
+
+	memset ( &opts, 0, sizeof ( opts ) );
+	opts.bytes = UINT64_MAX;
+	opts.jobs = sysconf ( _SC_NPROCESSORS_ONLN );
+
+	if ( parseopts ( argc, argv, &opts ) != ( argc - 1 ) ) {
+		eprintf ( "Error: no capture file given (see -h)\n" );
+		exit ( EXIT_FAILURE );
+	}
+	path = argv[argc - 1];
+	if ( ( opts.jobs < 1 ) || ( opts.jobs > 256 ) )
+		opts.jobs = 1;
+
+	if ( opts.striped ) {
+		if ( ( rc = qusb_stripe_open ( path, opts.board,
+					       &file ) ) != 0 ) {
+			eprintf ( "Error: Could not open board %u of %s: %s\n",
+				  opts.board, path,
+				  ( ( rc == -EINVAL ) ? "not a manifest" :
+				    ( rc == -ENOENT ) ? "board not captured" :
+				    strerror ( -rc ) ) );
+			exit ( EXIT_FAILURE );
+		}
+	} else if ( ( rc = qusb_file_open ( path, &file ) ) != 0 ) {
+		eprintf ( "Error: Could not open %s: %s\n", path,
+			  ( ( rc == -EINVAL ) ? "not a capture file" :
+			    strerror ( -rc ) ) );
+		exit ( EXIT_FAILURE );
+	}
+
+	if ( opts.time ) {
+		block = qusb_file_seek_time ( file,
+					      parsetime ( file, opts.time ) );
+	} else if ( opts.seek_offset ) {
+		block = qusb_file_seek_offset ( file, opts.offset );
+		offset = opts.offset;
+	}
+	if ( block < 0 ) {
+		eprintf ( "Error: not in %s: %s\n", path,
+			  ( ( block == -ERANGE ) ? "after the end" :
+			    "before the start, or data lost" ) );
+		qusb_file_close ( file );
+		exit ( EXIT_FAILURE );
+	}
+
+	rc = 0;
+	if ( opts.verify ) {
+		rc = verify_file ( file, block, offset, &opts );
+	} else if ( opts.extract ) {
+		rc = extract ( file, block, offset, opts.bytes, opts.jobs,
+			       NULL );
+	} else if ( opts.list ) {
+		list ( file, block );
+	} else if ( opts.time || opts.seek_offset ) {
+		printf ( "block %lld\n", ( long long ) block );
+		print_time ( "timestamp",
+			     qusb_file_block ( file, block )->timestamp_ns );
+		printf ( "offset %llu\nlength %u\n",
+			 ( unsigned long long )
+			 qusb_file_block ( file, block )->offset,
+			 qusb_file_block ( file, block )->length );
+	} else {
+		info ( file );
+	}
+
+	qusb_file_close ( file );
+	return ( rc ? EXIT_FAILURE : EXIT_SUCCESS );
+}
+
+/*
+ * Parse command-line options and return index of last element in
+ * argument list that is not an option
+ */
+int parseopts ( const int argc, char **argv, struct options *opts ) {
+	int c;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "list", 0, NULL, 'l' },
+			{ "extract", 0, NULL, 'x' },
+			{ "time", required_argument, NULL, 't' },
+			{ "sample", required_argument, NULL, 's' },
+			{ "offset", required_argument, NULL, 'o' },
+			{ "bytes", required_argument, NULL, 'n' },
+			{ "verify", required_argument, NULL, 'V' },
+			{ "jobs", required_argument, NULL, 'j' },
+			{ "manifest", required_argument, NULL, 'm' },
+			{ "help", 0, NULL, 'h' },
+			{ 0, 0, 0, 0 }
+		};
+
+		if ( ( c = getopt_long ( argc, argv, "lxt:s:o:n:j:m:V:h", long_options, &option_index ) ) == -1 ) {
+			break;
+		}
+
+		switch ( c ) {
+		case 'l':
+			opts->list = 1;
+			break;
+		case 'x':
+			opts->extract = 1;
+			break;
+		case 't':
+			opts->time = optarg;
+			break;
+		case 's':
+			/* 16-bit words */
+			opts->seek_offset = 1;
+			opts->offset = ( strtoull ( optarg, NULL, 0 ) * 2 );
+			break;
+		case 'o':
+			opts->seek_offset = 1;
+			opts->offset = strtoull ( optarg, NULL, 0 );
+			break;
+		case 'n':
+			opts->bytes = strtoull ( optarg, NULL, 0 );
+			break;
+		case 'j':
+			opts->jobs = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'm':
+			opts->striped = 1;
+			opts->board = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'V':
+			opts->verify = optarg;
+			break;
+		case 'h':
+			printhelp();
+			break;
+		case '?':
+		default:
+			eprintf ( "Unrecognised option: %c\n", c );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	return optind;
+}
+
+void printhelp () {
+	printf( "qusb-file: inspect, search and extract QuickUSB capture files.\n"
+	"\n"
+	"USAGE:	qusb-file [OPTIONS] FILE\n"
+	"\n"
+	"	With no options, prints the file's header: the board settings as\n"
+	"	the capture started, and the range of offsets and times it holds.\n"
+	"\n"
+	"OPTIONS:\n"
+	"	-t, --time=T		Seek to time T: seconds since the epoch, or\n"
+	"				+seconds from the start of the capture\n"
+	"	-s, --sample=N		Seek to 16-bit sample N of the stream\n"
+	"	-o, --offset=N		Seek to byte N of the stream\n"
+	"	-l, --list		List the blocks (from the seek)\n"
+	"	-x, --extract		Write the data (from the seek) to stdout\n"
+	"	-n, --bytes=N		Extract (or verify) at most N bytes\n"
+	"	-V, --verify=PATTERN	Check the data (from the seek) against a test\n"
+	"				pattern: counter, lfsr, or crc[:N]\n"
+	"	-j, --jobs=N		Threads unpacking compressed files (default: CPUs)\n"
+	"	-m, --manifest=BOARD	FILE is the manifest of a striped capture\n"
+	"				(qusb-stripe): read board BOARD's stream\n"
+	"	-h, --help		Show this help\n"
+	"\n"
+	"	A seek alone prints the block found: the first one read at or\n"
+	"	after the time, or the one holding the sample. Offsets count the\n"
+	"	data read from the board (including any the capture dropped), so\n"
+	"	they are the same in each file of a rotated capture.\n"
+	"\n"
+	"	With -m, the board's blocks are gathered from the stripe files\n"
+	"	the manifest names, in order, and read as one capture file.\n"
+	"\n"
+	"	Verification lists each gap, duplicate and damaged word, at its\n"
+	"	byte offset in the stream, then the totals, and fails if there\n"
+	"	were any; see qusb-capture -V. Data the capture dropped is\n"
+	"	skipped, not reported.\n"
+	"\n");
+
+	exit(EXIT_SUCCESS);
+}
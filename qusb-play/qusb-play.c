@@ -0,0 +1,676 @@
+/*
+ * qusb-play - play a file out of QuickUSB HSPIO, without gaps
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+/*
+ * The reverse of qusb-capture.  A loader thread reads the file ahead
+ * into a large ring, so that the write path never waits for the disk
+ * or the page cache; the main thread copies the ring into the blocks of
+ * a libquickusb OUT stream, and keeps them all queued, so there are
+ * always several writes outstanding.  A file that fits in the ring is
+ * read once, before playback starts, and played from memory.
+ *
+ * The file can be played repeatedly (-l): the stream runs straight on
+ * from the end of the file to its start, in the same block if need be,
+ * so the board sees no gap between iterations.
+ *
+ * An underrun is the board being left with nothing to write before the
+ * end: every block written, and the ring not yet refilled.  They are
+ * counted, and reported.
+ *
+ * The ring is lock-free, as in qusb-capture: the loader alone advances
+ * its head and the player alone advances its tail (both in bytes),
+ * each published with release/acquire ordering.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../libquickusb/libquickusb.h"
+
+#define eprintf(...) fprintf ( stderr, __VA_ARGS__ )
+
+struct options {
+	unsigned int board;
+	enum qusb_backend_type backend;
+	const char *input;
+	const char *output;		/* File to write instead of a board */
+	size_t block_size;
+	size_t ring_size;
+	unsigned int depth;		/* Writes outstanding */
+	unsigned long long loops;	/* Plays of the file (0: forever) */
+	double interval;		/* Statistics */
+	unsigned long long pace_rate;	/* Bytes/s, paced by the driver */
+	size_t pace_chunk;
+	int verbose;
+};
+
+struct play {
+	struct options *opts;
+	struct qusb_device *dev;
+	int input_fd;
+	int output_fd;
+	unsigned long long file_size;
+	unsigned long long total;	/* Bytes to play (0: forever) */
+	/* Ring */
+	unsigned char *ring;
+	size_t ring_size;
+	int resident;			/* The whole file, loaded once */
+	unsigned long long head;	/* Bytes loaded (loader) */
+	unsigned long long tail;	/* Bytes taken (player) */
+	/* Loader */
+	pthread_t loader_thread;
+	int loader_done;
+	int loader_error;
+	/* Player */
+	unsigned long long taken;	/* Of the stream */
+	unsigned long long bytes_written;
+	unsigned int outstanding;	/* Blocks submitted, not completed */
+	unsigned long long underruns;
+	int dry;			/* Nothing outstanding */
+	int writer_error;
+};
+
+static volatile sig_atomic_t stop;
+
+int parseopts ( const int, char **argv, struct options * );
+void printhelp ();
+
+/****************************************************************************
+ *
+ * Loader
+ *
+ */
+
+/* Read @len bytes of the file from @offset; returns 0 or -errno */
+static int load ( struct play *play, unsigned char *data,
+		  unsigned long long offset, size_t len ) {
+	ssize_t rc;
+
+	while ( len ) {
+		rc = pread ( play->input_fd, data, len, offset );
+		if ( rc < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			return -errno;
+		}
+		if ( rc == 0 )
+			return -EIO;	/* Truncated while playing */
+		data += rc;
+		offset += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+/* Top up the ring: returns bytes loaded, or -errno */
+static ssize_t loader_fill ( struct play *play ) {
+	unsigned long long head = play->head;
+	unsigned long long tail = __atomic_load_n ( &play->tail,
+						    __ATOMIC_ACQUIRE );
+	unsigned long long offset = ( head % play->file_size );
+	size_t len = ( play->ring_size - ( head - tail ) );
+	size_t pos = ( head % play->ring_size );
+	int rc;
+
+	/* Contiguous, within the file, a block at most */
+	if ( len > play->opts->block_size )
+		len = play->opts->block_size;
+	if ( len > ( play->ring_size - pos ) )
+		len = ( play->ring_size - pos );
+	if ( len > ( play->file_size - offset ) )
+		len = ( play->file_size - offset );
+	if ( play->total && ( len > ( play->total - head ) ) )
+		len = ( play->total - head );
+	if ( ! len )
+		return 0;
+
+	if ( ( rc = load ( play, ( play->ring + pos ), offset, len ) ) != 0 )
+		return rc;
+	if ( ( offset + len ) == play->file_size ) {
+		/* Round again: have the start read in already */
+		posix_fadvise ( play->input_fd, 0, play->ring_size,
+				POSIX_FADV_WILLNEED );
+	}
+	__atomic_store_n ( &play->head, ( head + len ), __ATOMIC_RELEASE );
+	return len;
+}
+
+static void * loader ( void *arg ) {
+	struct play *play = arg;
+	ssize_t len;
+
+	while ( ! stop ) {
+		if ( play->total && ( play->head == play->total ) )
+			break;
+		if ( ( len = loader_fill ( play ) ) < 0 ) {
+			play->loader_error = len;
+			stop = 1;
+			break;
+		}
+		if ( len == 0 ) {
+			/* Ring full: wait for the player */
+			usleep ( 1000 );
+		}
+	}
+	__atomic_store_n ( &play->loader_done, 1, __ATOMIC_RELEASE );
+	return NULL;
+}
+
+/* Fill the ring before playing, or load a small file whole */
+static int loader_prefill ( struct play *play ) {
+	ssize_t len;
+	int rc;
+
+	if ( play->file_size <= play->ring_size ) {
+		if ( ( rc = load ( play, play->ring, 0,
+				   play->file_size ) ) != 0 )
+			return rc;
+		play->resident = 1;
+		return 0;
+	}
+
+	posix_fadvise ( play->input_fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+	do {
+		if ( ( len = loader_fill ( play ) ) < 0 )
+			return len;
+	} while ( len );
+	return 0;
+}
+
+/****************************************************************************
+ *
+ * Player
+ *
+ */
+
+/*
+ * Copy the next @len bytes of the stream to @data.  Returns the bytes
+ * copied: short only at the end, and 0 if the ring has too little.
+ */
+static size_t take ( struct play *play, unsigned char *data, size_t len ) {
+	unsigned long long head;
+	size_t chunk;
+	size_t pos;
+	size_t done;
+
+	if ( play->total && ( len > ( play->total - play->taken ) ) )
+		len = ( play->total - play->taken );
+
+	if ( play->resident ) {
+		for ( done = 0 ; done < len ; done += chunk ) {
+			pos = ( ( play->taken + done ) % play->file_size );
+			chunk = ( play->file_size - pos );
+			if ( chunk > ( len - done ) )
+				chunk = ( len - done );
+			memcpy ( ( data + done ), ( play->ring + pos ), chunk );
+		}
+		play->taken += len;
+		return len;
+	}
+
+	head = __atomic_load_n ( &play->head, __ATOMIC_ACQUIRE );
+	if ( ( head - play->tail ) < len )
+		return 0;
+	for ( done = 0 ; done < len ; done += chunk ) {
+		pos = ( ( play->tail + done ) % play->ring_size );
+		chunk = ( play->ring_size - pos );
+		if ( chunk > ( len - done ) )
+			chunk = ( len - done );
+		memcpy ( ( data + done ), ( play->ring + pos ), chunk );
+	}
+	play->taken += len;
+	__atomic_store_n ( &play->tail, ( play->tail + len ),
+			   __ATOMIC_RELEASE );
+	return len;
+}
+
+static int finished ( struct play *play ) {
+	return ( play->total && ( play->taken == play->total ) );
+}
+
+static int play_complete ( struct qusb_block *block, void *priv ) {
+	struct play *play = priv;
+
+	play->outstanding--;
+	if ( block->status < 0 ) {
+		if ( ! play->writer_error )
+			play->writer_error = block->status;
+		return QUSB_STOP;
+	}
+	__atomic_add_fetch ( &play->bytes_written, block->status,
+			     __ATOMIC_RELAXED );
+	return QUSB_CONTINUE;
+}
+
+/* Queue as many blocks as the stream and the ring allow */
+static void play_feed ( struct play *play, struct qusb_stream *stream ) {
+	struct qusb_block *block;
+	size_t len;
+
+	while ( ! finished ( play ) &&
+		( block = qusb_stream_get_block ( stream ) ) ) {
+		if ( ! ( len = take ( play, block->data,
+				      play->opts->block_size ) ) ) {
+			qusb_block_release ( block );
+			break;
+		}
+		block->len = len;
+		qusb_stream_submit ( block );
+		play->outstanding++;
+		play->dry = 0;
+	}
+	if ( ! play->outstanding && ! finished ( play ) && ! play->dry ) {
+		__atomic_add_fetch ( &play->underruns, 1, __ATOMIC_RELAXED );
+		play->dry = 1;
+	}
+}
+
+/****************************************************************************
+ *
+ * Main
+ *
+ */
+
+static void handle_signal ( int sig ) {
+	stop = 1;
+}
+
+static void report ( struct play *play, double start, int final ) {
+	static unsigned long long last_written;
+	static double last;
+	unsigned long long bytes_written;
+	unsigned long long head;
+	unsigned long long tail;
+	double t = qusb_now_us();
+	double dt;
+
+	if ( ! last )
+		last = start;
+	dt = ( ( final ? ( t - start ) : ( t - last ) ) / 1e6 );
+	if ( dt <= 0 )
+		dt = 1e-6;
+	bytes_written = __atomic_load_n ( &play->bytes_written,
+					  __ATOMIC_RELAXED );
+	head = __atomic_load_n ( &play->head, __ATOMIC_RELAXED );
+	tail = __atomic_load_n ( &play->tail, __ATOMIC_RELAXED );
+
+	eprintf ( "%s%.1f %.3f %.1f %llu %llu\n",
+		  ( final ? "# total " : "" ), ( ( t - start ) / 1e6 ),
+		  ( ( final ? bytes_written :
+		      ( bytes_written - last_written ) ) / dt / 1e6 ),
+		  ( play->resident ? 100.0 :
+		    ( ( ( head - tail ) * 100.0 ) / play->ring_size ) ),
+		  ( bytes_written / play->file_size ),
+		  __atomic_load_n ( &play->underruns, __ATOMIC_RELAXED ) );
+
+	last_written = bytes_written;
+	last = t;
+}
+
+/* Play to a board, through a stream */
+static int play_board ( struct play *play, double start ) {
+	struct options *opts = play->opts;
+	struct qusb_stream_config config;
+	struct qusb_stream *stream;
+	struct qusb_loop *loop;
+	double next_report = ( start + ( opts->interval * 1e6 ) );
+	int rc;
+
+	memset ( &config, 0, sizeof ( config ) );
+	config.direction = QUSB_OUT;
+	config.block_size = opts->block_size;
+	config.depth = opts->depth;
+	config.blocks = ( 2 * config.depth );
+	config.complete = play_complete;
+	config.priv = play;
+
+	if ( ( rc = qusb_loop_create ( config.blocks, &loop ) ) != 0 )
+		return rc;
+	if ( ( rc = qusb_stream_create ( loop, play->dev, &config,
+					 &stream ) ) != 0 )
+		goto err_stream;
+
+	/* Everything queued before the first write */
+	play_feed ( play, stream );
+	play->dry = 0;
+	qusb_stream_start ( stream );
+	while ( ! stop && qusb_stream_running ( stream ) ) {
+		if ( finished ( play ) && ! play->outstanding )
+			break;
+		if ( ( rc = qusb_loop_run ( loop, ( play->dry ? 1 : 100 ) ) ) < 0 )
+			break;
+		rc = 0;
+		play_feed ( play, stream );
+		if ( qusb_now_us() >= next_report ) {
+			report ( play, start, 0 );
+			next_report += ( opts->interval * 1e6 );
+		}
+	}
+
+	qusb_stream_destroy ( stream );
+ err_stream:
+	qusb_loop_destroy ( loop );
+	return rc;
+}
+
+/* Play to a file (for testing), a block at a time */
+static int play_file ( struct play *play, double start ) {
+	struct options *opts = play->opts;
+	double next_report = ( start + ( opts->interval * 1e6 ) );
+	unsigned char *block;
+	size_t len;
+	ssize_t rc;
+
+	if ( ! ( block = malloc ( opts->block_size ) ) )
+		return -ENOMEM;
+	while ( ! stop && ! finished ( play ) ) {
+		if ( ! ( len = take ( play, block, opts->block_size ) ) ) {
+			if ( ! play->dry ) {
+				play->underruns++;
+				play->dry = 1;
+			}
+			usleep ( 100 );
+			continue;
+		}
+		play->dry = 0;
+		if ( ( rc = write ( play->output_fd, block, len ) ) !=
+		     ( ssize_t ) len ) {
+			free ( block );
+			return ( ( rc < 0 ) ? -errno : -ENOSPC );
+		}
+		play->bytes_written += len;
+		if ( qusb_now_us() >= next_report ) {
+			report ( play, start, 0 );
+			next_report += ( opts->interval * 1e6 );
+		}
+	}
+	free ( block );
+	return 0;
+}
+
+int main ( int argc, char* argv[] ) {
+	static struct play play;
+	struct options opts;
+	struct quickusb_pacing_stats_ioctl_data pacing_stats;
+	struct sigaction sa;
+	struct stat st;
+	double start;
+	int rc;
+
+	memset ( &opts, 0, sizeof ( opts ) );
+	opts.block_size = ( 1024 * 1024 );
+	opts.ring_size = ( 256 * 1024 * 1024 );
+	opts.depth = 8;
+	opts.loops = 1;
+	opts.interval = 1.0;
+
+	if ( parseopts ( argc, argv, &opts ) != ( argc - 1 ) ) {
+		eprintf ( "Error: no input file given (see -h)\n" );
+		exit ( EXIT_FAILURE );
+	}
+	opts.input = argv[argc - 1];
+	if ( ( opts.block_size < 2 ) || ( opts.block_size % 2 ) ||
+	     ( opts.ring_size < ( 2 * opts.block_size ) ) ||
+	     ( opts.depth < 1 ) || ( opts.depth > 256 ) ||
+	     ( opts.interval <= 0 ) ) {
+		eprintf ( "Invalid options (see -h)\n" );
+		exit ( EXIT_FAILURE );
+	}
+
+	memset ( &play, 0, sizeof ( play ) );
+	play.opts = &opts;
+	play.ring_size = opts.ring_size;
+	if ( ( ( play.input_fd = open ( opts.input, O_RDONLY ) ) < 0 ) ||
+	     ( fstat ( play.input_fd, &st ) < 0 ) ) {
+		eprintf ( "Error: Could not open %s: %s\n", opts.input,
+			  strerror ( errno ) );
+		exit ( EXIT_FAILURE );
+	}
+	if ( ! ( play.file_size = st.st_size ) ) {
+		eprintf ( "Error: %s is empty\n", opts.input );
+		exit ( EXIT_FAILURE );
+	}
+	play.total = ( opts.loops * play.file_size );
+	if ( play.file_size < play.ring_size )
+		play.ring_size = play.file_size;
+	if ( ! ( play.ring = malloc ( play.ring_size ) ) ) {
+		eprintf ( "Error: out of memory\n" );
+		exit ( EXIT_FAILURE );
+	}
+	/* Keep the ring resident if allowed */
+	if ( ( mlock ( play.ring, play.ring_size ) < 0 ) && opts.verbose )
+		eprintf ( "Warning: could not lock the ring in memory: %s\n",
+			  strerror ( errno ) );
+
+	if ( ( rc = loader_prefill ( &play ) ) != 0 ) {
+		eprintf ( "Error: Could not read %s: %s\n", opts.input,
+			  strerror ( -rc ) );
+		exit ( EXIT_FAILURE );
+	}
+
+	if ( opts.output ) {
+		play.output_fd = ( strcmp ( opts.output, "-" ) ?
+				   open ( opts.output,
+					  ( O_WRONLY | O_CREAT | O_TRUNC ),
+					  0666 ) : 1 );
+		if ( play.output_fd < 0 ) {
+			eprintf ( "Error: Could not open %s: %s\n",
+				  opts.output, strerror ( errno ) );
+			exit ( EXIT_FAILURE );
+		}
+	} else if ( ( rc = qusb_open_backend ( opts.backend, opts.board,
+					       &play.dev ) ) != 0 ) {
+		eprintf ( "Error: Could not open board %u: %s\n", opts.board,
+			  strerror ( -rc ) );
+		exit ( EXIT_FAILURE );
+	}
+	if ( play.dev && opts.pace_rate ) {
+		struct quickusb_pacing_ioctl_data pacing = {
+			.rate = opts.pace_rate,
+			.chunk = opts.pace_chunk,
+		};
+
+		if ( ( rc = qusb_set_pacing ( play.dev, &pacing ) ) != 0 ) {
+			eprintf ( "Error: Could not pace board %u: %s\n",
+				  opts.board, strerror ( -rc ) );
+			exit ( EXIT_FAILURE );
+		}
+	}
+
+	memset ( &sa, 0, sizeof ( sa ) );
+	sa.sa_handler = handle_signal;
+	sigaction ( SIGINT, &sa, NULL );
+	sigaction ( SIGTERM, &sa, NULL );
+
+	if ( ( ! play.resident ) &&
+	     ( ( rc = pthread_create ( &play.loader_thread, NULL, loader,
+				       &play ) ) != 0 ) ) {
+		eprintf ( "Error: Could not start threads: %s\n",
+			  strerror ( rc ) );
+		exit ( EXIT_FAILURE );
+	}
+
+	eprintf ( "# seconds write_MBps ring_pct loops underruns\n" );
+	start = qusb_now_us();
+	if ( play.dev ) {
+		rc = play_board ( &play, start );
+	} else {
+		rc = play_file ( &play, start );
+	}
+	stop = 1;
+	if ( ! play.resident )
+		pthread_join ( play.loader_thread, NULL );
+	report ( &play, start, 1 );
+
+	if ( play.loader_error ) {
+		eprintf ( "Error: read failed: %s\n",
+			  strerror ( -play.loader_error ) );
+		rc = -1;
+	}
+	if ( play.writer_error || ( rc < 0 ) ) {
+		eprintf ( "Error: write failed: %s\n",
+			  strerror ( play.writer_error ?
+				     -play.writer_error : -rc ) );
+		rc = -1;
+	}
+	if ( play.underruns ) {
+		eprintf ( "Warning: %llu underruns (nothing left to write)\n",
+			  play.underruns );
+	}
+
+	if ( play.dev && opts.pace_rate &&
+	     ( qusb_pacing_stats ( play.dev, &pacing_stats ) == 0 ) ) {
+		eprintf ( "Paced at %llu bytes/s (achieved %llu): %llu chunks, "
+			  "%llu late, %llu underruns, lateness max %llu ns "
+			  "mean %llu ns\n",
+			  ( unsigned long long ) pacing_stats.rate,
+			  ( unsigned long long ) pacing_stats.achieved_rate,
+			  ( unsigned long long ) pacing_stats.chunks,
+			  ( unsigned long long ) pacing_stats.late,
+			  ( unsigned long long ) pacing_stats.underruns,
+			  ( unsigned long long ) pacing_stats.lateness_max_ns,
+			  ( unsigned long long ) pacing_stats.lateness_mean_ns );
+	}
+
+	if ( play.dev )
+		qusb_close ( play.dev );
+	return ( rc ? EXIT_FAILURE : EXIT_SUCCESS );
+}
+
+/*
+ * Parse command-line options and return index of last element in
+ * argument list that is not an option
+ */
+int parseopts ( const int argc, char **argv, struct options *opts ) {
+	int c;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "board", required_argument, NULL, 'b' },
+			{ "backend", required_argument, NULL, 'B' },
+			{ "output", required_argument, NULL, 'o' },
+			{ "block-size", required_argument, NULL, 'c' },
+			{ "ring-size", required_argument, NULL, 'r' },
+			{ "depth", required_argument, NULL, 'q' },
+			{ "loops", required_argument, NULL, 'l' },
+			{ "interval", required_argument, NULL, 'I' },
+			{ "pace", required_argument, NULL, 'p' },
+			{ "pace-chunk", required_argument, NULL, 'P' },
+			{ "verbose", 0, NULL, 'v' },
+			{ "help", 0, NULL, 'h' },
+			{ 0, 0, 0, 0 }
+		};
+
+		if ( ( c = getopt_long ( argc, argv, "b:B:o:c:r:q:l:I:p:P:vh", long_options, &option_index ) ) == -1 ) {
+			break;
+		}
+
+		switch ( c ) {
+		case 'b':
+			opts->board = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'B':
+			if ( strcmp ( optarg, "kernel" ) == 0 ) {
+				opts->backend = QUSB_BACKEND_KERNEL;
+			} else if ( strcmp ( optarg, "libusb" ) == 0 ) {
+				opts->backend = QUSB_BACKEND_LIBUSB;
+			} else {
+				eprintf ( "Unknown backend: %s\n", optarg );
+				exit ( EXIT_FAILURE );
+			}
+			break;
+		case 'o':
+			opts->output = optarg;
+			break;
+		case 'c':
+			opts->block_size = qusb_parse_size ( optarg );
+			break;
+		case 'r':
+			opts->ring_size = qusb_parse_size ( optarg );
+			break;
+		case 'q':
+			opts->depth = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'l':
+			opts->loops = strtoull ( optarg, NULL, 0 );
+			break;
+		case 'I':
+			opts->interval = strtod ( optarg, NULL );
+			break;
+		case 'p':
+			opts->pace_rate = qusb_parse_size ( optarg );
+			break;
+		case 'P':
+			opts->pace_chunk = qusb_parse_size ( optarg );
+			break;
+		case 'v':
+			opts->verbose = 1;
+			break;
+		case 'h':
+			printhelp();
+			break;
+		case '?':
+		default:
+			eprintf ( "Unrecognised option: %c\n", c );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	return optind;
+}
+
+void printhelp () {
+	printf( "qusb-play: play a file out of QuickUSB HSPIO, without gaps.\n"
+	"\n"
+	"USAGE:	qusb-play [OPTIONS] FILE\n"
+	"\n"
+	"	Reads FILE ahead into a ring buffer, and writes it to /dev/quNhd\n"
+	"	(through libquickusb) with several writes always outstanding.\n"
+	"	Played repeatedly, the end of the file runs straight on to its\n"
+	"	start, with no gap. Stops on SIGINT/SIGTERM, or at the end.\n"
+	"\n"
+	"	Every INTERVAL, prints to stderr: seconds, write MB/s, ring fill\n"
+	"	(%%), plays of the file completed, and underruns (times the board\n"
+	"	was left with nothing to write, because the file could not be\n"
+	"	read fast enough).\n"
+	"\n"
+	"OPTIONS:\n"
+	"	-b, --board=N		Board number (default 0)\n"
+	"	-B, --backend=B		kernel or libusb (default: $QUSB_BACKEND, else kernel)\n"
+	"	-o, --output=FILE	Write FILE (or - for stdout) instead of a board\n"
+	"	-c, --block-size=N	Write size (default 1M; even)\n"
+	"	-r, --ring-size=N	Ring buffer size (default 256M)\n"
+	"	-q, --depth=N		Writes outstanding (default 8)\n"
+	"	-l, --loops=N		Play the file N times; 0 for ever (default 1)\n"
+	"	-I, --interval=S	Statistics interval (default 1)\n"
+	"	-p, --pace=RATE		Have the driver release data at RATE bytes/s\n"
+	"				(kernel backend; default: as fast as possible)\n"
+	"	-P, --pace-chunk=N	Bytes released per tick (default chunk_size;\n"
+	"				a multiple of 512)\n"
+	"	-v, --verbose		Report failure to mlock the ring\n"
+	"	-h, --help		Show this help\n"
+	"\n"
+	"	Sizes take k, M, G suffixes. A file no larger than the ring is\n"
+	"	read once, before playing starts, and played from memory.\n"
+	"\n");
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,449 @@
+/*
+ * qusb-replay - re-drive a recorded QuickUSB transaction trace
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+/*
+ * The trace is the binary stream of struct quickusb_trace_record read
+ * from debugfs quickusb/trace.  The trace holds the transactions of
+ * every board; those of one USB device are replayed through the
+ * ordinary device nodes of one board, so that a production traffic
+ * pattern becomes a reproducible benchmark of the driver and device
+ * (or emulator).  Note that opening the device nodes causes some
+ * traffic of its own (e.g. /dev/quNhd sets FIFOCONFIG).
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "../kernel/quickusb.h"
+#include "../libquickusb/libquickusb.h"
+
+#define eprintf(...) fprintf ( stderr, __VA_ARGS__ )
+
+#define USB_DIR_IN 0x80
+
+enum kind {
+	KIND_SETTING = 0,
+	KIND_COMMAND,
+	KIND_GPPIO_DIR,
+	KIND_GPPIO_DATA,
+	KIND_BULK_IN,
+	KIND_BULK_OUT,
+	KIND_SKIPPED,
+	NUM_KINDS
+};
+
+static const char *kind_names[NUM_KINDS] = {
+	"setting", "command", "gppio-dir", "gppio-data",
+	"bulk-in", "bulk-out", "skipped",
+};
+
+struct stats {
+	unsigned long count;
+	unsigned long errors;
+	unsigned long long bytes;
+	double recorded_us;
+	double replay_us;
+	double min_us;
+	double max_us;
+};
+
+struct options {
+	unsigned int board;
+	int device;		/* USB device number to replay, or -1 */
+	unsigned int loops;
+	int timing;
+	int dry_run;
+	int verbose;
+};
+
+static int fds[16];
+static unsigned char *buffer;
+static size_t buffer_len;
+
+int parseopts ( const int, char **argv, struct options * );
+void printhelp ();
+
+/* Open (once) the named subdevice of the board, e.g. "hd" or "ga" */
+static int subdev_fd ( unsigned int board, unsigned int idx,
+		       const char *subdev ) {
+	char name[32];
+
+	if ( fds[idx] > 0 )
+		return fds[idx];
+	snprintf ( name, sizeof ( name ), "/dev/qu%d%s", board, subdev );
+	fds[idx] = open ( name, O_RDWR );
+	if ( fds[idx] < 0 ) {
+		eprintf ( "Error: Could not open device %s: %s\n", name,
+			  strerror ( errno ) );
+		exit ( EXIT_FAILURE );
+	}
+	return fds[idx];
+}
+
+static int gppio_fd ( unsigned int board, unsigned int port ) {
+	char subdev[3] = { 'g', ( 'a' + ( port % 5 ) ), 0 };
+
+	return subdev_fd ( board, ( port % 5 ), subdev );
+}
+
+static void *get_buffer ( size_t len ) {
+	size_t i;
+
+	if ( len > buffer_len ) {
+		buffer = realloc ( buffer, len );
+		if ( ! buffer ) {
+			eprintf ( "Error: out of memory\n" );
+			exit ( EXIT_FAILURE );
+		}
+		/* Incrementing 16-bit little-endian words for bulk OUT */
+		for ( i = buffer_len ; i < len ; i++ )
+			buffer[i] = ( ( i & 1 ) ? ( i >> 9 ) : ( i >> 1 ) );
+		buffer_len = len;
+	}
+	return buffer;
+}
+
+static enum kind classify ( const struct quickusb_trace_record *rec ) {
+	if ( rec->type == QUICKUSB_TRACE_BULK ) {
+		return ( ( rec->endpoint == QUICKUSB_BULK_IN_EP ) ?
+			 KIND_BULK_IN : KIND_BULK_OUT );
+	}
+	switch ( rec->request ) {
+	case QUICKUSB_BREQUEST_SETTING:
+		return KIND_SETTING;
+	case QUICKUSB_BREQUEST_HSPIO_COMMAND:
+		return KIND_COMMAND;
+	case QUICKUSB_BREQUEST_GPPIO:
+		return ( ( rec->index == QUICKUSB_WINDEX_GPPIO_DIR ) ?
+			 KIND_GPPIO_DIR : KIND_GPPIO_DATA );
+	default:
+		/* The HSPIO length announcement is re-issued by the
+		 * driver for each bulk IN record. */
+		return KIND_SKIPPED;
+	}
+}
+
+/* Replay one record, returning 0 or -errno */
+static int replay ( const struct options *opts,
+		    const struct quickusb_trace_record *rec, enum kind kind ) {
+	int in = ( rec->request_type & USB_DIR_IN );
+	struct quickusb_setting_ioctl_data setting;
+	quickusb_gppio_ioctl_data_t gppio;
+	void *data;
+	ssize_t len;
+	int fd;
+	int rc = 0;
+
+	switch ( kind ) {
+	case KIND_SETTING:
+		fd = subdev_fd ( opts->board, 0, "ga" );
+		setting.address = rec->index;
+		setting.value = ( rec->data[0] | ( rec->data[1] << 8 ) );
+		rc = ioctl ( fd, ( in ? QUICKUSB_IOC_GET_SETTING :
+				   QUICKUSB_IOC_SET_SETTING ), &setting );
+		break;
+	case KIND_GPPIO_DIR:
+		fd = gppio_fd ( opts->board, rec->value );
+		gppio = rec->data[0];
+		rc = ioctl ( fd, ( in ? QUICKUSB_IOC_GPPIO_GET_OUTPUTS :
+				   QUICKUSB_IOC_GPPIO_SET_OUTPUTS ), &gppio );
+		break;
+	case KIND_GPPIO_DATA:
+		fd = gppio_fd ( opts->board, rec->value );
+		data = get_buffer ( rec->length );
+		if ( ! in )
+			memcpy ( data, rec->data, ( ( rec->length < 8 ) ?
+						    rec->length : 8 ) );
+		len = ( in ? read ( fd, data, rec->length ) :
+			write ( fd, data, rec->length ) );
+		rc = ( ( len < 0 ) ? -1 : 0 );
+		break;
+	case KIND_COMMAND:
+		fd = subdev_fd ( opts->board, 5, "hc" );
+		data = get_buffer ( rec->length );
+		if ( ! in )
+			memcpy ( data, rec->data, ( ( rec->length < 8 ) ?
+						    rec->length : 8 ) );
+		len = ( in ? pread ( fd, data, rec->length, rec->index ) :
+			pwrite ( fd, data, rec->length, rec->index ) );
+		rc = ( ( len < 0 ) ? -1 : 0 );
+		break;
+	case KIND_BULK_IN:
+		fd = subdev_fd ( opts->board, 6, "hd" );
+		len = read ( fd, get_buffer ( rec->length ), rec->length );
+		rc = ( ( len < 0 ) ? -1 : 0 );
+		break;
+	case KIND_BULK_OUT:
+		fd = subdev_fd ( opts->board, 6, "hd" );
+		len = write ( fd, get_buffer ( rec->length ), rec->length );
+		rc = ( ( len < 0 ) ? -1 : 0 );
+		break;
+	default:
+		break;
+	}
+
+	return ( ( rc < 0 ) ? -errno : 0 );
+}
+
+static void print_record ( const struct quickusb_trace_record *rec,
+			   enum kind kind ) {
+	printf ( "%llu.%09llu dev %u %-10s req 0x%02x/0x%02x val 0x%04x "
+		 "idx 0x%04x ep 0x%02x len %u status %d %uus\n",
+		 ( unsigned long long ) ( rec->timestamp_ns / 1000000000 ),
+		 ( unsigned long long ) ( rec->timestamp_ns % 1000000000 ),
+		 rec->device, kind_names[kind], rec->request_type,
+		 rec->request, rec->value, rec->index, rec->endpoint,
+		 rec->length, rec->status, rec->duration_us );
+}
+
+int main ( int argc, char* argv[] ) {
+	struct options opts;
+	struct stats stats[NUM_KINDS];
+	struct quickusb_trace_record *recs = NULL;
+	size_t nrecs = 0;
+	size_t others = 0;
+	size_t alloc = 0;
+	struct timespec due;
+	double start_us, t0, elapsed;
+	uint64_t base_ns;
+	unsigned int loop;
+	enum kind kind;
+	FILE *trace;
+	size_t i;
+	int last_index;
+	int rc;
+
+	memset ( &opts, 0, sizeof ( opts ) );
+	memset ( stats, 0, sizeof ( stats ) );
+	opts.loops = 1;
+	opts.device = -1;
+
+	last_index = parseopts ( argc, argv, &opts );
+	if ( last_index != ( argc - 1 ) ) {
+		eprintf ( "No trace file specified!\n" );
+		exit ( EXIT_FAILURE );
+	}
+	if ( strcmp ( argv[last_index], "-" ) == 0 ) {
+		trace = stdin;
+	} else if ( ! ( trace = fopen ( argv[last_index], "r" ) ) ) {
+		eprintf ( "Error: Could not open trace %s: %s\n",
+			  argv[last_index], strerror ( errno ) );
+		exit ( EXIT_FAILURE );
+	}
+
+	/* Load the whole trace, so that file I/O doesn't perturb timing */
+	while ( 1 ) {
+		if ( nrecs == alloc ) {
+			alloc = ( alloc ? ( alloc * 2 ) : 1024 );
+			recs = realloc ( recs, ( alloc * sizeof ( recs[0] ) ) );
+			if ( ! recs ) {
+				eprintf ( "Error: out of memory\n" );
+				exit ( EXIT_FAILURE );
+			}
+		}
+		if ( fread ( &recs[nrecs], sizeof ( recs[0] ), 1, trace ) != 1 )
+			break;
+		/* Replay a single device: by default, the first one seen */
+		if ( ( opts.device < 0 ) && ! opts.dry_run )
+			opts.device = recs[nrecs].device;
+		if ( ( opts.device >= 0 ) &&
+		     ( recs[nrecs].device != opts.device ) ) {
+			others++;
+			continue;
+		}
+		nrecs++;
+	}
+	if ( trace != stdin )
+		fclose ( trace );
+	if ( others ) {
+		eprintf ( "Ignoring %zd records of USB devices other than %d\n",
+			  others, opts.device );
+	}
+	if ( ! nrecs ) {
+		eprintf ( "Trace is empty\n" );
+		exit ( EXIT_FAILURE );
+	}
+
+	if ( opts.dry_run ) {
+		for ( i = 0 ; i < nrecs ; i++ )
+			print_record ( &recs[i], classify ( &recs[i] ) );
+		return 0;
+	}
+
+	for ( i = 0 ; i < NUM_KINDS ; i++ )
+		stats[i].min_us = 1e99;
+
+	base_ns = recs[0].timestamp_ns;
+	start_us = qusb_now_us();
+	for ( loop = 0 ; loop < opts.loops ; loop++ ) {
+		for ( i = 0 ; i < nrecs ; i++ ) {
+			kind = classify ( &recs[i] );
+
+			if ( opts.timing ) {
+				/* Keep the recorded spacing within a loop */
+				elapsed = ( ( recs[i].timestamp_ns - base_ns )
+					    / 1e3 );
+				t0 = ( start_us + elapsed );
+				due.tv_sec = ( t0 / 1e6 );
+				due.tv_nsec = ( ( t0 - ( due.tv_sec * 1e6 ) )
+						* 1e3 );
+				clock_nanosleep ( CLOCK_MONOTONIC,
+						  TIMER_ABSTIME, &due, NULL );
+			}
+
+			t0 = qusb_now_us();
+			rc = replay ( &opts, &recs[i], kind );
+			elapsed = ( qusb_now_us() - t0 );
+
+			stats[kind].count++;
+			stats[kind].bytes += recs[i].length;
+			stats[kind].recorded_us += recs[i].duration_us;
+			stats[kind].replay_us += elapsed;
+			if ( elapsed < stats[kind].min_us )
+				stats[kind].min_us = elapsed;
+			if ( elapsed > stats[kind].max_us )
+				stats[kind].max_us = elapsed;
+			if ( rc != 0 ) {
+				stats[kind].errors++;
+				if ( opts.verbose )
+					eprintf ( "Record %zd: %s\n", i,
+						  strerror ( -rc ) );
+			}
+			if ( opts.verbose > 1 ) {
+				print_record ( &recs[i], kind );
+				printf ( "  replayed in %.0fus\n", elapsed );
+			}
+		}
+		if ( opts.timing )
+			start_us = qusb_now_us();
+	}
+
+	/* One line per transaction kind, for easy comparison of runs */
+	printf ( "# kind count errors bytes recorded_us replay_us "
+		 "min_us mean_us max_us replay_MB/s\n" );
+	for ( i = 0 ; i < NUM_KINDS ; i++ ) {
+		if ( ! stats[i].count )
+			continue;
+		printf ( "%s %lu %lu %llu %.0f %.0f %.1f %.1f %.1f %.3f\n",
+			 kind_names[i], stats[i].count, stats[i].errors,
+			 stats[i].bytes, stats[i].recorded_us,
+			 stats[i].replay_us, stats[i].min_us,
+			 ( stats[i].replay_us / stats[i].count ),
+			 stats[i].max_us,
+			 ( stats[i].replay_us ?
+			   ( stats[i].bytes / stats[i].replay_us ) : 0 ) );
+	}
+
+	for ( i = 0 ; i < ( sizeof ( fds ) / sizeof ( fds[0] ) ) ; i++ ) {
+		if ( fds[i] > 0 )
+			close ( fds[i] );
+	}
+	free ( recs );
+	free ( buffer );
+	return 0;
+}
+
+/*
+ * Parse command-line options and return index of last element in
+ * argument list that is not an option
+ */
+int parseopts ( const int argc, char **argv, struct options *opts ) {
+	int c;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "board", required_argument, NULL, 'b' },
+			{ "device", required_argument, NULL, 'd' },
+			{ "loops", required_argument, NULL, 'l' },
+			{ "timing", 0, NULL, 't' },
+			{ "dry-run", 0, NULL, 'n' },
+			{ "verbose", 0, NULL, 'v' },
+			{ "help", 0, NULL, 'h' },
+			{ 0, 0, 0, 0 }
+		};
+
+		if ( ( c = getopt_long ( argc, argv, "b:d:l:tnvh", long_options, &option_index ) ) == -1 ) {
+			break;
+		}
+
+		switch ( c ) {
+		case 'b':
+			opts->board = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'd':
+			opts->device = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'l':
+			opts->loops = strtoul ( optarg, NULL, 0 );
+			break;
+		case 't':
+			opts->timing = 1;
+			break;
+		case 'n':
+			opts->dry_run = 1;
+			break;
+		case 'v':
+			opts->verbose++;
+			break;
+		case 'h':
+			printhelp();
+			break;
+		case '?':
+		default:
+			eprintf ( "Unrecognised option: %c\n", c );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	return optind;
+}
+
+void printhelp () {
+	printf( "qusb-replay: re-drive a recorded QuickUSB transaction trace.\n"
+	"\n"
+	"USAGE:	qusb-replay [OPTIONS] TRACEFILE\n"
+	"\n"
+	"OPTIONS:\n"
+	"	-b, --board=N		Replay against /dev/quN* (default 0)\n"
+	"	-d, --device=N		Replay the records of USB device number N\n"
+	"				(default: the first record's; with -n, all)\n"
+	"	-l, --loops=N		Replay the trace N times\n"
+	"	-t, --timing		Keep the recorded spacing between transactions\n"
+	"				(default: as fast as possible)\n"
+	"	-n, --dry-run		Just decode and print the trace\n"
+	"	-v, --verbose		Report failed transactions (twice: all)\n"
+	"	-h, --help		Show this help\n"
+	"\n"
+	"RECORDING:\n"
+	"	Load quickusb with trace_size=N (records, default 4096), then:\n"
+	"	   cat /sys/kernel/debug/quickusb/trace > TRACEFILE\n"
+	"	which ends when the ring has been drained. To keep recording\n"
+	"	until interrupted, read /sys/kernel/debug/quickusb/trace_pipe\n"
+	"	instead. /sys/kernel/debug/quickusb/trace_lost counts records\n"
+	"	overwritten before they were read. Use '-' to read the trace\n"
+	"	from stdin. The dev column of -n is the USB device number (as\n"
+	"	in lsusb) for -d.\n"
+	"\n"
+	"OUTPUT:\n"
+	"	One line per kind of transaction: count, errors, bytes, the total\n"
+	"	recorded and replayed durations, replayed latency min/mean/max\n"
+	"	(microseconds) and throughput (MB/s).\n"
+	"\n");
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,1013 @@
+/*
+ * qusb-stripe - capture several QuickUSB boards, striped across disks
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+/*
+ * With many boards on one host, no one disk can take all their data;
+ * qusb-stripe spreads it over several.  As in qusb-capture, a reader
+ * thread per board does nothing but read() the board's HSPIO data into
+ * that board's ring of blocks, each headed by a struct qusb_file_block
+ * (libquickusb's struct qusb_ring; a file given with -i is read without
+ * dropping anything, waiting for the ring to have room).
+ * Each target (a stripe file, on its own disk) has a writer thread with
+ * its own io_uring, writing the blocks it is given with O_DIRECT, one
+ * after another, several at a time.
+ *
+ * The main thread places the blocks: taking the boards in turn, it
+ * gives each block read to the target that should finish it soonest,
+ * counting the target's writes in flight at the moving average of its
+ * recent write times.  So a fast NVMe disk takes more of the blocks
+ * than a slow one, and a disk that stalls is given nothing more until
+ * it recovers; no target ever has more than DEPTH writes in flight.
+ * Blocks are released to each reader in order, as in qusb-capture.
+ *
+ * As each write completes, the writer appends an entry to the manifest
+ * (see libquickusb.h): the board, block number and stream offset, and
+ * where the block is.  qusb_stripe_open() puts each board's blocks back
+ * in order from it, and qusb-file -m reads them.
+ *
+ * Each ring is lock-free: the reader alone advances its head, and the
+ * main thread its tail.  Each target's queue is the same: the main
+ * thread alone advances the count of blocks placed, and the writer the
+ * count of those written.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../libquickusb/libquickusb.h"
+
+#define eprintf(...) fprintf ( stderr, __VA_ARGS__ )
+
+/* O_DIRECT alignment of buffers, offsets and lengths */
+#define STRIPE_ALIGN		4096
+
+struct options {
+	unsigned int boards[QUSB_STRIPE_MAX_BOARDS];
+	unsigned int nboards;
+	enum qusb_backend_type backend;
+	/* Files to read instead of boards */
+	const char *inputs[QUSB_STRIPE_MAX_BOARDS];
+	unsigned int ninputs;
+	const char *manifest;
+	const char *targets[QUSB_STRIPE_MAX_TARGETS];
+	unsigned int ntargets;
+	size_t block_size;
+	size_t ring_size;		/* Per board */
+	unsigned int depth;		/* Writes in flight, per target */
+	unsigned long long limit_bytes;	/* Per board */
+	unsigned int limit_secs;
+	double interval;		/* Statistics */
+	int buffered;			/* No O_DIRECT */
+	int verbose;
+};
+
+struct board {
+	struct stripe *stripe;
+	unsigned int index;		/* In the manifest */
+	unsigned int number;
+	/* Ring, and its reader (the board, or input) */
+	struct qusb_ring ring;
+	pthread_t thread;
+	unsigned long long next;	/* Blocks placed (main) */
+	unsigned char *done;		/* Per block: written */
+};
+
+/* A block given to a target */
+struct placement {
+	struct board *board;
+	unsigned long long block;
+};
+
+/* A write in flight */
+struct write {
+	struct board *board;		/* NULL if the slot is free */
+	unsigned long long block;
+	unsigned long long position;
+	double submitted;		/* us */
+};
+
+struct target {
+	struct stripe *stripe;
+	unsigned int index;
+	const char *path;
+	int fd;
+	int fd_direct;
+	pthread_t thread;
+	struct qusb_writer *uring;	/* Or NULL: write synchronously */
+	/* Queue, of depth entries */
+	struct placement *queue;
+	unsigned long long placed;	/* Blocks given (main) */
+	unsigned long long completed;	/* Blocks written (writer) */
+	struct write *writes;		/* Per slot */
+	unsigned long long file_offset;
+	/* Writer */
+	int writer_done;
+	int writer_error;
+	unsigned int latency;		/* Moving average of writes, us */
+	unsigned int latency_max;	/* Slowest write this interval, us */
+	unsigned long long bytes_written;
+};
+
+struct stripe {
+	struct options *opts;
+	unsigned int nblocks;		/* Per ring */
+	struct board boards[QUSB_STRIPE_MAX_BOARDS];
+	struct target targets[QUSB_STRIPE_MAX_TARGETS];
+	unsigned int rr;		/* Board to place from first */
+	int placing_done;		/* Every block read has been placed */
+	/* Manifest */
+	struct qusb_stripe_manifest *manifest;
+	FILE *manifest_file;
+	pthread_mutex_t manifest_lock;
+	int manifest_error;
+	struct qusb_file_header *header;	/* Aligned, for stripe files */
+};
+
+static volatile sig_atomic_t stop;
+
+int parseopts ( const int, char **argv, struct options * );
+void printhelp ();
+
+/* "0,1,4-7": returns the count, or -1 if invalid or too many */
+static int parseboards ( const char *arg, unsigned int *boards,
+			 unsigned int max ) {
+	unsigned long first;
+	unsigned long last;
+	unsigned int count = 0;
+	char *end;
+
+	while ( *arg ) {
+		first = last = strtoul ( arg, &end, 0 );
+		if ( end == arg )
+			return -1;
+		if ( *end == '-' ) {
+			arg = ( end + 1 );
+			last = strtoul ( arg, &end, 0 );
+			if ( ( end == arg ) || ( last < first ) )
+				return -1;
+		}
+		for ( ; first <= last ; first++ ) {
+			if ( count == max )
+				return -1;
+			boards[count++] = first;
+		}
+		if ( *end == ',' )
+			end++;
+		else if ( *end )
+			return -1;
+		arg = end;
+	}
+	return count;
+}
+
+/****************************************************************************
+ *
+ * Readers
+ *
+ */
+
+static unsigned char * board_block ( struct board *board,
+				     unsigned long long block ) {
+	return qusb_ring_block ( &board->ring, block );
+}
+
+/****************************************************************************
+ *
+ * Writers
+ *
+ */
+
+static int target_open ( struct target *target ) {
+	struct stripe *stripe = target->stripe;
+	struct qusb_stripe_manifest *manifest = stripe->manifest;
+	int flags = ( O_WRONLY | O_CREAT | O_TRUNC );
+	char path[PATH_MAX];
+
+	target->fd_direct = ! stripe->opts->buffered;
+	target->fd = open ( target->path,
+			    ( flags | ( target->fd_direct ? O_DIRECT : 0 ) ),
+			    0644 );
+	if ( ( target->fd < 0 ) && ( errno == EINVAL ) && target->fd_direct ) {
+		/* e.g. tmpfs */
+		eprintf ( "Warning: %s does not support O_DIRECT\n",
+			  target->path );
+		target->fd_direct = 0;
+		target->fd = open ( target->path, flags, 0644 );
+	}
+	if ( target->fd < 0 ) {
+		eprintf ( "Error: Could not open %s: %s\n", target->path,
+			  strerror ( errno ) );
+		return -errno;
+	}
+
+	/* The manifest names it absolutely, to be found from anywhere */
+	if ( ! realpath ( target->path, path ) )
+		return -errno;
+	if ( strlen ( path ) >= QUSB_STRIPE_PATH_MAX ) {
+		eprintf ( "Error: %s: name too long\n", path );
+		return -ENAMETOOLONG;
+	}
+	strcpy ( manifest->target[target->index], path );
+
+	stripe->header->board = target->index;
+	if ( pwrite ( target->fd, stripe->header, QUSB_FILE_HEADER_SIZE,
+		      0 ) != QUSB_FILE_HEADER_SIZE )
+		return ( ( errno > 0 ) ? -errno : -ENOSPC );
+	target->file_offset = QUSB_FILE_HEADER_SIZE;
+	return 0;
+}
+
+/* A write has completed: record where the block went, and free it */
+static int write_done ( struct target *target, struct write *write ) {
+	struct stripe *stripe = target->stripe;
+	struct board *board = write->board;
+	const struct qusb_file_block *block =
+		( const void * ) board_block ( board, write->block );
+	struct qusb_stripe_entry entry;
+	unsigned int latency = ( qusb_now_us() - write->submitted );
+	int rc = 0;
+
+	memset ( &entry, 0, sizeof ( entry ) );
+	entry.board = board->index;
+	entry.target = target->index;
+	entry.sequence = block->sequence;
+	entry.offset = block->offset;
+	entry.timestamp_ns = block->timestamp_ns;
+	entry.position = write->position;
+	pthread_mutex_lock ( &stripe->manifest_lock );
+	if ( fwrite ( &entry, sizeof ( entry ), 1,
+		      stripe->manifest_file ) != 1 )
+		rc = -EIO;
+	pthread_mutex_unlock ( &stripe->manifest_lock );
+
+	/* Weighted to the last eight or so writes */
+	__atomic_store_n ( &target->latency,
+			   ( target->latency ?
+			     ( ( ( target->latency * 7 ) + latency ) / 8 ) :
+			     latency ), __ATOMIC_RELAXED );
+	if ( latency > target->latency_max )
+		__atomic_store_n ( &target->latency_max, latency,
+				   __ATOMIC_RELAXED );
+	__atomic_add_fetch ( &target->bytes_written, block->length,
+			     __ATOMIC_RELAXED );
+
+	/* The block may be reused as soon as this is seen */
+	__atomic_store_n ( &board->done[write->block % stripe->nblocks], 1,
+			   __ATOMIC_RELEASE );
+	write->board = NULL;
+	__atomic_add_fetch ( &target->completed, 1, __ATOMIC_RELEASE );
+	return rc;
+}
+
+static void * writer ( void *arg ) {
+	struct target *target = arg;
+	struct stripe *stripe = target->stripe;
+	struct options *opts = stripe->opts;
+	unsigned long long taken = 0;	/* Blocks taken from the queue */
+	unsigned long long placed;
+	struct placement *placement;
+	struct write *write;
+	struct qusb_write_done done;
+	unsigned int inflight = 0;
+	unsigned int queued;
+	unsigned int slot;
+	ssize_t res;
+	int rc;
+
+	while ( 1 ) {
+		placed = __atomic_load_n ( &target->placed, __ATOMIC_ACQUIRE );
+
+		/* Queue writes of the blocks placed here, end to end */
+		for ( queued = 0 ; taken < placed ; taken++ ) {
+			placement = &target->queue[taken % opts->depth];
+			for ( slot = 0 ; target->writes[slot].board ; slot++ )
+				;
+			write = &target->writes[slot];
+			write->board = placement->board;
+			write->block = placement->block;
+			write->position = target->file_offset;
+			write->submitted = qusb_now_us();
+			target->file_offset += opts->block_size;
+			if ( target->uring ) {
+				if ( ( rc = qusb_writer_write ( target->uring,
+						target->fd,
+						board_block ( write->board,
+							      write->block ),
+						opts->block_size,
+						write->position, slot ) ) != 0 )
+					goto err;
+				queued++;
+				inflight++;
+			} else {
+				res = pwrite ( target->fd,
+					       board_block ( write->board,
+							     write->block ),
+					       opts->block_size, write->position );
+				if ( res != ( ssize_t ) opts->block_size ) {
+					rc = ( ( res < 0 ) ? -errno : -ENOSPC );
+					goto err;
+				}
+				if ( ( rc = write_done ( target, write ) ) != 0 )
+					goto err;
+			}
+		}
+
+		/* Submit, and wait briefly for a completion if there is
+		 * nothing else to do */
+		if ( target->uring && ( queued || inflight ) ) {
+			if ( ( rc = qusb_writer_submit ( target->uring,
+							 ( queued ? 0 : 1 ) ) )
+			     != 0 )
+				goto err;
+			while ( qusb_writer_reap ( target->uring, &done ) ) {
+				if ( done.res < 0 ) {
+					rc = done.res;
+					goto err;
+				}
+				if ( done.res != ( int ) opts->block_size ) {
+					rc = -ENOSPC;
+					goto err;
+				}
+				if ( ( rc = write_done ( target,
+							 &target->writes[done.user_data] ) ) != 0 )
+					goto err;
+				inflight--;
+			}
+		}
+
+		if ( ! inflight && ( taken == placed ) ) {
+			if ( __atomic_load_n ( &stripe->placing_done,
+					       __ATOMIC_ACQUIRE ) &&
+			     ( taken == __atomic_load_n ( &target->placed,
+							  __ATOMIC_ACQUIRE ) ) )
+				break;
+			/* Idle: wait to be given blocks */
+			usleep ( 500 );
+		}
+	}
+
+	if ( fsync ( target->fd ) < 0 ) {
+		rc = -errno;
+		goto err;
+	}
+	__atomic_store_n ( &target->writer_done, 1, __ATOMIC_RELEASE );
+	return NULL;
+
+ err:
+	target->writer_error = rc;
+	/* Stop reading too: the blocks given here will never be written */
+	stop = 1;
+	__atomic_store_n ( &target->writer_done, 1, __ATOMIC_RELEASE );
+	return NULL;
+}
+
+/****************************************************************************
+ *
+ * Placement
+ *
+ */
+
+/*
+ * The target to give the next block to: of those with room in their
+ * queue, the one that should finish it soonest, i.e. with the fewest
+ * writes ahead of it at its recent write time.  Until a target has
+ * completed a write its time is unknown, and counts as the fastest.
+ */
+static struct target * place_target ( struct stripe *stripe ) {
+	struct options *opts = stripe->opts;
+	struct target *target;
+	struct target *best = NULL;
+	unsigned long long outstanding;
+	double cost;
+	double best_cost = 0;
+	unsigned int latency;
+	unsigned int i;
+
+	for ( i = 0 ; i < opts->ntargets ; i++ ) {
+		target = &stripe->targets[i];
+		if ( __atomic_load_n ( &target->writer_done, __ATOMIC_ACQUIRE ) )
+			continue;
+		outstanding = ( target->placed -
+				__atomic_load_n ( &target->completed,
+						  __ATOMIC_ACQUIRE ) );
+		if ( outstanding >= opts->depth )
+			continue;
+		latency = __atomic_load_n ( &target->latency, __ATOMIC_RELAXED );
+		cost = ( ( outstanding + 1 ) * ( latency ? latency : 1 ) );
+		if ( ( ! best ) || ( cost < best_cost ) ) {
+			best = target;
+			best_cost = cost;
+		}
+	}
+	return best;
+}
+
+/* Place the blocks read, a board at a time in turn; returns the number
+ * placed */
+static unsigned int place ( struct stripe *stripe ) {
+	struct options *opts = stripe->opts;
+	struct board *board;
+	struct target *target;
+	unsigned int placed = 0;
+	unsigned int progress;
+	unsigned int i;
+
+	do {
+		progress = 0;
+		for ( i = 0 ; i < opts->nboards ; i++ ) {
+			board = &stripe->boards[( stripe->rr + i ) %
+						opts->nboards];
+			if ( board->next ==
+			     __atomic_load_n ( &board->ring.head,
+					       __ATOMIC_ACQUIRE ) )
+				continue;
+			if ( ! ( target = place_target ( stripe ) ) )
+				return placed;
+			target->queue[target->placed % opts->depth].board = board;
+			target->queue[target->placed % opts->depth].block =
+				board->next++;
+			__atomic_store_n ( &target->placed, ( target->placed + 1 ),
+					   __ATOMIC_RELEASE );
+			progress++;
+		}
+		stripe->rr++;
+		placed += progress;
+	} while ( progress );
+	return placed;
+}
+
+/* Release written blocks to each reader, in order */
+static void release ( struct stripe *stripe ) {
+	struct board *board;
+	unsigned long long tail;
+	unsigned int i;
+
+	for ( i = 0 ; i < stripe->opts->nboards ; i++ ) {
+		board = &stripe->boards[i];
+		tail = board->ring.tail;
+		while ( ( tail < board->next ) &&
+			__atomic_load_n ( &board->done[tail % stripe->nblocks],
+					  __ATOMIC_ACQUIRE ) ) {
+			board->done[tail % stripe->nblocks] = 0;
+			tail++;
+		}
+		qusb_ring_release ( &board->ring, tail );
+	}
+}
+
+/* Every block read has been placed, and no more will be read */
+static int placed_all ( struct stripe *stripe ) {
+	struct board *board;
+	unsigned int i;
+
+	for ( i = 0 ; i < stripe->opts->nboards ; i++ ) {
+		board = &stripe->boards[i];
+		if ( ! __atomic_load_n ( &board->ring.done, __ATOMIC_ACQUIRE ) ||
+		     ( board->next != __atomic_load_n ( &board->ring.head,
+							__ATOMIC_ACQUIRE ) ) )
+			return 0;
+	}
+	return 1;
+}
+
+/****************************************************************************
+ *
+ * Main
+ *
+ */
+
+static void handle_signal ( int sig ) {
+	stop = 1;
+}
+
+/* Interrupts the readers' read() (no SA_RESTART) */
+static void handle_wakeup ( int sig ) {
+}
+
+static void report ( struct stripe *stripe, double start, int final ) {
+	static unsigned long long last_read;
+	static unsigned long long last_written;
+	static unsigned long long last_target[QUSB_STRIPE_MAX_TARGETS];
+	static double last;
+	struct options *opts = stripe->opts;
+	struct target *target;
+	struct board *board;
+	unsigned long long bytes_read = 0;
+	unsigned long long bytes_written = 0;
+	unsigned long long dropped = 0;
+	unsigned long long written;
+	unsigned int fill_max = 0;
+	unsigned int fill;
+	double t = qusb_now_us();
+	double dt;
+	unsigned int i;
+
+	if ( ! last )
+		last = start;
+	dt = ( ( final ? ( t - start ) : ( t - last ) ) / 1e6 );
+	if ( dt <= 0 )
+		dt = 1e-6;
+	for ( i = 0 ; i < opts->nboards ; i++ ) {
+		board = &stripe->boards[i];
+		bytes_read += __atomic_load_n ( &board->ring.bytes_read,
+						__ATOMIC_RELAXED );
+		dropped += __atomic_load_n ( &board->ring.bytes_dropped,
+					     __ATOMIC_RELAXED );
+		fill = __atomic_load_n ( &board->ring.fill_max,
+					 __ATOMIC_RELAXED );
+		if ( fill > fill_max )
+			fill_max = fill;
+	}
+	for ( i = 0 ; i < opts->ntargets ; i++ ) {
+		bytes_written += __atomic_load_n ( &stripe->targets[i].bytes_written,
+						   __ATOMIC_RELAXED );
+	}
+
+	eprintf ( "%s%.1f %.3f %.3f %.1f %llu", ( final ? "# total " : "" ),
+		  ( ( t - start ) / 1e6 ),
+		  ( ( final ? bytes_read : ( bytes_read - last_read ) ) /
+		    dt / 1e6 ),
+		  ( ( final ? bytes_written :
+		      ( bytes_written - last_written ) ) /
+		    dt / 1e6 ),
+		  ( ( fill_max * 100.0 ) / stripe->nblocks ), dropped );
+	for ( i = 0 ; i < opts->ntargets ; i++ ) {
+		target = &stripe->targets[i];
+		written = __atomic_load_n ( &target->bytes_written,
+					    __ATOMIC_RELAXED );
+		eprintf ( " %.3f %.1f", ( ( final ? written :
+					    ( written - last_target[i] ) ) /
+					  dt / 1e6 ),
+			  ( __atomic_exchange_n ( &target->latency_max, 0,
+						  __ATOMIC_RELAXED ) / 1e3 ) );
+		last_target[i] = written;
+	}
+	eprintf ( "\n" );
+
+	last_read = bytes_read;
+	last_written = bytes_written;
+	last = t;
+}
+
+/* Entries for the blocks written so far, to disk */
+static int manifest_flush ( struct stripe *stripe ) {
+	int rc = 0;
+
+	pthread_mutex_lock ( &stripe->manifest_lock );
+	if ( fflush ( stripe->manifest_file ) != 0 )
+		rc = -errno;
+	pthread_mutex_unlock ( &stripe->manifest_lock );
+	return rc;
+}
+
+static int board_open ( struct stripe *stripe, struct board *board ) {
+	struct options *opts = stripe->opts;
+	struct qusb_file_header *header = &stripe->manifest->board[board->index];
+	const char *input;
+	int rc;
+
+	board->stripe = stripe;
+	board->ring.nblocks = stripe->nblocks;
+	board->ring.block_size = opts->block_size;
+	board->ring.header_size = QUSB_FILE_BLOCK_HEADER_SIZE;
+	board->ring.board = board->number;
+	/* Whole blocks are written */
+	board->ring.pad = 1;
+	board->ring.limit_bytes = opts->limit_bytes;
+	if ( ( posix_memalign ( ( void ** ) &board->ring.blocks, STRIPE_ALIGN,
+				( ( size_t ) stripe->nblocks *
+				  opts->block_size ) ) != 0 ) ||
+	     ( posix_memalign ( ( void ** ) &board->ring.scratch, STRIPE_ALIGN,
+				opts->block_size ) != 0 ) ||
+	     ! ( board->done = calloc ( stripe->nblocks,
+					sizeof ( board->done[0] ) ) ) )
+		return -ENOMEM;
+	/* Fault the ring in now, and keep it resident if allowed */
+	memset ( board->ring.blocks, 0, ( ( size_t ) stripe->nblocks *
+					  opts->block_size ) );
+	if ( ( mlock ( board->ring.blocks, ( ( size_t ) stripe->nblocks *
+					     opts->block_size ) ) < 0 ) &&
+	     opts->verbose )
+		eprintf ( "Warning: could not lock the ring in memory: %s\n",
+			  strerror ( errno ) );
+
+	if ( opts->ninputs ) {
+		input = opts->inputs[board->index];
+		board->ring.input_fd = ( strcmp ( input, "-" ) ?
+					 open ( input, O_RDONLY ) : 0 );
+		if ( board->ring.input_fd < 0 ) {
+			rc = -errno;
+			eprintf ( "Error: Could not open %s: %s\n", input,
+				  strerror ( errno ) );
+			return rc;
+		}
+	} else if ( ( rc = qusb_open_backend ( opts->backend, board->number,
+					       &board->ring.dev ) ) != 0 ) {
+		eprintf ( "Error: Could not open board %u: %s\n",
+			  board->number, strerror ( -rc ) );
+		return rc;
+	}
+
+	/* The board's settings, as the capture starts */
+	qusb_file_header_init ( board->ring.dev, header, opts->block_size );
+	header->board = board->number;
+	header->start_ns = stripe->manifest->start_ns;
+	return 0;
+}
+
+int main ( int argc, char* argv[] ) {
+	static struct stripe stripe;
+	struct qusb_stripe_manifest *manifest;
+	struct options opts;
+	struct sigaction sa;
+	struct target *target;
+	struct board *board;
+	double start;
+	double next_report;
+	unsigned int placed;
+	unsigned int i;
+	int rc;
+
+	memset ( &opts, 0, sizeof ( opts ) );
+	opts.nboards = 1;
+	opts.block_size = ( 1024 * 1024 );
+	opts.ring_size = ( 256 * 1024 * 1024 );
+	opts.depth = 4;
+	opts.interval = 1.0;
+
+	memset ( &sa, 0, sizeof ( sa ) );
+	sa.sa_handler = handle_signal;
+	sigaction ( SIGINT, &sa, NULL );
+	sigaction ( SIGTERM, &sa, NULL );
+	sa.sa_handler = handle_wakeup;
+	sigaction ( SIGUSR1, &sa, NULL );
+
+	i = parseopts ( argc, argv, &opts );
+	if ( ( argc - i ) < 2 ) {
+		eprintf ( "Error: no manifest and targets given (see -h)\n" );
+		exit ( EXIT_FAILURE );
+	}
+	opts.manifest = argv[i++];
+	for ( ; i < ( unsigned int ) argc ; i++ ) {
+		if ( opts.ntargets == QUSB_STRIPE_MAX_TARGETS ) {
+			eprintf ( "Error: at most %d targets\n",
+				  QUSB_STRIPE_MAX_TARGETS );
+			exit ( EXIT_FAILURE );
+		}
+		opts.targets[opts.ntargets++] = argv[i];
+	}
+	if ( opts.ninputs )
+		opts.nboards = opts.ninputs;
+	if ( ( opts.block_size < STRIPE_ALIGN ) ||
+	     ( opts.block_size % STRIPE_ALIGN ) ||
+	     ( opts.ring_size < ( 2 * opts.block_size ) ) ||
+	     ( opts.depth < 1 ) || ( opts.depth > 256 ) ||
+	     ( opts.interval <= 0 ) ) {
+		eprintf ( "Invalid options (see -h)\n" );
+		exit ( EXIT_FAILURE );
+	}
+
+	stripe.opts = &opts;
+	stripe.nblocks = ( opts.ring_size / opts.block_size );
+	pthread_mutex_init ( &stripe.manifest_lock, NULL );
+	if ( ! ( manifest = stripe.manifest = calloc ( 1, sizeof ( *manifest ) ) ) ||
+	     ( posix_memalign ( ( void ** ) &stripe.header, STRIPE_ALIGN,
+				QUSB_FILE_HEADER_SIZE ) != 0 ) ) {
+		eprintf ( "Error: out of memory\n" );
+		exit ( EXIT_FAILURE );
+	}
+	manifest->magic = QUSB_STRIPE_MAGIC;
+	manifest->version = QUSB_STRIPE_VERSION;
+	manifest->header_size = sizeof ( *manifest );
+	manifest->block_size = opts.block_size;
+	manifest->boards = opts.nboards;
+	manifest->targets = opts.ntargets;
+
+	/* Each stripe file's header, less its target number */
+	memset ( stripe.header, 0, QUSB_FILE_HEADER_SIZE );
+	qusb_file_header_init ( NULL, stripe.header, opts.block_size );
+	stripe.header->flags |= QUSB_FILE_STRIPED;
+	manifest->start_ns = stripe.header->start_ns;
+
+	for ( i = 0 ; i < opts.nboards ; i++ ) {
+		board = &stripe.boards[i];
+		board->index = i;
+		board->number = ( opts.ninputs ? i : opts.boards[i] );
+		if ( ( rc = board_open ( &stripe, board ) ) != 0 ) {
+			if ( rc == -ENOMEM )
+				eprintf ( "Error: out of memory\n" );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	for ( i = 0 ; i < opts.ntargets ; i++ ) {
+		target = &stripe.targets[i];
+		target->stripe = &stripe;
+		target->index = i;
+		target->path = opts.targets[i];
+		if ( ! ( target->queue = calloc ( opts.depth,
+						  sizeof ( target->queue[0] ) ) ) ||
+		     ! ( target->writes = calloc ( opts.depth,
+						   sizeof ( target->writes[0] ) ) ) ) {
+			eprintf ( "Error: out of memory\n" );
+			exit ( EXIT_FAILURE );
+		}
+		if ( ( rc = target_open ( target ) ) != 0 ) {
+			eprintf ( "Error: Could not write %s: %s\n",
+				  target->path, strerror ( -rc ) );
+			exit ( EXIT_FAILURE );
+		}
+		if ( ( rc = qusb_writer_create ( opts.depth,
+						 &target->uring ) ) != 0 ) {
+			eprintf ( "Warning: io_uring unavailable (%s), writing "
+				  "%s synchronously\n", strerror ( -rc ),
+				  target->path );
+		}
+	}
+
+	if ( ! ( stripe.manifest_file = fopen ( opts.manifest, "w" ) ) ||
+	     ( fwrite ( manifest, sizeof ( *manifest ), 1,
+			stripe.manifest_file ) != 1 ) ||
+	     ( fflush ( stripe.manifest_file ) != 0 ) ) {
+		eprintf ( "Error: Could not write %s: %s\n", opts.manifest,
+			  strerror ( errno ) );
+		exit ( EXIT_FAILURE );
+	}
+
+	start = qusb_now_us();
+	for ( i = 0 ; i < opts.ntargets ; i++ ) {
+		if ( ( rc = pthread_create ( &stripe.targets[i].thread, NULL,
+					     writer, &stripe.targets[i] ) ) != 0 ) {
+			eprintf ( "Error: Could not start threads: %s\n",
+				  strerror ( rc ) );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	for ( i = 0 ; i < opts.nboards ; i++ ) {
+		if ( ( rc = pthread_create ( &stripe.boards[i].thread, NULL,
+					     qusb_ring_reader,
+					     &stripe.boards[i].ring ) ) != 0 ) {
+			eprintf ( "Error: Could not start threads: %s\n",
+				  strerror ( rc ) );
+			exit ( EXIT_FAILURE );
+		}
+	}
+
+	eprintf ( "# seconds read_MBps write_MBps ring_max_pct dropped_bytes, "
+		  "then per target: write_MBps write_max_ms\n" );
+	next_report = ( start + ( opts.interval * 1e6 ) );
+	while ( ! placed_all ( &stripe ) ) {
+		placed = place ( &stripe );
+		release ( &stripe );
+		if ( opts.limit_secs &&
+		     ( ( qusb_now_us() - start ) >= ( opts.limit_secs * 1e6 ) ) )
+			stop = 1;
+		if ( stop ) {
+			for ( i = 0 ; i < opts.nboards ; i++ ) {
+				board = &stripe.boards[i];
+				if ( ! __atomic_load_n ( &board->ring.done,
+							 __ATOMIC_ACQUIRE ) ) {
+					qusb_ring_stop ( &board->ring );
+					pthread_kill ( board->thread, SIGUSR1 );
+				}
+			}
+		}
+		if ( qusb_now_us() >= next_report ) {
+			report ( &stripe, start, 0 );
+			if ( ( rc = manifest_flush ( &stripe ) ) != 0 ) {
+				stripe.manifest_error = rc;
+				stop = 1;
+			}
+			next_report += ( opts.interval * 1e6 );
+		}
+		if ( ! placed ) {
+			/* Idle: wait for the readers, or the writers */
+			usleep ( 200 );
+		}
+		/* A writer gave up: the blocks it held are never released */
+		for ( i = 0 ; i < opts.ntargets ; i++ ) {
+			if ( stripe.targets[i].writer_error )
+				break;
+		}
+		if ( i < opts.ntargets )
+			break;
+	}
+	__atomic_store_n ( &stripe.placing_done, 1, __ATOMIC_RELEASE );
+
+	for ( i = 0 ; i < opts.ntargets ; i++ )
+		pthread_join ( stripe.targets[i].thread, NULL );
+	for ( i = 0 ; i < opts.nboards ; i++ ) {
+		board = &stripe.boards[i];
+		qusb_ring_stop ( &board->ring );
+		while ( ! __atomic_load_n ( &board->ring.done,
+					    __ATOMIC_ACQUIRE ) ) {
+			pthread_kill ( board->thread, SIGUSR1 );
+			usleep ( 10000 );
+		}
+		pthread_join ( board->thread, NULL );
+	}
+	report ( &stripe, start, 1 );
+
+	rc = EXIT_SUCCESS;
+	if ( ( fflush ( stripe.manifest_file ) != 0 ) ||
+	     ( fsync ( fileno ( stripe.manifest_file ) ) < 0 ) ||
+	     ( fclose ( stripe.manifest_file ) != 0 ) ) {
+		stripe.manifest_error = -errno;
+	}
+	if ( stripe.manifest_error ) {
+		eprintf ( "Error: Could not write %s: %s\n", opts.manifest,
+			  strerror ( -stripe.manifest_error ) );
+		rc = EXIT_FAILURE;
+	}
+	for ( i = 0 ; i < opts.nboards ; i++ ) {
+		board = &stripe.boards[i];
+		if ( board->ring.error ) {
+			eprintf ( "Error: board %u: read failed: %s\n",
+				  board->number,
+				  strerror ( -board->ring.error ) );
+			rc = EXIT_FAILURE;
+		}
+		if ( board->ring.bytes_dropped ) {
+			eprintf ( "Warning: board %u: %llu bytes dropped "
+				  "(ring full)\n", board->number,
+				  ( unsigned long long )
+				  board->ring.bytes_dropped );
+		}
+		if ( board->ring.dev )
+			qusb_close ( board->ring.dev );
+	}
+	for ( i = 0 ; i < opts.ntargets ; i++ ) {
+		target = &stripe.targets[i];
+		if ( target->writer_error ) {
+			eprintf ( "Error: %s: write failed: %s\n", target->path,
+				  strerror ( -target->writer_error ) );
+			rc = EXIT_FAILURE;
+		}
+		if ( opts.verbose ) {
+			eprintf ( "# target %s blocks %llu latency_ms %.1f\n",
+				  target->path, target->completed,
+				  ( target->latency / 1e3 ) );
+		}
+		close ( target->fd );
+		qusb_writer_destroy ( target->uring );
+	}
+	return rc;
+}
+
+/*
+ * Parse command-line options and return index of last element in
+ * argument list that is not an option
+ */
+int parseopts ( const int argc, char **argv, struct options *opts ) {
+	int count;
+	int c;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "boards", required_argument, NULL, 'b' },
+			{ "backend", required_argument, NULL, 'B' },
+			{ "input", required_argument, NULL, 'i' },
+			{ "block-size", required_argument, NULL, 'c' },
+			{ "ring-size", required_argument, NULL, 'r' },
+			{ "depth", required_argument, NULL, 'q' },
+			{ "bytes", required_argument, NULL, 'n' },
+			{ "time", required_argument, NULL, 't' },
+			{ "interval", required_argument, NULL, 'I' },
+			{ "buffered", 0, NULL, 'u' },
+			{ "verbose", 0, NULL, 'v' },
+			{ "help", 0, NULL, 'h' },
+			{ 0, 0, 0, 0 }
+		};
+
+		if ( ( c = getopt_long ( argc, argv, "b:B:i:c:r:q:n:t:I:uvh", long_options, &option_index ) ) == -1 ) {
+			break;
+		}
+
+		switch ( c ) {
+		case 'b':
+			if ( ( count = parseboards ( optarg, opts->boards,
+						     QUSB_STRIPE_MAX_BOARDS ) ) < 1 ) {
+				eprintf ( "Invalid boards: %s\n", optarg );
+				exit ( EXIT_FAILURE );
+			}
+			opts->nboards = count;
+			break;
+		case 'B':
+			if ( strcmp ( optarg, "kernel" ) == 0 ) {
+				opts->backend = QUSB_BACKEND_KERNEL;
+			} else if ( strcmp ( optarg, "libusb" ) == 0 ) {
+				opts->backend = QUSB_BACKEND_LIBUSB;
+			} else {
+				eprintf ( "Unknown backend: %s\n", optarg );
+				exit ( EXIT_FAILURE );
+			}
+			break;
+		case 'i':
+			if ( opts->ninputs == QUSB_STRIPE_MAX_BOARDS ) {
+				eprintf ( "Error: at most %d inputs\n",
+					  QUSB_STRIPE_MAX_BOARDS );
+				exit ( EXIT_FAILURE );
+			}
+			opts->inputs[opts->ninputs++] = optarg;
+			break;
+		case 'c':
+			opts->block_size = qusb_parse_size ( optarg );
+			break;
+		case 'r':
+			opts->ring_size = qusb_parse_size ( optarg );
+			break;
+		case 'q':
+			opts->depth = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'n':
+			opts->limit_bytes = qusb_parse_size ( optarg );
+			break;
+		case 't':
+			opts->limit_secs = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'I':
+			opts->interval = strtod ( optarg, NULL );
+			break;
+		case 'u':
+			opts->buffered = 1;
+			break;
+		case 'v':
+			opts->verbose = 1;
+			break;
+		case 'h':
+			printhelp();
+			break;
+		case '?':
+		default:
+			eprintf ( "Unrecognised option: %c\n", c );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	return optind;
+}
+
+void printhelp () {
+	printf( "qusb-stripe: capture several QuickUSB boards, striped across disks.\n"
+	"\n"
+	"USAGE:	qusb-stripe [OPTIONS] MANIFEST TARGET...\n"
+	"\n"
+	"	Reads each board's /dev/quNhd (through libquickusb) into its own\n"
+	"	ring buffer, and writes the blocks to the TARGETs (stripe files,\n"
+	"	each on its own disk) with O_DIRECT, through an io_uring per\n"
+	"	target. Each block goes to the target that should write it\n"
+	"	soonest, by its writes in flight and its recent write times.\n"
+	"	MANIFEST records where each block went; read a board's stream\n"
+	"	back with qusb-file -m BOARD MANIFEST.\n"
+	"	Stops on SIGINT/SIGTERM, or at the given limits.\n"
+	"\n"
+	"	Every INTERVAL, prints to stderr: seconds, read and write MB/s,\n"
+	"	the fullest ring's maximum fill (%%), bytes dropped because a\n"
+	"	ring was full (total), then for each target its write MB/s and\n"
+	"	slowest write in the interval (ms).\n"
+	"\n"
+	"OPTIONS:\n"
+	"	-b, --boards=LIST	Board numbers, e.g. 0-3,6 (default 0)\n"
+	"	-B, --backend=B		kernel or libusb (default: $QUSB_BACKEND, else kernel)\n"
+	"	-i, --input=FILE	Read FILE (or - for stdin) instead of a board;\n"
+	"				repeat for more, numbered 0, 1, ... (waiting\n"
+	"				when a ring is full, not dropping)\n"
+	"	-c, --block-size=N	Read and write size (default 1M; multiple of 4k)\n"
+	"	-r, --ring-size=N	Ring buffer size, per board (default 256M)\n"
+	"	-q, --depth=N		Writes in flight, per target (default 4)\n"
+	"	-n, --bytes=N		Stop after N bytes, per board\n"
+	"	-t, --time=S		Stop after S seconds\n"
+	"	-I, --interval=S	Statistics interval (default 1)\n"
+	"	-u, --buffered		Write through the page cache (no O_DIRECT)\n"
+	"	-v, --verbose		Report each target's share at the end, and\n"
+	"				failure to mlock the rings\n"
+	"	-h, --help		Show this help\n"
+	"\n"
+	"	Sizes take k, M, G suffixes. At most %d boards and %d targets.\n"
+	"\n"
+	"	Each block holds BLOCK-SIZE less 64 bytes of data, with its board,\n"
+	"	stream offset and time; the manifest has an entry for each block\n"
+	"	once it is written, so an interrupted capture can still be read.\n"
+	"\n", QUSB_STRIPE_MAX_BOARDS, QUSB_STRIPE_MAX_TARGETS );
+
+	exit(EXIT_SUCCESS);
+}
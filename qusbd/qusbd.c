@@ -0,0 +1,983 @@
+/*
+ * qusbd - QuickUSB board daemon
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ */
+
+/*
+ * qusbd opens every board once, and keeps it open, so that short-lived
+ * clients neither pay for opening the device nodes (and the FIFOCONFIG
+ * round trips of entering master mode) each time, nor contend for the
+ * HSPIO port.  Clients talk to it over a Unix SOCK_SEQPACKET socket,
+ * through libquickusb (qusbd_connect() etc.); see libquickusb.h for the
+ * protocol.
+ *
+ * The daemon is a single thread, polling the socket, its clients, the
+ * stream rings' eventfds and the libquickusb loop's io_uring.  Batches
+ * of setting and GPPIO operations are gathered from all the clients
+ * that are ready, then run board by board, back to back: a read of a
+ * value that is already known in that round (read or written by an
+ * earlier operation on the board) is answered without a transfer.
+ *
+ * Each stream is a libquickusb stream on the board, and a ring of
+ * blocks in a memfd shared with the client.  IN blocks are copied into
+ * the ring as they complete (or dropped, and counted, if the client
+ * has fallen a whole ring behind: the board is never made to wait);
+ * OUT blocks are copied from the ring into the stream as fast as the
+ * stream has free blocks.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "../libquickusb/libquickusb.h"
+
+#define eprintf(...) fprintf ( stderr, __VA_ARGS__ )
+
+#define QUSBD_MAX_CLIENTS	64
+#define QUSBD_MAX_BLOCK_SIZE	( 64 * 1024 * 1024 )
+#define QUSBD_MAX_RING_BLOCKS	4096
+#define QUSBD_MAX_RING_SIZE	( 1024ULL * 1024 * 1024 )
+#define QUSBD_LOOP_ENTRIES	1024
+#define QUSBD_CACHE_SIZE	64
+
+struct options {
+	const char *socket_path;
+	enum qusb_backend_type backend;
+	unsigned int depth;		/* Stream requests in flight */
+	int verbose;
+};
+
+struct client;
+
+/* A client's stream on a board */
+struct ring {
+	struct client *client;
+	struct board *board;
+	enum qusb_direction direction;
+	struct qusbd_ring *shm;
+	size_t map_size;
+	int wait_fd;			/* Signalled by the client */
+	int notify_fd;			/* Signalled by us */
+	struct qusb_stream *stream;
+};
+
+/* A value known in the current round of batches */
+struct cached {
+	uint16_t type;			/* QUSBD_GET_xxx */
+	uint16_t address;
+	uint16_t value;
+};
+
+struct board {
+	unsigned int number;
+	struct qusb_device *dev;
+	struct ring *rings[2];		/* By direction */
+	struct cached cache[QUSBD_CACHE_SIZE];
+	unsigned int cached;
+};
+
+struct client {
+	int fd;
+	/* Batch received this round, if msg.count or pending */
+	struct qusbd_msg msg;
+	struct qusbd_op ops[QUSBD_MAX_OPS];
+	int pending;
+};
+
+struct daemon {
+	struct options *opts;
+	int listen_fd;
+	struct qusb_loop *loop;
+	struct board boards[QUSB_MAX_BOARDS];
+	struct client *clients[QUSBD_MAX_CLIENTS];
+	/* Statistics */
+	unsigned long long batches;
+	unsigned long long ops;
+	unsigned long long coalesced;	/* Answered without a transfer */
+};
+
+static volatile sig_atomic_t stop;
+
+int parseopts ( const int, char **argv, struct options * );
+void printhelp ();
+
+static void handle_signal ( int sig ) {
+	stop = 1;
+}
+
+static void notify ( int fd ) {
+	uint64_t one = 1;
+
+	if ( write ( fd, &one, sizeof ( one ) ) < 0 ) {
+		/* Already signalled (counter saturated): nothing lost */
+	}
+}
+
+/****************************************************************************
+ *
+ * Boards
+ *
+ */
+
+/* The board, opened if need be */
+static struct board * board_get ( struct daemon *qd, unsigned int number,
+				  int *rc ) {
+	struct board *board;
+
+	if ( number >= QUSB_MAX_BOARDS ) {
+		*rc = -ENODEV;
+		return NULL;
+	}
+	board = &qd->boards[number];
+	if ( ! board->dev ) {
+		if ( ( *rc = qusb_open_backend ( qd->opts->backend, number,
+						 &board->dev ) ) != 0 )
+			return NULL;
+		board->number = number;
+		if ( qd->opts->verbose ) {
+			eprintf ( "qusbd: opened board %u (%s)\n", number,
+				  qusb_backend_name ( board->dev ) );
+		}
+	}
+	*rc = 0;
+	return board;
+}
+
+static void board_close ( struct board *board ) {
+	if ( board->dev && ! board->rings[QUSB_IN] &&
+	     ! board->rings[QUSB_OUT] ) {
+		qusb_close ( board->dev );
+		board->dev = NULL;
+	}
+}
+
+/****************************************************************************
+ *
+ * Batches
+ *
+ */
+
+/* The cache entry for the value an operation reads or writes */
+static struct cached * cache_find ( struct board *board, uint16_t type,
+				    uint16_t address ) {
+	unsigned int i;
+
+	for ( i = 0 ; i < board->cached ; i++ ) {
+		if ( ( board->cache[i].type == type ) &&
+		     ( board->cache[i].address == address ) )
+			return &board->cache[i];
+	}
+	return NULL;
+}
+
+static void cache_store ( struct board *board, uint16_t type,
+			  uint16_t address, uint16_t value ) {
+	struct cached *entry;
+
+	if ( ! ( entry = cache_find ( board, type, address ) ) ) {
+		if ( board->cached == QUSBD_CACHE_SIZE )
+			return;
+		entry = &board->cache[board->cached++];
+		entry->type = type;
+		entry->address = address;
+	}
+	entry->value = value;
+}
+
+static void cache_forget ( struct board *board, uint16_t type,
+			   uint16_t address ) {
+	struct cached *entry;
+
+	if ( ( entry = cache_find ( board, type, address ) ) )
+		*entry = board->cache[--board->cached];
+}
+
+/* Run one operation, answering configuration reads from the cache
+ * where possible; the live level of a port is always read afresh */
+static int batch_op ( struct daemon *qd, struct board *board,
+		      struct qusbd_op *op ) {
+	struct qusb_device *dev = board->dev;
+	struct cached *entry;
+	uint16_t get_type;
+	uint16_t setting = 0;
+	uint8_t value = 0;
+	int rc;
+
+	/* Sets are cached as the value the matching get would return */
+	get_type = op->type;
+	if ( ( op->type == QUSBD_SET_SETTING ) ||
+	     ( op->type == QUSBD_SET_OUTPUTS ) ||
+	     ( op->type == QUSBD_SET_DEFAULT_OUTPUTS ) ||
+	     ( op->type == QUSBD_SET_DEFAULT_LEVELS ) )
+		get_type = ( op->type - 1 );
+
+	if ( ( get_type == op->type ) &&
+	     ( entry = cache_find ( board, op->type, op->address ) ) ) {
+		op->value = entry->value;
+		qd->coalesced++;
+		return 0;
+	}
+
+	switch ( op->type ) {
+	case QUSBD_GET_SETTING:
+		rc = qusb_get_setting ( dev, op->address, &setting );
+		op->value = setting;
+		break;
+	case QUSBD_SET_SETTING:
+		rc = qusb_set_setting ( dev, op->address, op->value );
+		break;
+	case QUSBD_GET_OUTPUTS:
+		rc = qusb_gppio_get_outputs ( dev, op->address, &value );
+		op->value = value;
+		break;
+	case QUSBD_SET_OUTPUTS:
+		rc = qusb_gppio_set_outputs ( dev, op->address, op->value );
+		break;
+	case QUSBD_GET_DEFAULT_OUTPUTS:
+		rc = qusb_gppio_get_default_outputs ( dev, op->address,
+						      &value );
+		op->value = value;
+		break;
+	case QUSBD_SET_DEFAULT_OUTPUTS:
+		rc = qusb_gppio_set_default_outputs ( dev, op->address,
+						      op->value );
+		break;
+	case QUSBD_GET_DEFAULT_LEVELS:
+		rc = qusb_gppio_get_default_levels ( dev, op->address, &value );
+		op->value = value;
+		break;
+	case QUSBD_SET_DEFAULT_LEVELS:
+		rc = qusb_gppio_set_default_levels ( dev, op->address,
+						     op->value );
+		break;
+	case QUSBD_GPPIO_READ:
+		rc = qusb_gppio_read ( dev, op->address, &value );
+		op->value = value;
+		return rc;
+	case QUSBD_GPPIO_WRITE:
+		return qusb_gppio_write ( dev, op->address, op->value );
+	default:
+		return -EINVAL;
+	}
+
+	if ( rc == 0 )
+		cache_store ( board, get_type, op->address, op->value );
+	else
+		cache_forget ( board, get_type, op->address );
+	return rc;
+}
+
+/* Run every client's pending batch, board by board, in arrival order */
+static void batch_round ( struct daemon *qd ) {
+	struct client *client;
+	struct board *board;
+	unsigned int number;
+	unsigned int i;
+	unsigned int j;
+	int lost;
+	int rc;
+
+	for ( number = 0 ; number < QUSB_MAX_BOARDS ; number++ ) {
+		board = NULL;
+		lost = 0;
+		for ( i = 0 ; i < QUSBD_MAX_CLIENTS ; i++ ) {
+			client = qd->clients[i];
+			if ( ! ( client && client->pending &&
+				 ( client->msg.board == number ) ) )
+				continue;
+			client->pending = 0;
+			if ( ! board ) {
+				board = board_get ( qd, number, &rc );
+				if ( board )
+					board->cached = 0;
+			}
+			if ( board ) {
+				/* A batch stops at its first failure, as
+				 * the same ioctls made directly would */
+				rc = 0;
+				for ( j = 0 ; j < client->msg.count ; j++ ) {
+					if ( rc != 0 ) {
+						client->ops[j].status =
+							-ECANCELED;
+						continue;
+					}
+					rc = batch_op ( qd, board,
+							&client->ops[j] );
+					client->ops[j].status = rc;
+					lost |= ( rc == -ENODEV );
+				}
+				rc = 0;
+			}
+			qd->batches++;
+			qd->ops += client->msg.count;
+			client->msg.status = rc;
+			if ( send ( client->fd, &client->msg,
+				    ( sizeof ( client->msg ) +
+				      ( rc ? 0 : ( client->msg.count *
+						   sizeof ( client->ops[0] ) ) ) ),
+				    MSG_NOSIGNAL ) < 0 ) {
+				/* A client gone away is noticed by poll() */
+			}
+		}
+		/* Unplugged: reopen when next asked for */
+		if ( board && lost )
+			board_close ( board );
+	}
+}
+
+/****************************************************************************
+ *
+ * Streams
+ *
+ */
+
+static void ring_fail ( struct ring *ring, int rc ) {
+	if ( ! ring->shm->status ) {
+		__atomic_store_n ( &ring->shm->status, rc, __ATOMIC_RELEASE );
+		notify ( ring->notify_fd );
+	}
+	qusb_stream_stop ( ring->stream );
+}
+
+/* A block read from the board: into the ring, unless it is full */
+static int ring_complete_in ( struct qusb_block *block, void *priv ) {
+	struct ring *ring = priv;
+	struct qusbd_ring *shm = ring->shm;
+	unsigned int slot;
+
+	if ( block->status < 0 ) {
+		ring_fail ( ring, block->status );
+		return QUSB_STOP;
+	}
+	if ( ( shm->head - __atomic_load_n ( &shm->tail, __ATOMIC_ACQUIRE ) )
+	     >= shm->blocks ) {
+		__atomic_add_fetch ( &shm->dropped, 1, __ATOMIC_RELAXED );
+		return QUSB_CONTINUE;
+	}
+	slot = ( shm->head % shm->blocks );
+	memcpy ( ( ( ( uint8_t * ) shm ) + shm->data_offset +
+		   ( slot * ( size_t ) shm->block_size ) ), block->data,
+		 block->len );
+	shm->len[slot] = block->len;
+	__atomic_store_n ( &shm->head, ( shm->head + 1 ), __ATOMIC_RELEASE );
+	notify ( ring->notify_fd );
+	return QUSB_CONTINUE;
+}
+
+static int ring_complete_out ( struct qusb_block *block, void *priv ) {
+	struct ring *ring = priv;
+
+	if ( block->status < 0 ) {
+		ring_fail ( ring, block->status );
+		return QUSB_STOP;
+	}
+	return QUSB_CONTINUE;
+}
+
+/* Move blocks the client has written into the stream; returns a count */
+static unsigned int ring_feed ( struct ring *ring ) {
+	struct qusbd_ring *shm = ring->shm;
+	struct qusb_block *block;
+	unsigned int fed = 0;
+	unsigned int slot;
+	int rc;
+
+	while ( ( ! shm->status ) &&
+		( shm->tail != __atomic_load_n ( &shm->head,
+						 __ATOMIC_ACQUIRE ) ) ) {
+		slot = ( shm->tail % shm->blocks );
+		if ( shm->len[slot] ) {
+			if ( ! ( block = qusb_stream_get_block ( ring->stream ) ) )
+				break;
+			block->len = shm->len[slot];
+			memcpy ( block->data, ( ( ( uint8_t * ) shm ) +
+						shm->data_offset +
+						( slot * ( size_t )
+						  shm->block_size ) ),
+				 block->len );
+			if ( ( rc = qusb_stream_submit ( block ) ) != 0 ) {
+				ring_fail ( ring, rc );
+				break;
+			}
+		}
+		__atomic_store_n ( &shm->tail, ( shm->tail + 1 ),
+				   __ATOMIC_RELEASE );
+		fed++;
+	}
+	if ( fed )
+		notify ( ring->notify_fd );
+	return fed;
+}
+
+static void ring_close ( struct daemon *qd, struct ring *ring ) {
+	struct board *board = ring->board;
+
+	if ( ring->stream ) {
+		qusb_stream_stop ( ring->stream );
+		qusb_stream_destroy ( ring->stream );
+	}
+	board->rings[ring->direction] = NULL;
+	munmap ( ring->shm, ring->map_size );
+	close ( ring->wait_fd );
+	close ( ring->notify_fd );
+	if ( qd->opts->verbose ) {
+		eprintf ( "qusbd: board %u %s stream closed\n", board->number,
+			  ( ( ring->direction == QUSB_IN ) ? "IN" : "OUT" ) );
+	}
+	free ( ring );
+}
+
+/**
+ * ring_open - create a stream on a board for a client
+ *
+ * @qd: Daemon
+ * @client: Client
+ * @msg: Stream request (block_size and blocks are answered)
+ * @fds: The ring's memfd, and the client's ends of the eventfds
+ *
+ * Returns 0 for success, or negative errno
+ */
+static int ring_open ( struct daemon *qd, struct client *client,
+		       struct qusbd_msg *msg, int *fds ) {
+	struct qusb_stream_config config;
+	struct board *board;
+	struct ring *ring;
+	long page_size = sysconf ( _SC_PAGESIZE );
+	size_t header;
+	int memfd;
+	int rc;
+
+	fds[0] = fds[1] = fds[2] = -1;
+	if ( ( msg->direction != QUSB_IN ) && ( msg->direction != QUSB_OUT ) )
+		return -EINVAL;
+	if ( ( ! msg->block_size ) || ( msg->block_size % 512 ) ||
+	     ( msg->block_size > QUSBD_MAX_BLOCK_SIZE ) ||
+	     ( msg->blocks < 2 ) || ( msg->blocks > QUSBD_MAX_RING_BLOCKS ) ||
+	     ( ( ( unsigned long long ) msg->block_size * msg->blocks ) >
+	       QUSBD_MAX_RING_SIZE ) )
+		return -EINVAL;
+	if ( ! ( board = board_get ( qd, msg->board, &rc ) ) )
+		return rc;
+	if ( board->rings[msg->direction] )
+		return -EBUSY;
+
+	if ( ! ( ring = calloc ( 1, sizeof ( *ring ) ) ) )
+		return -ENOMEM;
+	ring->client = client;
+	ring->board = board;
+	ring->direction = msg->direction;
+	ring->wait_fd = ring->notify_fd = -1;
+
+	header = ( sizeof ( *ring->shm ) +
+		   ( msg->blocks * sizeof ( ring->shm->len[0] ) ) );
+	header = ( ( header + page_size - 1 ) & ~( page_size - 1 ) );
+	ring->map_size = ( header + ( ( size_t ) msg->block_size *
+				      msg->blocks ) );
+	if ( ( memfd = memfd_create ( "qusbd-ring", MFD_CLOEXEC ) ) < 0 ) {
+		rc = -errno;
+		goto err;
+	}
+	fds[0] = memfd;
+	if ( ftruncate ( memfd, ring->map_size ) < 0 ) {
+		rc = -errno;
+		goto err;
+	}
+	ring->shm = mmap ( NULL, ring->map_size, ( PROT_READ | PROT_WRITE ),
+			   MAP_SHARED, memfd, 0 );
+	if ( ring->shm == MAP_FAILED ) {
+		ring->shm = NULL;
+		rc = -errno;
+		goto err;
+	}
+	ring->shm->magic = QUSBD_RING_MAGIC;
+	ring->shm->direction = msg->direction;
+	ring->shm->block_size = msg->block_size;
+	ring->shm->blocks = msg->blocks;
+	ring->shm->data_offset = header;
+
+	/* The client waits on fds[1], and signals fds[2] */
+	if ( ( ( ring->notify_fd = eventfd ( 0, ( EFD_NONBLOCK |
+						  EFD_CLOEXEC ) ) ) < 0 ) ||
+	     ( ( ring->wait_fd = eventfd ( 0, ( EFD_NONBLOCK |
+						EFD_CLOEXEC ) ) ) < 0 ) ) {
+		rc = -errno;
+		goto err;
+	}
+	fds[1] = ring->notify_fd;
+	fds[2] = ring->wait_fd;
+
+	memset ( &config, 0, sizeof ( config ) );
+	config.direction = msg->direction;
+	config.block_size = msg->block_size;
+	config.depth = qd->opts->depth;
+	config.blocks = ( 2 * config.depth );
+	config.complete = ( ( msg->direction == QUSB_IN ) ?
+			    ring_complete_in : ring_complete_out );
+	config.priv = ring;
+	if ( ( rc = qusb_stream_create ( qd->loop, board->dev, &config,
+					 &ring->stream ) ) != 0 )
+		goto err;
+	qusb_stream_start ( ring->stream );
+
+	board->rings[msg->direction] = ring;
+	if ( qd->opts->verbose ) {
+		eprintf ( "qusbd: board %u %s stream, %u x %u bytes\n",
+			  board->number,
+			  ( ( msg->direction == QUSB_IN ) ? "IN" : "OUT" ),
+			  msg->blocks, msg->block_size );
+	}
+	return 0;
+
+ err:
+	if ( ring->shm )
+		munmap ( ring->shm, ring->map_size );
+	if ( ring->wait_fd >= 0 )
+		close ( ring->wait_fd );
+	if ( ring->notify_fd >= 0 )
+		close ( ring->notify_fd );
+	if ( memfd >= 0 )
+		close ( memfd );
+	free ( ring );
+	fds[0] = -1;
+	return rc;
+}
+
+/****************************************************************************
+ *
+ * Clients
+ *
+ */
+
+static void client_accept ( struct daemon *qd ) {
+	struct client *client;
+	unsigned int i;
+	int fd;
+
+	if ( ( fd = accept4 ( qd->listen_fd, NULL, NULL,
+			      ( SOCK_NONBLOCK | SOCK_CLOEXEC ) ) ) < 0 )
+		return;
+	for ( i = 0 ; i < QUSBD_MAX_CLIENTS ; i++ ) {
+		if ( ! qd->clients[i] )
+			break;
+	}
+	if ( ( i == QUSBD_MAX_CLIENTS ) ||
+	     ! ( client = calloc ( 1, sizeof ( *client ) ) ) ) {
+		close ( fd );
+		return;
+	}
+	client->fd = fd;
+	qd->clients[i] = client;
+}
+
+static void client_close ( struct daemon *qd, unsigned int index ) {
+	struct client *client = qd->clients[index];
+	struct ring *ring;
+	unsigned int i;
+	unsigned int dir;
+
+	for ( i = 0 ; i < QUSB_MAX_BOARDS ; i++ ) {
+		for ( dir = QUSB_IN ; dir <= QUSB_OUT ; dir++ ) {
+			ring = qd->boards[i].rings[dir];
+			if ( ring && ( ring->client == client ) )
+				ring_close ( qd, ring );
+		}
+	}
+	close ( client->fd );
+	free ( client );
+	qd->clients[index] = NULL;
+}
+
+static void client_answer ( struct client *client, struct qusbd_msg *msg,
+			    int *fds, unsigned int nfds ) {
+	union {
+		struct cmsghdr cmsg;
+		char buf[CMSG_SPACE ( 4 * sizeof ( int ) )];
+	} control;
+	struct iovec iov = { .iov_base = msg, .iov_len = sizeof ( *msg ) };
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+
+	memset ( &mh, 0, sizeof ( mh ) );
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if ( nfds ) {
+		mh.msg_control = control.buf;
+		mh.msg_controllen = CMSG_SPACE ( nfds * sizeof ( int ) );
+		cmsg = CMSG_FIRSTHDR ( &mh );
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN ( nfds * sizeof ( int ) );
+		memcpy ( CMSG_DATA ( cmsg ), fds, ( nfds * sizeof ( int ) ) );
+	}
+	if ( sendmsg ( client->fd, &mh, MSG_NOSIGNAL ) < 0 ) {
+		/* A client gone away is noticed by poll() */
+	}
+}
+
+/* Read a request; returns 0, or negative errno to drop the client */
+static int client_receive ( struct daemon *qd, struct client *client ) {
+	struct qusbd_msg msg;
+	struct iovec iov[2];
+	struct board *board;
+	struct ring *ring;
+	ssize_t len;
+	int fds[3];
+	int rc;
+
+	/* Only one batch per client per round */
+	if ( client->pending )
+		return 0;
+
+	iov[0].iov_base = &msg;
+	iov[0].iov_len = sizeof ( msg );
+	iov[1].iov_base = client->ops;
+	iov[1].iov_len = sizeof ( client->ops );
+	if ( ( len = readv ( client->fd, iov, 2 ) ) < 0 )
+		return ( ( errno == EAGAIN ) ? 0 : -errno );
+	if ( len == 0 )
+		return -ECONNRESET;
+	if ( ( len < ( ssize_t ) sizeof ( msg ) ) ||
+	     ( msg.magic != QUSBD_MAGIC ) || ( msg.version != QUSBD_VERSION ) )
+		return -EPROTO;
+	len -= sizeof ( msg );
+
+	switch ( msg.type ) {
+	case QUSBD_MSG_BATCH:
+		if ( ( msg.count > QUSBD_MAX_OPS ) ||
+		     ( len != ( ssize_t ) ( msg.count *
+					    sizeof ( client->ops[0] ) ) ) )
+			return -EPROTO;
+		client->msg = msg;
+		client->pending = 1;
+		return 0;
+	case QUSBD_MSG_STREAM:
+		msg.status = ring_open ( qd, client, &msg, fds );
+		client_answer ( client, &msg, fds,
+				( msg.status ? 0 : 3 ) );
+		/* The client has its own references now */
+		if ( fds[0] >= 0 )
+			close ( fds[0] );
+		return 0;
+	case QUSBD_MSG_CLOSE:
+		rc = -ENOENT;
+		if ( ( msg.board < QUSB_MAX_BOARDS ) &&
+		     ( msg.direction <= QUSB_OUT ) ) {
+			board = &qd->boards[msg.board];
+			ring = board->rings[msg.direction];
+			if ( ring && ( ring->client == client ) ) {
+				ring_close ( qd, ring );
+				rc = 0;
+			}
+		}
+		msg.status = rc;
+		client_answer ( client, &msg, NULL, 0 );
+		return 0;
+	default:
+		msg.status = -ENOSYS;
+		client_answer ( client, &msg, NULL, 0 );
+		return 0;
+	}
+}
+
+/****************************************************************************
+ *
+ * Main loop
+ *
+ */
+
+static int listen_socket ( struct daemon *qd ) {
+	const char *path = qd->opts->socket_path;
+	struct sockaddr_un addr;
+
+	if ( strlen ( path ) >= sizeof ( addr.sun_path ) )
+		return -ENAMETOOLONG;
+	if ( ( qd->listen_fd = socket ( AF_UNIX, ( SOCK_SEQPACKET |
+						   SOCK_NONBLOCK |
+						   SOCK_CLOEXEC ), 0 ) ) < 0 )
+		return -errno;
+	memset ( &addr, 0, sizeof ( addr ) );
+	addr.sun_family = AF_UNIX;
+	strcpy ( addr.sun_path, path );
+	unlink ( path );
+	if ( ( bind ( qd->listen_fd, ( struct sockaddr * ) &addr,
+		      sizeof ( addr ) ) < 0 ) ||
+	     ( chmod ( path, 0660 ) < 0 ) ||
+	     ( listen ( qd->listen_fd, 16 ) < 0 ) )
+		return -errno;
+	return 0;
+}
+
+/* Open every board present, so the first client need not wait */
+static void open_boards ( struct daemon *qd ) {
+	struct qusb_info info[QUSB_MAX_BOARDS];
+	int count;
+	int rc;
+	int i;
+
+	if ( ( count = qusb_enumerate_backend ( qd->opts->backend, info,
+						QUSB_MAX_BOARDS ) ) < 0 )
+		count = 0;
+	for ( i = 0 ; i < count ; i++ ) {
+		if ( ( ! board_get ( qd, info[i].board, &rc ) ) &&
+		     qd->opts->verbose ) {
+			eprintf ( "qusbd: could not open board %u: %s\n",
+				  info[i].board, strerror ( -rc ) );
+		}
+	}
+	if ( qd->opts->verbose )
+		eprintf ( "qusbd: %d board(s) found\n", count );
+}
+
+static int serve ( struct daemon *qd ) {
+	struct pollfd pfds[ 2 + QUSBD_MAX_CLIENTS + ( 2 * QUSB_MAX_BOARDS ) ];
+	struct ring *rings[ 2 * QUSB_MAX_BOARDS ];
+	unsigned int clients[QUSBD_MAX_CLIENTS];
+	unsigned int nclients;
+	unsigned int nrings;
+	unsigned int npfds;
+	unsigned int busy = 0;
+	unsigned int i;
+	unsigned int dir;
+	uint64_t count;
+	int polled_libusb;
+	int timeout;
+	int rc;
+
+	while ( ! stop ) {
+		npfds = 0;
+		pfds[npfds].fd = qd->listen_fd;
+		pfds[npfds++].events = POLLIN;
+		pfds[npfds].fd = qusb_loop_fd ( qd->loop );
+		pfds[npfds++].events = POLLIN;
+		nclients = 0;
+		for ( i = 0 ; i < QUSBD_MAX_CLIENTS ; i++ ) {
+			if ( ! qd->clients[i] )
+				continue;
+			clients[nclients++] = i;
+			pfds[npfds].fd = qd->clients[i]->fd;
+			pfds[npfds++].events = POLLIN;
+		}
+		nrings = 0;
+		polled_libusb = 0;
+		for ( i = 0 ; i < QUSB_MAX_BOARDS ; i++ ) {
+			for ( dir = QUSB_IN ; dir <= QUSB_OUT ; dir++ ) {
+				if ( ! qd->boards[i].rings[dir] )
+					continue;
+				rings[nrings++] = qd->boards[i].rings[dir];
+				pfds[npfds].fd = qd->boards[i].rings[dir]->wait_fd;
+				pfds[npfds++].events = POLLIN;
+				polled_libusb |= ( strcmp ( qusb_backend_name (
+					qd->boards[i].dev ), "libusb" ) == 0 );
+			}
+		}
+
+		/* libusb completions arrive other than on the io_uring */
+		timeout = ( busy ? 0 : ( polled_libusb ? 1 : -1 ) );
+		if ( ( rc = poll ( pfds, npfds, timeout ) ) < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			return -errno;
+		}
+
+		/* Before any client can close its rings */
+		for ( i = 0 ; i < nrings ; i++ ) {
+			if ( pfds[ 2 + nclients + i ].revents & POLLIN ) {
+				if ( read ( rings[i]->wait_fd, &count,
+					    sizeof ( count ) ) < 0 ) {
+					/* Spurious: nothing to clear */
+				}
+			}
+			if ( rings[i]->direction == QUSB_OUT )
+				ring_feed ( rings[i] );
+		}
+
+		if ( pfds[0].revents & POLLIN )
+			client_accept ( qd );
+		for ( i = 0 ; i < nclients ; i++ ) {
+			if ( ! ( pfds[ 2 + i ].revents ) )
+				continue;
+			if ( ( pfds[ 2 + i ].revents & POLLIN ) &&
+			     ( client_receive ( qd, qd->clients[clients[i]] )
+			       == 0 ) )
+				continue;
+			client_close ( qd, clients[i] );
+		}
+		batch_round ( qd );
+
+		/* A stream's next chain is submitted by the next run */
+		if ( ( rc = qusb_loop_run ( qd->loop, 0 ) ) < 0 )
+			return rc;
+		busy = rc;
+
+		/* Completions free blocks for the next ones */
+		for ( i = 0 ; i < QUSB_MAX_BOARDS ; i++ ) {
+			if ( qd->boards[i].rings[QUSB_OUT] )
+				busy += ring_feed ( qd->boards[i].rings[QUSB_OUT] );
+		}
+	}
+
+	return 0;
+}
+
+int main ( int argc, char* argv[] ) {
+	static struct daemon qd;
+	struct options opts;
+	struct sigaction sa;
+	struct ring *ring;
+	unsigned int i;
+	unsigned int dir;
+	int rc;
+
+	memset ( &opts, 0, sizeof ( opts ) );
+	opts.socket_path = ( getenv ( "QUSBD_SOCKET" ) ?
+			     getenv ( "QUSBD_SOCKET" ) : QUSBD_SOCKET );
+	opts.depth = 8;
+	parseopts ( argc, argv, &opts );
+	if ( opts.depth < 1 ) {
+		eprintf ( "Error: depth must be at least 1\n" );
+		exit ( EXIT_FAILURE );
+	}
+	qd.opts = &opts;
+
+	memset ( &sa, 0, sizeof ( sa ) );
+	sa.sa_handler = handle_signal;
+	sigaction ( SIGINT, &sa, NULL );
+	sigaction ( SIGTERM, &sa, NULL );
+	sa.sa_handler = SIG_IGN;
+	sigaction ( SIGPIPE, &sa, NULL );
+
+	if ( ( rc = qusb_loop_create ( QUSBD_LOOP_ENTRIES, &qd.loop ) ) != 0 ) {
+		eprintf ( "Error: Could not create loop: %s\n",
+			  strerror ( -rc ) );
+		exit ( EXIT_FAILURE );
+	}
+	if ( ( rc = listen_socket ( &qd ) ) != 0 ) {
+		eprintf ( "Error: Could not listen on %s: %s\n",
+			  opts.socket_path, strerror ( -rc ) );
+		exit ( EXIT_FAILURE );
+	}
+	open_boards ( &qd );
+
+	rc = serve ( &qd );
+	if ( rc != 0 )
+		eprintf ( "Error: %s\n", strerror ( -rc ) );
+
+	/* Tell stream clients, then let them go */
+	for ( i = 0 ; i < QUSB_MAX_BOARDS ; i++ ) {
+		for ( dir = QUSB_IN ; dir <= QUSB_OUT ; dir++ ) {
+			if ( ( ring = qd.boards[i].rings[dir] ) )
+				ring_fail ( ring, -ESHUTDOWN );
+		}
+	}
+	for ( i = 0 ; i < QUSBD_MAX_CLIENTS ; i++ ) {
+		if ( qd.clients[i] )
+			client_close ( &qd, i );
+	}
+	for ( i = 0 ; i < QUSB_MAX_BOARDS ; i++ )
+		board_close ( &qd.boards[i] );
+	qusb_loop_destroy ( qd.loop );
+	close ( qd.listen_fd );
+	unlink ( opts.socket_path );
+
+	if ( opts.verbose ) {
+		eprintf ( "qusbd: %llu batches, %llu operations, %llu answered "
+			  "without a transfer\n", qd.batches, qd.ops,
+			  qd.coalesced );
+	}
+	return ( rc ? EXIT_FAILURE : EXIT_SUCCESS );
+}
+
+/*
+ * Parse command-line options and return index of last element in
+ * argument list that is not an option
+ */
+int parseopts ( const int argc, char **argv, struct options *opts ) {
+	int c;
+
+	while (1) {
+		int option_index = 0;
+		static struct option long_options[] = {
+			{ "socket", required_argument, NULL, 's' },
+			{ "backend", required_argument, NULL, 'B' },
+			{ "depth", required_argument, NULL, 'q' },
+			{ "verbose", 0, NULL, 'v' },
+			{ "help", 0, NULL, 'h' },
+			{ 0, 0, 0, 0 }
+		};
+
+		if ( ( c = getopt_long ( argc, argv, "s:B:q:vh", long_options, &option_index ) ) == -1 ) {
+			break;
+		}
+
+		switch ( c ) {
+		case 's':
+			opts->socket_path = optarg;
+			break;
+		case 'B':
+			if ( strcmp ( optarg, "kernel" ) == 0 ) {
+				opts->backend = QUSB_BACKEND_KERNEL;
+			} else if ( strcmp ( optarg, "libusb" ) == 0 ) {
+				opts->backend = QUSB_BACKEND_LIBUSB;
+			} else {
+				eprintf ( "Unknown backend: %s\n", optarg );
+				exit ( EXIT_FAILURE );
+			}
+			break;
+		case 'q':
+			opts->depth = strtoul ( optarg, NULL, 0 );
+			break;
+		case 'v':
+			opts->verbose = 1;
+			break;
+		case 'h':
+			printhelp();
+			break;
+		case '?':
+		default:
+			eprintf ( "Unrecognised option: %c\n", c );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	return optind;
+}
+
+void printhelp () {
+	printf( "qusbd: hold QuickUSB boards open, and serve clients.\n"
+	"\n"
+	"USAGE:	qusbd [OPTIONS]\n"
+	"\n"
+	"	Opens every board, and serves libquickusb clients (such as\n"
+	"	setquickusb) on a Unix socket: batches of setting and GPPIO\n"
+	"	operations, and HSPIO data streams through shared memory.\n"
+	"	Runs in the foreground until SIGINT/SIGTERM.\n"
+	"\n"
+	"OPTIONS:\n"
+	"	-s, --socket=PATH	Socket (default: $QUSBD_SOCKET, else " QUSBD_SOCKET ")\n"
+	"	-B, --backend=B		kernel or libusb (default: $QUSB_BACKEND, else kernel)\n"
+	"	-q, --depth=N		Stream requests in flight (default 8)\n"
+	"	-v, --verbose		Log boards, streams and statistics\n"
+	"	-h, --help		Show this help\n"
+	"\n");
+
+	exit(EXIT_SUCCESS);
+}
@@ -28,7 +28,7 @@
 #include <string.h>
 #include <sys/ioctl.h>
 
-#include "../kernel/quickusb.h"
+#include "../libquickusb/libquickusb.h"
 
 #define eprintf(...) fprintf ( stderr, __VA_ARGS__ )
 
@@ -50,6 +50,16 @@ struct options {
 	struct action settings[16];
 };
 
+/* A batch of operations for qusbd, with what to call each */
+struct batch {
+	struct qusbd_op ops[ 3 + 16 ];
+	const char *names[ 3 + 16 ];
+	unsigned int count;
+};
+
+int run_daemon ( const char *device, struct options *opts );
+void gppio_op ( struct batch *batch, const char *name, struct action *action, int port, int get_type );
+void setting_op ( struct batch *batch, unsigned int setting, struct action *action );
 void gppio_ioctl ( int fd, const char *name, struct action *action, int get_ioctl, int set_ioctl );
 void setting_ioctl ( int fd, unsigned int setting, struct action *action );
 int parseopts ( const int, char **argv, struct options * );
@@ -66,13 +76,17 @@ int main ( int argc, char* argv[] ) {
 	memset ( &opts, 0, sizeof ( opts ) );
 
 	last_index = parseopts ( argc, argv, &opts );
-	if ( last_index == ( argc - 1 ) ) {
-		fd = open( argv[last_index], O_RDWR );
-	} else {
+	if ( last_index != ( argc - 1 ) ) {
 		eprintf("No device specified!\n");
 		exit(EXIT_FAILURE);
 	}
 
+	/* Go through qusbd if it is running, else straight to the device */
+	if ( run_daemon ( argv[last_index], &opts ) == 0 )
+		return 0;
+
+	fd = open( argv[last_index], O_RDWR );
+
 	if ( fd < 0 ) {
 		eprintf( "Error: Could not open device %s: %s\n", argv[last_index], strerror(errno) );
     		exit(EXIT_FAILURE);
@@ -96,6 +110,93 @@ int main ( int argc, char* argv[] ) {
 	return 0;
 }
 
+/*
+ * Run the actions as one batch through qusbd.  Returns non-zero,
+ * without having done anything, if the daemon is not running or the
+ * device is not a /dev/quN node.
+ */
+int run_daemon ( const char *device, struct options *opts ) {
+	struct qusbd_client *client;
+	struct batch batch;
+	struct qusbd_op *op;
+	const char *name;
+	unsigned int board;
+	unsigned int i;
+	char kind;
+	char port;
+	int rc;
+
+	name = strrchr ( device, '/' );
+	name = ( name ? ( name + 1 ) : device );
+	if ( ( sscanf ( name, "qu%u%c%c", &board, &kind, &port ) != 3 ) ||
+	     ! ( ( ( kind == 'g' ) && ( port >= 'a' ) &&
+		   ( port < ( 'a' + QUSB_MAX_GPPIO ) ) ) ||
+		 ( ( kind == 'h' ) && ( ( port == 'c' ) || ( port == 'd' ) ) ) ) )
+		return -ENODEV;
+	if ( qusbd_connect ( NULL, &client ) != 0 )
+		return -ENOTCONN;
+
+	memset ( &batch, 0, sizeof ( batch ) );
+	port = ( ( kind == 'g' ) ? ( port - 'a' ) : -1 );
+	gppio_op ( &batch, "outputs", &opts->outputs, port, QUSBD_GET_OUTPUTS );
+	gppio_op ( &batch, "default-outputs", &opts->default_outputs, port,
+		   QUSBD_GET_DEFAULT_OUTPUTS );
+	gppio_op ( &batch, "default-levels", &opts->default_levels, port,
+		   QUSBD_GET_DEFAULT_LEVELS );
+	for ( i = 0 ; ( i < ( sizeof ( opts->settings ) /  sizeof ( opts->settings[0] ) ) ) ; i++ ) {
+		setting_op ( &batch, i, &opts->settings[i] );
+	}
+
+	if ( ( rc = qusbd_batch ( client, board, batch.ops, batch.count ) ) != 0 ) {
+		eprintf ( "Error: qusbd could not reach board %u: %s\n", board, strerror ( -rc ) );
+		exit ( EXIT_FAILURE );
+	}
+	qusbd_disconnect ( client );
+
+	for ( i = 0 ; i < batch.count ; i++ ) {
+		op = &batch.ops[i];
+		if ( op->status != 0 ) {
+			eprintf ( "Could not %s %s: %s\n", ( ( op->type % 2 ) ? "get" : "set" ),
+				  batch.names[i], strerror ( -op->status ) );
+			exit ( EXIT_FAILURE );
+		}
+		if ( op->type == QUSBD_GET_SETTING ) {
+			printf ( "setting[%d] = 0x%04x\n", op->address, op->value );
+		} else if ( op->type % 2 ) {
+			printf ( "%s = 0x%02x\n", batch.names[i], op->value );
+		}
+	}
+	return 0;
+}
+
+void gppio_op ( struct batch *batch, const char *name, struct action *action, int port, int get_type ) {
+	struct qusbd_op *op = &batch->ops[batch->count];
+
+	if ( action->type == DO_NOTHING )
+		return;
+	if ( port < 0 ) {
+		eprintf ( "Could not %s %s: not a GPPIO port\n", ( ( action->type == SHOW ) ? "get" : "set" ), name );
+		exit ( EXIT_FAILURE );
+	}
+	op->type = ( ( action->type == SHOW ) ? get_type : ( get_type + 1 ) );
+	op->address = port;
+	op->value = action->value;
+	batch->names[batch->count++] = name;
+}
+
+void setting_op ( struct batch *batch, unsigned int setting, struct action *action ) {
+	struct qusbd_op *op = &batch->ops[batch->count];
+	static char names[16][16];
+
+	if ( action->type == DO_NOTHING )
+		return;
+	op->type = ( ( action->type == SHOW ) ? QUSBD_GET_SETTING : QUSBD_SET_SETTING );
+	op->address = setting;
+	op->value = action->value;
+	snprintf ( names[setting], sizeof ( names[setting] ), "setting %d", setting );
+	batch->names[batch->count++] = names[setting];
+}
+
 void gppio_ioctl ( int fd, const char *name, struct action *action, int get_ioctl, int set_ioctl ) {
 	quickusb_gppio_ioctl_data_t data;
 
@@ -261,6 +362,8 @@ void printhelp () {
 	"USAGE: setquickusb --OPTION [ ARG ] DEVICE\n"
 	"\n"
 	"setquickusb reads or sets the port parameters for a QuickUSB module.\n"
+	"If qusbd is running, the request goes through it (as one batch), so the\n"
+	"board need not be re-opened; otherwise DEVICE is opened directly.\n"
 	"The value to be set is any integer from 0-255, specified in either decimal or:\n"
 	"hexadecimal form; when reading, setquickusb returns values in hexadecimal.\n"
 	"\n"